@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "archive.h"
+
+#define VARINT_MAX 10
+
+/* Tokens: a value is (zz << 1), a run of zero differences is
+   (len << 2) | 1, and a run of missing ports' counters (len << 2) | 3. */
+#define TOK_ZERO 1
+#define TOK_MISSING 3
+
+static inline uint64_t zigzag(int64_t x)
+{
+  return ((uint64_t) x << 1) ^ (uint64_t) (x >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t x)
+{
+  return (int64_t) (x >> 1) ^ -(int64_t) (x & 1);
+}
+
+static inline size_t varint_put(uint8_t *p, uint64_t x)
+{
+  size_t n = 0;
+
+  while (x >= 0x80) {
+    p[n++] = (x & 0x7f) | 0x80;
+    x >>= 7;
+  }
+  p[n++] = x;
+
+  return n;
+}
+
+/* Returns 0 if the varint runs past end. */
+static inline size_t varint_get(const uint8_t *p, const uint8_t *end,
+                                uint64_t *x)
+{
+  size_t n = 0;
+  unsigned int shift = 0;
+
+  *x = 0;
+  while (p + n < end && shift < 64) {
+    uint8_t b = p[n++];
+    *x |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return n;
+    shift += 7;
+  }
+
+  return 0;
+}
+
+static size_t archive_table_size(const struct archive_port *ports,
+                                 size_t nr_ports)
+{
+  size_t i, size = 0;
+
+  for (i = 0; i < nr_ports; i++)
+    size += sizeof(uint64_t) + 1 + strlen(ports[i].ap_name) + 1;
+
+  return size;
+}
+
+static inline size_t archive_record_max(struct archive *ar)
+{
+  return VARINT_MAX + ar->ar_nr_ports * ar->ar_nr_ctrs * VARINT_MAX;
+}
+
+static inline off_t archive_seg_offset(size_t seg_size, size_t i)
+{
+  return sizeof(struct archive_hdr) + (off_t) i * seg_size;
+}
+
+int archive_open(struct archive *ar, const char *path, size_t nr_ctrs,
+                 const struct archive_port *ports, size_t nr_ports)
+{
+  struct archive_hdr hdr;
+  struct stat stat_buf;
+  size_t need;
+
+  memset(ar, 0, sizeof(*ar));
+  ar->ar_fd = -1;
+  ar->ar_nr_ctrs = nr_ctrs;
+  ar->ar_ports = ports;
+  ar->ar_nr_ports = nr_ports;
+
+  /* Room for at least a few records in each segment. */
+  need = sizeof(struct archive_seg_hdr) +
+    archive_table_size(ports, nr_ports) + 4 * archive_record_max(ar);
+
+  ar->ar_fd = open(path, O_RDWR|O_CREAT, 0644);
+  if (ar->ar_fd < 0)
+    goto err;
+
+  if (fstat(ar->ar_fd, &stat_buf) < 0)
+    goto err;
+
+  if (stat_buf.st_size == 0) {
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ah_magic = ARCHIVE_MAGIC;
+    hdr.ah_nr_ctrs = nr_ctrs;
+    hdr.ah_seg_size = ARCHIVE_SEG_SIZE_MIN;
+    while (hdr.ah_seg_size < need)
+      hdr.ah_seg_size *= 2;
+
+    if (pwrite(ar->ar_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+      goto err;
+  } else {
+    if (pread(ar->ar_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.ah_magic != ARCHIVE_MAGIC || hdr.ah_nr_ctrs != nr_ctrs) {
+      errno = EINVAL;
+      goto err;
+    }
+
+    /* Too many ports for this file's segments. */
+    if (hdr.ah_seg_size < need) {
+      errno = EFBIG;
+      goto err;
+    }
+  }
+
+  ar->ar_seg_size = hdr.ah_seg_size;
+
+  /* We always start a new segment, so a partial last one is left as
+     is (its header says how much of it is good). */
+  if (stat_buf.st_size > sizeof(hdr))
+    ar->ar_nr_segs = (stat_buf.st_size - sizeof(hdr) + ar->ar_seg_size - 1) /
+      ar->ar_seg_size;
+
+  ar->ar_seg = malloc(ar->ar_seg_size);
+  ar->ar_prev = calloc(nr_ports * nr_ctrs + 1, sizeof(ar->ar_prev[0]));
+  if (ar->ar_seg == NULL || ar->ar_prev == NULL)
+    goto err;
+
+  memset(ar->ar_seg, 0, sizeof(struct archive_seg_hdr));
+
+  return 0;
+
+ err:
+  archive_close(ar);
+
+  return -1;
+}
+
+static int archive_seg_begin(struct archive *ar, double time)
+{
+  struct archive_seg_hdr *sh = (struct archive_seg_hdr *) ar->ar_seg;
+  uint8_t *p = (uint8_t *) (sh + 1);
+  size_t i;
+
+  memset(sh, 0, sizeof(*sh));
+  sh->as_magic = ARCHIVE_SEG_MAGIC;
+  sh->as_nr_ports = ar->ar_nr_ports;
+  sh->as_time_first = time;
+  sh->as_time_last = time;
+
+  for (i = 0; i < ar->ar_nr_ports; i++) {
+    const struct archive_port *ap = &ar->ar_ports[i];
+    size_t len = strlen(ap->ap_name) + 1;
+
+    memcpy(p, &ap->ap_guid, sizeof(ap->ap_guid));
+    p += sizeof(ap->ap_guid);
+    *p++ = ap->ap_port;
+    memcpy(p, ap->ap_name, len);
+    p += len;
+  }
+
+  sh->as_table_size = p - (uint8_t *) (sh + 1);
+  sh->as_used = sh->as_table_size;
+
+  memset(ar->ar_prev, 0,
+         ar->ar_nr_ports * ar->ar_nr_ctrs * sizeof(ar->ar_prev[0]));
+  ar->ar_time = time;
+
+  if (pwrite(ar->ar_fd, sh, sizeof(*sh) + sh->as_table_size,
+             archive_seg_offset(ar->ar_seg_size, ar->ar_nr_segs)) < 0)
+    return -1;
+
+  ar->ar_nr_segs++;
+
+  return 0;
+}
+
+int archive_append(struct archive *ar, double time,
+                   const uint64_t *ctrs, const uint8_t *valid)
+{
+  struct archive_seg_hdr *sh = (struct archive_seg_hdr *) ar->ar_seg;
+  size_t i, n = ar->ar_nr_ports * ar->ar_nr_ctrs;
+  uint64_t run = 0;
+  int run_tok = 0;
+  uint8_t *start, *p;
+
+  if (sh->as_magic != ARCHIVE_SEG_MAGIC || time < ar->ar_time ||
+      sizeof(*sh) + sh->as_used + archive_record_max(ar) > ar->ar_seg_size) {
+    if (archive_seg_begin(ar, time) < 0)
+      return -1;
+  }
+
+  start = p = (uint8_t *) (sh + 1) + sh->as_used;
+
+  /* Keep time in whole milliseconds so readers add up the same. */
+  uint64_t ms = llround((time - ar->ar_time) * 1000);
+  p += varint_put(p, ms);
+  ar->ar_time += ms / 1000.0;
+
+  for (i = 0; i < n; i++) {
+    int tok = 0;
+    uint64_t zz = 0;
+
+    if (!valid[i / ar->ar_nr_ctrs]) {
+      tok = TOK_MISSING;
+    } else {
+      int64_t d = ctrs[i];
+      zz = zigzag(d - ar->ar_prev[i]);
+      /* Differences that don't fit a value token are dropped. */
+      if (zz >> 63)
+        tok = TOK_MISSING;
+      else if (zz == 0)
+        tok = TOK_ZERO;
+      else
+        ar->ar_prev[i] = d;
+    }
+
+    if (run > 0 && tok != run_tok) {
+      p += varint_put(p, (run << 2) | run_tok);
+      run = 0;
+    }
+
+    if (tok != 0) {
+      run_tok = tok;
+      run++;
+    } else {
+      p += varint_put(p, zz << 1);
+    }
+  }
+
+  if (run > 0)
+    p += varint_put(p, (run << 2) | run_tok);
+
+  off_t offs = archive_seg_offset(ar->ar_seg_size, ar->ar_nr_segs - 1);
+
+  if (pwrite(ar->ar_fd, start, p - start,
+             offs + sizeof(*sh) + sh->as_used) != p - start)
+    return -1;
+
+  sh->as_used += p - start;
+  sh->as_nr_records++;
+  sh->as_time_last = ar->ar_time;
+
+  if (pwrite(ar->ar_fd, sh, sizeof(*sh), offs) != sizeof(*sh))
+    return -1;
+
+  return 0;
+}
+
+void archive_close(struct archive *ar)
+{
+  if (ar->ar_fd >= 0)
+    close(ar->ar_fd);
+
+  free(ar->ar_seg);
+  free(ar->ar_prev);
+  memset(ar, 0, sizeof(*ar));
+  ar->ar_fd = -1;
+}
+
+int archive_reader_open(struct archive_reader *rd, const char *path)
+{
+  struct stat stat_buf;
+  int fd;
+
+  memset(rd, 0, sizeof(*rd));
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &stat_buf) < 0)
+    goto err;
+
+  if (stat_buf.st_size < sizeof(struct archive_hdr)) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  rd->rd_size = stat_buf.st_size;
+  rd->rd_map = mmap(NULL, rd->rd_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (rd->rd_map == MAP_FAILED) {
+    rd->rd_map = NULL;
+    goto err;
+  }
+
+  close(fd);
+  fd = -1;
+
+  rd->rd_hdr = rd->rd_map;
+  if (rd->rd_hdr->ah_magic != ARCHIVE_MAGIC ||
+      rd->rd_hdr->ah_seg_size < sizeof(struct archive_seg_hdr)) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  rd->rd_nr_segs = (rd->rd_size - sizeof(struct archive_hdr) +
+                    rd->rd_hdr->ah_seg_size - 1) / rd->rd_hdr->ah_seg_size;
+
+  return 0;
+
+ err:
+  if (fd >= 0)
+    close(fd);
+  archive_reader_close(rd);
+
+  return -1;
+}
+
+void archive_reader_close(struct archive_reader *rd)
+{
+  if (rd->rd_map != NULL)
+    munmap(rd->rd_map, rd->rd_size);
+
+  memset(rd, 0, sizeof(*rd));
+}
+
+/* Returns the header of segment i if it's whole and sane. */
+static const struct archive_seg_hdr *
+archive_reader_seg(struct archive_reader *rd, size_t i)
+{
+  size_t seg_size = rd->rd_hdr->ah_seg_size;
+  off_t offs = archive_seg_offset(seg_size, i);
+  const struct archive_seg_hdr *sh;
+
+  if (offs + sizeof(*sh) > rd->rd_size)
+    return NULL;
+
+  sh = (const struct archive_seg_hdr *) ((char *) rd->rd_map + offs);
+  if (sh->as_magic != ARCHIVE_SEG_MAGIC ||
+      sh->as_table_size > sh->as_used ||
+      sizeof(*sh) + sh->as_used > seg_size ||
+      offs + sizeof(*sh) + sh->as_used > rd->rd_size)
+    return NULL;
+
+  return sh;
+}
+
+static int archive_read_seg(struct archive_reader *rd,
+                            const struct archive_seg_hdr *sh,
+                            double from, double to,
+                            archive_fn_t fn, void *arg)
+{
+  size_t nr_ctrs = rd->rd_hdr->ah_nr_ctrs;
+  size_t nr_ports = sh->as_nr_ports, n = nr_ports * nr_ctrs;
+  const uint8_t *p = (const uint8_t *) (sh + 1);
+  const uint8_t *end = p + sh->as_used;
+  const uint8_t *table_end = p + sh->as_table_size;
+  const char **names = NULL;
+  uint64_t *guids = NULL, *ctrs = NULL;
+  uint8_t *ports = NULL, *valid = NULL;
+  int64_t *prev = NULL;
+  double time = sh->as_time_first, last = time;
+  size_t i, r;
+  int rc = -1;
+
+  names = calloc(nr_ports + 1, sizeof(names[0]));
+  guids = calloc(nr_ports + 1, sizeof(guids[0]));
+  ports = calloc(nr_ports + 1, sizeof(ports[0]));
+  valid = calloc(nr_ports + 1, sizeof(valid[0]));
+  ctrs = calloc(n + 1, sizeof(ctrs[0]));
+  prev = calloc(n + 1, sizeof(prev[0]));
+  if (names == NULL || guids == NULL || ports == NULL || valid == NULL ||
+      ctrs == NULL || prev == NULL)
+    goto out;
+
+  for (i = 0; i < nr_ports; i++) {
+    const uint8_t *nul;
+
+    if (p + sizeof(uint64_t) + 1 >= table_end)
+      goto bad;
+
+    memcpy(&guids[i], p, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    ports[i] = *p++;
+
+    nul = memchr(p, 0, table_end - p);
+    if (nul == NULL)
+      goto bad;
+
+    names[i] = (const char *) p;
+    p = nul + 1;
+  }
+
+  p = table_end;
+
+  for (r = 0; r < sh->as_nr_records; r++) {
+    uint64_t x;
+    size_t len = varint_get(p, end, &x);
+    if (len == 0)
+      goto bad;
+    p += len;
+
+    /* Same arithmetic as the writer. */
+    time += x / 1000.0;
+
+    if (time > to) {
+      rc = 1;
+      goto out;
+    }
+
+    memset(valid, 1, nr_ports);
+
+    for (i = 0; i < n; ) {
+      len = varint_get(p, end, &x);
+      if (len == 0)
+        goto bad;
+      p += len;
+
+      if (!(x & 1)) {
+        prev[i] += unzigzag(x >> 1);
+        ctrs[i] = prev[i];
+        i++;
+        continue;
+      }
+
+      uint64_t run = x >> 2;
+      if (run > n - i)
+        goto bad;
+
+      for (; run > 0; run--, i++) {
+        if ((x & 3) == TOK_MISSING)
+          valid[i / nr_ctrs] = 0;
+        ctrs[i] = prev[i];
+      }
+    }
+
+    if (time >= from &&
+        (*fn)(arg, time, r > 0 ? time - last : 0, nr_ports,
+              names, guids, ports, ctrs, valid) != 0) {
+      rc = 1;
+      goto out;
+    }
+
+    last = time;
+  }
+
+  rc = 0;
+  goto out;
+
+ bad:
+  errno = EINVAL;
+  rc = -1;
+
+ out:
+  free(names);
+  free(guids);
+  free(ports);
+  free(valid);
+  free(ctrs);
+  free(prev);
+
+  return rc;
+}
+
+int archive_read(struct archive_reader *rd, double from, double to,
+                 archive_fn_t fn, void *arg)
+{
+  const struct archive_seg_hdr *sh;
+  size_t lo = 0, hi = rd->rd_nr_segs, i;
+
+  /* First segment that ends at or after from. */
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    sh = archive_reader_seg(rd, mid);
+    if (sh != NULL && sh->as_time_last >= from)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  for (i = lo; i < rd->rd_nr_segs; i++) {
+    sh = archive_reader_seg(rd, i);
+    if (sh == NULL)
+      continue;
+
+    if (sh->as_time_first > to)
+      break;
+
+    int rc = archive_read_seg(rd, sh, from, to, fn, arg);
+    if (rc < 0)
+      ERROR("skipping bad segment %zu: %m\n", i);
+    else if (rc > 0)
+      break;
+  }
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/* Append-only archive of per port counter changes.  After a file
+   header, the file is a sequence of fixed size segments, each one
+   decodable on its own:
+
+     segment header (times of its first and last record, sizes)
+     port table (GUID, port, and name of each port)
+     records
+
+   A record is the time since the previous record in milliseconds
+   followed by the change of each counter of each port, port-major.
+   Each change is stored as the difference from that counter's change
+   in the previous record of the segment (delta-of-delta), zigzagged
+   and varint encoded, with runs of zero differences and of missing
+   ports collapsed into a single varint.  Segment headers double as
+   the time index: readers map the file and binary search them. */
+
+#define ARCHIVE_MAGIC 0x3148435241544249ULL     /* "IBTARCH1" */
+#define ARCHIVE_SEG_MAGIC 0x4745535241544249ULL /* "IBTARSEG" */
+#define ARCHIVE_SEG_SIZE_MIN (1UL << 20)
+
+struct archive_hdr {
+  uint64_t ah_magic;
+  uint32_t ah_seg_size;
+  uint32_t ah_nr_ctrs;
+  uint8_t ah_pad[48];
+};
+
+struct archive_seg_hdr {
+  uint64_t as_magic;
+  uint32_t as_nr_ports;
+  uint32_t as_nr_records;
+  uint32_t as_table_size;
+  uint32_t as_used; /* Bytes after this header, table included. */
+  double as_time_first;
+  double as_time_last;
+  uint8_t as_pad[24];
+};
+
+struct archive_port {
+  const char *ap_name;
+  uint64_t ap_guid;
+  uint8_t ap_port;
+};
+
+struct archive {
+  int ar_fd;
+  size_t ar_nr_ctrs;
+  size_t ar_seg_size;
+  size_t ar_nr_segs;
+  const struct archive_port *ar_ports;
+  size_t ar_nr_ports;
+  char *ar_seg;       /* Current segment, ar_seg_size bytes. */
+  int64_t *ar_prev;   /* Previous change of each counter. */
+  double ar_time;     /* Time of the previous record. */
+};
+
+/* Open (creating if needed) the archive at path for appending records
+   for nr_ports ports with nr_ctrs counters each.  ports must stay put
+   until archive_close(). */
+int archive_open(struct archive *ar, const char *path, size_t nr_ctrs,
+                 const struct archive_port *ports, size_t nr_ports);
+
+/* Append the changes ctrs[i * nr_ctrs + k] ending at time (realtime
+   seconds).  Ports with valid[i] == 0 are recorded as missing. */
+int archive_append(struct archive *ar, double time,
+                   const uint64_t *ctrs, const uint8_t *valid);
+
+void archive_close(struct archive *ar);
+
+struct archive_reader {
+  void *rd_map;
+  size_t rd_size;
+  const struct archive_hdr *rd_hdr;
+  size_t rd_nr_segs;
+};
+
+int archive_reader_open(struct archive_reader *rd, const char *path);
+void archive_reader_close(struct archive_reader *rd);
+
+/* Called for each record with from <= time <= to.  names and guids
+   (and ports) describe the nr_ports ports of the record's segment;
+   they and ctrs/valid are only good during the call.  elapsed is the
+   time since the previous record in the segment, or 0 for its first
+   record.  A nonzero return stops the iteration. */
+typedef int (*archive_fn_t)(void *arg, double time, double elapsed,
+                            size_t nr_ports, const char **names,
+                            const uint64_t *guids, const uint8_t *ports,
+                            const uint64_t *ctrs, const uint8_t *valid);
+
+int archive_read(struct archive_reader *rd, double from, double to,
+                 archive_fn_t fn, void *arg);
+
+#endif
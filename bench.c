@@ -0,0 +1,404 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <infiniband/mad.h>
+#include "trace.h"
+#include "dict.h"
+#include "mad-codec.h"
+#include "net-disc.h"
+#include "ib-net-db.h"
+#include "bench.h"
+
+#define BENCH_MAD_SIZE 256
+
+/* Keeps the compiler from throwing away what we time. */
+static volatile uint64_t bench_sink;
+
+double bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void bench_report(const char *name, size_t nodes, size_t nr_ops, double sec)
+{
+  printf("bench=%s version=%s nodes=%zu ops=%zu sec=%.6f ns_per_op=%.1f\n",
+         name, VERSION, nodes, nr_ops, sec,
+         nr_ops > 0 ? sec * 1e9 / nr_ops : 0.0);
+  fflush(stdout);
+}
+
+void bench_loop(const char *name, size_t nodes, size_t nr_ops,
+                void (*fn)(void *), void *arg)
+{
+  size_t i, n = 1;
+  double sec;
+
+  /* Once to warm up. */
+  (*fn)(arg);
+
+  while (1) {
+    double start = bench_now();
+
+    for (i = 0; i < n; i++)
+      (*fn)(arg);
+
+    sec = bench_now() - start;
+    if (sec >= BENCH_MIN_SEC)
+      break;
+
+    n *= 2;
+  }
+
+  bench_report(name, nodes, n * nr_ops, sec);
+}
+
+void bench_loop_reset(const char *name, size_t nodes, size_t nr_ops,
+                      void (*reset)(void *), void (*fn)(void *), void *arg)
+{
+  size_t n = 0;
+  double sec = 0;
+
+  (*reset)(arg);
+  (*fn)(arg);
+
+  while (sec < BENCH_MIN_SEC) {
+    double start;
+
+    (*reset)(arg);
+
+    start = bench_now();
+    (*fn)(arg);
+    sec += bench_now() - start;
+    n++;
+  }
+
+  bench_report(name, nodes, n * nr_ops, sec);
+}
+
+struct bench_dict {
+  char **bd_keys;
+  size_t bd_nr_keys;
+  struct dict bd_dict;
+  size_t bd_hint;
+};
+
+static void bench_strhash(void *arg)
+{
+  struct bench_dict *bd = arg;
+  hash_t x = 0;
+  size_t i;
+
+  for (i = 0; i < bd->bd_nr_keys; i++)
+    x ^= dict_strhash(bd->bd_keys[i]);
+
+  bench_sink += x;
+}
+
+static void bench_entry_ref(void *arg)
+{
+  struct bench_dict *bd = arg;
+  size_t i, n = 0;
+
+  for (i = 0; i < bd->bd_nr_keys; i++) {
+    const char *key = bd->bd_keys[i];
+
+    n += dict_entry_ref(&bd->bd_dict, dict_strhash(key), key)->d_key != NULL;
+  }
+
+  bench_sink += n;
+}
+
+static void bench_set(void *arg)
+{
+  struct bench_dict *bd = arg;
+  struct dict dict;
+  size_t i;
+
+  if (dict_init(&dict, bd->bd_hint) < 0)
+    OOM();
+
+  for (i = 0; i < bd->bd_nr_keys; i++)
+    if (dict_set(&dict, bd->bd_keys[i]) < 0)
+      OOM();
+
+  bench_sink += dict.d_count;
+  dict_destroy(&dict, NULL);
+}
+
+void bench_dict(size_t nodes)
+{
+  struct bench_dict bd = { .bd_nr_keys = nodes, };
+  size_t i;
+
+  bd.bd_keys = calloc(nodes, sizeof(bd.bd_keys[0]));
+  if (bd.bd_keys == NULL)
+    OOM();
+
+  for (i = 0; i < nodes; i++)
+    if (asprintf(&bd.bd_keys[i], "c%06zu", i) < 0)
+      OOM();
+
+  if (dict_init(&bd.bd_dict, nodes) < 0)
+    OOM();
+
+  for (i = 0; i < nodes; i++)
+    if (dict_set(&bd.bd_dict, bd.bd_keys[i]) < 0)
+      OOM();
+
+  bench_loop("dict_strhash", nodes, nodes, &bench_strhash, &bd);
+  bench_loop("dict_entry_ref", nodes, nodes, &bench_entry_ref, &bd);
+
+  bd.bd_hint = nodes;
+  bench_loop("dict_set", nodes, nodes, &bench_set, &bd);
+
+  /* From the minimum table, so every doubling is paid for. */
+  bd.bd_hint = 0;
+  bench_loop("dict_resize", nodes, nodes, &bench_set, &bd);
+
+  dict_destroy(&bd.bd_dict, NULL);
+  for (i = 0; i < nodes; i++)
+    free(bd.bd_keys[i]);
+  free(bd.bd_keys);
+}
+
+struct bench_net_disc {
+  const char *bd_disc_path;
+  int bd_nr_threads;
+};
+
+/* By the old parser if nr_threads < 0. */
+static void bench_net_disc_run(const char *disc_path, int nr_threads,
+                               FILE *info_file)
+{
+  FILE *disc_file;
+  int rc;
+
+  disc_file = fopen(disc_path, "r");
+  if (disc_file == NULL)
+    FATAL("cannot open `%s': %m\n", disc_path);
+
+  if (nr_threads < 0)
+    rc = net_disc_to_info(disc_file, info_file);
+  else
+    rc = net_disc_fast_to_info(disc_file, info_file, nr_threads);
+
+  if (rc < 0)
+    FATAL("cannot parse `%s'\n", disc_path);
+
+  fclose(disc_file);
+}
+
+static void bench_net_disc_1(void *arg)
+{
+  struct bench_net_disc *bd = arg;
+  FILE *info_file = fopen("/dev/null", "w");
+
+  if (info_file == NULL)
+    FATAL("cannot open `%s': %m\n", "/dev/null");
+
+  bench_net_disc_run(bd->bd_disc_path, bd->bd_nr_threads, info_file);
+  fclose(info_file);
+}
+
+static char *bench_net_disc_info(const char *disc_path, int nr_threads,
+                                 size_t *size)
+{
+  char *info = NULL;
+  FILE *info_file = open_memstream(&info, size);
+
+  if (info_file == NULL)
+    OOM();
+
+  bench_net_disc_run(disc_path, nr_threads, info_file);
+  if (fclose(info_file) != 0)
+    OOM();
+
+  return info;
+}
+
+/* The fast parser must write exactly what the old one does, however
+   the input is split. */
+static void bench_net_disc_check(const char *disc_path)
+{
+  static const int nr_threads_vec[] = { 1, 2, 3, 8, 0, };
+  size_t ref_size, size, i;
+  char *ref, *info;
+
+  ref = bench_net_disc_info(disc_path, -1, &ref_size);
+
+  for (i = 0; i < sizeof(nr_threads_vec) / sizeof(nr_threads_vec[0]); i++) {
+    info = bench_net_disc_info(disc_path, nr_threads_vec[i], &size);
+
+    if (size != ref_size || memcmp(info, ref, size) != 0)
+      FATAL("net_disc_buf_to_info() with %d threads differs from "
+            "net_disc_to_info() on `%s'\n", nr_threads_vec[i], disc_path);
+
+    free(info);
+  }
+
+  free(ref);
+}
+
+void bench_net_disc(const char *disc_path, size_t nodes)
+{
+  struct bench_net_disc bd = { .bd_disc_path = disc_path, };
+
+  bench_net_disc_check(disc_path);
+
+  bd.bd_nr_threads = -1;
+  bench_loop("net_disc_to_info", nodes, nodes, &bench_net_disc_1, &bd);
+
+  bd.bd_nr_threads = 1;
+  bench_loop("net_disc_buf_to_info_1", nodes, nodes, &bench_net_disc_1, &bd);
+
+  bd.bd_nr_threads = 0;
+  bench_loop("net_disc_buf_to_info", nodes, nodes, &bench_net_disc_1, &bd);
+}
+
+struct bench_mad {
+  char *bm_buf;
+  size_t bm_nr;
+  struct pce_ctrs *bm_pce;
+};
+
+static void bench_mad_encode(void *arg)
+{
+  struct bench_mad *bm = arg;
+  size_t i;
+
+  for (i = 0; i < bm->bm_nr; i++) {
+    void *m = bm->bm_buf + i * BENCH_MAD_SIZE;
+
+    mad_encode_hdr(m, IB_PERFORMANCE_CLASS, IB_MAD_METHOD_GET,
+                   IB_GSI_PORT_COUNTERS_EXT, 0, i);
+    put_u8((char *) m + MAD_PMA_DATA_OFFS, PCE_PORT_SELECT_OFFS, 1);
+  }
+}
+
+static void bench_mad_decode(void *arg)
+{
+  struct bench_mad *bm = arg;
+  uint64_t x = 0;
+  size_t i;
+
+  pce_decode_batch(bm->bm_buf, BENCH_MAD_SIZE, bm->bm_nr, bm->bm_pce);
+
+  for (i = 0; i < bm->bm_nr; i++)
+    x += bm->bm_pce[i].pce_xmt_bytes;
+
+  bench_sink += x;
+}
+
+void bench_mad_codec(size_t nodes)
+{
+  struct bench_mad bm = { .bm_nr = nodes, };
+  size_t i;
+
+  bm.bm_buf = calloc(nodes, BENCH_MAD_SIZE);
+  bm.bm_pce = calloc(nodes, sizeof(bm.bm_pce[0]));
+  if (bm.bm_buf == NULL || bm.bm_pce == NULL)
+    OOM();
+
+  bench_loop("mad_encode", nodes, nodes, &bench_mad_encode, &bm);
+
+  for (i = 0; i < nodes; i++) {
+    char *pc = bm.bm_buf + i * BENCH_MAD_SIZE + MAD_PMA_DATA_OFFS;
+
+    put_be64(pc, PCE_XMT_BYTES_OFFS, i << 20);
+    put_be64(pc, PCE_RCV_BYTES_OFFS, i << 19);
+  }
+
+  bench_loop("mad_decode", nodes, nodes, &bench_mad_decode, &bm);
+
+  free(bm.bm_pce);
+  free(bm.bm_buf);
+}
+
+struct bench_net_db {
+  const char *bn_info_path;
+  const char *bn_db_path;
+  struct ib_net_db bn_db;
+  char **bn_names;
+};
+
+static void bench_net_db_build(void *arg)
+{
+  struct bench_net_db *bn = arg;
+  FILE *info_file = fopen(bn->bn_info_path, "r");
+
+  if (info_file == NULL)
+    FATAL("cannot open `%s': %m\n", bn->bn_info_path);
+
+  if (ib_net_db_build(bn->bn_db_path, info_file) < 0)
+    FATAL("cannot write `%s': %m\n", bn->bn_db_path);
+
+  fclose(info_file);
+}
+
+static void bench_net_db_open(void *arg)
+{
+  struct bench_net_db *bn = arg;
+  struct ib_net_db nd;
+
+  if (ib_net_db_open(&nd, bn->bn_db_path, O_RDONLY, 0) < 0)
+    FATAL("cannot open `%s': %m\n", bn->bn_db_path);
+
+  bench_sink += nd.nd_count;
+  ib_net_db_close(&nd);
+}
+
+static void bench_net_db_fetch(void *arg)
+{
+  struct bench_net_db *bn = arg;
+  struct ib_net_ent ne;
+  size_t i, n = 0;
+
+  for (i = 0; i < bn->bn_db.nd_count; i++)
+    n += ib_net_db_fetch(&bn->bn_db, bn->bn_names[i], &ne) > 0 ? ne.ne_lid : 0;
+
+  bench_sink += n;
+}
+
+void bench_net_db(const char *info_path, const char *db_path, size_t nodes)
+{
+  struct bench_net_db bn = {
+    .bn_info_path = info_path,
+    .bn_db_path = db_path,
+  };
+  size_t i;
+
+  bench_loop("ib_net_db_build", nodes, nodes, &bench_net_db_build, &bn);
+  bench_loop("ib_net_db_open", nodes, 1, &bench_net_db_open, &bn);
+
+  if (ib_net_db_open(&bn.bn_db, db_path, O_RDONLY, 0) < 0)
+    FATAL("cannot open `%s': %m\n", db_path);
+
+  bn.bn_names = calloc(bn.bn_db.nd_count + 1, sizeof(bn.bn_names[0]));
+  if (bn.bn_names == NULL)
+    OOM();
+
+  for (i = 0; i < bn.bn_db.nd_count; i++) {
+    struct ib_net_ent ne;
+    const char *name;
+
+    ib_net_db_ent(&bn.bn_db, i, &name, &ne);
+    bn.bn_names[i] = strdup(name);
+    if (bn.bn_names[i] == NULL)
+      OOM();
+  }
+
+  bench_loop("ib_net_db_fetch", nodes, bn.bn_db.nd_count,
+             &bench_net_db_fetch, &bn);
+
+  for (i = 0; i < bn.bn_db.nd_count; i++)
+    free(bn.bn_names[i]);
+  free(bn.bn_names);
+  ib_net_db_close(&bn.bn_db);
+}
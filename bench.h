@@ -0,0 +1,39 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+#include <stddef.h>
+
+/* Benchmark results are printed one per line, as KEY=VALUE pairs:
+
+     bench=NAME version=VERSION nodes=N ops=OPS sec=SEC ns_per_op=NS
+
+   where OPS is the number of operations (hosts hashed, lines parsed,
+   MADs decoded, ...) timed in SEC seconds. */
+
+double bench_now(void);
+
+void bench_report(const char *name, size_t nodes, size_t nr_ops, double sec);
+
+/* Call fn(arg), which does nr_ops operations, until at least
+   BENCH_MIN_SEC have gone by, and report the time per operation. */
+#define BENCH_MIN_SEC 0.2
+
+void bench_loop(const char *name, size_t nodes, size_t nr_ops,
+                void (*fn)(void *), void *arg);
+
+/* Like bench_loop(), for fn that need a fresh start: reset(arg) is
+   called, untimed, before each fn(arg). */
+void bench_loop_reset(const char *name, size_t nodes, size_t nr_ops,
+                      void (*reset)(void *), void (*fn)(void *), void *arg);
+
+/* Benchmarks of the generic parts: dict_strhash(), dict_entry_ref(),
+   and dict_set() with and without resizing; net_disc_to_info() and
+   net_disc_buf_to_info() of disc_path, after checking that their
+   output is the same; PortCountersExtended encoding and decoding; and
+   compiling the net info at info_path to db_path, opening it, and
+   fetching every host. */
+void bench_dict(size_t nodes);
+void bench_net_disc(const char *disc_path, size_t nodes);
+void bench_mad_codec(size_t nodes);
+void bench_net_db(const char *info_path, const char *db_path, size_t nodes);
+
+#endif
@@ -0,0 +1,506 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <inttypes.h>
+#include <infiniband/umad.h>
+#include "trace.h"
+#include "string1.h"
+#include "list.h"
+#include "dict.h"
+#include "mad-codec.h"
+#include "net-disc.h"
+#include "dr-disc.h"
+
+#define DR_MAD_SIZE 256
+#define DR_RECV_BATCH 64
+#define DR_CLASS_SMP 0x81
+#define DR_METHOD_GET 0x01
+#define DR_PERMISSIVE_LID 0xffff
+
+#define DR_ATTR_NODE_DESC 0x0010
+#define DR_ATTR_NODE_INFO 0x0011
+#define DR_ATTR_PORT_INFO 0x0015
+
+#define P_GUID "%016"PRIx64
+
+/* A switch, or a CA as seen from one switch port.  dn_path is the
+   initial path of SMPs to the node (ports from dn_path[1]). */
+struct dr_node {
+  struct list_head dn_link;
+  uint64_t dn_guid;
+  uint8_t dn_path[SMP_MAX_HOPS + 1];
+  unsigned int dn_nr_hops;
+  unsigned int dn_type;
+  unsigned int dn_nr_ports;
+  unsigned int dn_port;       /* LocalPortNum, the port we came in by. */
+  unsigned int dn_from_sw:1;
+  uint16_t dn_lid;
+  unsigned int dn_width;      /* CAs: LinkWidthActive, ... */
+  unsigned int dn_speed;
+  unsigned int dn_speed_ext;
+  struct dr_node *dn_sw;      /* CAs: the switch and port they're on. */
+  unsigned int dn_sw_port;
+  char dn_desc[SMP_DATA_SIZE + 1];
+  char dn_key[17];            /* Switches: the GUID, for dr_sw_dict. */
+};
+
+/* A query of rq_attr about rq_node, or, for NodeInfo, about what's
+   at the far end of rq_port of rq_node (the local node if rq_node is
+   NULL). */
+struct dr_req {
+  struct list_head rq_link;
+  struct dr_node *rq_node;
+  unsigned int rq_attr;
+  unsigned int rq_port;
+  uint32_t rq_trid;
+  double rq_deadline;
+};
+
+struct dr_disc {
+  struct umad_io *dd_io;
+  const struct dr_disc_conf *dd_conf;
+  size_t dd_umad_len;
+  struct list_head dd_pending;
+  struct list_head dd_nodes;
+  struct dict dd_sw_dict;
+  struct dr_req **dd_slots;   /* Outstanding, indexed by TRID. */
+  char *dd_send_bufs;
+  size_t dd_nr_out;
+  uint32_t dd_seq;
+  size_t dd_nr_sent;
+  size_t dd_nr_failed;
+  size_t dd_nr_switches;
+  size_t dd_nr_cas;
+};
+
+static double dr_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static struct dr_node *dr_node_new(struct dr_disc *dd, struct dr_node *from,
+                                   unsigned int port)
+{
+  struct dr_node *dn = calloc(1, sizeof(*dn));
+
+  if (dn == NULL)
+    OOM();
+
+  if (from != NULL) {
+    memcpy(dn->dn_path, from->dn_path, from->dn_nr_hops + 1);
+    dn->dn_nr_hops = from->dn_nr_hops + 1;
+    dn->dn_path[dn->dn_nr_hops] = port;
+    dn->dn_from_sw = from->dn_type == NI_TYPE_SWITCH;
+  }
+
+  list_add_tail(&dn->dn_link, &dd->dd_nodes);
+
+  return dn;
+}
+
+static void dr_queue(struct dr_disc *dd, struct dr_node *dn,
+                     unsigned int attr, unsigned int port)
+{
+  struct dr_req *rq = calloc(1, sizeof(*rq));
+
+  if (rq == NULL)
+    OOM();
+
+  rq->rq_node = dn;
+  rq->rq_attr = attr;
+  rq->rq_port = port;
+  list_add_tail(&rq->rq_link, &dd->dd_pending);
+}
+
+/* What's behind port of dn, unless that's more hops than an SMP can
+   take. */
+static void dr_queue_peer(struct dr_disc *dd, struct dr_node *dn,
+                          unsigned int port)
+{
+  if (dn != NULL && !(dn->dn_nr_hops < SMP_MAX_HOPS)) {
+    ERROR("not following port %u of "P_GUID": too many hops\n",
+          port, dn->dn_guid);
+    return;
+  }
+
+  dr_queue(dd, dn, DR_ATTR_NODE_INFO, port);
+}
+
+/* Switches' descriptions aren't needed. */
+static void dr_queue_switch(struct dr_disc *dd, struct dr_node *dn)
+{
+  unsigned int port;
+
+  for (port = 0; port <= dn->dn_nr_ports; port++)
+    dr_queue(dd, dn, DR_ATTR_PORT_INFO, port);
+}
+
+static int dr_send(struct dr_disc *dd, struct dr_req *rq, size_t slot)
+{
+  const struct dr_disc_conf *dc = dd->dd_conf;
+  void *um = dd->dd_send_bufs + slot * dd->dd_umad_len;
+  struct ib_user_mad *umh = um;
+  struct dr_node *dn = rq->rq_node;
+  unsigned int nr_hops = dn != NULL ? dn->dn_nr_hops : 0;
+  unsigned int attr_mod = 0;
+  char *m;
+
+  memset(um, 0, dd->dd_umad_len);
+  umad_set_addr(um, DR_PERMISSIVE_LID, 0, 0, 0);
+  umh->agent_id = dc->dc_agent_id;
+  umh->timeout_ms = dc->dc_timeout_ms;
+  umh->retries = dc->dc_retries;
+
+  if (rq->rq_attr == DR_ATTR_PORT_INFO)
+    attr_mod = rq->rq_port;
+
+  rq->rq_trid = (dd->dd_seq++ & 0xffff) << 16 | slot;
+
+  m = umad_get_mad(um);
+  mad_encode_hdr(m, DR_CLASS_SMP, DR_METHOD_GET, rq->rq_attr, attr_mod,
+                 rq->rq_trid);
+
+  if (dn != NULL)
+    memcpy(m + SMP_INIT_PATH_OFFS, dn->dn_path, nr_hops + 1);
+
+  if (rq->rq_attr == DR_ATTR_NODE_INFO && dn != NULL)
+    m[SMP_INIT_PATH_OFFS + ++nr_hops] = rq->rq_port;
+
+  put_u8(m, SMP_HOP_PTR_OFFS, 0);
+  put_u8(m, SMP_HOP_CNT_OFFS, nr_hops);
+  put_be16(m, SMP_DR_SLID_OFFS, DR_PERMISSIVE_LID);
+  put_be16(m, SMP_DR_DLID_OFFS, DR_PERMISSIVE_LID);
+
+  if (umad_io_send(dd->dd_io, um, dd->dd_umad_len) < 0) {
+    ERROR("cannot send SMP: %m\n");
+    return -1;
+  }
+
+  /* The kernel times out and retries, this is only in case a
+     response goes missing altogether. */
+  rq->rq_deadline = dr_now() + 1 +
+    dc->dc_timeout_ms * (dc->dc_retries + 1) / 1000.0;
+
+  dd->dd_slots[slot] = rq;
+  dd->dd_nr_out++;
+  dd->dd_nr_sent++;
+
+  return 0;
+}
+
+static void dr_node_info(struct dr_disc *dd, struct dr_req *rq, const char *d)
+{
+  struct dr_node *from = rq->rq_node, *dn;
+  unsigned int type = get_u8(d, NI_NODE_TYPE_OFFS);
+  uint64_t guid = get_be64(d, NI_NODE_GUID_OFFS);
+  struct dict_entry *de;
+  char key[sizeof(dn->dn_key)];
+  hash_t hash;
+
+  /* The walk only goes on through switches, and from the local node. */
+  if (from != NULL && from->dn_type != NI_TYPE_SWITCH &&
+      type != NI_TYPE_SWITCH)
+    return;
+
+  if (type == NI_TYPE_SWITCH) {
+    snprintf(key, sizeof(key), "%016"PRIx64, guid);
+    hash = dict_strhash(key);
+    de = dict_entry_ref(&dd->dd_sw_dict, hash, key);
+    if (de->d_key != NULL)
+      return;
+
+    dn = dr_node_new(dd, from, rq->rq_port);
+    strcpy(dn->dn_key, key);
+    if (dict_entry_set(&dd->dd_sw_dict, de, hash, dn->dn_key) < 0)
+      OOM();
+  } else {
+    dn = dr_node_new(dd, from, rq->rq_port);
+  }
+
+  dn->dn_guid = guid;
+  dn->dn_type = type;
+  dn->dn_nr_ports = get_u8(d, NI_NR_PORTS_OFFS);
+  dn->dn_port = get_u8(d, NI_LOCAL_PORT_OFFS);
+
+  TRACE("node "P_GUID", type %u, ports %u, port %u, hops %u\n",
+        dn->dn_guid, dn->dn_type, dn->dn_nr_ports, dn->dn_port,
+        dn->dn_nr_hops);
+
+  if (type == NI_TYPE_SWITCH) {
+    dd->dd_nr_switches++;
+    dr_queue_switch(dd, dn);
+  } else if (from == NULL) {
+    /* Us.  Out through the port we'd have come in by. */
+    dr_queue_peer(dd, dn, dn->dn_port);
+  } else {
+    dd->dd_nr_cas++;
+    dn->dn_sw = from;
+    dn->dn_sw_port = rq->rq_port;
+    dr_queue(dd, dn, DR_ATTR_NODE_DESC, 0);
+    dr_queue(dd, dn, DR_ATTR_PORT_INFO, dn->dn_port);
+  }
+}
+
+static void dr_port_info(struct dr_disc *dd, struct dr_req *rq, const char *d)
+{
+  struct dr_node *dn = rq->rq_node;
+  unsigned int state = get_u8(d, PI_PORT_STATE_OFFS) & 0xf;
+
+  if (dn->dn_type != NI_TYPE_SWITCH || rq->rq_port == 0) {
+    dn->dn_lid = get_be16(d, PI_LID_OFFS);
+    dn->dn_width = get_u8(d, PI_LINK_WIDTH_ACTIVE_OFFS);
+    dn->dn_speed = get_u8(d, PI_LINK_SPEED_ACTIVE_OFFS) >> 4;
+    if (get_be32(d, PI_CAP_MASK_OFFS) & PI_CAP_EXT_SPEEDS)
+      dn->dn_speed_ext = get_u8(d, PI_LINK_SPEED_EXT_OFFS) >> 4;
+    return;
+  }
+
+  /* Init, Armed, or Active.  The way back to a switch we came from
+     only leads to it again. */
+  if (state <= PI_STATE_DOWN)
+    return;
+
+  if (rq->rq_port == dn->dn_port && dn->dn_from_sw)
+    return;
+
+  dr_queue_peer(dd, dn, rq->rq_port);
+}
+
+static void dr_recv(struct dr_disc *dd, const void *um, size_t len)
+{
+  const struct ib_user_mad *umh = um;
+  const char *m = umad_get_mad((void *) um);
+  uint32_t trid;
+  size_t slot;
+  struct dr_req *rq;
+  unsigned int status;
+
+  if (len < dd->dd_umad_len - DR_MAD_SIZE + SMP_INIT_PATH_OFFS)
+    return;
+
+  trid = mad_get_trid(m);
+  slot = trid & 0xffff;
+  if (!(slot < dd->dd_conf->dc_window))
+    return;
+
+  rq = dd->dd_slots[slot];
+  if (rq == NULL || rq->rq_trid != trid)
+    return; /* Duplicate or stale. */
+
+  dd->dd_slots[slot] = NULL;
+  dd->dd_nr_out--;
+
+  status = mad_get_status(m);
+  if (umh->status != 0 || status != 0) {
+    /* Ports that are down but not yet marked so end up here. */
+    TRACE("SMP attr %#x, port %u, hops %u failed: umad status %d, "
+          "status %#x\n", rq->rq_attr, rq->rq_port,
+          rq->rq_node != NULL ? rq->rq_node->dn_nr_hops : 0,
+          umh->status, status);
+    dd->dd_nr_failed++;
+    goto out;
+  }
+
+  switch (rq->rq_attr) {
+  case DR_ATTR_NODE_INFO:
+    dr_node_info(dd, rq, m + SMP_DATA_OFFS);
+    break;
+  case DR_ATTR_NODE_DESC:
+    memcpy(rq->rq_node->dn_desc, m + SMP_DATA_OFFS, SMP_DATA_SIZE);
+    break;
+  case DR_ATTR_PORT_INFO:
+    dr_port_info(dd, rq, m + SMP_DATA_OFFS);
+    break;
+  }
+
+ out:
+  free(rq);
+}
+
+/* Give up on requests whose responses never came. */
+static void dr_expire(struct dr_disc *dd, double now)
+{
+  size_t slot;
+
+  for (slot = 0; slot < dd->dd_conf->dc_window; slot++) {
+    struct dr_req *rq = dd->dd_slots[slot];
+
+    if (rq == NULL || now < rq->rq_deadline)
+      continue;
+
+    ERROR("no response to SMP attr %#x\n", rq->rq_attr);
+    dd->dd_slots[slot] = NULL;
+    dd->dd_nr_out--;
+    dd->dd_nr_failed++;
+    free(rq);
+  }
+}
+
+static int dr_ca_cmp(const void *p1, const void *p2)
+{
+  const struct dr_node *n1 = *(struct dr_node **) p1;
+  const struct dr_node *n2 = *(struct dr_node **) p2;
+
+  if (n1->dn_sw->dn_guid != n2->dn_sw->dn_guid)
+    return n1->dn_sw->dn_guid < n2->dn_sw->dn_guid ? -1 : 1;
+
+  if (n1->dn_sw_port != n2->dn_sw_port)
+    return n1->dn_sw_port < n2->dn_sw_port ? -1 : 1;
+
+  return 0;
+}
+
+static int dr_write_info(struct dr_disc *dd, FILE *info_file)
+{
+  struct dr_node **ca_vec, *dn;
+  size_t nr_cas = 0, i;
+
+  ca_vec = calloc(dd->dd_nr_cas + 1, sizeof(ca_vec[0]));
+  if (ca_vec == NULL)
+    OOM();
+
+  list_for_each_entry(dn, &dd->dd_nodes, dn_link)
+    if (dn->dn_sw != NULL)
+      ca_vec[nr_cas++] = dn;
+
+  qsort(ca_vec, nr_cas, sizeof(ca_vec[0]), &dr_ca_cmp);
+
+  for (i = 0; i < nr_cas; i++) {
+    struct net_info_port np;
+    char link[32];
+
+    dn = ca_vec[i];
+    np.np_host = chop(dn->dn_desc, ' ');
+    if (*np.np_host == 0) {
+      ERROR("no description for CA "P_GUID" on switch "P_GUID" port %u\n",
+            dn->dn_guid, dn->dn_sw->dn_guid, dn->dn_sw_port);
+      continue;
+    }
+
+    snprintf(link, sizeof(link), "%sx%s", net_info_width_str(dn->dn_width),
+             net_info_speed_str(dn->dn_speed, dn->dn_speed_ext));
+
+    np.np_host_len = strlen(np.np_host);
+    np.np_hca_guid = dn->dn_guid;
+    np.np_hca_lid = dn->dn_lid;
+    np.np_hca_port = dn->dn_port;
+    np.np_sw_guid = dn->dn_sw->dn_guid;
+    np.np_sw_lid = dn->dn_sw->dn_lid;
+    np.np_sw_port = dn->dn_sw_port;
+    np.np_link = link;
+    np.np_link_len = strlen(link);
+    net_info_write(info_file, &np);
+  }
+
+  free(ca_vec);
+
+  return ferror(info_file) ? -1 : 0;
+}
+
+int dr_disc_to_info(struct umad_io *io, const struct dr_disc_conf *dc,
+                    FILE *info_file)
+{
+  struct dr_disc dd = {
+    .dd_io = io,
+    .dd_conf = dc,
+    .dd_umad_len = umad_size() + DR_MAD_SIZE,
+  };
+  size_t recv_len[DR_RECV_BATCH];
+  char *recv_bufs = NULL;
+  struct dr_node *dn, *dn_next;
+  double start = dr_now();
+  size_t slot = 0;
+  int rc = -1;
+
+  if (dc->dc_window == 0 || dc->dc_window > 0x10000) {
+    ERROR("invalid SMP window %zu\n", dc->dc_window);
+    return -1;
+  }
+
+  INIT_LIST_HEAD(&dd.dd_pending);
+  INIT_LIST_HEAD(&dd.dd_nodes);
+
+  dd.dd_slots = calloc(dc->dc_window, sizeof(dd.dd_slots[0]));
+  dd.dd_send_bufs = malloc(dc->dc_window * dd.dd_umad_len);
+  recv_bufs = malloc(DR_RECV_BATCH * dd.dd_umad_len);
+  if (dd.dd_slots == NULL || dd.dd_send_bufs == NULL || recv_bufs == NULL ||
+      dict_init(&dd.dd_sw_dict, 1024) < 0)
+    OOM();
+
+  dr_queue_peer(&dd, NULL, 0);
+
+  while (!list_empty(&dd.dd_pending) || dd.dd_nr_out > 0) {
+    ssize_t i, nr;
+
+    while (dd.dd_nr_out < dc->dc_window && !list_empty(&dd.dd_pending)) {
+      struct dr_req *rq =
+        list_entry(dd.dd_pending.next, struct dr_req, rq_link);
+
+      while (dd.dd_slots[slot] != NULL)
+        slot = (slot + 1) % dc->dc_window;
+
+      list_del(&rq->rq_link);
+      if (dr_send(&dd, rq, slot) < 0) {
+        free(rq);
+        goto out;
+      }
+    }
+
+    if (umad_io_flush(io) < 0) {
+      ERROR("cannot send SMPs: %m\n");
+      goto out;
+    }
+
+    if (umad_io_wait(io, 0.1) < 0) {
+      ERROR("cannot wait for SMPs: %m\n");
+      goto out;
+    }
+
+    nr = umad_io_recv(io, recv_bufs, dd.dd_umad_len, DR_RECV_BATCH, recv_len,
+                      NULL);
+    if (nr < 0) {
+      ERROR("cannot receive SMPs: %m\n");
+      goto out;
+    }
+
+    for (i = 0; i < nr; i++)
+      dr_recv(&dd, recv_bufs + i * dd.dd_umad_len, recv_len[i]);
+
+    dr_expire(&dd, dr_now());
+  }
+
+  TRACE("%zu switches, %zu CA ports, %zu SMPs (%zu failed) in %f s\n",
+        dd.dd_nr_switches, dd.dd_nr_cas, dd.dd_nr_sent, dd.dd_nr_failed,
+        dr_now() - start);
+
+  rc = dr_write_info(&dd, info_file);
+
+ out:
+  for (slot = 0; slot < dc->dc_window; slot++)
+    free(dd.dd_slots[slot]);
+
+  while (!list_empty(&dd.dd_pending)) {
+    struct dr_req *rq =
+      list_entry(dd.dd_pending.next, struct dr_req, rq_link);
+
+    list_del(&rq->rq_link);
+    free(rq);
+  }
+
+  list_for_each_entry_safe(dn, dn_next, &dd.dd_nodes, dn_link)
+    free(dn);
+
+  dict_destroy(&dd.dd_sw_dict, NULL);
+  free(dd.dd_slots);
+  free(dd.dd_send_bufs);
+  free(recv_bufs);
+
+  return rc;
+}
@@ -0,0 +1,26 @@
+#ifndef _DR_DISC_H_
+#define _DR_DISC_H_
+#include <stddef.h>
+#include <stdio.h>
+#include "umad-io.h"
+
+/* Native fabric discovery, for make-net-info -d: a breadth first walk
+   of the subnet by directed route SMPs (NodeInfo, NodeDescription, and
+   PortInfo), keeping up to dc_window of them outstanding, rather than
+   one at a time as ibnetdiscover does.  Switches are told apart by
+   node GUID, and the walk doesn't go through CAs. */
+
+struct dr_disc_conf {
+  int dc_agent_id;     /* An SMI (directed route) agent on io's port. */
+  size_t dc_window;
+  int dc_timeout_ms;
+  int dc_retries;
+};
+
+/* Discover the fabric through io and write a net info line (see
+   net-disc.h) for each CA port attached to a switch, in switch GUID
+   and port order. */
+int dr_disc_to_info(struct umad_io *io, const struct dr_disc_conf *dc,
+                    FILE *info_file);
+
+#endif
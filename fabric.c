@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "trace.h"
+#include "string1.h"
+#include "mad-codec.h"
+#include "sa-dump.h"
+#include "fabric.h"
+
+#define LEAF_GUID  UINT64_C(0x0002c90200000000)
+#define SPINE_GUID UINT64_C(0x0002c90210000000)
+#define HCA_GUID   UINT64_C(0x0002c90300000000)
+#define LID_MAX    0xbfff
+#define P_GUID "%016"PRIx64
+
+/* Record strides of the SA tables, in multiples of 8 bytes. */
+#define NR_STRIDE  112
+#define PIR_STRIDE 72
+#define LR_STRIDE  8
+
+/* Each leaf has as many uplinks as hosts, spread over the spines
+   (see leaf_uplink()). */
+#define SW_PORTS (2 * FABRIC_LEAF_HOSTS)
+
+struct fabric_geom {
+  size_t fg_nr_leaves;
+  size_t fg_nr_spines;
+};
+
+/* The inverse of a mod n, or 0 if they aren't coprime. */
+static size_t mod_inverse(size_t a, size_t n)
+{
+  long long r0 = n, r1 = a % n, t0 = 0, t1 = 1;
+
+  while (r1 != 0) {
+    long long k = r0 / r1, x;
+
+    x = r0 - k * r1, r0 = r1, r1 = x;
+    x = t0 - k * t1, t0 = t1, t1 = x;
+  }
+
+  if (r0 != 1)
+    return 0;
+
+  return t0 < 0 ? t0 + n : t0;
+}
+
+static void fabric_geom(const struct fabric_conf *fc, struct fabric_geom *fg)
+{
+  fg->fg_nr_leaves = (fc->fc_nr_hosts + FABRIC_LEAF_HOSTS - 1) /
+    FABRIC_LEAF_HOSTS;
+  fg->fg_nr_spines = (fg->fg_nr_leaves * FABRIC_LEAF_HOSTS + SW_PORTS - 1) /
+    SW_PORTS;
+}
+
+/* Uplink q permutes the leaves by its own multiplier, so the spines of
+   different q mix them and the fabric stays a few hops across at any
+   size. */
+static size_t uplink_mul(const struct fabric_geom *fg, size_t q)
+{
+  size_t n = fg->fg_nr_leaves, m;
+
+  if (n == 1)
+    return 0;
+
+  m = q == 0 ? 1 : (q * UINT64_C(2654435761)) % n;
+  while (mod_inverse(m, n) == 0)
+    m = (m + 1) % n;
+
+  return m;
+}
+
+static inline uint16_t leaf_lid(const struct fabric_geom *fg, size_t l)
+{
+  return 1 + l;
+}
+
+static inline uint16_t spine_lid(const struct fabric_geom *fg, size_t s)
+{
+  return 1 + fg->fg_nr_leaves + s;
+}
+
+/* Fabrics bigger than a subnet can hold are still worth timing, so
+   HCA LIDs wrap.  Only switch LIDs are queried. */
+static inline uint16_t hca_lid(const struct fabric_geom *fg, size_t i)
+{
+  return 1 + (fg->fg_nr_leaves + fg->fg_nr_spines + i) % LID_MAX;
+}
+
+/* Uplink q of leaf l goes to a spine by up = q * nr_leaves + (l *
+   uplink_mul(q)) % nr_leaves, so each spine has up to SW_PORTS
+   leaves. */
+static inline void leaf_uplink(const struct fabric_geom *fg, size_t l,
+                               size_t q, size_t *s, size_t *port)
+{
+  size_t n = fg->fg_nr_leaves;
+  size_t up = q * n + (l * uplink_mul(fg, q)) % n;
+
+  *s = up / SW_PORTS;
+  *port = up % SW_PORTS + 1;
+}
+
+/* Returns -1 if port of spine s is unused. */
+static inline int spine_downlink(const struct fabric_geom *fg, size_t s,
+                                 size_t port, size_t *l, size_t *q)
+{
+  size_t n = fg->fg_nr_leaves;
+  size_t up = s * SW_PORTS + port - 1;
+
+  if (!(up < n * FABRIC_LEAF_HOSTS))
+    return -1;
+
+  *q = up / n;
+  *l = (up % n) * mod_inverse(uplink_mul(fg, *q), n) % n;
+
+  return 0;
+}
+
+static void write_sw_hdr(FILE *file, uint64_t guid, unsigned int devid)
+{
+  fprintf(file,
+          "vendid=0x2c9\n"
+          "devid=0x%x\n"
+          "sysimgguid=0x%"PRIx64"\n"
+          "switchguid=0x%"PRIx64"(%"PRIx64")\n",
+          devid, guid, guid, guid);
+}
+
+int fabric_write_disc(const struct fabric_conf *fc, FILE *file)
+{
+  struct fabric_geom fg;
+  size_t l, s, i, p;
+
+  fabric_geom(fc, &fg);
+
+  for (s = 0; s < fg.fg_nr_spines; s++) {
+    write_sw_hdr(file, SPINE_GUID + s, 0xc738);
+    fprintf(file, "Switch\t%d \"S-"P_GUID"\"\t\t# \"spine %zu\" "
+            "base port 0 lid %u lmc 0\n",
+            SW_PORTS, SPINE_GUID + s, s, spine_lid(&fg, s));
+
+    for (p = 0; p < SW_PORTS; p++) {
+      size_t q;
+
+      if (spine_downlink(&fg, s, p + 1, &l, &q) < 0)
+        break;
+
+      fprintf(file, "[%zu]\t\"S-"P_GUID"\"[%zu]\t\t# \"leaf %zu\" lid %u 4xQDR\n",
+              p + 1, LEAF_GUID + l, FABRIC_LEAF_HOSTS + q + 1,
+              l, leaf_lid(&fg, l));
+    }
+    fprintf(file, "\n");
+  }
+
+  for (l = 0; l < fg.fg_nr_leaves; l++) {
+    write_sw_hdr(file, LEAF_GUID + l, 0xc738);
+    fprintf(file, "Switch\t%d \"S-"P_GUID"\"\t\t# \"leaf %zu\" "
+            "base port 0 lid %u lmc 0\n",
+            SW_PORTS, LEAF_GUID + l, l, leaf_lid(&fg, l));
+
+    for (p = 0; p < FABRIC_LEAF_HOSTS; p++) {
+      i = l * FABRIC_LEAF_HOSTS + p;
+      if (!(i < fc->fc_nr_hosts))
+        break;
+
+      fprintf(file, "[%zu]\t\"H-"P_GUID"\"[1](%"PRIx64")\t\t"
+              "# \"c%06zu HCA-1\" lid %u 4xQDR\n",
+              p + 1, HCA_GUID + 2 * i, HCA_GUID + 2 * i + 1, i,
+              hca_lid(&fg, i));
+    }
+
+    for (p = 0; p < FABRIC_LEAF_HOSTS; p++) {
+      size_t port;
+
+      leaf_uplink(&fg, l, p, &s, &port);
+      fprintf(file, "[%zu]\t\"S-"P_GUID"\"[%zu]\t\t# \"spine %zu\" lid %u 4xQDR\n",
+              FABRIC_LEAF_HOSTS + p + 1, SPINE_GUID + s, port,
+              s, spine_lid(&fg, s));
+    }
+    fprintf(file, "\n");
+  }
+
+  for (i = 0; i < fc->fc_nr_hosts; i++) {
+    l = i / FABRIC_LEAF_HOSTS;
+    fprintf(file,
+            "vendid=0x2c9\n"
+            "devid=0x673c\n"
+            "sysimgguid=0x%"PRIx64"\n"
+            "caguid=0x%"PRIx64"\n"
+            "Ca\t2 \"H-"P_GUID"\"\t\t# \"c%06zu HCA-1\"\n"
+            "[1](%"PRIx64") \t\"S-"P_GUID"\"[%zu]\t\t"
+            "# lid %u lmc 0 \"leaf %zu\" lid %u 4xQDR\n"
+            "\n",
+            HCA_GUID + 2 * i, HCA_GUID + 2 * i, HCA_GUID + 2 * i, i,
+            HCA_GUID + 2 * i + 1, LEAF_GUID + l, i % FABRIC_LEAF_HOSTS + 1,
+            hca_lid(&fg, i), l, leaf_lid(&fg, l));
+  }
+
+  return ferror(file) ? -1 : 0;
+}
+
+int fabric_write_info(const struct fabric_conf *fc, FILE *file)
+{
+  struct fabric_geom fg;
+  size_t i;
+
+  fabric_geom(fc, &fg);
+
+  for (i = 0; i < fc->fc_nr_hosts; i++) {
+    size_t l = i / FABRIC_LEAF_HOSTS;
+
+    fprintf(file, "c%06zu 0 %"PRIx64" %x %x %"PRIx64" %x %x 4xQDR\n",
+            i, HCA_GUID + 2 * i, hca_lid(&fg, i), 1,
+            LEAF_GUID + l, leaf_lid(&fg, l),
+            (unsigned int) (i % FABRIC_LEAF_HOSTS + 1));
+  }
+
+  return ferror(file) ? -1 : 0;
+}
+
+/* xorshift64*, so the fabric doesn't depend on libc's random(). */
+static inline uint64_t fabric_rand(uint64_t *x)
+{
+  *x ^= *x >> 12;
+  *x ^= *x << 25;
+  *x ^= *x >> 27;
+
+  return *x * 0x2545f4914f6cdd1dULL;
+}
+
+int fabric_write_job_map(const struct fabric_conf *fc, FILE *file)
+{
+  uint64_t x = fc->fc_seed * 0x9e3779b97f4a7c15ULL + 1;
+  size_t job_size = fc->fc_job_size > 0 ? fc->fc_job_size : 1;
+  size_t i, job = 1000000, left = 0;
+
+  /* Jobs are numbered in order, all with 7 digits. */
+  fprintf(file, "#sorted-by-job\n");
+
+  for (i = 0; i < fc->fc_nr_hosts; i++) {
+    if ((fabric_rand(&x) >> 11) * 0x1p-53 < fc->fc_idle)
+      continue;
+
+    if (left == 0) {
+      job++;
+      left = 1 + fabric_rand(&x) % (2 * job_size - 1);
+    }
+    left--;
+
+    fprintf(file, "c%06zu %zu user%zu\n", i, job, job % 97);
+  }
+
+  return ferror(file) ? -1 : 0;
+}
+
+static int fabric_write_file(const struct fabric_conf *fc, const char *dir,
+                             const char *name,
+                             int (*write)(const struct fabric_conf *, FILE *))
+{
+  char *path = strf("%s/%s", dir, name);
+  FILE *file = NULL;
+  int rc = -1;
+
+  if (path == NULL)
+    OOM();
+
+  file = fopen(path, "w");
+  if (file == NULL) {
+    ERROR("cannot open `%s': %m\n", path);
+    goto out;
+  }
+
+  if ((*write)(fc, file) < 0) {
+    ERROR("cannot write `%s': %m\n", path);
+    goto out;
+  }
+
+  rc = 0;
+
+ out:
+  if (file != NULL && fclose(file) != 0 && rc == 0) {
+    ERROR("cannot write `%s': %m\n", path);
+    rc = -1;
+  }
+
+  free(path);
+
+  return rc;
+}
+
+int fabric_write_dir(const struct fabric_conf *fc, const char *dir)
+{
+  if (fabric_write_file(fc, dir, "net-disc", &fabric_write_disc) < 0 ||
+      fabric_write_file(fc, dir, "net-info", &fabric_write_info) < 0 ||
+      fabric_write_file(fc, dir, "job-map", &fabric_write_job_map) < 0)
+    return -1;
+
+  if (fc->fc_sa_dump &&
+      fabric_write_file(fc, dir, "sa-dump", &fabric_write_sa) < 0)
+    return -1;
+
+  return 0;
+}
+
+void fabric_node_info(const struct fabric_conf *fc,
+                      const struct fabric_node *fn,
+                      struct fabric_node_info *fi)
+{
+  struct fabric_geom fg;
+
+  fabric_geom(fc, &fg);
+
+  switch (fn->fn_kind) {
+  case FABRIC_HOST:
+    fi->fi_guid = HCA_GUID + 2 * fn->fn_index;
+    fi->fi_port_guid = fi->fi_guid + 1;
+    fi->fi_lid = hca_lid(&fg, fn->fn_index);
+    fi->fi_nr_ports = 2;
+    fi->fi_is_switch = 0;
+    snprintf(fi->fi_desc, sizeof(fi->fi_desc), "c%06zu HCA-1",
+             fn->fn_index);
+    break;
+  case FABRIC_LEAF:
+    fi->fi_guid = fi->fi_port_guid = LEAF_GUID + fn->fn_index;
+    fi->fi_lid = leaf_lid(&fg, fn->fn_index);
+    fi->fi_nr_ports = SW_PORTS;
+    fi->fi_is_switch = 1;
+    snprintf(fi->fi_desc, sizeof(fi->fi_desc), "leaf %zu", fn->fn_index);
+    break;
+  default:
+    fi->fi_guid = fi->fi_port_guid = SPINE_GUID + fn->fn_index;
+    fi->fi_lid = spine_lid(&fg, fn->fn_index);
+    fi->fi_nr_ports = SW_PORTS;
+    fi->fi_is_switch = 1;
+    snprintf(fi->fi_desc, sizeof(fi->fi_desc), "spine %zu", fn->fn_index);
+    break;
+  }
+}
+
+/* The same cabling as fabric_write_disc(). */
+int fabric_link(const struct fabric_conf *fc, const struct fabric_node *fn,
+                unsigned int port, struct fabric_node *peer,
+                unsigned int *peer_port)
+{
+  struct fabric_geom fg;
+  size_t l, q, s, sw_port;
+
+  fabric_geom(fc, &fg);
+
+  if (port == 0)
+    return -1;
+
+  switch (fn->fn_kind) {
+  case FABRIC_HOST:
+    if (port != 1 || !(fn->fn_index < fc->fc_nr_hosts))
+      return -1;
+
+    peer->fn_kind = FABRIC_LEAF;
+    peer->fn_index = fn->fn_index / FABRIC_LEAF_HOSTS;
+    *peer_port = fn->fn_index % FABRIC_LEAF_HOSTS + 1;
+    return 0;
+  case FABRIC_LEAF:
+    if (port <= FABRIC_LEAF_HOSTS) {
+      size_t i = fn->fn_index * FABRIC_LEAF_HOSTS + port - 1;
+
+      if (!(i < fc->fc_nr_hosts))
+        return -1;
+
+      peer->fn_kind = FABRIC_HOST;
+      peer->fn_index = i;
+      *peer_port = 1;
+      return 0;
+    }
+
+    if (port > SW_PORTS)
+      return -1;
+
+    leaf_uplink(&fg, fn->fn_index, port - FABRIC_LEAF_HOSTS - 1, &s, &sw_port);
+    peer->fn_kind = FABRIC_SPINE;
+    peer->fn_index = s;
+    *peer_port = sw_port;
+    return 0;
+  default:
+    if (port > SW_PORTS || spine_downlink(&fg, fn->fn_index, port, &l, &q) < 0)
+      return -1;
+
+    peer->fn_kind = FABRIC_LEAF;
+    peer->fn_index = l;
+    *peer_port = FABRIC_LEAF_HOSTS + q + 1;
+    return 0;
+  }
+}
+
+void fabric_node_info_encode(const struct fabric_node_info *fi,
+                             unsigned int in_port, void *ni)
+{
+  memset(ni, 0, SMP_DATA_SIZE);
+  put_u8(ni, 0, 1);
+  put_u8(ni, 1, 1);
+  put_u8(ni, NI_NODE_TYPE_OFFS, fi->fi_is_switch ? NI_TYPE_SWITCH : NI_TYPE_CA);
+  put_u8(ni, NI_NR_PORTS_OFFS, fi->fi_nr_ports);
+  put_be64(ni, NI_SYS_GUID_OFFS, fi->fi_guid);
+  put_be64(ni, NI_NODE_GUID_OFFS, fi->fi_guid);
+  put_be64(ni, NI_PORT_GUID_OFFS,
+           fi->fi_is_switch ? fi->fi_port_guid :
+           fi->fi_port_guid + in_port - 1);
+  put_be16(ni, NI_DEVICE_ID_OFFS, fi->fi_is_switch ? 0xc738 : 0x673c);
+  put_u8(ni, NI_LOCAL_PORT_OFFS, in_port);
+  put_be16(ni, NI_VENDOR_ID_OFFS + 1, 0x02c9);
+}
+
+int fabric_port_info_encode(const struct fabric_conf *fc,
+                            const struct fabric_node *fn,
+                            const struct fabric_node_info *fi,
+                            unsigned int port, unsigned int in_port,
+                            void *pi)
+{
+  struct fabric_node peer;
+  unsigned int peer_port;
+  int linked;
+
+  if (port == 0 && !fi->fi_is_switch)
+    port = in_port;
+
+  if (port > fi->fi_nr_ports)
+    return -1;
+
+  linked = port == 0 || fabric_link(fc, fn, port, &peer, &peer_port) == 0;
+
+  memset(pi, 0, SMP_DATA_SIZE);
+  put_be16(pi, PI_LID_OFFS, fi->fi_is_switch || linked ? fi->fi_lid : 0);
+  put_u8(pi, PI_LOCAL_PORT_OFFS, in_port);
+  if (linked) {
+    put_u8(pi, PI_LINK_WIDTH_ACTIVE_OFFS, 0x02); /* 4x */
+    put_u8(pi, PI_PORT_STATE_OFFS, PI_STATE_ACTIVE);
+    put_u8(pi, PI_LINK_SPEED_ACTIVE_OFFS, 0x04 << 4); /* QDR */
+  } else {
+    put_u8(pi, PI_PORT_STATE_OFFS, PI_STATE_DOWN);
+  }
+
+  return 0;
+}
+
+/* Call fn on every node, hosts first, then leaves, then spines. */
+static int fabric_for_each_node(const struct fabric_conf *fc,
+                                int (*fn)(const struct fabric_conf *,
+                                          const struct fabric_node *,
+                                          void *),
+                                void *arg)
+{
+  struct fabric_geom fg;
+  struct fabric_node n;
+
+  fabric_geom(fc, &fg);
+
+  for (n.fn_kind = FABRIC_HOST; n.fn_kind <= FABRIC_SPINE; n.fn_kind++) {
+    size_t nr = n.fn_kind == FABRIC_HOST ? fc->fc_nr_hosts :
+      n.fn_kind == FABRIC_LEAF ? fg.fg_nr_leaves : fg.fg_nr_spines;
+
+    for (n.fn_index = 0; n.fn_index < nr; n.fn_index++)
+      if ((*fn)(fc, &n, arg) < 0)
+        return -1;
+  }
+
+  return 0;
+}
+
+struct fabric_sa {
+  FILE *fs_file;
+  size_t fs_count;
+  char fs_rec[NR_STRIDE];
+};
+
+static int fabric_sa_write_rec(struct fabric_sa *fs, size_t stride)
+{
+  fs->fs_count++;
+
+  if (fs->fs_file != NULL && fwrite(fs->fs_rec, stride, 1, fs->fs_file) != 1)
+    return -1;
+
+  return 0;
+}
+
+/* One per node: hosts have a LID on port 1 only. */
+static int fabric_sa_node(const struct fabric_conf *fc,
+                          const struct fabric_node *fn, void *arg)
+{
+  struct fabric_sa *fs = arg;
+  struct fabric_node_info fi;
+  char *r = fs->fs_rec;
+
+  fabric_node_info(fc, fn, &fi);
+
+  memset(r, 0, NR_STRIDE);
+  put_be16(r, NR_LID_OFFS, fi.fi_lid);
+  fabric_node_info_encode(&fi, fi.fi_is_switch ? 0 : 1,
+                          r + NR_NODE_INFO_OFFS);
+  memcpy(r + NR_NODE_DESC_OFFS, fi.fi_desc, strlen(fi.fi_desc));
+
+  return fabric_sa_write_rec(fs, NR_STRIDE);
+}
+
+/* Switches have all their ports under their LID. */
+static int fabric_sa_port_info(const struct fabric_conf *fc,
+                               const struct fabric_node *fn, void *arg)
+{
+  struct fabric_sa *fs = arg;
+  struct fabric_node_info fi;
+  char *r = fs->fs_rec;
+  unsigned int port;
+
+  fabric_node_info(fc, fn, &fi);
+
+  for (port = fi.fi_is_switch ? 0 : 1;
+       port <= (fi.fi_is_switch ? fi.fi_nr_ports : 1); port++) {
+    memset(r, 0, PIR_STRIDE);
+    put_be16(r, PIR_LID_OFFS, fi.fi_lid);
+    put_u8(r, PIR_PORT_OFFS, port);
+    fabric_port_info_encode(fc, fn, &fi, port, port, r + PIR_PORT_INFO_OFFS);
+
+    if (fabric_sa_write_rec(fs, PIR_STRIDE) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Each link both ways. */
+static int fabric_sa_links(const struct fabric_conf *fc,
+                           const struct fabric_node *fn, void *arg)
+{
+  struct fabric_sa *fs = arg;
+  struct fabric_node_info fi, peer_fi;
+  struct fabric_node peer;
+  unsigned int port, peer_port;
+  char *r = fs->fs_rec;
+
+  fabric_node_info(fc, fn, &fi);
+
+  for (port = 1; port <= fi.fi_nr_ports; port++) {
+    if (fabric_link(fc, fn, port, &peer, &peer_port) < 0)
+      continue;
+
+    fabric_node_info(fc, &peer, &peer_fi);
+
+    memset(r, 0, LR_STRIDE);
+    put_be16(r, LR_FROM_LID_OFFS, fi.fi_lid);
+    put_u8(r, LR_FROM_PORT_OFFS, port);
+    put_u8(r, LR_TO_PORT_OFFS, peer_port);
+    put_be16(r, LR_TO_LID_OFFS, peer_fi.fi_lid);
+
+    if (fabric_sa_write_rec(fs, LR_STRIDE) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+int fabric_write_sa(const struct fabric_conf *fc, FILE *file)
+{
+  static const struct {
+    unsigned int attr;
+    size_t stride;
+    int (*fn)(const struct fabric_conf *, const struct fabric_node *, void *);
+  } tables[] = {
+    { SA_ATTR_NODE_RECORD, NR_STRIDE, &fabric_sa_node, },
+    { SA_ATTR_PORT_INFO_RECORD, PIR_STRIDE, &fabric_sa_port_info, },
+    { SA_ATTR_LINK_RECORD, LR_STRIDE, &fabric_sa_links, },
+  };
+  struct fabric_geom fg;
+  size_t i;
+
+  fabric_geom(fc, &fg);
+
+  if (fc->fc_nr_hosts + fg.fg_nr_leaves + fg.fg_nr_spines >= LID_MAX) {
+    ERROR("too many hosts for an SA dump\n");
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sa_dump_write_magic(file) < 0)
+    return -1;
+
+  /* Once to count and once to write. */
+  for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+    struct fabric_sa fs = { .fs_file = NULL, };
+
+    fabric_for_each_node(fc, tables[i].fn, &fs);
+
+    if (sa_dump_write_hdr(file, tables[i].attr, tables[i].stride,
+                          fs.fs_count) < 0)
+      return -1;
+
+    fs.fs_file = file;
+    if (fabric_for_each_node(fc, tables[i].fn, &fs) < 0)
+      return -1;
+  }
+
+  return ferror(file) ? -1 : 0;
+}
@@ -0,0 +1,87 @@
+#ifndef _FABRIC_H_
+#define _FABRIC_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A synthetic two level fat tree for benchmarks and ibtop-sim: leaf
+   switches with LEAF_HOSTS hosts (c000000, c000001, ...) on their
+   lower ports and spines on their upper ones.  Jobs have between 1
+   and 2 * fc_job_size - 1 hosts, and about fc_idle of the hosts are in
+   no job.  The same conf always gives the same fabric. */
+
+#define FABRIC_LEAF_HOSTS 18
+
+struct fabric_conf {
+  size_t fc_nr_hosts;
+  size_t fc_job_size;
+  double fc_idle;
+  unsigned long fc_seed;
+  int fc_sa_dump;
+};
+
+/* As ibnetdiscover would print it. */
+int fabric_write_disc(const struct fabric_conf *fc, FILE *file);
+
+/* As make-net-info would make it from the above. */
+int fabric_write_info(const struct fabric_conf *fc, FILE *file);
+
+/* HOST JOBID OWNER, like make-job-map. */
+int fabric_write_job_map(const struct fabric_conf *fc, FILE *file);
+
+/* The SA's NodeRecord, PortInfoRecord, and LinkRecord tables, as an
+   SA dump (see sa-dump.h).  SA queries join records by LID, so this
+   fails if the fabric has more nodes than a subnet has LIDs. */
+int fabric_write_sa(const struct fabric_conf *fc, FILE *file);
+
+/* Write all three to dir/net-disc, dir/net-info, and dir/job-map, and
+   the SA dump to dir/sa-dump if fc_sa_dump is set. */
+int fabric_write_dir(const struct fabric_conf *fc, const char *dir);
+
+/* The fabric node by node, for the simulator's SMP agents.  Hosts
+   have two ports, of which only port 1 is cabled, and every link is
+   4xQDR. */
+enum {
+  FABRIC_HOST,
+  FABRIC_LEAF,
+  FABRIC_SPINE,
+};
+
+struct fabric_node {
+  int fn_kind;
+  size_t fn_index;
+};
+
+struct fabric_node_info {
+  uint64_t fi_guid;
+  uint64_t fi_port_guid;
+  uint16_t fi_lid;
+  unsigned int fi_nr_ports;
+  unsigned int fi_is_switch:1;
+  char fi_desc[64];
+};
+
+void fabric_node_info(const struct fabric_conf *fc,
+                      const struct fabric_node *fn,
+                      struct fabric_node_info *fi);
+
+/* Encode fn's NodeInfo and the PortInfo of port (in_port if fn is a
+   CA and port is 0) as its SMA would answer a query that came in by
+   in_port.  fabric_port_info_encode() returns -1 if there is no such
+   port. */
+void fabric_node_info_encode(const struct fabric_node_info *fi,
+                             unsigned int in_port, void *ni);
+
+int fabric_port_info_encode(const struct fabric_conf *fc,
+                            const struct fabric_node *fn,
+                            const struct fabric_node_info *fi,
+                            unsigned int port, unsigned int in_port,
+                            void *pi);
+
+/* Set *peer and *peer_port to what port of fn is cabled to.  Returns
+   -1 if the port is down or doesn't exist. */
+int fabric_link(const struct fabric_conf *fc, const struct fabric_node *fn,
+                unsigned int port, struct fabric_node *peer,
+                unsigned int *peer_port);
+
+#endif
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "string1.h"
+#include "trace.h"
+#include "hca.h"
+
+/* Read the first line of the sysfs file at fmt into buf, without its
+   newline. */
+static int sysfs_read(char *buf, size_t size, const char *fmt, ...)
+{
+  char *path = NULL;
+  va_list args;
+  ssize_t nr;
+  int fd = -1, rc = -1;
+
+  va_start(args, fmt);
+  if (vasprintf(&path, fmt, args) < 0)
+    path = NULL;
+  va_end(args);
+
+  if (path == NULL)
+    goto out;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    goto out;
+
+  nr = read(fd, buf, size - 1);
+  if (nr < 0)
+    goto out;
+
+  buf[nr] = 0;
+  chop(buf, '\n');
+  rc = 0;
+
+ out:
+  if (fd >= 0)
+    close(fd);
+  free(path);
+
+  return rc;
+}
+
+static int hca_port_active(const char *hca, int port)
+{
+  char buf[80];
+
+  /* "4: ACTIVE" */
+  if (sysfs_read(buf, sizeof(buf), HCA_SYSFS_DIR"/%s/ports/%d/state",
+                 hca, port) < 0)
+    return 0;
+
+  if (strtol(buf, NULL, 10) != 4)
+    return 0;
+
+  /* Older kernels have no link_layer; those ports are all IB. */
+  if (sysfs_read(buf, sizeof(buf), HCA_SYSFS_DIR"/%s/ports/%d/link_layer",
+                 hca, port) < 0)
+    return 1;
+
+  return strcmp(buf, "InfiniBand") == 0;
+}
+
+static int hca_port_cmp(const void *p1, const void *p2)
+{
+  const struct hca_port *hp1 = p1, *hp2 = p2;
+  int c = strcmp(hp1->hp_hca, hp2->hp_hca);
+
+  return c != 0 ? c : hp1->hp_port - hp2->hp_port;
+}
+
+/* Append the active ports of hca to *vec. */
+static int hca_scan_ports(const char *hca, struct hca_port **vec,
+                          size_t *nr, size_t *len)
+{
+  char *path = NULL;
+  DIR *dir = NULL;
+  struct dirent *de;
+  int rc = -1;
+
+  path = strf(HCA_SYSFS_DIR"/%s/ports", hca);
+  if (path == NULL)
+    goto out;
+
+  dir = opendir(path);
+  if (dir == NULL)
+    goto out;
+
+  while ((de = readdir(dir)) != NULL) {
+    char *end;
+    long port = strtol(de->d_name, &end, 10);
+    if (*de->d_name == 0 || *end != 0 || port <= 0)
+      continue;
+
+    if (!hca_port_active(hca, port))
+      continue;
+
+    if (!(*nr < *len)) {
+      size_t new_len = *len != 0 ? 2 * *len : 4;
+      struct hca_port *new_vec = realloc(*vec, new_len * sizeof((*vec)[0]));
+      if (new_vec == NULL)
+        goto out;
+
+      *vec = new_vec;
+      *len = new_len;
+    }
+
+    snprintf((*vec)[*nr].hp_hca, sizeof((*vec)[*nr].hp_hca), "%s", hca);
+    (*vec)[*nr].hp_port = port;
+    (*nr)++;
+  }
+
+  rc = 0;
+
+ out:
+  if (dir != NULL)
+    closedir(dir);
+  free(path);
+
+  return rc;
+}
+
+int hca_port_scan(struct hca_port **vec, size_t *nr)
+{
+  DIR *dir = NULL;
+  struct dirent *de;
+  size_t len = 0;
+
+  *vec = NULL;
+  *nr = 0;
+
+  dir = opendir(HCA_SYSFS_DIR);
+  if (dir == NULL)
+    return -1;
+
+  while ((de = readdir(dir)) != NULL) {
+    if (*de->d_name == '.')
+      continue;
+
+    if (hca_scan_ports(de->d_name, vec, nr, &len) < 0 && errno == ENOMEM) {
+      closedir(dir);
+      return -1;
+    }
+  }
+
+  closedir(dir);
+
+  qsort(*vec, *nr, sizeof((*vec)[0]), &hca_port_cmp);
+
+  return 0;
+}
+
+int hca_port_parse(struct hca_port *hp, const char *str)
+{
+  const char *sep = strchr(str, ':');
+  size_t name_len = sep != NULL ? sep - str : strlen(str);
+
+  if (name_len == 0 || name_len >= sizeof(hp->hp_hca)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memcpy(hp->hp_hca, str, name_len);
+  hp->hp_hca[name_len] = 0;
+  hp->hp_port = 1;
+
+  if (sep != NULL) {
+    char *end;
+    long port = strtol(sep + 1, &end, 10);
+    if (sep[1] == 0 || *end != 0 || port <= 0 || port > 255) {
+      errno = EINVAL;
+      return -1;
+    }
+    hp->hp_port = port;
+  } else {
+    struct hca_port *vec = NULL;
+    size_t nr = 0, len = 0;
+
+    if (hca_scan_ports(hp->hp_hca, &vec, &nr, &len) == 0 && nr > 0) {
+      qsort(vec, nr, sizeof(vec[0]), &hca_port_cmp);
+      hp->hp_port = vec[0].hp_port;
+    }
+
+    free(vec);
+  }
+
+  return 0;
+}
+
+int hca_numa_node(const char *hca)
+{
+  char buf[80];
+
+  if (sysfs_read(buf, sizeof(buf), HCA_SYSFS_DIR"/%s/device/numa_node",
+                 hca) < 0)
+    return -1;
+
+  return strtol(buf, NULL, 10);
+}
+
+int hca_cpu_set(const char *hca, cpu_set_t *set)
+{
+  char buf[4096], *rest, *range;
+  int node = hca_numa_node(hca);
+
+  if (node < 0)
+    return -1;
+
+  /* "0-7,16-23" */
+  if (sysfs_read(buf, sizeof(buf),
+                 "/sys/devices/system/node/node%d/cpulist", node) < 0)
+    return -1;
+
+  CPU_ZERO(set);
+
+  rest = buf;
+  while ((range = strsep_ne(&rest, ",")) != NULL) {
+    char *end;
+    long lo = strtol(range, &end, 10), hi = lo;
+
+    if (*end == '-')
+      hi = strtol(end + 1, NULL, 10);
+
+    for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+      CPU_SET(lo, set);
+  }
+
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
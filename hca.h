@@ -0,0 +1,29 @@
+#ifndef _HCA_H_
+#define _HCA_H_
+#include <sched.h>
+#include <stddef.h>
+
+#define HCA_SYSFS_DIR "/sys/class/infiniband"
+#define HCA_NAME_MAX 64
+
+/* /sys/class/infiniband/HP_HCA/ports/HP_PORT */
+struct hca_port {
+  char hp_hca[HCA_NAME_MAX];
+  int hp_port;
+};
+
+/* Set *vec (malloced) to the active InfiniBand ports of all local
+   HCAs, in HCA name and port order, and *nr to their number. */
+int hca_port_scan(struct hca_port **vec, size_t *nr);
+
+/* Parse "NAME[:PORT]" into *hp.  Without a port, use the first active
+   port of NAME, or port 1 if there is none. */
+int hca_port_parse(struct hca_port *hp, const char *str);
+
+/* Returns the NUMA node of hca's PCI device, or -1 if it's unknown. */
+int hca_numa_node(const char *hca);
+
+/* Set *set to the CPUs local to hca.  Returns -1 if they're unknown. */
+int hca_cpu_set(const char *hca, cpu_set_t *set);
+
+#endif
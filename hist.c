@@ -0,0 +1,144 @@
+#include <string.h>
+#include <math.h>
+#include "hist.h"
+
+void hist_conf_init(struct hist_conf *hc, double epoch, double interval)
+{
+  memset(hc, 0, sizeof(*hc));
+
+  hc->hc_epoch = epoch;
+  hc->hc_step[0] = 0;
+  hc->hc_step[1] = interval > 5 ? interval : 5;
+  hc->hc_step[2] = interval > 30 ? interval : 30;
+}
+
+void hist_reset(struct hist *hi)
+{
+  memset(hi, 0, sizeof(*hi));
+}
+
+/* Times wrap every 49 days, so only compare their differences. */
+static inline uint32_t hist_ms(const struct hist_conf *hc, double time)
+{
+  double ms = (time - hc->hc_epoch) * 1000;
+
+  return ms > 0 ? (uint32_t) (uint64_t) ms : 0;
+}
+
+static void hist_level_add(struct hist_level *hl, uint32_t ms,
+                           const uint64_t *ctrs)
+{
+  if (hl->hl_count > 0)
+    hl->hl_head = (hl->hl_head + 1) % HIST_LEN;
+
+  if (hl->hl_count < HIST_LEN)
+    hl->hl_count++;
+
+  hl->hl_time[hl->hl_head] = ms;
+  memcpy(hl->hl_ctrs[hl->hl_head], ctrs, sizeof(hl->hl_ctrs[0]));
+}
+
+void hist_add(const struct hist_conf *hc, struct hist *hi, double time,
+              const uint64_t *ctrs)
+{
+  struct hist_level *hl0 = &hi->hi_level[0];
+  uint32_t ms = hist_ms(hc, time);
+  size_t i, k;
+
+  if (hl0->hl_count > 0) {
+    uint32_t prev_ms = hl0->hl_time[hl0->hl_head];
+    const uint64_t *prev = hl0->hl_ctrs[hl0->hl_head];
+
+    if ((int32_t) (ms - prev_ms) <= 0)
+      return;
+
+    /* Counters were reset, start over. */
+    for (k = 0; k < HIST_NR_CTRS; k++)
+      if (ctrs[k] < prev[k])
+        break;
+
+    if (k < HIST_NR_CTRS) {
+      hist_reset(hi);
+    } else {
+      double dt = (ms - prev_ms) / 1000.0;
+
+      for (i = 0; i < hc->hc_nr_tau; i++) {
+        double alpha = 1 - exp(-dt / hc->hc_tau[i]);
+
+        for (k = 0; k < HIST_NR_CTRS; k++) {
+          double rate = (ctrs[k] - prev[k]) / dt;
+
+          if (hi->hi_have_ema)
+            hi->hi_ema[i][k] += alpha * (rate - hi->hi_ema[i][k]);
+          else
+            hi->hi_ema[i][k] = rate;
+        }
+      }
+
+      hi->hi_have_ema = 1;
+    }
+  }
+
+  for (i = 0; i < HIST_NR_LEVELS; i++) {
+    struct hist_level *hl = &hi->hi_level[i];
+
+    if (hl->hl_count == 0 ||
+        ms - hl->hl_time[hl->hl_head] >= hc->hc_step[i] * 1000)
+      hist_level_add(hl, ms, ctrs);
+  }
+}
+
+int hist_rate(const struct hist *hi, double span, double *rate)
+{
+  const struct hist_level *hl0 = &hi->hi_level[0];
+  uint32_t new_ms, span_ms = span * 1000, old_age = 0;
+  const uint64_t *new, *old = NULL;
+  size_t i, j, k;
+
+  if (hl0->hl_count < 2)
+    return -1;
+
+  new_ms = hl0->hl_time[hl0->hl_head];
+  new = hl0->hl_ctrs[hl0->hl_head];
+
+  /* The newest sample at least span old, or failing that the oldest
+     sample there is. */
+  for (i = 0; i < HIST_NR_LEVELS; i++) {
+    const struct hist_level *hl = &hi->hi_level[i];
+
+    for (j = 0; j < hl->hl_count; j++) {
+      uint32_t age = new_ms - hl->hl_time[j];
+
+      if (age == 0 || (int32_t) age < 0)
+        continue;
+
+      if (old == NULL ||
+          (age >= span_ms ? old_age < span_ms || age < old_age :
+                            old_age < span_ms && age > old_age)) {
+        old = hl->hl_ctrs[j];
+        old_age = age;
+      }
+    }
+  }
+
+  if (old == NULL)
+    return -1;
+
+  for (k = 0; k < HIST_NR_CTRS; k++)
+    rate[k] = (new[k] - old[k]) / (old_age / 1000.0);
+
+  return 0;
+}
+
+int hist_ema(const struct hist *hi, size_t i, double *rate)
+{
+  size_t k;
+
+  if (!hi->hi_have_ema || i >= HIST_NR_EMA)
+    return -1;
+
+  for (k = 0; k < HIST_NR_CTRS; k++)
+    rate[k] = hi->hi_ema[i][k];
+
+  return 0;
+}
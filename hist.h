@@ -0,0 +1,57 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/* Per port history of raw (cumulative) byte counters, for rates over
+   windows longer than one interval.  Level 0 keeps the most recent
+   samples, and each higher level keeps a sample at most every
+   hc_step[i] seconds, so the history spans about
+   HIST_LEN * hc_step[HIST_NR_LEVELS - 1] seconds in a fixed
+   sizeof(struct hist) bytes per port.  Times are milliseconds since
+   hc_epoch. */
+
+#define HIST_NR_LEVELS 3
+#define HIST_LEN 12
+#define HIST_NR_CTRS 2
+#define HIST_NR_EMA 2
+
+struct hist_level {
+  uint32_t hl_time[HIST_LEN];
+  uint64_t hl_ctrs[HIST_LEN][HIST_NR_CTRS];
+  uint8_t hl_head;  /* Index of the newest sample. */
+  uint8_t hl_count;
+};
+
+struct hist {
+  struct hist_level hi_level[HIST_NR_LEVELS];
+  double hi_ema[HIST_NR_EMA][HIST_NR_CTRS];
+  unsigned int hi_have_ema:1;
+};
+
+struct hist_conf {
+  double hc_epoch;
+  double hc_step[HIST_NR_LEVELS];
+  double hc_tau[HIST_NR_EMA];
+  size_t hc_nr_tau;
+};
+
+/* Level 0 takes every sample; levels 1 and 2 every 5 and 30 seconds
+   (but no more often than every interval). */
+void hist_conf_init(struct hist_conf *hc, double epoch, double interval);
+
+void hist_reset(struct hist *hi);
+
+/* Add the sample ctrs taken at time (in hc_epoch's clock). */
+void hist_add(const struct hist_conf *hc, struct hist *hi, double time,
+              const uint64_t *ctrs);
+
+/* Set rate[] to the per second rates over the last span seconds (or
+   as much of it as there is history for).  Returns -1 if there's
+   not enough history for any rate. */
+int hist_rate(const struct hist *hi, double span, double *rate);
+
+/* Set rate[] to the moving average with time constant hc_tau[i]. */
+int hist_ema(const struct hist *hi, size_t i, double *rate);
+
+#endif
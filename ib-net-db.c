@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "string1.h"
+#include "trace.h"
+#include "ibtop.h"
+#include "ib-net-db.h"
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+
+/* FNV-1a, which unlike dict_strhash() is the same on every arch. */
+static inline uint32_t ib_net_hash(const char *s)
+{
+  uint32_t h = 2166136261U;
+
+  for (; *s != 0; s++) {
+    h ^= (unsigned char) *s;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static inline const char *ib_net_name(const char *names, size_t names_size,
+                                      const struct ib_net_db_rec *nr)
+{
+  return nr->nr_name_offs < names_size ? names + nr->nr_name_offs : "";
+}
+
+/* The slot holding name, or the empty slot where it would go.  There
+   is always an empty slot, since count < table_len. */
+static size_t ib_net_probe(const uint32_t *table, size_t table_len,
+                           const struct ib_net_db_rec *recs, size_t count,
+                           const char *names, size_t names_size,
+                           const char *name, uint32_t hash)
+{
+  size_t mask = table_len - 1, i = hash & mask;
+
+  for (; table[i] != 0; i = (i + 1) & mask) {
+    const struct ib_net_db_rec *nr;
+
+    if (table[i] > count)
+      continue;
+
+    nr = &recs[table[i] - 1];
+    if (nr->nr_hash == hash &&
+        strcmp(ib_net_name(names, names_size, nr), name) == 0)
+      break;
+  }
+
+  return i;
+}
+
+static void ib_net_rec_ent(const struct ib_net_db_rec *nr,
+                           struct ib_net_ent *ne)
+{
+  memset(ne, 0, sizeof(*ne));
+
+  if (nr->nr_use_hca) {
+    ne->ne_guid = nr->nr_hca_guid;
+    ne->ne_lid = nr->nr_hca_lid;
+    ne->ne_port = nr->nr_hca_port;
+    ne->ne_is_hca = 1;
+  } else {
+    ne->ne_guid = nr->nr_sw_guid;
+    ne->ne_lid = nr->nr_sw_lid;
+    ne->ne_port = nr->nr_sw_port;
+  }
+}
+
+int ib_net_db_open(struct ib_net_db *nd, const char *path, int flags,
+                   mode_t mode)
+{
+  const struct ib_net_db_hdr *nh;
+  struct stat stat_buf;
+  int fd = -1;
+
+  memset(nd, 0, sizeof(*nd));
+
+  if (path == NULL)
+    path = IBTOP_NET_DB_PATH;
+
+  if ((flags & O_ACCMODE) != O_RDONLY) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  fd = open(path, flags, mode);
+  if (fd < 0)
+    goto err;
+
+  if (fstat(fd, &stat_buf) < 0)
+    goto err;
+
+  if (stat_buf.st_size < sizeof(struct ib_net_db_hdr)) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  nd->nd_size = stat_buf.st_size;
+  nd->nd_map = mmap(NULL, nd->nd_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (nd->nd_map == MAP_FAILED) {
+    nd->nd_map = NULL;
+    goto err;
+  }
+
+  close(fd);
+  fd = -1;
+
+  nh = nd->nd_hdr = nd->nd_map;
+
+  if (nh->nh_magic != IB_NET_DB_MAGIC ||
+      nh->nh_rec_size != sizeof(struct ib_net_db_rec) ||
+      nh->nh_table_len == 0 ||
+      (nh->nh_table_len & (nh->nh_table_len - 1)) != 0 ||
+      !(nh->nh_count < nh->nh_table_len) ||
+      nh->nh_recs_offs % 8 != 0 || nh->nh_table_offs % 4 != 0 ||
+      nh->nh_recs_offs > nd->nd_size ||
+      (nd->nd_size - nh->nh_recs_offs) / sizeof(struct ib_net_db_rec) <
+        nh->nh_count ||
+      nh->nh_table_offs > nd->nd_size ||
+      (nd->nd_size - nh->nh_table_offs) / sizeof(uint32_t) <
+        nh->nh_table_len ||
+      nh->nh_names_offs > nd->nd_size ||
+      nd->nd_size - nh->nh_names_offs < nh->nh_names_size ||
+      nh->nh_names_size == 0 ||
+      ((const char *) nd->nd_map)[nh->nh_names_offs + nh->nh_names_size - 1]
+        != 0) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  nd->nd_recs = (const void *) ((const char *) nd->nd_map + nh->nh_recs_offs);
+  nd->nd_table = (const void *) ((const char *) nd->nd_map + nh->nh_table_offs);
+  nd->nd_names = (const char *) nd->nd_map + nh->nh_names_offs;
+  nd->nd_count = nh->nh_count;
+
+  return 0;
+
+ err:
+  if (fd >= 0)
+    close(fd);
+  ib_net_db_close(nd);
+
+  return -1;
+}
+
+void ib_net_db_close(struct ib_net_db *nd)
+{
+  if (nd->nd_map != NULL)
+    munmap(nd->nd_map, nd->nd_size);
+
+  memset(nd, 0, sizeof(*nd));
+}
+
+int ib_net_db_fetch(struct ib_net_db *nd, const char *name,
+                    struct ib_net_ent *ne)
+{
+  uint32_t hash = ib_net_hash(name);
+  size_t i;
+
+  i = ib_net_probe(nd->nd_table, nd->nd_hdr->nh_table_len, nd->nd_recs,
+                   nd->nd_count, nd->nd_names, nd->nd_hdr->nh_names_size,
+                   name, hash);
+  if (nd->nd_table[i] == 0)
+    return 0;
+
+  ib_net_rec_ent(&nd->nd_recs[nd->nd_table[i] - 1], ne);
+
+  return 1;
+}
+
+void ib_net_db_ent(const struct ib_net_db *nd, size_t i, const char **name,
+                   struct ib_net_ent *ne)
+{
+  const struct ib_net_db_rec *nr = &nd->nd_recs[i];
+
+  *name = ib_net_name(nd->nd_names, nd->nd_hdr->nh_names_size, nr);
+  ib_net_rec_ent(nr, ne);
+}
+
+void ib_net_db_iter(struct ib_net_db *nd, char **name, size_t *name_size)
+{
+  const char *str;
+  size_t len;
+
+  if (!(nd->nd_iter < nd->nd_count)) {
+    free(*name);
+    *name = NULL;
+    *name_size = 0;
+    return;
+  }
+
+  str = ib_net_name(nd->nd_names, nd->nd_hdr->nh_names_size,
+                    &nd->nd_recs[nd->nd_iter++]);
+  len = strlen(str);
+
+  if (*name == NULL || *name_size < len + 1) {
+    char *new_name = realloc(*name, len + 1);
+    if (new_name == NULL)
+      OOM();
+
+    *name = new_name;
+    *name_size = len + 1;
+  }
+
+  memcpy(*name, str, len + 1);
+}
+
+struct ib_net_build {
+  struct ib_net_db_rec *nb_recs;
+  size_t nb_count, nb_recs_len;
+  uint32_t *nb_table;
+  size_t nb_table_len;
+  char *nb_names;
+  size_t nb_names_size, nb_names_len;
+};
+
+static int ib_net_build_rehash(struct ib_net_build *nb, size_t table_len)
+{
+  uint32_t *table = calloc(table_len, sizeof(table[0]));
+  size_t i;
+
+  if (table == NULL)
+    return -1;
+
+  for (i = 0; i < nb->nb_count; i++) {
+    size_t k = nb->nb_recs[i].nr_hash & (table_len - 1);
+
+    while (table[k] != 0)
+      k = (k + 1) & (table_len - 1);
+
+    table[k] = i + 1;
+  }
+
+  free(nb->nb_table);
+  nb->nb_table = table;
+  nb->nb_table_len = table_len;
+
+  return 0;
+}
+
+/* Later lines for a host replace earlier ones, as in host_vec_init(). */
+static int ib_net_build_add(struct ib_net_build *nb, const char *name,
+                            const struct ib_net_db_rec *rec)
+{
+  uint32_t hash = ib_net_hash(name);
+  size_t len = strlen(name) + 1, k;
+
+  if (2 * (nb->nb_count + 1) > nb->nb_table_len &&
+      ib_net_build_rehash(nb, 2 * nb->nb_table_len) < 0)
+    return -1;
+
+  k = ib_net_probe(nb->nb_table, nb->nb_table_len, nb->nb_recs, nb->nb_count,
+                   nb->nb_names, nb->nb_names_size, name, hash);
+  if (nb->nb_table[k] != 0) {
+    struct ib_net_db_rec *nr = &nb->nb_recs[nb->nb_table[k] - 1];
+    uint32_t name_offs = nr->nr_name_offs;
+
+    *nr = *rec;
+    nr->nr_name_offs = name_offs;
+    nr->nr_hash = hash;
+    return 0;
+  }
+
+  if (nb->nb_count >= UINT32_MAX - 1 ||
+      nb->nb_names_size + len > UINT32_MAX) {
+    errno = EOVERFLOW;
+    return -1;
+  }
+
+  if (!(nb->nb_count < nb->nb_recs_len)) {
+    size_t new_len = 2 * nb->nb_recs_len + 1024;
+    struct ib_net_db_rec *new_recs =
+      realloc(nb->nb_recs, new_len * sizeof(new_recs[0]));
+    if (new_recs == NULL)
+      return -1;
+
+    nb->nb_recs = new_recs;
+    nb->nb_recs_len = new_len;
+  }
+
+  if (nb->nb_names_size + len > nb->nb_names_len) {
+    size_t new_len = 2 * nb->nb_names_len + len + 4096;
+    char *new_names = realloc(nb->nb_names, new_len);
+    if (new_names == NULL)
+      return -1;
+
+    nb->nb_names = new_names;
+    nb->nb_names_len = new_len;
+  }
+
+  struct ib_net_db_rec *nr = &nb->nb_recs[nb->nb_count];
+
+  *nr = *rec;
+  nr->nr_name_offs = nb->nb_names_size;
+  nr->nr_hash = hash;
+  memcpy(nb->nb_names + nb->nb_names_size, name, len);
+  nb->nb_names_size += len;
+
+  nb->nb_table[k] = ++nb->nb_count;
+
+  return 0;
+}
+
+static int ib_net_build_write(struct ib_net_build *nb, FILE *file)
+{
+  struct ib_net_db_hdr nh;
+  size_t table_len = nb->nb_table_len;
+
+  memset(&nh, 0, sizeof(nh));
+  nh.nh_magic = IB_NET_DB_MAGIC;
+  nh.nh_rec_size = sizeof(struct ib_net_db_rec);
+  nh.nh_count = nb->nb_count;
+  nh.nh_table_len = table_len;
+  nh.nh_names_size = nb->nb_names_size;
+  nh.nh_recs_offs = ALIGN8(sizeof(nh));
+  nh.nh_table_offs = ALIGN8(nh.nh_recs_offs + nh.nh_count * sizeof(nb->nb_recs[0]));
+  nh.nh_names_offs = ALIGN8(nh.nh_table_offs + table_len * sizeof(nb->nb_table[0]));
+
+  if (fwrite(&nh, sizeof(nh), 1, file) != 1 ||
+      fseek(file, nh.nh_recs_offs, SEEK_SET) < 0 ||
+      fwrite(nb->nb_recs, sizeof(nb->nb_recs[0]), nh.nh_count, file) !=
+        nh.nh_count ||
+      fseek(file, nh.nh_table_offs, SEEK_SET) < 0 ||
+      fwrite(nb->nb_table, sizeof(nb->nb_table[0]), table_len, file) !=
+        table_len ||
+      fseek(file, nh.nh_names_offs, SEEK_SET) < 0 ||
+      fwrite(nb->nb_names, 1, nh.nh_names_size, file) != nh.nh_names_size)
+    return -1;
+
+  return 0;
+}
+
+int ib_net_db_build(const char *path, FILE *info_file)
+{
+  int rc = -1;
+  struct ib_net_build nb;
+  char *line = NULL;
+  size_t line_size = 0;
+  char *tmp_path = NULL;
+  FILE *tmp_file = NULL;
+  int tmp_fd = -1;
+
+  memset(&nb, 0, sizeof(nb));
+
+  if (ib_net_build_rehash(&nb, 1024) < 0)
+    goto out;
+
+  /* Start the names with an empty one, so they're never empty. */
+  nb.nb_names = calloc(1, 4096);
+  if (nb.nb_names == NULL)
+    goto out;
+
+  nb.nb_names_size = 1;
+  nb.nb_names_len = 4096;
+
+  while (getline(&line, &line_size, info_file) >= 0) {
+    char *rest = line;
+    char *host = wsep(&rest);
+    struct ib_net_db_rec rec;
+    int use_hca;
+
+    if (host == NULL)
+      continue;
+
+    memset(&rec, 0, sizeof(rec));
+
+    if (sscanf(rest, "%d %"SCNx64" %"SCNx16" %"SCNx8" "
+               "%"SCNx64" %"SCNx16" %"SCNx8,
+               &use_hca, &rec.nr_hca_guid, &rec.nr_hca_lid, &rec.nr_hca_port,
+               &rec.nr_sw_guid, &rec.nr_sw_lid, &rec.nr_sw_port) != 7)
+      continue;
+
+    rec.nr_use_hca = use_hca != 0;
+
+    if (ib_net_build_add(&nb, host, &rec) < 0)
+      goto out;
+  }
+
+  if (ferror(info_file))
+    goto out;
+
+  tmp_path = strf("%s.XXXXXXXX", path);
+  if (tmp_path == NULL)
+    goto out;
+
+  tmp_fd = mkstemp(tmp_path);
+  if (tmp_fd < 0)
+    goto out;
+
+  if (fchmod(tmp_fd, 0644) < 0)
+    goto out;
+
+  tmp_file = fdopen(tmp_fd, "w");
+  if (tmp_file == NULL)
+    goto out;
+  tmp_fd = -1;
+
+  if (ib_net_build_write(&nb, tmp_file) < 0)
+    goto out;
+
+  if (fclose(tmp_file) != 0) {
+    tmp_file = NULL;
+    goto out;
+  }
+  tmp_file = NULL;
+
+  if (rename(tmp_path, path) < 0)
+    goto out;
+
+  rc = 0;
+
+ out:
+  if (tmp_file != NULL)
+    fclose(tmp_file);
+  if (tmp_fd >= 0)
+    close(tmp_fd);
+  if (rc < 0 && tmp_path != NULL) {
+    int err = errno;
+    unlink(tmp_path);
+    errno = err;
+  }
+  free(tmp_path);
+  free(line);
+  free(nb.nb_recs);
+  free(nb.nb_table);
+  free(nb.nb_names);
+
+  return rc;
+}
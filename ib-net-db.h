@@ -0,0 +1,84 @@
+#ifndef _IB_NET_DB_H_
+#define _IB_NET_DB_H_
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The net info compiled for mapping: a header, one record per host
+   (in net info order), a hash table of record indexes keyed by host
+   name, and the names.  Opening it is an mmap() and a few checks, and
+   fetching a host is a hash probe, so nothing is parsed at startup.
+   make-net-info writes it next to the net info text. */
+
+#define IB_NET_DB_MAGIC 0x31424454454e4249ULL /* "IBNETDB1" */
+
+struct ib_net_db_hdr {
+  uint64_t nh_magic;
+  uint32_t nh_rec_size;
+  uint32_t nh_count;
+  uint32_t nh_table_len;  /* A power of two. */
+  uint32_t nh_names_size;
+  uint64_t nh_recs_offs;
+  uint64_t nh_table_offs; /* uint32_t record index + 1, 0 if empty. */
+  uint64_t nh_names_offs; /* NUL terminated names. */
+};
+
+struct ib_net_db_rec {
+  uint64_t nr_hca_guid;
+  uint64_t nr_sw_guid;
+  uint32_t nr_name_offs;
+  uint32_t nr_hash;
+  uint16_t nr_hca_lid;
+  uint16_t nr_sw_lid;
+  uint8_t nr_hca_port;
+  uint8_t nr_sw_port;
+  uint8_t nr_use_hca;
+  uint8_t nr_pad[5];
+};
+
+/* Where to query a host: its HCA port if use_hca, else the port of
+   the switch it's attached to. */
+struct ib_net_ent {
+  uint64_t ne_guid;
+  uint16_t ne_lid;
+  uint8_t ne_port;
+  unsigned int ne_is_hca:1;
+};
+
+struct ib_net_db {
+  void *nd_map;
+  size_t nd_size;
+  const struct ib_net_db_hdr *nd_hdr;
+  const struct ib_net_db_rec *nd_recs;
+  const uint32_t *nd_table;
+  const char *nd_names;
+  size_t nd_count;
+  size_t nd_iter;
+};
+
+/* Map the DB at path (IBTOP_NET_DB_PATH if NULL).  flags and mode are
+   as for open(2), but the DB can only be read.  Returns -1 (with errno
+   set) if it's missing or malformed. */
+int ib_net_db_open(struct ib_net_db *nd, const char *path, int flags,
+                   mode_t mode);
+
+void ib_net_db_close(struct ib_net_db *nd);
+
+/* Returns 1 and fills in ne if name is in the DB, 0 if not. */
+int ib_net_db_fetch(struct ib_net_db *nd, const char *name,
+                    struct ib_net_ent *ne);
+
+/* Copy the next name into *name (reallocated as needed, like
+   getline()), or set *name to NULL after the last. */
+void ib_net_db_iter(struct ib_net_db *nd, char **name, size_t *name_size);
+
+/* The i-th host, i < nd_count.  The name points into the map. */
+void ib_net_db_ent(const struct ib_net_db *nd, size_t i, const char **name,
+                   struct ib_net_ent *ne);
+
+/* Compile the net info lines in info_file and atomically replace the
+   DB at path. */
+int ib_net_db_build(const char *path, FILE *info_file);
+
+#endif
@@ -10,11 +10,13 @@
 #include <infiniband/umad.h>
 #include <infiniband/mad.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include "ib-net-db.h"
 #include "string1.h"
 #include "trace.h"
 
 #define TRID_BASE 0xE1F2A3B4C5D6E7F8
+#define P_TRID "%016"PRIx64
 
 static inline double dnow(void)
 {
@@ -0,0 +1,164 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "trace.h"
+#include "archive.h"
+
+/* Counters are archived in ibtop's order. */
+enum {
+  C_TX_B,
+  C_RX_B,
+  C_TX_P,
+  C_RX_P,
+  NR_CTRS,
+};
+
+struct dump_args {
+  char **hosts;
+  size_t nr_hosts;
+  int want_sum;
+};
+
+static int host_wanted(struct dump_args *da, const char *name)
+{
+  size_t i;
+
+  if (da->nr_hosts == 0)
+    return 1;
+
+  for (i = 0; i < da->nr_hosts; i++)
+    if (strcmp(da->hosts[i], name) == 0)
+      return 1;
+
+  return 0;
+}
+
+static int dump_record(void *arg, double time, double elapsed,
+                       size_t nr_ports, const char **names,
+                       const uint64_t *guids, const uint8_t *ports,
+                       const uint64_t *ctrs, const uint8_t *valid)
+{
+  struct dump_args *da = arg;
+  double tx_b = 0, rx_b = 0;
+  size_t i, nr = 0;
+
+  /* The first record of a segment has nothing to divide by. */
+  if (elapsed <= 0)
+    return 0;
+
+  for (i = 0; i < nr_ports; i++) {
+    const uint64_t *c = ctrs + i * NR_CTRS;
+
+    if (!valid[i] || !host_wanted(da, names[i]))
+      continue;
+
+    if (da->want_sum) {
+      tx_b += c[C_TX_B];
+      rx_b += c[C_RX_B];
+      nr++;
+      continue;
+    }
+
+    printf("%.3f %-12s %14.3f %14.3f\n", time, names[i],
+           c[C_TX_B] / elapsed / 1048576, c[C_RX_B] / elapsed / 1048576);
+  }
+
+  if (da->want_sum)
+    printf("%.3f %14.3f %14.3f %8zu\n", time,
+           tx_b / elapsed / 1048576, rx_b / elapsed / 1048576, nr);
+
+  return 0;
+}
+
+/* Seconds since the epoch, or local "YYYY-MM-DD HH:MM[:SS]". */
+static double parse_time(const char *str)
+{
+  struct tm tm;
+  char *end;
+  double t = strtod(str, &end);
+
+  if (*str != 0 && *end == 0)
+    return t;
+
+  memset(&tm, 0, sizeof(tm));
+  end = strptime(str, "%Y-%m-%d %H:%M", &tm);
+  if (end != NULL && *end == ':')
+    end = strptime(end + 1, "%S", &tm);
+
+  if (end == NULL || *end != 0)
+    FATAL("invalid time `%s'\n", str);
+
+  tm.tm_isdst = -1;
+
+  return mktime(&tm);
+}
+
+int main(int argc, char *argv[])
+{
+  struct dump_args da = { .want_sum = 0 };
+  struct archive_reader rd;
+  double from = 0, to = 1e300;
+  const char *path;
+
+  struct option opts[] = {
+    { "from", 1, NULL, 'f' },
+    { "help", 0, NULL, 'h' },
+    { "sum",  0, NULL, 's' },
+    { "to",   1, NULL, 't' },
+    { NULL, 0, NULL, 0},
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "f:hst:", opts, 0)) != -1) {
+    switch (c) {
+    case 'f':
+      from = parse_time(optarg);
+      break;
+    case 'h':
+      printf("Usage: %s [OPTION]... PATH [HOST]...\n"
+             "Print archived IB load by host.\n"
+             "\n"
+             "Mandatory arguments to long options are mandatory for short options too.\n"
+             "  -f, --from=TIME               start at TIME\n"
+             "  -h, --help                    display this help and exit\n"
+             "  -s, --sum                     sum over hosts, one line per sample\n"
+             "  -t, --to=TIME                 stop at TIME\n"
+             "\n"
+             "TIME is seconds since the epoch, or `YYYY-MM-DD HH:MM[:SS]'.\n",
+             program_invocation_short_name);
+      exit(EXIT_SUCCESS);
+    case 's':
+      da.want_sum = 1;
+      break;
+    case 't':
+      to = parse_time(optarg);
+      break;
+    case '?':
+      fprintf(stderr, "Try `%s --help' for more information.",
+              program_invocation_short_name);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind >= argc)
+    FATAL("must specify archive path\n");
+
+  path = argv[optind];
+  da.hosts = argv + optind + 1;
+  da.nr_hosts = argc - optind - 1;
+
+  if (archive_reader_open(&rd, path) < 0)
+    FATAL("cannot open archive `%s': %m\n", path);
+
+  if (rd.rd_hdr->ah_nr_ctrs != NR_CTRS)
+    FATAL("archive `%s' has %u counters per port, expected %d\n",
+          path, rd.rd_hdr->ah_nr_ctrs, NR_CTRS);
+
+  archive_read(&rd, from, to, &dump_record, &da);
+  archive_reader_close(&rd);
+
+  return 0;
+}
@@ -1,14 +1,20 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <endian.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <unistd.h>
-#include <poll.h>
 #include <time.h>
 #include <getopt.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <infiniband/umad.h>
 #include <infiniband/mad.h>
 #include "string1.h"
@@ -16,18 +22,53 @@
 #include "dict.h"
 #include "list.h"
 #include "ibtop.h"
+#include "sched.h"
+#include "wheel.h"
+#include "mad-codec.h"
+#include "umad-io.h"
+#include "umad-rec.h"
+#include "ib-net-db.h"
+#include "hca.h"
+#include "state.h"
+#include "snap.h"
+#include "archive.h"
+#include "hist.h"
+#include "fabric.h"
+#include "bench.h"
 
 #define NR_JOBS_HINT 256
 #define NR_HOSTS_HINT 4096
 #define TRID_BASE 0xE1F2A3B4C5D6E7F8
 #define P_TRID "%016"PRIx64
 
-/* /sys/class/infiniband/HCA_NAME/ports/HCA_PORT */
-
-char *hca_name = "mlx4_0";
-int hca_port = 1;
+/* The kernel replaces the high 32 bits of the TRID with the agent's,
+   so only the low 32 are ours.  We use them (offset by TRID_BASE) for
+   the pass generation, the attempt number, and the host index:
+
+     31      24 23  20 19                  0
+     [  gen   ][ seq ][        index        ]
+
+   Each attempt needs its own TRID since earlier attempts stay in the
+   kernel's send list, and the generation lets us tell a late answer
+   from an earlier pass from one to the current pass. */
+#define TRID_INDEX_BITS 20
+#define TRID_SEQ_BITS 4
+#define TRID_GEN_BITS 8
+#define TRID_INDEX_MASK ((1u << TRID_INDEX_BITS) - 1)
+#define TRID_SEQ_MASK ((1u << TRID_SEQ_BITS) - 1)
+#define TRID_GEN_MASK ((1u << TRID_GEN_BITS) - 1)
+#define TRID_SEQ_SHIFT TRID_INDEX_BITS
+#define TRID_GEN_SHIFT (TRID_INDEX_BITS + TRID_SEQ_BITS)
+
+static inline uint64_t trid_make(size_t index, unsigned int gen, unsigned int seq)
+{
+  return TRID_BASE + (((uint64_t) (gen & TRID_GEN_MASK) << TRID_GEN_SHIFT) |
+                      ((seq & TRID_SEQ_MASK) << TRID_SEQ_SHIFT) |
+                      (index & TRID_INDEX_MASK));
+}
 
 struct ib_net_info {
+  uint64_t ni_guid;
   uint16_t ni_lid;
   uint8_t ni_port;
   unsigned int ni_is_hca:1;
@@ -53,10 +94,94 @@ static inline double dnow(void)
   return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-int umad_fd = -1;
-int umad_agent_id = -1;
+static inline double mnow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int umad_timeout_ms = 15;
-int umad_retries = 10;
+int umad_retries = 3;
+int want_stats = 0;
+
+struct pass_stats {
+  size_t ps_nr_queued;
+  size_t ps_nr_sent;
+  size_t ps_nr_responses;
+  size_t ps_nr_retries;
+  size_t ps_nr_failed;
+  size_t ps_nr_late;
+  size_t ps_nr_dup;
+  size_t ps_nr_stale;
+  size_t ps_nr_syscalls;
+  double ps_first; /* Monotonic times of the earliest and latest */
+  double ps_last;  /* good response, 0 if none. */
+};
+
+/* Responses aren't always handled in the order of their times (a
+   replay delivers them as its sends go), so take the extremes. */
+static inline void pass_stats_stamp(struct pass_stats *ps, double mono)
+{
+  if (ps->ps_first == 0 || mono < ps->ps_first)
+    ps->ps_first = mono;
+  if (mono > ps->ps_last)
+    ps->ps_last = mono;
+}
+
+/* One collector per local port, each with its own umad agent, I/O,
+   scheduler, and timers.  Hosts are sharded across collectors by
+   destination LID, so a target, and the hosts and in flight state
+   behind it, are only ever touched by one collector.  With more than
+   one collector, each runs a pass in its own thread (co_thread),
+   pinned to the CPUs local to its HCA.
+
+   Retransmission is ours: the kernel gets no retries and a timeout
+   (umad_timeout_ms, set from the maximum RTO) that only serves as a
+   backstop, so that late responses to earlier attempts still count.
+   Retransmit timers live in co_wheel. */
+struct collector {
+  struct hca_port co_port;
+  char co_name[HCA_NAME_MAX + 8];
+  int co_fd;
+  int co_agent_id;
+  struct umad_io co_io;
+  struct sched co_sched;
+  struct wheel co_wheel;
+  struct pass_stats co_stats;
+  char *co_recv_ring;
+  struct host_ent **co_queue;
+  size_t co_nr_queued;
+  pthread_t co_thread;
+  cpu_set_t co_cpus;
+  unsigned int co_have_cpus:1;
+};
+
+size_t nr_colls = 0;
+
+/* With --record, everything the collectors send and receive. */
+struct umad_rec *mad_rec;
+
+/* With --replay, collectors talk to a recording instead. */
+struct umad_replay *mad_replay;
+struct collector *coll_vec = NULL;
+
+/* Threaded passes start and end at these barriers. */
+pthread_barrier_t pass_begin_barrier, pass_end_barrier;
+double pass_deadline;
+int pass_exit;
+
+/* Set by burst mode: collectors poll for responses without sleeping. */
+int pass_busy_poll = 0;
+
+/* Time between the first and last good response of the last pass,
+   over all collectors. */
+double pass_skew;
+
+/* Generation of the current pass, as it appears in TRIDs. */
+unsigned int mad_gen;
 
 enum {
   C_TX_B,
@@ -66,32 +191,182 @@ enum {
   NR_CTRS,
 };
 
+/* Extra report columns: rates over spans longer than an interval,
+   and moving averages, from each host's history (hist_vec, indexed
+   like host_vec).  Only byte counters (TX, RX) are kept. */
+#define NR_RATE_COLS_MAX 6
+
+struct rate_col {
+  char rc_label[16];
+  double rc_span;
+  int rc_ema; /* rc_span is then the time constant hc_tau[rc_ema - 1]. */
+};
+
+struct rate_col rate_cols[NR_RATE_COLS_MAX];
+size_t nr_rate_cols = 0, nr_ema_cols = 0;
+
+struct hist_conf hist_conf;
+struct hist *hist_vec = NULL;
+size_t hist_vec_len = 0;
+
+/* Running totals for a job over the time it's in the job map. */
+struct job_acct {
+  uint64_t ja_ctrs[NR_CTRS];
+  double ja_peak[NR_CTRS]; /* Per second. */
+  double ja_begin;         /* Realtime of the first interval's start... */
+  double ja_end;           /* ...and the last one's end. */
+  double ja_active;        /* Seconds in intervals with samples. */
+  size_t ja_max_hosts;
+};
+
+/* Fake jobs stand for hosts not in any job. */
 struct job_ent {
   uint64_t j_ctrs[NR_CTRS];
   char *j_owner;
   struct list_head j_host_list;
   size_t j_nr_hosts, j_nr_valid;
+  uint32_t j_snap_index;
+  unsigned int j_fake:1;
+  unsigned int j_in_map:1;
+  struct job_acct j_acct;
+  double j_cols[NR_RATE_COLS_MAX][HIST_NR_CTRS];
   char j_name[];
 };
 
+/* h_ctrs holds the change over the last interval, h_raw the most
+   recent sample.  Bit 0 of h_valid is set if h_raw was filled in by a
+   previous pass (or the state file), bit 1 if it was filled in by the
+   current pass.  h_time is the CLOCK_MONOTONIC time of h_raw, and
+   h_elapsed the time that h_ctrs is over. */
 struct host_ent {
   uint64_t h_ctrs[NR_CTRS];
-  uint64_t h_trid;
+  uint64_t h_raw[NR_CTRS];
+  double h_time;
+  double h_elapsed;
+  uint32_t h_index;
+  struct wheel_timer h_timer;
   struct job_ent *h_job;
   struct list_head h_job_link;
+  struct list_head h_sched_link;
+  struct sched_target *h_target;
+  struct collector *h_coll;
+  struct samples_group *h_sgroup;
+  double h_sample_time;
   struct ib_net_info h_info;
   unsigned int h_valid:2;
+  unsigned int h_want:1;
   char h_name[];
 };
 
+/* In flight state of each host's query, indexed like host_vec and by
+   the index in the TRID, so the receive path can throw out stale and
+   duplicate responses without touching the host. */
+struct inflight {
+  double if_sent;
+  uint8_t if_gen;
+  uint8_t if_attempt;
+  uint8_t if_state;
+};
+
+enum {
+  H_IDLE,
+  H_QUEUED,
+  H_WAITING,
+};
+
 size_t nr_hosts = 0, host_vec_len = 0;
 struct host_ent **host_vec = NULL;
+struct inflight *inflight_vec = NULL;
 struct dict host_dict;
 
+/* The PortCountersExtended query for each host is built once, by
+   umad_vec_init() or, for hosts added later, host_set_info(), in
+   umad_vec[h_index * umad_stride].  Only the TRID changes from send
+   to send. */
+#define UMAD_ALIGN 64
+
+char *umad_vec = NULL;
+size_t umad_stride = 0;
+size_t umad_len = 0;
+
+void umad_build_perf(void *buf, struct host_ent *h);
+
+/* Targets (destination LIDs), indexed by LID.  Each belongs to the
+   scheduler of lid_coll(lid). */
+struct sched_target **lid_target_vec = NULL;
+
 size_t nr_jobs = 0, job_vec_len = 0;
 struct job_ent **job_vec = NULL;
 struct dict job_dict;
 
+void tables_init(void)
+{
+  host_vec_len = NR_HOSTS_HINT > 0 ? NR_HOSTS_HINT : 4096;
+  host_vec = malloc(host_vec_len * sizeof(host_vec[0]));
+  if (host_vec == NULL)
+    OOM();
+
+  inflight_vec = malloc(host_vec_len * sizeof(inflight_vec[0]));
+  if (inflight_vec == NULL)
+    OOM();
+
+  if (dict_init(&host_dict, NR_HOSTS_HINT) < 0)
+    OOM();
+
+  job_vec_len = NR_JOBS_HINT > 0 ? NR_JOBS_HINT : 256;
+  job_vec = malloc(job_vec_len * sizeof(job_vec[0]));
+  if (job_vec == NULL)
+    OOM();
+
+  if (dict_init(&job_dict, NR_JOBS_HINT) < 0)
+    OOM();
+}
+
+/* Everything indexed by h_index grows with host_vec, since hosts may
+   be added after startup (by job map rereads, with lazy hosts).  This
+   is only done between passes. */
+void host_vecs_grow(size_t new_len)
+{
+  struct host_ent **new_vec = realloc(host_vec, new_len * sizeof(host_vec[0]));
+  if (new_vec == NULL)
+    OOM();
+
+  host_vec = new_vec;
+
+  struct inflight *new_inflight_vec =
+    realloc(inflight_vec, new_len * sizeof(inflight_vec[0]));
+  if (new_inflight_vec == NULL)
+    OOM();
+
+  inflight_vec = new_inflight_vec;
+
+  if (hist_vec != NULL) {
+    struct hist *new_hist_vec = realloc(hist_vec, new_len * sizeof(hist_vec[0]));
+    if (new_hist_vec == NULL)
+      OOM();
+
+    hist_vec = new_hist_vec;
+    hist_vec_len = new_len;
+  }
+
+  if (umad_vec != NULL) {
+    char *new_umad_vec;
+
+    errno = posix_memalign((void **) &new_umad_vec, UMAD_ALIGN,
+                           new_len * umad_stride);
+    if (errno != 0)
+      OOM();
+
+    memcpy(new_umad_vec, umad_vec, nr_hosts * umad_stride);
+    memset(new_umad_vec + nr_hosts * umad_stride, 0,
+           (new_len - nr_hosts) * umad_stride);
+    free(umad_vec);
+    umad_vec = new_umad_vec;
+  }
+
+  host_vec_len = new_len;
+}
+
 struct host_ent *host_lookup(const char *name, int create)
 {
   struct host_ent *h;
@@ -105,35 +380,192 @@ struct host_ent *host_lookup(const char *name, int create)
   if (!create)
     return NULL;
 
-  if (!(nr_hosts < host_vec_len)) {
-    size_t new_len = 2 * host_vec_len;
-    struct host_ent **new_vec = realloc(host_vec, new_len * sizeof(host_vec[0]));
-    if (new_vec == NULL)
-      OOM();
+  if (!(nr_hosts < host_vec_len))
+    host_vecs_grow(2 * host_vec_len);
 
-    host_vec = new_vec;
-    host_vec_len = new_len;
-  }
+  if (nr_hosts > TRID_INDEX_MASK)
+    FATAL("too many hosts\n");
 
   ALLOC_NAMED(h, h_name, name);
   INIT_LIST_HEAD(&h->h_job_link);
+  INIT_LIST_HEAD(&h->h_sched_link);
+  wheel_timer_init(&h->h_timer);
 
   if (dict_entry_set(&host_dict, de, hash, h->h_name) < 0)
     OOM();
 
-  h->h_trid = TRID_BASE + nr_hosts;
+  h->h_index = nr_hosts;
+  memset(&inflight_vec[nr_hosts], 0, sizeof(inflight_vec[0]));
+  if (hist_vec != NULL)
+    memset(&hist_vec[nr_hosts], 0, sizeof(hist_vec[0]));
   host_vec[nr_hosts++] = h;
 
   return h;
 }
 
-int host_vec_init(const char *info_path, const char *info_cmd)
+static inline struct collector *lid_coll(uint16_t lid)
+{
+  return &coll_vec[lid % nr_colls];
+}
+
+struct sched_target *lid_target(uint16_t lid)
+{
+  if (lid_target_vec == NULL) {
+    lid_target_vec = calloc(1 << 16, sizeof(lid_target_vec[0]));
+    if (lid_target_vec == NULL)
+      OOM();
+  }
+
+  struct sched_target *t = lid_target_vec[lid];
+  if (t != NULL)
+    return t;
+
+  t = malloc(sizeof(*t));
+  if (t == NULL)
+    OOM();
+
+  sched_target_init(&lid_coll(lid)->co_sched, t, lid);
+  lid_target_vec[lid] = t;
+
+  return t;
+}
+
+/* The compiled net DB (see ib-net-db.h) saves parsing the net info,
+   as long as it's no older. */
+int net_db_open(struct ib_net_db *nd, const char *db_path,
+                const char *info_path)
+{
+  struct stat db_stat, info_stat;
+
+  if (stat(db_path, &db_stat) < 0)
+    return -1;
+
+  if (stat(info_path, &info_stat) == 0 &&
+      info_stat.st_mtime > db_stat.st_mtime) {
+    ERROR("`%s' is older than `%s', ignoring it\n", db_path, info_path);
+    return -1;
+  }
+
+  if (ib_net_db_open(nd, db_path, O_RDONLY, 0) < 0) {
+    ERROR("cannot open `%s': %m\n", db_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+void host_set_info(struct host_ent *h, const struct ib_net_ent *ne)
+{
+  h->h_info.ni_guid = ne->ne_guid;
+  h->h_info.ni_lid = ne->ne_lid;
+  h->h_info.ni_port = ne->ne_port;
+  h->h_info.ni_is_hca = ne->ne_is_hca;
+
+  h->h_target = lid_target(h->h_info.ni_lid);
+  h->h_coll = lid_coll(h->h_info.ni_lid);
+
+  if (umad_vec != NULL)
+    umad_build_perf(umad_vec + h->h_index * umad_stride, h);
+}
+
+int host_vec_init_db(const char *db_path, const char *info_path)
+{
+  struct ib_net_db nd;
+  size_t i;
+
+  if (net_db_open(&nd, db_path, info_path) < 0)
+    return -1;
+
+  for (i = 0; i < nd.nd_count; i++) {
+    struct ib_net_ent ne;
+    const char *name;
+    struct host_ent *h;
+
+    ib_net_db_ent(&nd, i, &name, &ne);
+
+    h = host_lookup(name, 1);
+    if (h == NULL)
+      OOM();
+
+    host_set_info(h, &ne);
+  }
+
+  ib_net_db_close(&nd);
+
+  return 0;
+}
+
+/* With -l or -j (and a net DB), hosts are only loaded when asked
+   about: by name for -l, or for -j when the job map puts them in one
+   of lazy_job_args.  lazy_db stays open for job map rereads. */
+struct ib_net_db lazy_db;
+int lazy_hosts = 0;
+char **lazy_job_args = NULL;
+size_t nr_lazy_job_args = 0;
+
+struct host_ent *host_lookup_lazy(const char *name)
+{
+  struct host_ent *h = host_lookup(name, 0);
+  struct ib_net_ent ne;
+
+  if (h != NULL || !lazy_hosts)
+    return h;
+
+  if (ib_net_db_fetch(&lazy_db, name, &ne) <= 0)
+    return NULL;
+
+  h = host_lookup(name, 1);
+  if (h == NULL)
+    OOM();
+
+  host_set_info(h, &ne);
+
+  return h;
+}
+
+int lazy_job_wanted(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < nr_lazy_job_args; i++)
+    if (strcmp(name, lazy_job_args[i]) == 0)
+      return 1;
+
+  return 0;
+}
+
+int hosts_lazy_init(const char *db_path, const char *info_path,
+                    int have_host_args, char **args, size_t nr_args)
+{
+  size_t i;
+
+  if (net_db_open(&lazy_db, db_path, info_path) < 0)
+    return -1;
+
+  lazy_hosts = 1;
+
+  if (have_host_args) {
+    for (i = 0; i < nr_args; i++)
+      host_lookup_lazy(args[i]);
+  } else {
+    lazy_job_args = args;
+    nr_lazy_job_args = nr_args;
+  }
+
+  return 0;
+}
+
+int host_vec_init(const char *db_path, const char *info_path,
+                  const char *info_cmd)
 {
   int rc = -1;
   FILE *info_file = NULL;
   char *line = NULL;
   size_t line_size = 0;
 
+  if (db_path != NULL && host_vec_init_db(db_path, info_path) == 0)
+    return 0;
+
   info_file = fopen(info_path, "r");
   if (info_file != NULL)
     goto have_info_file;
@@ -169,12 +601,15 @@ int host_vec_init(const char *info_path, const char *info_cmd)
     char *rest = line;
     char *host = wsep(&rest);
     int use_hca;
+    uint64_t hca_guid, sw_guid;
     uint16_t hca_lid, sw_lid;
     uint8_t hca_port, sw_port;
     struct host_ent *h;
 
-    if (sscanf(rest, "%d %*x %"SCNx16" %"SCNx8" %*x %"SCNx16" %"SCNx8,
-               &use_hca, &hca_lid, &hca_port, &sw_lid, &sw_port) != 5)
+    if (sscanf(rest, "%d %"SCNx64" %"SCNx16" %"SCNx8" "
+               "%"SCNx64" %"SCNx16" %"SCNx8,
+               &use_hca, &hca_guid, &hca_lid, &hca_port,
+               &sw_guid, &sw_lid, &sw_port) != 7)
       continue;
 
     h = host_lookup(host, 1);
@@ -182,13 +617,18 @@ int host_vec_init(const char *info_path, const char *info_cmd)
       OOM();
 
     if (use_hca) {
+      h->h_info.ni_guid = hca_guid;
       h->h_info.ni_lid = hca_lid;
       h->h_info.ni_port = hca_port;
       h->h_info.ni_is_hca = 1;
     } else {
+      h->h_info.ni_guid = sw_guid;
       h->h_info.ni_lid = sw_lid;
       h->h_info.ni_port = sw_port;
     }
+
+    h->h_target = lid_target(h->h_info.ni_lid);
+    h->h_coll = lid_coll(h->h_info.ni_lid);
   }
 
   rc = 0;
@@ -273,6 +713,147 @@ int do_job_map_cmd(const char *cmd)
   return 0;
 }
 
+/* Forget who is in which job, before (re)reading the job map. */
+void job_map_reset(void)
+{
+  size_t i;
+
+  for (i = 0; i < nr_hosts; i++) {
+    list_del_init(&host_vec[i]->h_job_link);
+    host_vec[i]->h_job = NULL;
+  }
+
+  for (i = 0; i < nr_jobs; i++)
+    job_vec[i]->j_nr_hosts = 0;
+}
+
+void job_map_line(char *line)
+{
+  char *rest = line;
+  char *h_name = wsep(&rest);
+  char *j_name = wsep(&rest);
+  char *j_owner = wsep(&rest);
+  if (h_name == NULL || j_name == NULL || j_owner == NULL)
+    return;
+
+  struct host_ent *h = host_lookup(h_name, 0);
+  if (h == NULL && lazy_job_wanted(j_name))
+    h = host_lookup_lazy(h_name);
+
+  if (h == NULL)
+    return;
+
+  /* First line for a host wins. */
+  if (h->h_job != NULL)
+    return;
+
+  struct job_ent *j = job_lookup(j_name, j_owner, 1);
+  if (j == NULL)
+    OOM();
+
+  list_add(&h->h_job_link, &j->j_host_list);
+  j->j_nr_hosts++;
+  h->h_job = j;
+}
+
+/* Compare the job (second field) of the line at p with name. */
+static int job_map_line_cmp(const char *p, const char *end, const char *name)
+{
+  const char *q;
+
+  while (p < end && *p != '\n' && !isspace(*p))
+    p++;
+  while (p < end && *p != '\n' && isspace(*p))
+    p++;
+
+  for (q = p; q < end && !isspace(*q); q++)
+    ;
+
+  size_t len = q - p, name_len = strlen(name);
+  int c = memcmp(p, name, len < name_len ? len : name_len);
+
+  if (c != 0)
+    return c;
+
+  return len < name_len ? -1 : len > name_len;
+}
+
+static const char *job_map_next_line(const char *p, const char *end)
+{
+  p = memchr(p, '\n', end - p);
+
+  return p != NULL ? p + 1 : end;
+}
+
+/* make-job-map writes its map sorted by job (bytewise, as with
+   LC_ALL=C sort), under a JOB_MAP_SORTED line, so the lines for each
+   of lazy_job_args can be found by binary search.  Returns -1 if the
+   map isn't sorted. */
+#define JOB_MAP_SORTED "#sorted-by-job\n"
+
+int job_map_read_sorted(FILE *file)
+{
+  struct stat stat_buf;
+  char *map, *line = NULL;
+  size_t line_size = 0, i;
+  const char *body, *end;
+
+  if (fstat(fileno(file), &stat_buf) < 0 || !S_ISREG(stat_buf.st_mode) ||
+      stat_buf.st_size < strlen(JOB_MAP_SORTED))
+    return -1;
+
+  map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+  if (map == MAP_FAILED)
+    return -1;
+
+  if (memcmp(map, JOB_MAP_SORTED, strlen(JOB_MAP_SORTED)) != 0) {
+    munmap(map, stat_buf.st_size);
+    return -1;
+  }
+
+  body = map + strlen(JOB_MAP_SORTED);
+  end = map + stat_buf.st_size;
+
+  for (i = 0; i < nr_lazy_job_args; i++) {
+    const char *lo = body, *hi = end, *p;
+
+    /* The first line with a job not less than ours. */
+    while (lo < hi) {
+      const char *mid = lo + (hi - lo) / 2;
+
+      while (mid > lo && mid[-1] != '\n')
+        mid--;
+
+      if (job_map_line_cmp(mid, end, lazy_job_args[i]) < 0)
+        lo = job_map_next_line(mid, end);
+      else
+        hi = mid;
+    }
+
+    for (p = lo; p < end && job_map_line_cmp(p, end, lazy_job_args[i]) == 0;
+         p = job_map_next_line(p, end)) {
+      size_t len = job_map_next_line(p, end) - p;
+
+      if (line_size < len + 1) {
+        free(line);
+        line_size = len + 1;
+        line = malloc(line_size);
+        if (line == NULL)
+          OOM();
+      }
+
+      memcpy(line, p, len);
+      line[len] = 0;
+      job_map_line(line);
+    }
+  }
+
+  free(line);
+  munmap(map, stat_buf.st_size);
+
+  return 0;
+}
+
 int job_map_init(const char *path, const char *cmd, int max_age)
 {
   int rc = -1;
@@ -340,27 +921,17 @@ int job_map_init(const char *path, const char *cmd, int max_age)
   }
 
  have_file:
-  while (getline(&line, &line_size, file) >= 0) {
-    char *rest = line;
-    char *h_name = wsep(&rest);
-    char *j_name = wsep(&rest);
-    char *j_owner = wsep(&rest);
-    if (h_name == NULL || j_name == NULL || j_owner == NULL)
-      continue;
+  /* Only now that we have a map to replace it with. */
+  job_map_reset();
 
-    struct host_ent *h = host_lookup(h_name, 0);
-    if (h == NULL)
-      continue;
-
-    struct job_ent *j = job_lookup(j_name, j_owner, 1);
-    if (j == NULL)
-      OOM();
-
-    list_add(&h->h_job_link, &j->j_host_list);
-    j->j_nr_hosts++;
-    h->h_job = j;
+  if (nr_lazy_job_args > 0 && job_map_read_sorted(file) == 0) {
+    rc = 0;
+    goto out;
   }
 
+  while (getline(&line, &line_size, file) >= 0)
+    job_map_line(line);
+
   rc = 0;
 
  out:
@@ -393,152 +964,2125 @@ static inline void ibtop_umad_dump(void *um, size_t len)
 #endif
 }
 
-int host_send_perf_umad(struct host_ent *h)
+/* With --port-samples, switch ports (hosts with ni_is_hca == 0) are
+   measured by their switch's PMA over a window of samples_window
+   seconds instead of by differencing PortCountersExtended.  Each pass
+   collects the PortSamplesResult of the windows started by the
+   previous pass and then starts new ones.  A PMA samples one port at
+   a time, so the ports behind each switch LID take turns. */
+enum {
+  SG_UNKNOWN, /* Tick not known yet. */
+  SG_READY,
+  SG_RUNNING, /* Window started on sg_cur with sg_tag. */
+  SG_FAILED,  /* No port sampling, fall back to PortCountersExtended. */
+};
+
+struct samples_group {
+  struct host_ent **sg_hosts;
+  size_t sg_nr_hosts;
+  size_t sg_next;
+  struct host_ent *sg_cur;
+  double sg_tick; /* Seconds. */
+  uint16_t sg_tag;
+  int sg_state;
+  char *sg_send_buf;
+};
+
+double samples_window = 0;
+double samples_max_age;
+struct samples_group *samples_group_vec = NULL;
+size_t nr_samples_groups = 0;
+struct host_ent **samples_queue = NULL;
+uint16_t samples_tag = 0;
+
+/* The attribute queried by the current pass. */
+unsigned int pass_attr = IB_GSI_PORT_COUNTERS_EXT;
+
+void umad_build_perf(void *buf, struct host_ent *h)
 {
-  char buf[1024];
-  struct ib_user_mad *um;
-  size_t um_size = umad_size() + IB_MAD_SIZE;
+  struct ib_user_mad *um = buf;
   void *m;
 
-  memset(buf, 0, sizeof(buf));
-
-  um = (struct ib_user_mad *) buf;
   umad_set_addr(um, h->h_info.ni_lid, 1, 0, IB_DEFAULT_QP1_QKEY);
 
-  um->agent_id   = umad_agent_id;
+  um->agent_id   = h->h_coll->co_agent_id;
   um->timeout_ms = umad_timeout_ms;
-  um->retries    = umad_retries;
+  um->retries    = 0;
 
   m = umad_get_mad(um);
-  mad_set_field(m, 0, IB_MAD_METHOD_F, IB_MAD_METHOD_GET);
-  /* mad_set_field(m, 0, IB_MAD_RESPONSE_F, 0); */
-  /* mad_set_field(m, 0, IB_MAD_STATUS_F, 0 ); *//* rpc->rstatus */
-  mad_set_field(m, 0, IB_MAD_CLASSVER_F, 1);
-  mad_set_field(m, 0, IB_MAD_MGMTCLASS_F, IB_PERFORMANCE_CLASS);
-  mad_set_field(m, 0, IB_MAD_BASEVER_F, 1);
-  mad_set_field(m, 0, IB_MAD_ATTRID_F, IB_GSI_PORT_COUNTERS_EXT);
-  /* mad_set_field(m, 0, IB_MAD_ATTRMOD_F, 0); *//* rpc->attr.mod */
-  /* mad_set_field64(m, 0, IB_MAD_MKEY_F, 0); *//* rpc->mkey */
+  mad_encode_hdr(m, IB_PERFORMANCE_CLASS, IB_MAD_METHOD_GET,
+                 IB_GSI_PORT_COUNTERS_EXT, 0, 0);
 
-  mad_set_field64(m, 0, IB_MAD_TRID_F, h->h_trid);
+  void *pc = (char *) m + MAD_PMA_DATA_OFFS;
+  put_u8(pc, PCE_PORT_SELECT_OFFS, h->h_info.ni_port);
+}
 
-  void *pc = (char *) m + IB_PC_DATA_OFFS;
-  mad_set_field(pc, 0, IB_PC_PORT_SELECT_F, h->h_info.ni_port);
+void umad_vec_init(void)
+{
+  size_t i;
 
-  TRACE("sending perf umad for host `%s', "
-        "lid %"PRIx16", port %"PRIx8", is_hca %u, trid "P_TRID"\n",
-        h->h_name, h->h_info.ni_lid, h->h_info.ni_port,
-        (unsigned int) h->h_info.ni_is_hca, h->h_trid);
+  umad_len = umad_size() + IB_MAD_SIZE;
+  umad_stride = (umad_len + UMAD_ALIGN - 1) & ~((size_t) UMAD_ALIGN - 1);
 
-  ibtop_umad_dump(um, um_size);
+  free(umad_vec);
+  umad_vec = NULL;
 
-  ssize_t nw = write(umad_fd, um, um_size);
-  if (nw < 0) {
-    ERROR("error sending umad for host `%s': %m\n", h->h_name);
-    return -1;
-  } else if (nw < um_size) {
-    /* ... */
-  }
+  errno = posix_memalign((void **) &umad_vec, UMAD_ALIGN,
+                         host_vec_len * umad_stride);
+  if (errno != 0)
+    OOM();
 
-  return 0;
+  memset(umad_vec, 0, host_vec_len * umad_stride);
+
+  for (i = 0; i < nr_hosts; i++)
+    umad_build_perf(umad_vec + i * umad_stride, host_vec[i]);
 }
 
-int recv_response_umad(int which)
+/* Time of the window programmed for sg. */
+static inline double samples_elapsed(const struct samples_group *sg)
 {
-  char buf[1024];
-  memset(buf, 0, sizeof(buf));
-  size_t um_size = umad_size() + IB_MAD_SIZE;
+  return (uint32_t) (samples_window / sg->sg_tick) * sg->sg_tick;
+}
 
-  ssize_t nr = read(umad_fd, buf, sizeof(buf));
-  if (nr < 0) {
-    if (errno != EWOULDBLOCK)
-      ERROR("error receiving mad: %m\n");
-    return -1;
-  }
+/* PortSamplesControl and PortSamplesResult queries are few, so they
+   are built as they are sent, in the group's sg_send_buf (a group has
+   at most one outstanding, and the buffer must stay put until the
+   collector's next flush).  Until the PMA's tick is known,
+   PortSamplesControl is only read. */
+void umad_build_samples(void *buf, struct host_ent *h, unsigned int attr)
+{
+  static const uint16_t sel[] = {
+    PS_SEL_XMT_DATA, PS_SEL_RCV_DATA, PS_SEL_XMT_PKTS, PS_SEL_RCV_PKTS,
+  };
+  struct samples_group *sg = h->h_sgroup;
+  struct ib_user_mad *um = buf;
+  unsigned int method = IB_MAD_METHOD_GET;
+  void *m;
+  size_t i;
 
-  struct ib_user_mad *um = (struct ib_user_mad *) buf;
-  void *m = umad_get_mad(um);
-  uint64_t trid = mad_get_field64(m, 0, IB_MAD_TRID_F);
+  memset(buf, 0, umad_len);
+  umad_set_addr(um, h->h_info.ni_lid, 1, 0, IB_DEFAULT_QP1_QKEY);
+
+  um->agent_id   = h->h_coll->co_agent_id;
+  um->timeout_ms = umad_timeout_ms;
+  um->retries    = 0;
+
+  m = umad_get_mad(um);
+
+  void *pc = (char *) m + MAD_PMA_DATA_OFFS;
+
+  if (attr == IB_GSI_PORT_SAMPLES_CONTROL && sg->sg_state == SG_READY) {
+    method = IB_MAD_METHOD_SET;
+    put_u8(pc, PSC_PORT_SELECT_OFFS, h->h_info.ni_port);
+    put_be32(pc, PSC_SAMPLE_START_OFFS, 0);
+    put_be32(pc, PSC_SAMPLE_INTERVAL_OFFS, samples_window / sg->sg_tick);
+    put_be16(pc, PSC_TAG_OFFS, sg->sg_tag);
+    for (i = 0; i < sizeof(sel) / sizeof(sel[0]); i++)
+      put_be16(pc, PSC_COUNTER_SELECT_OFFS + 2 * i, sel[i]);
+  }
+
+  mad_encode_hdr(m, IB_PERFORMANCE_CLASS, method, attr, 0, 0);
+}
+
+int host_send_perf_umad(struct host_ent *h)
+{
+  void *um = umad_vec + h->h_index * umad_stride;
+
+  if (pass_attr != IB_GSI_PORT_COUNTERS_EXT) {
+    um = h->h_sgroup->sg_send_buf;
+    umad_build_samples(um, h, pass_attr);
+  }
+  struct inflight *f = &inflight_vec[h->h_index];
+  uint64_t trid = trid_make(h->h_index, f->if_gen, f->if_attempt);
+
+  mad_put_trid((char *) um + umad_len - IB_MAD_SIZE, trid);
+
+  TRACE("sending perf umad for host `%s', "
+        "lid %"PRIx16", port %"PRIx8", is_hca %u, trid "P_TRID"\n",
+        h->h_name, h->h_info.ni_lid, h->h_info.ni_port,
+        (unsigned int) h->h_info.ni_is_hca, trid);
+
+  ibtop_umad_dump(um, umad_len);
+
+  if (umad_io_send(&h->h_coll->co_io, um, umad_len) < 0) {
+    ERROR("error sending umad for host `%s': %m\n", h->h_name);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Compare the fixed layout decode against libibmad's. */
+static inline void pce_check(void *m, const struct pce_ctrs *pce)
+{
+#ifdef IBTOP_UMAD_DEBUG
+  uint8_t *pc = (uint8_t *) m + IB_PC_DATA_OFFS;
+  uint64_t rcv_b, rcv_p, xmt_b, xmt_p;
+
+  mad_decode_field(pc, IB_PC_EXT_RCV_BYTES_F, &rcv_b);
+  mad_decode_field(pc, IB_PC_EXT_RCV_PKTS_F,  &rcv_p);
+  mad_decode_field(pc, IB_PC_EXT_XMT_BYTES_F, &xmt_b);
+  mad_decode_field(pc, IB_PC_EXT_XMT_PKTS_F,  &xmt_p);
+
+  if (rcv_b != pce->pce_rcv_bytes || rcv_p != pce->pce_rcv_pkts ||
+      xmt_b != pce->pce_xmt_bytes || xmt_p != pce->pce_xmt_pkts ||
+      mad_get_field64(m, 0, IB_MAD_TRID_F) != mad_get_trid(m) ||
+      mad_get_field(m, 0, IB_DRSMP_STATUS_F) != mad_get_status(m))
+    FATAL("PortCountersExtended decode mismatch\n");
+#endif
+}
+
+/* Queue another attempt for h if it has any left.  Returns 0 if it
+   was requeued, -1 if we gave up on it. */
+int host_retry(struct host_ent *h)
+{
+  struct collector *co = h->h_coll;
+  struct inflight *f = &inflight_vec[h->h_index];
+
+  f->if_state = H_IDLE;
+
+  if (f->if_attempt >= umad_retries) {
+    TRACE("giving up on host `%s' after %u attempts\n",
+          h->h_name, f->if_attempt + 1);
+    co->co_stats.ps_nr_failed++;
+    return -1;
+  }
+
+  f->if_attempt++;
+  f->if_state = H_QUEUED;
+  sched_enqueue(&co->co_sched, h->h_target, &h->h_sched_link);
+  co->co_stats.ps_nr_retries++;
+
+  return 0;
+}
+
+void host_timeout(struct host_ent *h)
+{
+  TRACE("host `%s' attempt %u timed out\n",
+        h->h_name, inflight_vec[h->h_index].if_attempt);
+
+  wheel_del(&h->h_coll->co_wheel, &h->h_timer);
+  sched_lost(&h->h_coll->co_sched, h->h_target);
+  host_retry(h);
+}
+
+/* Handle a PortSamplesControl or PortSamplesResult response for h.
+   Returns 0 if it completed a window. */
+int recv_samples(struct collector *co, struct host_ent *h, void *m,
+                 double mono)
+{
+  struct samples_group *sg = h->h_sgroup;
+  const char *pc = (const char *) m + MAD_PMA_DATA_OFFS;
+  unsigned int status = mad_get_status(m);
+  unsigned int is_hca = h->h_info.ni_is_hca;
+  size_t i;
+
+  if (sg == NULL || sg->sg_state == SG_FAILED)
+    return -1;
+
+  if (mad_get_attr_id(m) == IB_GSI_PORT_SAMPLES_CONTROL) {
+    unsigned int tick = get_u8(pc, PSC_TICK_OFFS);
+
+    if (status != 0 || tick == 0) {
+      ERROR("switch LID %"PRIx16" cannot sample ports (status %x, tick %u), "
+            "using PortCountersExtended\n",
+            h->h_info.ni_lid, status, tick);
+
+      /* Their h_raw is stale, start over. */
+      for (i = 0; i < sg->sg_nr_hosts; i++)
+        sg->sg_hosts[i]->h_valid = 0;
+
+      sg->sg_state = SG_FAILED;
+      return -1;
+    }
+
+    /* The tick is in units of 5 ns. */
+    sg->sg_tick = tick * 5e-9;
+
+    if (sg->sg_state == SG_UNKNOWN) {
+      sg->sg_state = SG_READY;
+    } else if (sg->sg_state == SG_READY &&
+               get_be16(pc, PSC_TAG_OFFS) == sg->sg_tag &&
+               get_u8(pc, PSC_PORT_SELECT_OFFS) == h->h_info.ni_port) {
+      sg->sg_state = SG_RUNNING;
+      sg->sg_cur = h;
+    }
+
+    return -1;
+  }
+
+  /* PortSamplesResult.  Whatever it says, the PMA is free again. */
+  if (sg->sg_state != SG_RUNNING || sg->sg_cur != h)
+    return -1;
+
+  sg->sg_state = SG_READY;
+
+  if (status != 0 || get_be16(pc, PSR_TAG_OFFS) != sg->sg_tag ||
+      (get_u8(pc, PSR_SAMPLE_STATUS_OFFS) & PS_STATUS_MASK) != PS_STATUS_DONE) {
+    TRACE("port sample for host `%s' not done, status %x\n",
+          h->h_name, status);
+    return -1;
+  }
+
+  /* Data in the same units as PortCountersExtended's. */
+  uint64_t xmt_b = get_be32(pc, PSR_COUNTER_OFFS + 0);
+  uint64_t rcv_b = get_be32(pc, PSR_COUNTER_OFFS + 4);
+  uint64_t xmt_p = get_be32(pc, PSR_COUNTER_OFFS + 8);
+  uint64_t rcv_p = get_be32(pc, PSR_COUNTER_OFFS + 12);
+
+  h->h_ctrs[is_hca ? C_RX_B : C_TX_B] = rcv_b;
+  h->h_ctrs[is_hca ? C_RX_P : C_TX_P] = rcv_p;
+  h->h_ctrs[is_hca ? C_TX_B : C_RX_B] = xmt_b;
+  h->h_ctrs[is_hca ? C_TX_P : C_RX_P] = xmt_p;
+  h->h_elapsed = samples_elapsed(sg);
+  h->h_sample_time = mono;
+
+  pass_stats_stamp(&co->co_stats, mono);
+
+  return 0;
+}
+
+/* Handle one received umad of nr bytes whose PortCountersExtended
+   payload (if any) has already been decoded into *pce.  now is
+   realtime and mono monotonic.  Returns 0 if it gave us a good
+   sample. */
+int recv_response_umad(struct collector *co, void *buf, ssize_t nr,
+                       const struct pce_ctrs *pce, double now, double mono)
+{
+  size_t um_size = umad_len;
+  struct ib_user_mad *um = (struct ib_user_mad *) buf;
+  void *m = umad_get_mad(um);
+  uint64_t trid = mad_get_trid(m);
 
   TRACE("received umad trid "P_TRID", status %d\n", trid, um->status);
 
-  ibtop_umad_dump(buf, nr);
+  ibtop_umad_dump(buf, nr);
+
+  uint32_t x = trid - TRID_BASE;
+  size_t i = x & TRID_INDEX_MASK;
+  unsigned int seq = (x >> TRID_SEQ_SHIFT) & TRID_SEQ_MASK;
+  unsigned int gen = (x >> TRID_GEN_SHIFT) & TRID_GEN_MASK;
+  TRACE("i %zu, seq %u, gen %u\n", i, seq, gen);
+
+  /* Other collectors' hosts can only show up here if the TRID is
+     garbled, but their in flight state is not ours to look at. */
+  if (!(i < nr_hosts) || host_vec[i]->h_coll != co) {
+    ERROR("bad trid "P_TRID" in received umad\n", trid);
+    return -1;
+  }
+
+  struct inflight *f = &inflight_vec[i];
+
+  /* Left over from an earlier pass. */
+  if (gen != f->if_gen) {
+    TRACE("stale umad, trid "P_TRID", gen %u\n", trid, (unsigned int) f->if_gen);
+    co->co_stats.ps_nr_stale++;
+    return -1;
+  }
+
+  /* Already answered (or given up on) in this pass. */
+  if (f->if_state != H_WAITING) {
+    TRACE("duplicate umad, trid "P_TRID"\n", trid);
+    if (um->status == 0)
+      co->co_stats.ps_nr_dup++;
+    return -1;
+  }
+
+  struct host_ent *h = host_vec[i];
+  struct sched_target *t = h->h_target;
+
+  if (um->status != 0) {
+    TRACE("umad trid "P_TRID" failed, status %d\n", trid, um->status);
+    if (seq == f->if_attempt)
+      host_timeout(h);
+    return -1;
+  }
+
+  /* A response to an earlier attempt completes the current one too,
+     but only one to the current attempt gives an unambiguous RTT. */
+  if (seq == f->if_attempt)
+    sched_rtt_sample(&co->co_sched, t, now - f->if_sent);
+  else
+    co->co_stats.ps_nr_late++;
+
+  wheel_del(&co->co_wheel, &h->h_timer);
+  sched_acked(&co->co_sched, t);
+  f->if_state = H_IDLE;
+
+  if (mad_get_status(m) == IB_MAD_STS_REDIRECT) {
+    /* FIXME */
+    ERROR("received redirect, trid "P_TRID"\n", trid);
+    return -1;
+  }
+
+  if (nr < um_size) {
+    TRACE("short receive, expected %zu, only read %zd\n", um_size, nr);
+    host_retry(h);
+    return -1;
+  }
+
+  if (mad_get_attr_id(m) != IB_GSI_PORT_COUNTERS_EXT)
+    return recv_samples(co, h, m, mono);
+
+  unsigned int is_hca = h->h_info.ni_is_hca;
+
+  TRACE("host `%s', lid %"PRIx16", port %"PRIx8", is_hca %u\n",
+        h->h_name, h->h_info.ni_lid, h->h_info.ni_port, is_hca);
+
+  uint64_t c[NR_CTRS];
+
+  pce_check(m, pce);
+
+  c[is_hca ? C_RX_B : C_TX_B] = pce->pce_rcv_bytes;
+  c[is_hca ? C_RX_P : C_TX_P] = pce->pce_rcv_pkts;
+  c[is_hca ? C_TX_B : C_RX_B] = pce->pce_xmt_bytes;
+  c[is_hca ? C_TX_P : C_RX_P] = pce->pce_xmt_pkts;
+
+  TRACE("rx_b %"PRIx64", rx_p %"PRIx64", tx_b %"PRIx64", tx_p %"PRIx64"\n",
+        c[C_RX_B], c[C_RX_P], c[C_TX_B], c[C_TX_P]);
+
+  if (c[C_RX_B] == 0 || c[C_RX_B] == (uint64_t) -1 ||
+      c[C_TX_B] == 0 || c[C_TX_B] == (uint64_t) -1) {
+    if (host_retry(h) == 0)
+      return -1;
+
+    ERROR("perfquery for host `%s' returned bogus stats: "
+          "rx_b %"PRIx64", rx_p %"PRIx64", tx_b %"PRIx64", tx_p %"PRIx64"\n",
+          h->h_name, c[C_RX_B], c[C_RX_P], c[C_TX_B], c[C_TX_P]);
+    return -1;
+  }
+
+  /* Counters that went backwards were reset or cleared since the
+     previous sample, so there's no interval to report. */
+  int k;
+  for (k = 0; k < NR_CTRS; k++)
+    if (c[k] < h->h_raw[k])
+      h->h_valid &= ~1;
+
+  for (k = 0; k < NR_CTRS; k++) {
+    h->h_ctrs[k] = c[k] - h->h_raw[k];
+    h->h_raw[k] = c[k];
+  }
+
+  h->h_elapsed = mono - h->h_time;
+  h->h_time = mono;
+  h->h_valid |= 2;
+
+  pass_stats_stamp(&co->co_stats, mono);
+
+  if (h->h_index < hist_vec_len) {
+    uint64_t hc[HIST_NR_CTRS] = { c[C_TX_B], c[C_RX_B] };
+    hist_add(&hist_conf, &hist_vec[h->h_index], mono, hc);
+  }
+
+  return 0;
+}
+
+/* Received umads are drained RECV_BATCH at a time into co_recv_ring
+   and their counters decoded in one go before being handled. */
+#define RECV_BATCH 64
+#define RECV_BUF_SIZE 1024
+
+/* Returns the number of good samples received. */
+size_t recv_responses(struct collector *co)
+{
+  size_t len[RECV_BATCH];
+  double mono[RECV_BATCH];
+  struct pce_ctrs pce[RECV_BATCH];
+  char *recv_ring = co->co_recv_ring;
+  size_t nr_good = 0, mad_offs = umad_size();
+  ssize_t i, n;
+
+  do {
+    n = umad_io_recv(&co->co_io, recv_ring, RECV_BUF_SIZE, RECV_BATCH, len,
+                     mono);
+    if (n < 0) {
+      ERROR("error receiving mad: %m\n");
+      break;
+    }
+
+    double now = dnow();
+
+    pce_decode_batch(recv_ring + mad_offs, RECV_BUF_SIZE, n, pce);
+
+    for (i = 0; i < n; i++)
+      if (recv_response_umad(co, recv_ring + i * RECV_BUF_SIZE, len[i],
+                             &pce[i], now, mono[i]) == 0)
+        nr_good++;
+  } while (n == RECV_BATCH);
+
+  return nr_good;
+}
+
+/* Sample the hosts in co_queue, returning when all responses are in
+   or at deadline, whichever comes first.  Sends are paced by
+   co_sched, which is fed by the receive path. */
+void collector_pass(struct collector *co, double deadline)
+{
+  struct pass_stats *ps = &co->co_stats;
+  size_t nr_syscalls = co->co_io.io_nr_syscalls;
+  size_t i;
+
+  memset(ps, 0, sizeof(*ps));
+  sched_pass_begin(&co->co_sched, dnow());
+
+  /* Unqueued hosts have empty links, so this skips duplicates. */
+  for (i = 0; i < co->co_nr_queued; i++) {
+    struct host_ent *h = co->co_queue[i];
+    if (!list_empty(&h->h_sched_link))
+      continue;
+
+    inflight_vec[h->h_index].if_gen = mad_gen;
+    inflight_vec[h->h_index].if_attempt = 0;
+    inflight_vec[h->h_index].if_state = H_QUEUED;
+    sched_enqueue(&co->co_sched, h->h_target, &h->h_sched_link);
+    ps->ps_nr_queued++;
+  }
+
+  while (1) {
+    double now = dnow();
+    double wait = deadline - now;
+    struct list_head *item, expired;
+    struct sched_target *t;
+
+    if (wait <= 0)
+      break;
+
+    INIT_LIST_HEAD(&expired);
+    wheel_advance(&co->co_wheel, now, &expired);
+
+    while (!list_empty(&expired)) {
+      struct host_ent *h = list_entry(expired.next, struct host_ent, h_timer.wt_link);
+      list_del_init(&h->h_timer.wt_link);
+      host_timeout(h);
+    }
+
+    while ((item = sched_next(&co->co_sched, now, &wait, &t)) != NULL) {
+      struct host_ent *h = list_entry(item, struct host_ent, h_sched_link);
+      if (host_send_perf_umad(h) < 0) {
+        sched_release(&co->co_sched, t);
+        inflight_vec[h->h_index].if_state = H_IDLE;
+        continue;
+      }
+      sched_sent(&co->co_sched);
+      ps->ps_nr_sent++;
+
+      inflight_vec[h->h_index].if_state = H_WAITING;
+      inflight_vec[h->h_index].if_sent = now;
+      wheel_add(&co->co_wheel, &h->h_timer, now + t->t_rto);
+    }
+
+    if (umad_io_flush(&co->co_io) < 0)
+      ERROR("%s: error sending umads: %m\n", co->co_name);
+
+    if (sched_pass_done(&co->co_sched))
+      break;
+
+    /* Burst mode: spin on the receive side rather than sleep. */
+    if (pass_busy_poll) {
+      ps->ps_nr_responses += recv_responses(co);
+      continue;
+    }
+
+    double next = wheel_next(&co->co_wheel);
+    if (next >= 0 && wait > next - now)
+      wait = next - now;
+
+    if (wait > deadline - now)
+      wait = deadline - now;
+
+    int np = umad_io_wait(&co->co_io, wait);
+    if (np < 0)
+      FATAL("%s: error polling for responses: %m\n", co->co_name);
+
+    if (np == 0)
+      continue;
+
+    ps->ps_nr_responses += recv_responses(co);
+  }
+
+  /* Forget whatever is still queued or outstanding. */
+  for (i = 0; i < co->co_nr_queued; i++) {
+    struct host_ent *h = co->co_queue[i];
+    struct inflight *f = &inflight_vec[h->h_index];
+
+    if (f->if_state == H_WAITING) {
+      wheel_del(&co->co_wheel, &h->h_timer);
+      sched_abandon(&co->co_sched, h->h_target);
+      ps->ps_nr_failed++;
+    } else if (f->if_state == H_QUEUED) {
+      list_del_init(&h->h_sched_link);
+      ps->ps_nr_failed++;
+    }
+
+    f->if_state = H_IDLE;
+  }
+
+  ps->ps_nr_syscalls = co->co_io.io_nr_syscalls - nr_syscalls;
+}
+
+void *collector_thread(void *arg)
+{
+  struct collector *co = arg;
+
+  while (1) {
+    pthread_barrier_wait(&pass_begin_barrier);
+    if (pass_exit)
+      break;
+
+    collector_pass(co, pass_deadline);
+    pthread_barrier_wait(&pass_end_barrier);
+  }
+
+  return NULL;
+}
+
+void collectors_init(struct hca_port *port_vec, size_t nr_ports,
+                     size_t window, size_t window_max, double mad_rate,
+                     size_t target_max, double rto_init, double rto_min,
+                     double rto_max, const char *io_backend)
+{
+  size_t i;
+
+  nr_colls = nr_ports;
+  coll_vec = calloc(nr_colls, sizeof(coll_vec[0]));
+  if (coll_vec == NULL)
+    OOM();
+
+  for (i = 0; i < nr_colls; i++) {
+    struct collector *co = &coll_vec[i];
+
+    co->co_port = port_vec[i];
+    snprintf(co->co_name, sizeof(co->co_name), "%s:%d",
+             co->co_port.hp_hca, co->co_port.hp_port);
+
+    /* The MAD rate is for all ports together. */
+    sched_init(&co->co_sched, window, window_max, mad_rate / nr_colls,
+               target_max);
+    sched_rto_init(&co->co_sched, rto_init, rto_min, rto_max);
+
+    if (wheel_init(&co->co_wheel, 2048, 0.001, dnow()) < 0)
+      OOM();
+
+    co->co_fd = -1;
+    if (mad_replay == NULL && umad_io_needs_port(io_backend)) {
+      co->co_fd = umad_open_port(co->co_port.hp_hca, co->co_port.hp_port);
+      if (co->co_fd < 0)
+        FATAL("cannot open umad port `%s': %m\n", co->co_name);
+
+      co->co_agent_id = umad_register(co->co_fd, IB_PERFORMANCE_CLASS,
+                                      1, 0, 0);
+      if (co->co_agent_id < 0)
+        FATAL("cannot register umad agent on `%s': %m\n", co->co_name);
+    }
+
+    if (mad_replay != NULL) {
+      if (umad_replay_io_open(&co->co_io, mad_replay, i) < 0)
+        FATAL("cannot replay `%s': %m\n", co->co_name);
+    } else if (umad_io_open(&co->co_io, io_backend, co->co_fd,
+                            RECV_BATCH, RECV_BUF_SIZE) < 0) {
+      FATAL("cannot open umad I/O backend `%s': %m\n", io_backend);
+    }
+
+    errno = posix_memalign((void **) &co->co_recv_ring, UMAD_ALIGN,
+                           RECV_BATCH * RECV_BUF_SIZE);
+    if (errno != 0)
+      OOM();
+
+    if (hca_cpu_set(co->co_port.hp_hca, &co->co_cpus) == 0)
+      co->co_have_cpus = 1;
+  }
+
+  umad_timeout_ms = 2000 * coll_vec[0].co_sched.s_rto_max;
+}
+
+/* Threads are only worth it with more than one port. */
+void collectors_start(void)
+{
+  size_t i;
+
+  if (nr_colls < 2)
+    return;
+
+  if (pthread_barrier_init(&pass_begin_barrier, NULL, nr_colls + 1) != 0 ||
+      pthread_barrier_init(&pass_end_barrier, NULL, nr_colls + 1) != 0)
+    FATAL("cannot initialize barriers: %m\n");
+
+  for (i = 0; i < nr_colls; i++) {
+    struct collector *co = &coll_vec[i];
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    if (co->co_have_cpus)
+      pthread_attr_setaffinity_np(&attr, sizeof(co->co_cpus), &co->co_cpus);
+
+    errno = pthread_create(&co->co_thread, &attr, &collector_thread, co);
+    if (errno != 0)
+      FATAL("cannot create collector thread for `%s': %m\n", co->co_name);
+
+    pthread_attr_destroy(&attr);
+  }
+}
+
+void collectors_fini(void)
+{
+  size_t i;
+
+  if (nr_colls >= 2) {
+    pass_exit = 1;
+    pthread_barrier_wait(&pass_begin_barrier);
+    for (i = 0; i < nr_colls; i++)
+      pthread_join(coll_vec[i].co_thread, NULL);
+  }
+
+  for (i = 0; i < nr_colls; i++) {
+    struct collector *co = &coll_vec[i];
+
+    umad_io_close(&co->co_io);
+    if (co->co_fd >= 0)
+      umad_close_port(co->co_fd);
+  }
+}
+
+void recording_close(const char *record_path)
+{
+  if (mad_rec != NULL && umad_rec_close(mad_rec) < 0)
+    ERROR("cannot write recording `%s': %m\n", record_path);
+  mad_rec = NULL;
+
+  if (mad_replay != NULL)
+    umad_replay_close(mad_replay);
+  mad_replay = NULL;
+}
+
+/* Pass queues.  The first half of pass_queue_vec holds the hosts
+   queued by pass_queue(), the second half the per collector queues
+   split out by pass_run(). */
+struct host_ent **pass_queue_vec = NULL;
+size_t pass_queue_len = 0;
+
+/* Queue the hosts named in args (or the hosts of the jobs named in
+   args, or all hosts) into pass_queue_vec.  Returns the number
+   queued. */
+size_t pass_queue(int have_host_args, int have_job_args,
+                  char **args, size_t nr_args, int first)
+{
+  struct host_ent **queue;
+  size_t nr_queued = 0;
+  size_t i;
+
+  if (pass_queue_len < nr_hosts) {
+    free(pass_queue_vec);
+    pass_queue_len = nr_hosts;
+    pass_queue_vec = malloc(2 * pass_queue_len * sizeof(pass_queue_vec[0]));
+    if (pass_queue_vec == NULL)
+      OOM();
+  }
+
+  queue = pass_queue_vec;
+
+  if (have_host_args) {
+    for (i = 0; i < nr_args; i++) {
+      struct host_ent *h = host_lookup(args[i], 0);
+      if (h == NULL) {
+        if (first)
+          ERROR("unknown host `%s'\n", args[i]);
+        continue;
+      }
+      if (nr_queued < pass_queue_len)
+        queue[nr_queued++] = h;
+    }
+  } else if (have_job_args) {
+    for (i = 0; i < nr_args; i++) {
+      struct job_ent *j = job_lookup(args[i], NULL, 0);
+      if (j == NULL) {
+        if (first)
+          ERROR("unknown job `%s'\n", args[i]);
+        continue;
+      }
+
+      struct host_ent *h;
+      list_for_each_entry(h, &j->j_host_list, h_job_link) {
+        if (nr_queued < pass_queue_len)
+          queue[nr_queued++] = h;
+      }
+    }
+  } else {
+    for (i = 0; i < nr_hosts; i++)
+      queue[nr_queued++] = host_vec[i];
+  }
+
+  return nr_queued;
+}
+
+/* Sample the nr_queued hosts of queue (which must not be in the second
+   half of pass_queue_vec), returning when all responses are in or at
+   deadline. */
+void pass_run(struct host_ent **queue, size_t nr_queued, double deadline)
+{
+  size_t i;
+
+  /* Shuffle so that targets (and the ports behind each target) are
+     visited in a different order on every pass. */
+  for (i = nr_queued; i > 1; i--) {
+    size_t k = random() % i;
+    struct host_ent *h = queue[k];
+    queue[k] = queue[i - 1];
+    queue[i - 1] = h;
+  }
+
+  mad_gen = (mad_gen + 1) & TRID_GEN_MASK;
+
+  /* Split into per collector queues, keeping the shuffled order
+     within each. */
+  struct host_ent **co_queue = pass_queue_vec + pass_queue_len;
+
+  for (i = 0; i < nr_colls; i++) {
+    struct collector *co = &coll_vec[i];
+    size_t k;
+
+    co->co_queue = co_queue;
+    co->co_nr_queued = 0;
+    for (k = 0; k < nr_queued; k++)
+      if (queue[k]->h_coll == co)
+        co->co_queue[co->co_nr_queued++] = queue[k];
+
+    co_queue += co->co_nr_queued;
+  }
+
+  if (nr_colls < 2) {
+    collector_pass(&coll_vec[0], deadline);
+  } else {
+    pass_deadline = deadline;
+    pthread_barrier_wait(&pass_begin_barrier);
+    pthread_barrier_wait(&pass_end_barrier);
+  }
+
+  double t_first = 0, t_last = 0;
+
+  for (i = 0; i < nr_colls; i++) {
+    struct pass_stats *ps = &coll_vec[i].co_stats;
+
+    if (ps->ps_first == 0)
+      continue;
+    if (t_first == 0 || ps->ps_first < t_first)
+      t_first = ps->ps_first;
+    if (ps->ps_last > t_last)
+      t_last = ps->ps_last;
+  }
+
+  pass_skew = t_last - t_first;
+}
+
+/* Take one sample of every host we are interested in, returning when
+   all responses are in or at deadline, whichever comes first. */
+void print_pass_stats(double start);
+
+void sample_pass(int have_host_args, int have_job_args,
+                 char **args, size_t nr_args, int first, double deadline)
+{
+  double start = dnow();
+  size_t i, nr_queued;
+
+  for (i = 0; i < nr_hosts; i++)
+    host_vec[i]->h_valid >>= 1;
+
+  nr_queued = pass_queue(have_host_args, have_job_args, args, nr_args, first);
+  pass_run(pass_queue_vec, nr_queued, deadline);
+
+  TRACE("pass took %f seconds\n", dnow() - start);
+
+  if (want_stats)
+    print_pass_stats(start);
+}
+
+/* Per collector statistics of the last pass(es), started at start. */
+void print_pass_stats(double start)
+{
+  size_t i;
+
+  for (i = 0; i < nr_colls; i++) {
+    struct collector *co = &coll_vec[i];
+    struct pass_stats *ps = &co->co_stats;
+
+    fprintf(stderr, "%s: %s: sent %zu for %zu hosts, received %zu, lost %zu, "
+            "retried %zu, failed %zu, late %zu, dup %zu, stale %zu, "
+            "window %.1f/%.1f/%.1f, syscalls %zu, skew %.3f, time %.3f\n",
+            program_invocation_short_name, co->co_name,
+            ps->ps_nr_sent, ps->ps_nr_queued, ps->ps_nr_responses,
+            co->co_sched.s_nr_lost, ps->ps_nr_retries, ps->ps_nr_failed,
+            ps->ps_nr_late, ps->ps_nr_dup, ps->ps_nr_stale,
+            co->co_sched.s_window_lo, sched_window_mean(&co->co_sched),
+            co->co_sched.s_window_hi, ps->ps_nr_syscalls,
+            ps->ps_last - ps->ps_first, dnow() - start);
+  }
+}
+
+static int host_lid_cmp(const void *p1, const void *p2)
+{
+  const struct host_ent *h1 = *(struct host_ent **) p1;
+  const struct host_ent *h2 = *(struct host_ent **) p2;
+
+  if (h1->h_info.ni_lid != h2->h_info.ni_lid)
+    return h1->h_info.ni_lid < h2->h_info.ni_lid ? -1 : 1;
+
+  return h1->h_info.ni_port < h2->h_info.ni_port ? -1 :
+    h1->h_info.ni_port > h2->h_info.ni_port;
+}
+
+/* Group the switch ports by LID for port sampling.  A sampled port's
+   latest window is reported until about when its turn comes round
+   again. */
+void samples_init(double interval)
+{
+  struct host_ent **v;
+  char *buf;
+  size_t i, nr = 0, max_nr = 0;
+
+  v = malloc((nr_hosts + 1) * sizeof(v[0]));
+  if (v == NULL)
+    OOM();
+
+  for (i = 0; i < nr_hosts; i++)
+    if (!host_vec[i]->h_info.ni_is_hca)
+      v[nr++] = host_vec[i];
+
+  qsort(v, nr, sizeof(v[0]), &host_lid_cmp);
+
+  samples_group_vec = calloc(nr + 1, sizeof(samples_group_vec[0]));
+  samples_queue = malloc((nr + 1) * sizeof(samples_queue[0]));
+  if (samples_group_vec == NULL || samples_queue == NULL)
+    OOM();
+
+  for (i = 0; i < nr; i++) {
+    struct samples_group *sg;
+
+    if (i == 0 || v[i]->h_info.ni_lid != v[i - 1]->h_info.ni_lid) {
+      sg = &samples_group_vec[nr_samples_groups++];
+      sg->sg_hosts = v + i;
+      sg->sg_state = SG_UNKNOWN;
+    } else {
+      sg = &samples_group_vec[nr_samples_groups - 1];
+    }
+
+    sg->sg_nr_hosts++;
+    if (sg->sg_nr_hosts > max_nr)
+      max_nr = sg->sg_nr_hosts;
+
+    v[i]->h_sgroup = sg;
+  }
+
+  samples_max_age = (max_nr + 1) * interval;
+
+  errno = posix_memalign((void **) &buf, UMAD_ALIGN,
+                         (nr_samples_groups + 1) * umad_stride);
+  if (errno != 0)
+    OOM();
+
+  for (i = 0; i < nr_samples_groups; i++)
+    samples_group_vec[i].sg_send_buf = buf + i * umad_stride;
+}
+
+/* Like sample_pass(), but with switch ports measured by port
+   sampling, in three passes: collect the windows started last time,
+   start new ones, and query everything else with
+   PortCountersExtended. */
+void samples_pass(int have_host_args, int have_job_args,
+                  char **args, size_t nr_args, int first, double deadline)
+{
+  struct host_ent **queue = pass_queue_vec;
+  double start = dnow(), mono = mnow();
+  size_t i, k, nr, nr_pce = 0, nr_ps = 0;
+
+  for (i = 0; i < nr_hosts; i++)
+    host_vec[i]->h_valid >>= 1;
+
+  nr = pass_queue(have_host_args, have_job_args, args, nr_args, first);
+  queue = pass_queue_vec;
+
+  for (i = 0; i < nr; i++) {
+    struct host_ent *h = queue[i];
+
+    if (h->h_sgroup != NULL && h->h_sgroup->sg_state != SG_FAILED)
+      h->h_want = 1;
+    else
+      queue[nr_pce++] = h;
+  }
+
+  for (i = 0; i < nr_samples_groups; i++)
+    if (samples_group_vec[i].sg_state == SG_RUNNING)
+      samples_queue[nr_ps++] = samples_group_vec[i].sg_cur;
+
+  pass_attr = IB_GSI_PORT_SAMPLES_RESULT;
+  pass_run(samples_queue, nr_ps, deadline);
+
+  nr_ps = 0;
+  for (i = 0; i < nr_samples_groups; i++) {
+    struct samples_group *sg = &samples_group_vec[i];
+
+    /* Lost results. */
+    if (sg->sg_state == SG_RUNNING)
+      sg->sg_state = SG_READY;
+
+    if (sg->sg_state == SG_FAILED)
+      continue;
+
+    for (k = 0; k < sg->sg_nr_hosts; k++)
+      if (sg->sg_hosts[(sg->sg_next + k) % sg->sg_nr_hosts]->h_want)
+        break;
+
+    if (k == sg->sg_nr_hosts)
+      continue;
+
+    k = (sg->sg_next + k) % sg->sg_nr_hosts;
+    sg->sg_next = (k + 1) % sg->sg_nr_hosts;
+    sg->sg_tag = ++samples_tag;
+    samples_queue[nr_ps++] = sg->sg_hosts[k];
+  }
+
+  pass_attr = IB_GSI_PORT_SAMPLES_CONTROL;
+  pass_run(samples_queue, nr_ps, deadline);
+
+  pass_attr = IB_GSI_PORT_COUNTERS_EXT;
+  pass_run(queue, nr_pce, deadline);
+
+  for (i = 0; i < nr_samples_groups; i++) {
+    struct samples_group *sg = &samples_group_vec[i];
+
+    for (k = 0; k < sg->sg_nr_hosts; k++) {
+      struct host_ent *h = sg->sg_hosts[k];
+
+      if (h->h_want && sg->sg_state != SG_FAILED &&
+          h->h_sample_time > 0 && mono - h->h_sample_time < samples_max_age)
+        h->h_valid = 3;
+
+      h->h_want = 0;
+    }
+  }
+
+  TRACE("pass took %f seconds\n", dnow() - start);
+
+  if (want_stats)
+    print_pass_stats(start);
+}
+
+/* Burst mode samples a few hosts every period seconds (for duration
+   seconds) with the collectors busy polling, keeping every rate.
+   Sends still go through the schedulers, so --mad-rate and --per-lid
+   hold. */
+#define BURST_HOSTS_MAX 1024
+
+static int double_cmp(const void *p1, const void *p2)
+{
+  double d1 = *(const double *) p1, d2 = *(const double *) p2;
+
+  return d1 < d2 ? -1 : d1 > d2;
+}
+
+static int host_ptr_cmp(const void *p1, const void *p2)
+{
+  const struct host_ent *h1 = *(struct host_ent **) p1;
+  const struct host_ent *h2 = *(struct host_ent **) p2;
+
+  return h1->h_index < h2->h_index ? -1 : h1->h_index > h2->h_index;
+}
+
+/* Nearest rank percentile q of the n sorted values of v. */
+static double percentile(const double *v, size_t n, double q)
+{
+  return v[(size_t) (q * (n - 1) + 0.5)];
+}
+
+void burst_run(int have_host_args, int have_job_args, char **args,
+               size_t nr_args, double duration, double period,
+               int want_series)
+{
+  size_t nr_ticks = duration / period + 1.5; /* Including the baseline. */
+  struct host_ent **bv = NULL, **queue = NULL;
+  double *time_vec = NULL, *rate_vec = NULL, *sort_vec = NULL;
+  size_t i, k, nr, t;
+  size_t nr_lost = 0;
+  int c;
+
+  nr = pass_queue(have_host_args, have_job_args, args, nr_args, 1);
+
+  /* Hosts may be named more than once. */
+  qsort(pass_queue_vec, nr, sizeof(pass_queue_vec[0]), &host_ptr_cmp);
+  for (i = 0, k = 0; i < nr; i++)
+    if (k == 0 || pass_queue_vec[i] != pass_queue_vec[k - 1])
+      pass_queue_vec[k++] = pass_queue_vec[i];
+  nr = k;
+
+  if (nr == 0)
+    FATAL("no hosts to sample\n");
+
+  if (nr > BURST_HOSTS_MAX)
+    FATAL("cannot burst sample more than %d hosts\n", BURST_HOSTS_MAX);
+
+  bv = malloc(nr * sizeof(bv[0]));
+  queue = malloc(nr * sizeof(queue[0]));
+  time_vec = malloc(nr * nr_ticks * sizeof(time_vec[0]));
+  rate_vec = malloc(nr * nr_ticks * NR_CTRS * sizeof(rate_vec[0]));
+  sort_vec = malloc(nr_ticks * sizeof(sort_vec[0]));
+  if (bv == NULL || queue == NULL || time_vec == NULL || rate_vec == NULL ||
+      sort_vec == NULL)
+    OOM();
+
+  memcpy(bv, pass_queue_vec, nr * sizeof(bv[0]));
+
+  pass_busy_poll = 1;
+
+  double start = dnow(), mono_start = mnow();
+  double tick = start;
+
+  for (t = 0; t < nr_ticks; t++, tick += period) {
+    double now = dnow();
+
+    if (now < tick) {
+      struct timespec ts = {
+        .tv_sec = (time_t) (tick - now),
+        .tv_nsec = ((tick - now) - (time_t) (tick - now)) * 1e9,
+      };
+      while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+    }
+
+    for (i = 0; i < nr; i++)
+      bv[i]->h_valid >>= 1;
+
+    memcpy(queue, bv, nr * sizeof(queue[0]));
+    pass_run(queue, nr, tick + period);
+
+    for (i = 0; i < nr; i++) {
+      struct host_ent *h = bv[i];
+      double *r = rate_vec + (i * nr_ticks + t) * NR_CTRS;
+
+      time_vec[i * nr_ticks + t] = h->h_time - mono_start;
+
+      if (h->h_valid != 3 || h->h_elapsed <= 0) {
+        if (t > 0)
+          nr_lost++;
+        time_vec[i * nr_ticks + t] = -1;
+        continue;
+      }
+
+      for (c = 0; c < NR_CTRS; c++)
+        r[c] = h->h_ctrs[c] / h->h_elapsed;
+    }
+  }
+
+  pass_busy_poll = 0;
+
+  printf("%zu hosts, %zu samples each every %.3f ms over %.3f s, %zu lost\n",
+         nr, nr_ticks - 1, period * 1000, dnow() - start, nr_lost);
+
+  printf("%-12s %10s %10s %10s %10s %10s %10s %8s\n",
+         "HOST", "TX_PEAK", "TX_P50", "TX_P99",
+         "RX_PEAK", "RX_P50", "RX_P99", "SAMPLES");
+
+  for (i = 0; i < nr; i++) {
+    size_t n = 0;
+
+    printf("%-12s", bv[i]->h_name);
+
+    for (c = 0; c < 2; c++) {
+      int ctr = c == 0 ? C_TX_B : C_RX_B;
+
+      for (t = 0, n = 0; t < nr_ticks; t++)
+        if (time_vec[i * nr_ticks + t] >= 0)
+          sort_vec[n++] = rate_vec[(i * nr_ticks + t) * NR_CTRS + ctr];
+
+      if (n == 0) {
+        printf(" %10s %10s %10s", "-", "-", "-");
+        continue;
+      }
+
+      qsort(sort_vec, n, sizeof(sort_vec[0]), &double_cmp);
+      printf(" %10.3f %10.3f %10.3f",
+             sort_vec[n - 1] / 1048576,
+             percentile(sort_vec, n, 0.50) / 1048576,
+             percentile(sort_vec, n, 0.99) / 1048576);
+    }
+
+    printf(" %8zu\n", n);
+  }
+
+  if (want_series) {
+    printf("\n%-10s %-12s %10s %10s\n", "TIME", "HOST", "TX_MB/S", "RX_MB/S");
+
+    for (t = 0; t < nr_ticks; t++) {
+      for (i = 0; i < nr; i++) {
+        const double *r = rate_vec + (i * nr_ticks + t) * NR_CTRS;
+
+        if (time_vec[i * nr_ticks + t] < 0)
+          continue;
+
+        printf("%10.6f %-12s %10.3f %10.3f\n",
+               time_vec[i * nr_ticks + t], bv[i]->h_name,
+               r[C_TX_B] / 1048576, r[C_RX_B] / 1048576);
+      }
+    }
+  }
+
+  free(bv);
+  free(queue);
+  free(time_vec);
+  free(rate_vec);
+  free(sort_vec);
+}
+
+/* Take the previous sample of each host from the state file at path,
+   if it's no more than max_age seconds old.  Returns the number of
+   hosts with a baseline and sets *newest to the time of the newest. */
+size_t state_load(const char *path, double max_age, double *newest)
+{
+  struct state st;
+  double now = mnow();
+  size_t i, nr = 0;
+
+  *newest = 0;
+
+  if (state_open(&st, path) < 0) {
+    TRACE("cannot open state file `%s': %m\n", path);
+    return 0;
+  }
+
+  for (i = 0; i < nr_hosts; i++) {
+    struct host_ent *h = host_vec[i];
+    const struct state_ent *e;
+
+    if (h->h_info.ni_guid == 0)
+      continue;
+
+    e = state_lookup(&st, h->h_info.ni_guid, h->h_info.ni_port);
+    if (e == NULL || now - e->se_time > max_age || e->se_time > now)
+      continue;
+
+    memcpy(h->h_raw, e->se_raw, sizeof(h->h_raw));
+    h->h_time = e->se_time;
+
+    /* Pass 0 will shift this into the previous sample bit. */
+    h->h_valid = 2;
+
+    if (*newest < e->se_time)
+      *newest = e->se_time;
+    nr++;
+  }
+
+  state_close(&st);
+
+  TRACE("loaded baseline for %zu hosts from `%s'\n", nr, path);
+
+  return nr;
+}
+
+/* A pass over hosts with baselines needs no other pass before it can
+   be reported, unless some host answered without one. */
+int state_complete(void)
+{
+  size_t i;
+
+  for (i = 0; i < nr_hosts; i++)
+    if (host_vec[i]->h_valid == 2)
+      return 0;
+
+  return 1;
+}
+
+int state_save_hosts(const char *path, double max_age)
+{
+  struct state_ent *ents;
+  size_t i, nr = 0;
+  int rc;
+
+  ents = calloc(nr_hosts + 1, sizeof(ents[0]));
+  if (ents == NULL)
+    OOM();
+
+  for (i = 0; i < nr_hosts; i++) {
+    struct host_ent *h = host_vec[i];
+
+    if (!(h->h_valid & 2) || h->h_info.ni_guid == 0)
+      continue;
+
+    /* Port sampled hosts have no raw counters to save. */
+    if (h->h_sgroup != NULL && h->h_sgroup->sg_state != SG_FAILED)
+      continue;
+
+    ents[nr].se_guid = h->h_info.ni_guid;
+    ents[nr].se_port = h->h_info.ni_port;
+    ents[nr].se_time = h->h_time;
+    memcpy(ents[nr].se_raw, h->h_raw, sizeof(ents[nr].se_raw));
+    nr++;
+  }
+
+  rc = state_save(path, ents, nr, mnow(), max_age);
+  free(ents);
+
+  return rc;
+}
+
+/* Each reported interval is appended to the archive, if any. */
+struct archive mad_archive;
+struct archive_port *archive_ports = NULL;
+
+int archive_hosts_open(const char *path)
+{
+  size_t i;
+
+  archive_ports = calloc(nr_hosts + 1, sizeof(archive_ports[0]));
+  if (archive_ports == NULL)
+    OOM();
+
+  for (i = 0; i < nr_hosts; i++) {
+    archive_ports[i].ap_name = host_vec[i]->h_name;
+    archive_ports[i].ap_guid = host_vec[i]->h_info.ni_guid;
+    archive_ports[i].ap_port = host_vec[i]->h_info.ni_port;
+  }
+
+  return archive_open(&mad_archive, path, NR_CTRS, archive_ports, nr_hosts);
+}
+
+/* The archive's ports are the hosts when it was opened; hosts added
+   since aren't archived.  Readers divide by the time between records,
+   so each host's change is scaled to interval as in jobs_update(). */
+int archive_hosts_append(double interval)
+{
+  static uint64_t *ctrs = NULL;
+  static uint8_t *valid = NULL;
+  size_t i, nr = mad_archive.ar_nr_ports;
+
+  if (ctrs == NULL) {
+    ctrs = malloc((nr * NR_CTRS + 1) * sizeof(ctrs[0]));
+    valid = malloc(nr + 1);
+    if (ctrs == NULL || valid == NULL)
+      OOM();
+  }
+
+  for (i = 0; i < nr; i++) {
+    struct host_ent *h = host_vec[i];
+    uint64_t *c = ctrs + i * NR_CTRS;
+    int k;
+
+    valid[i] = h->h_valid == 3 && h->h_elapsed > 0;
+    for (k = 0; k < NR_CTRS; k++)
+      c[k] = valid[i] ? h->h_ctrs[k] * (interval / h->h_elapsed) : 0;
+  }
+
+  return archive_append(&mad_archive, dnow(), ctrs, valid);
+}
+
+int target_rtt_cmp(const void *p1, const void *p2)
+{
+  const struct sched_target *t1 = *(struct sched_target **) p1;
+  const struct sched_target *t2 = *(struct sched_target **) p2;
+
+  if (t1->t_srtt > t2->t_srtt)
+    return -1;
+  else if (t1->t_srtt < t2->t_srtt)
+    return 1;
+
+  return (int) t1->t_lid - (int) t2->t_lid;
+}
+
+/* Slowest targets first. */
+void print_rtt_table(void)
+{
+  struct sched_target *t, **v;
+  size_t i, n = 0;
+
+  for (i = 0; i < nr_colls; i++)
+    list_for_each_entry(t, &coll_vec[i].co_sched.s_targets, t_link)
+      n++;
+
+  v = malloc((n + 1) * sizeof(v[0]));
+  if (v == NULL)
+    OOM();
+
+  n = 0;
+  for (i = 0; i < nr_colls; i++)
+    list_for_each_entry(t, &coll_vec[i].co_sched.s_targets, t_link)
+      if (t->t_nr_samples != 0 || t->t_nr_timeouts != 0)
+        v[n++] = t;
+
+  qsort(v, n, sizeof(v[0]), &target_rtt_cmp);
+
+  printf("\n%-8s %10s %10s %10s %8s %8s\n",
+         "LID", "SRTT_MS", "RTTVAR_MS", "RTO_MS", "SAMPLES", "TIMEOUTS");
+
+  for (i = 0; i < n; i++)
+    printf("%-8u %10.3f %10.3f %10.3f %8zu %8zu\n",
+           v[i]->t_lid, v[i]->t_srtt * 1000, v[i]->t_rttvar * 1000,
+           v[i]->t_rto * 1000, v[i]->t_nr_samples, v[i]->t_nr_timeouts);
+
+  free(v);
+  fflush(stdout);
+}
+
+/* Parse a comma separated list of spans (seconds, or with an s, m, or
+   h suffix) into rate columns, EMA columns if ema. */
+int rate_cols_parse(const char *str, int ema)
+{
+  char *list = strdup(str), *rest = list, *tok;
+  int rc = -1;
+
+  if (list == NULL)
+    OOM();
+
+  while ((tok = strsep_ne(&rest, ",")) != NULL) {
+    struct rate_col *col = &rate_cols[nr_rate_cols];
+    char *end;
+    double span = strtod(tok, &end);
+
+    if (*end == 'm')
+      span *= 60;
+    else if (*end == 'h')
+      span *= 3600;
+    else if (*end != 's' && *end != 0)
+      goto out;
+
+    if (span <= 0 || (*end != 0 && end[1] != 0))
+      goto out;
+
+    if (!(nr_rate_cols < NR_RATE_COLS_MAX) ||
+        (ema && !(nr_ema_cols < HIST_NR_EMA)))
+      goto out;
+
+    snprintf(col->rc_label, sizeof(col->rc_label), "%s%s",
+             ema ? "E" : "", tok);
+    col->rc_span = span;
+
+    if (ema)
+      col->rc_ema = ++nr_ema_cols;
+
+    nr_rate_cols++;
+  }
+
+  rc = 0;
+ out:
+  free(list);
+
+  return rc;
+}
+
+int host_col_rate(struct host_ent *h, struct rate_col *col, double *rate)
+{
+  if (!(h->h_index < hist_vec_len))
+    return -1;
+
+  if (col->rc_ema)
+    return hist_ema(&hist_vec[h->h_index], col->rc_ema - 1, rate);
+
+  return hist_rate(&hist_vec[h->h_index], col->rc_span, rate);
+}
+
+void jobs_update_cols(void)
+{
+  size_t i, c;
+  int k;
+
+  for (i = 0; i < nr_jobs; i++)
+    memset(job_vec[i]->j_cols, 0, sizeof(job_vec[i]->j_cols));
+
+  for (i = 0; i < nr_hosts; i++) {
+    struct host_ent *h = host_vec[i];
+    struct job_ent *j = h->h_job;
+    double rate[HIST_NR_CTRS];
+
+    if (h->h_valid != 3)
+      continue;
+
+    if (j == NULL)
+      j = job_lookup(h->h_name, NULL, 0);
+
+    if (j == NULL)
+      continue;
+
+    for (c = 0; c < nr_rate_cols; c++)
+      if (host_col_rate(h, &rate_cols[c], rate) == 0)
+        for (k = 0; k < HIST_NR_CTRS; k++)
+          j->j_cols[c][k] += rate[k];
+  }
+}
+
+void print_cols_header(void)
+{
+  char label[32];
+  size_t c;
+
+  for (c = 0; c < nr_rate_cols; c++) {
+    snprintf(label, sizeof(label), "TX_%s", rate_cols[c].rc_label);
+    printf(" %10s", label);
+    snprintf(label, sizeof(label), "RX_%s", rate_cols[c].rc_label);
+    printf(" %10s", label);
+  }
+}
+
+void print_cols(double (*cols)[HIST_NR_CTRS])
+{
+  size_t c;
+
+  for (c = 0; c < nr_rate_cols; c++)
+    printf(" %10.3f %10.3f", cols[c][0] / 1048576, cols[c][1] / 1048576);
+}
+
+void print_host_cols(struct host_ent *h)
+{
+  double rate[HIST_NR_CTRS];
+  size_t c;
+
+  for (c = 0; c < nr_rate_cols; c++) {
+    if (host_col_rate(h, &rate_cols[c], rate) == 0)
+      printf(" %10.3f %10.3f", rate[0] / 1048576, rate[1] / 1048576);
+    else
+      printf(" %10s %10s", "-", "-");
+  }
+}
+
+/* Sum the hosts' changes over the last interval into their jobs and
+   sort the jobs busiest first. */
+void jobs_update(double interval)
+{
+  size_t i;
+
+  for (i = 0; i < nr_jobs; i++) {
+    struct job_ent *j = job_vec[i];
+    memset(j->j_ctrs, 0, sizeof(j->j_ctrs));
+    j->j_nr_valid = 0;
+  }
+
+  for (i = 0; i < nr_hosts; i++) {
+    struct host_ent *h = host_vec[i];
+    struct job_ent *j = h->h_job;
+
+    if (h->h_valid != 3 || h->h_elapsed <= 0) {
+      TRACE("skipping host `%s', valid %u\n",
+            h->h_name, (unsigned int) h->h_valid);
+      continue;
+    }
+
+    if (j == NULL) {
+      j = job_lookup(h->h_name, NULL, 1);
+      j->j_fake = 1;
+    }
+
+    j->j_nr_valid++;
+
+    /* Each host's change is over its own elapsed time, which only
+       approximates interval (and may be much longer after a baseline
+       from the state file), so scale it to interval. */
+    double scale = interval / h->h_elapsed;
+
+    int k;
+    for (k = 0; k < NR_CTRS; k++)
+      j->j_ctrs[k] += h->h_ctrs[k] * scale;
+  }
+
+  qsort(job_vec, nr_jobs, sizeof(job_vec[0]), &job_cmp);
+
+  if (nr_rate_cols > 0)
+    jobs_update_cols();
+}
+
+/* Host rates are over each host's own elapsed time (scaled to
+   interval by jobs_update()); skew is how far apart in time the
+   closing samples were taken. */
+void print_report(double interval, double skew, int want_expand)
+{
+  size_t i;
+
+  jobs_update(interval);
+
+  printf("interval %.3f s, sweep skew %.3f s\n", interval, skew);
+
+  /* Omit packet counters for now. */
+  printf("%-12s %14s %14s %8s %-12s",
+         "JOBID", "TX_MB/S", "RX_MB/S", "NR_HOSTS", "OWNER");
+  print_cols_header();
+  printf("\n");
+
+  for (i = 0; i < nr_jobs; i++) {
+    struct job_ent *j = job_vec[i];
+
+    if (j->j_nr_valid == 0)
+      continue;
+
+    double rx_mbps = j->j_ctrs[C_RX_B] / interval / 1048576;
+    /* double rx_ps = j->j_ctrs[C_RX_P] / interval; */
+    double tx_mbps = j->j_ctrs[C_TX_B] / interval / 1048576;
+    /* double tx_ps = j->j_ctrs[C_TX_P] / interval; */
+
+    if (j->j_fake) {
+      printf("%-12s %14.3f %14.3f", j->j_name, tx_mbps, rx_mbps);
+      if (nr_rate_cols > 0) {
+        printf(" %8s %-12s", "", "");
+        print_cols(j->j_cols);
+      }
+      printf("\n");
+      continue;
+    }
+
+    printf("%-12s %14.3f %14.3f %8zu %-12s",
+           j->j_name, tx_mbps, rx_mbps, j->j_nr_hosts,
+           j->j_owner != NULL ? j->j_owner : "-");
+    print_cols(j->j_cols);
+    printf("\n");
+
+    if (want_expand) {
+      struct host_ent *h, **v;
+      size_t i;
+
+      v = malloc(j->j_nr_hosts * sizeof(v[0]));
+      if (v == NULL)
+        OOM();
+
+      i = 0;
+      list_for_each_entry(h, &j->j_host_list, h_job_link)
+        v[i++] = h;
+
+      /* XXX We're sorting hosts using job_cmp(). */
+      qsort(v, j->j_nr_hosts, sizeof(v[0]), &job_cmp);
+
+      for (i = 0; i < j->j_nr_hosts; i++) {
+        if (v[i]->h_valid != 3 || v[i]->h_elapsed <= 0)
+          continue;
+
+        printf("  %-10s %14.3f %14.3f",
+               v[i]->h_name,
+               v[i]->h_ctrs[C_TX_B] / v[i]->h_elapsed / 1048576,
+               v[i]->h_ctrs[C_RX_B] / v[i]->h_elapsed / 1048576);
+        if (nr_rate_cols > 0) {
+          printf(" %8s %-12s", "", "");
+          print_host_cols(v[i]);
+        }
+        printf("\n");
+      }
+
+      free(v);
+    }
+  }
+
+  fflush(stdout);
+}
+
+/* Add the last interval (ending at now) to the totals of each job in
+   the job map.  A host's change is charged to the job it's in at the
+   end of the interval, scaled to interval by jobs_update(). */
+void jobs_account(double interval, double now)
+{
+  size_t i;
+  int k;
+
+  for (i = 0; i < nr_jobs; i++) {
+    struct job_ent *j = job_vec[i];
+    struct job_acct *ja = &j->j_acct;
+
+    if (j->j_fake || !j->j_in_map || j->j_nr_valid == 0)
+      continue;
+
+    for (k = 0; k < NR_CTRS; k++) {
+      ja->ja_ctrs[k] += j->j_ctrs[k];
+      if (ja->ja_peak[k] < j->j_ctrs[k] / interval)
+        ja->ja_peak[k] = j->j_ctrs[k] / interval;
+    }
+
+    if (ja->ja_begin == 0)
+      ja->ja_begin = now - interval;
+    ja->ja_end = now;
+    ja->ja_active += interval;
+
+    if (ja->ja_max_hosts < j->j_nr_valid)
+      ja->ja_max_hosts = j->j_nr_valid;
+  }
+}
+
+void job_acct_write(FILE *file, struct job_ent *j)
+{
+  struct job_acct *ja = &j->j_acct;
+
+  fprintf(file, "job=%s owner=%s begin=%.0f end=%.0f active=%.0f "
+          "max_hosts=%zu tx_bytes=%"PRIu64" rx_bytes=%"PRIu64" "
+          "tx_pkts=%"PRIu64" rx_pkts=%"PRIu64" "
+          "mean_tx_mbps=%.3f mean_rx_mbps=%.3f "
+          "peak_tx_mbps=%.3f peak_rx_mbps=%.3f\n",
+          j->j_name, j->j_owner != NULL ? j->j_owner : "-",
+          ja->ja_begin, ja->ja_end, ja->ja_active, ja->ja_max_hosts,
+          ja->ja_ctrs[C_TX_B], ja->ja_ctrs[C_RX_B],
+          ja->ja_ctrs[C_TX_P], ja->ja_ctrs[C_RX_P],
+          ja->ja_ctrs[C_TX_B] / ja->ja_active / 1048576,
+          ja->ja_ctrs[C_RX_B] / ja->ja_active / 1048576,
+          ja->ja_peak[C_TX_B] / 1048576, ja->ja_peak[C_RX_B] / 1048576);
+  fflush(file);
+}
+
+void job_free(struct job_ent *j)
+{
+  dict_remv(&job_dict, j->j_name);
+  free(j->j_owner);
+  free(j);
+}
+
+/* After (re)reading the job map: jobs that have left it get their
+   summary written to acct_file (if any) and are freed, so that a job
+   ID coming back starts over. */
+void jobs_map_update(FILE *acct_file)
+{
+  size_t i = 0;
+
+  while (i < nr_jobs) {
+    struct job_ent *j = job_vec[i];
+
+    if (j->j_fake || j->j_nr_hosts > 0) {
+      j->j_in_map = !j->j_fake;
+      i++;
+      continue;
+    }
+
+    TRACE("job `%s' left the job map\n", j->j_name);
+
+    if (acct_file != NULL && j->j_in_map && j->j_acct.ja_active > 0)
+      job_acct_write(acct_file, j);
+
+    job_vec[i] = job_vec[--nr_jobs];
+    job_free(j);
+  }
+}
+
+/* On exit, write the summaries of the jobs still in the job map. */
+void jobs_acct_flush(FILE *acct_file)
+{
+  size_t i;
+
+  for (i = 0; i < nr_jobs; i++) {
+    struct job_ent *j = job_vec[i];
+
+    if (!j->j_fake && j->j_in_map && j->j_acct.ja_active > 0)
+      job_acct_write(acct_file, j);
+  }
+}
+
+/* In continuous mode SIGINT and SIGTERM end the main loop, so that
+   the job summaries are written and the snapshot removed. */
+volatile sig_atomic_t exit_signal = 0;
+
+void exit_handler(int sig)
+{
+  exit_signal = sig;
+}
+
+/* Publish the rates of the last interval (already summed by
+   jobs_update()) to the snapshot.  Hosts refer to their jobs by index
+   into the snapshot's jobs; fake jobs aren't published. */
+void snap_publish(struct snap *sn, double interval)
+{
+  struct snap_buf *sb = snap_begin(sn);
+  struct snap_host *hs = snap_buf_hosts(sb);
+  struct snap_job *js = snap_buf_jobs(sb, sn->sn_hdr->sp_max_hosts);
+  size_t i, nr_sb_jobs = 0;
+  int k;
+
+  for (i = 0; i < nr_jobs; i++) {
+    struct job_ent *j = job_vec[i];
+
+    j->j_snap_index = (uint32_t) -1;
+    if (j->j_nr_hosts == 0 || !(nr_sb_jobs < sn->sn_hdr->sp_max_jobs))
+      continue;
+
+    j->j_snap_index = nr_sb_jobs;
+    snprintf(js[nr_sb_jobs].js_name, sizeof(js->js_name), "%s", j->j_name);
+    snprintf(js[nr_sb_jobs].js_owner, sizeof(js->js_owner), "%s",
+             j->j_owner != NULL ? j->j_owner : "-");
+    nr_sb_jobs++;
+  }
+
+  for (i = 0; i < nr_hosts && i < sn->sn_hdr->sp_max_hosts; i++) {
+    struct host_ent *h = host_vec[i];
+
+    snprintf(hs[i].hs_name, sizeof(hs->hs_name), "%s", h->h_name);
+    hs[i].hs_job = h->h_job != NULL ? h->h_job->j_snap_index : (uint32_t) -1;
+    hs[i].hs_valid = h->h_valid == 3 && h->h_elapsed > 0;
+
+    for (k = 0; k < NR_CTRS; k++)
+      hs[i].hs_rate[k] = hs[i].hs_valid ? h->h_ctrs[k] / h->h_elapsed : 0;
+  }
+
+  sb->sb_nr_hosts = i;
+  sb->sb_nr_jobs = nr_sb_jobs;
+  sb->sb_time = dnow();
+  sb->sb_interval = interval;
+  sb->sb_skew = pass_skew;
+
+  snap_commit(sn, sb);
+}
+
+/* Rebuild hosts and jobs from a snapshot, keeping only the hosts
+   (or the hosts of the jobs) named in args, if any, valid.  Changes
+   are set up as if sampled over the daemon's interval.  Counts past
+   the snapshot's maxima are clamped to them. */
+void snap_load(struct snap_buf *sb, size_t max_hosts, size_t max_jobs,
+               int have_host_args, int have_job_args, char **args,
+               size_t nr_args)
+{
+  struct snap_host *hs = snap_buf_hosts(sb);
+  struct snap_job *js = snap_buf_jobs(sb, max_hosts);
+  size_t nr_sb_hosts = sb->sb_nr_hosts < max_hosts ? sb->sb_nr_hosts : max_hosts;
+  size_t nr_sb_jobs = sb->sb_nr_jobs < max_jobs ? sb->sb_nr_jobs : max_jobs;
+  double interval = sb->sb_interval;
+  size_t i, a;
+  int k;
+
+  job_map_reset();
+
+  for (i = 0; i < nr_hosts; i++)
+    host_vec[i]->h_valid = 0;
+
+  for (i = 0; i < nr_sb_hosts; i++) {
+    struct host_ent *h;
+    struct job_ent *j = NULL;
+
+    hs[i].hs_name[sizeof(hs->hs_name) - 1] = 0;
+    h = host_lookup(hs[i].hs_name, 1);
+
+    if (hs[i].hs_job < nr_sb_jobs) {
+      struct snap_job *sj = &js[hs[i].hs_job];
+      sj->js_name[sizeof(sj->js_name) - 1] = 0;
+      sj->js_owner[sizeof(sj->js_owner) - 1] = 0;
+
+      j = job_lookup(sj->js_name, sj->js_owner, 1);
+      list_add(&h->h_job_link, &j->j_host_list);
+      j->j_nr_hosts++;
+      h->h_job = j;
+    }
+
+    if (!hs[i].hs_valid)
+      continue;
+
+    if (have_host_args || have_job_args) {
+      for (a = 0; a < nr_args; a++)
+        if (have_host_args ? strcmp(args[a], h->h_name) == 0 :
+            j != NULL && strcmp(args[a], j->j_name) == 0)
+          break;
+
+      if (a == nr_args)
+        continue;
+    }
+
+    for (k = 0; k < NR_CTRS; k++)
+      h->h_ctrs[k] = hs[i].hs_rate[k] * interval;
+
+    h->h_elapsed = interval;
+    h->h_valid = 3;
+  }
+}
+
+/* Report from the snapshot published by a running ibtopd, if there
+   is a recent one.  Returns -1 without printing anything if not. */
+int snap_client(const char *snap_name, int have_host_args, int have_job_args,
+                char **args, size_t nr_args, int want_continuous,
+                double interval, int want_expand)
+{
+  struct snap sn;
+  struct snap_buf *sb = NULL;
+  unsigned long nr_reports = 0;
+  int rc = -1;
+
+  if (snap_open(&sn, snap_name) < 0) {
+    TRACE("cannot open snapshot `%s': %m\n", snap_name);
+    return -1;
+  }
+
+  while (1) {
+    if (!snap_alive(&sn) || snap_read(&sn, &sb) < 0 ||
+        dnow() - sb->sb_time > 2 * sb->sb_interval + 1) {
+      if (nr_reports == 0)
+        goto out;
+      FATAL("ibtopd has stopped publishing to `%s'\n", snap_name);
+    }
+
+    snap_load(sb, sn.sn_hdr->sp_max_hosts, sn.sn_hdr->sp_max_jobs,
+              have_host_args, have_job_args, args, nr_args);
+    jobs_map_update(NULL);
+
+    if (want_continuous && isatty(STDOUT_FILENO))
+      printf("\033[H\033[2J");
+    else if (nr_reports > 0)
+      printf("\n");
+
+    print_report(sb->sb_interval, sb->sb_skew, want_expand);
+    nr_reports++;
+
+    if (!want_continuous)
+      break;
+
+    struct timespec ts = {
+      .tv_sec = (time_t) interval,
+      .tv_nsec = (interval - (time_t) interval) * 1e9,
+    };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+      ;
+  }
+
+  rc = 0;
+ out:
+  free(sb);
+  snap_close(&sn);
+
+  return rc;
+}
 
-  if (mad_get_field(m, 0, IB_DRSMP_STATUS_F) == IB_MAD_STS_REDIRECT) {
-    /* FIXME */
-    ERROR("received redirect, trid "P_TRID"\n", trid);
-    return -1;
-  }
+#ifdef IBTOP_BENCH
+static void bench_job_map(void *arg)
+{
+  if (job_map_init(arg, NULL, -1) < 0)
+    FATAL("cannot read job map `%s'\n", (char *) arg);
+}
 
-  if (nr < um_size) {
-    TRACE("short receive, expected %zu, only read %zd\n", um_size, nr);
-    return -1;
-  }
+/* Forget every job, for timing the first read of the job map. */
+static void bench_jobs_reset(void *arg)
+{
+  size_t i;
 
-  size_t i = (uint32_t) (trid - TRID_BASE);
-  TRACE("i %zu\n", i);
+  job_map_reset();
 
-  if (!(0 <= i && i < nr_hosts)) {
-    ERROR("bad trid "P_TRID" in received umad\n", trid);
-    return -1;
+  for (i = 0; i < nr_jobs; i++) {
+    free(job_vec[i]->j_owner);
+    free(job_vec[i]);
   }
+  nr_jobs = 0;
 
-  struct host_ent *h = host_vec[i];
-  if (h == NULL) {
-    ERROR("no host for umad, trid "P_TRID"\n", trid);
-    return -1;
+  dict_destroy(&job_dict, NULL);
+  if (dict_init(&job_dict, NR_JOBS_HINT) < 0)
+    OOM();
+}
+
+/* Forget every host (and job), for timing reading the net info. */
+static void bench_hosts_reset(void *arg)
+{
+  size_t i;
+
+  bench_jobs_reset(arg);
+
+  for (i = 0; i < nr_hosts; i++)
+    free(host_vec[i]);
+  nr_hosts = 0;
+
+  dict_destroy(&host_dict, NULL);
+  if (dict_init(&host_dict, NR_HOSTS_HINT) < 0)
+    OOM();
+}
+
+static void bench_host_vec_init(void *arg)
+{
+  if (host_vec_init(NULL, arg, NULL) < 0)
+    FATAL("cannot read net info `%s'\n", (char *) arg);
+}
+
+static void bench_host_vec_init_db(void *arg)
+{
+  char **paths = arg;
+
+  if (host_vec_init(paths[0], paths[1], NULL) < 0)
+    FATAL("cannot read net DB `%s'\n", paths[0]);
+}
+
+static void bench_jobs_update(void *arg)
+{
+  jobs_update(1);
+}
+
+/* Sort from the same shuffled order every time. */
+static void bench_job_sort(void *arg)
+{
+  memcpy(job_vec, arg, nr_jobs * sizeof(job_vec[0]));
+  qsort(job_vec, nr_jobs, sizeof(job_vec[0]), &job_cmp);
+}
+
+/* ibtop-bench times the parsers, the MAD codec, and job aggregation
+   on a synthetic fabric of NODES hosts.  See bench.h for the output. */
+int main(int argc, char *argv[])
+{
+  struct fabric_conf fc = {
+    .fc_nr_hosts = 10000,
+    .fc_job_size = 64,
+    .fc_idle = 0.1,
+    .fc_seed = 1,
+  };
+  char dir[] = "/tmp/ibtop-bench.XXXXXX";
+  char *disc_path, *info_path, *db_path, *map_path;
+  struct hca_port port;
+  struct job_ent **shuffle;
+  size_t i, nodes;
+  int c;
+
+  while ((c = getopt(argc, argv, "hj:n:s:")) != -1) {
+    switch (c) {
+    case 'h':
+      printf("Usage: %s [OPTION]...\n"
+             "Time ibtop's parsers and aggregation on a synthetic fabric.\n"
+             "\n"
+             "  -n NODES                      hosts in the fabric (default 10000)\n"
+             "  -j NUMBER                     mean hosts per job (default 64)\n"
+             "  -s NUMBER                     fabric seed (default 1)\n",
+             program_invocation_short_name);
+      exit(EXIT_SUCCESS);
+    case 'j':
+      fc.fc_job_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      fc.fc_nr_hosts = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      fc.fc_seed = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      exit(EXIT_FAILURE);
+    }
   }
 
-  unsigned int is_hca = h->h_info.ni_is_hca;
+  nodes = fc.fc_nr_hosts;
+  if (nodes == 0 || fc.fc_job_size == 0)
+    FATAL("invalid fabric size\n");
 
-  TRACE("host `%s', lid %"PRIx16", port %"PRIx8", is_hca %u\n",
-        h->h_name, h->h_info.ni_lid, h->h_info.ni_port, is_hca);
+  if (mkdtemp(dir) == NULL)
+    FATAL("cannot create `%s': %m\n", dir);
 
-  void *pc = (char *) m + IB_PC_DATA_OFFS;
-  uint64_t c[NR_CTRS];
+  disc_path = strf("%s/net-disc", dir);
+  info_path = strf("%s/net-info", dir);
+  db_path = strf("%s/net-db", dir);
+  map_path = strf("%s/job-map", dir);
+  if (disc_path == NULL || info_path == NULL || db_path == NULL ||
+      map_path == NULL)
+    OOM();
 
-  mad_decode_field(pc, IB_PC_EXT_RCV_BYTES_F, &c[is_hca ? C_RX_B : C_TX_B]);
-  mad_decode_field(pc, IB_PC_EXT_RCV_PKTS_F,  &c[is_hca ? C_RX_P : C_TX_P]);
-  mad_decode_field(pc, IB_PC_EXT_XMT_BYTES_F, &c[is_hca ? C_TX_B : C_RX_B]);
-  mad_decode_field(pc, IB_PC_EXT_XMT_PKTS_F,  &c[is_hca ? C_TX_P : C_RX_P]);
+  if (fabric_write_dir(&fc, dir) < 0)
+    FATAL("cannot generate fabric in `%s'\n", dir);
 
-  TRACE("rx_b %"PRIx64", rx_p %"PRIx64", tx_b %"PRIx64", tx_p %"PRIx64"\n",
-        c[C_RX_B], c[C_RX_P], c[C_TX_B], c[C_TX_P]);
+  bench_dict(nodes);
+  bench_net_disc(disc_path, nodes);
+  bench_mad_codec(nodes);
+  bench_net_db(info_path, db_path, nodes);
 
-  if (c[C_RX_B] == 0 || c[C_RX_B] == (uint64_t) -1 ||
-      c[C_TX_B] == 0 || c[C_TX_B] == (uint64_t) -1) {
-    ERROR("perfquery for host `%s' returned bogus stats: "
-          "rx_b %"PRIx64", rx_p %"PRIx64", tx_b %"PRIx64", tx_p %"PRIx64"\n",
-          h->h_name, c[C_RX_B], c[C_RX_P], c[C_TX_B], c[C_TX_P]);
-    return -1;
+  /* Hosts need a collector to shard to. */
+  tables_init();
+  if (hca_port_parse(&port, "sim:1") < 0)
+    FATAL("cannot parse port\n");
+  collectors_init(&port, 1, 64, 1024, 0, 4, 0, 0, 0, "sim");
+
+  /* Each way of reading the net info starts from empty tables. */
+  bench_loop_reset("host_vec_init", nodes, nodes, &bench_hosts_reset,
+                   &bench_host_vec_init, info_path);
+
+  char *db_paths[] = { db_path, info_path };
+  bench_loop_reset("host_vec_init_db", nodes, nodes, &bench_hosts_reset,
+                   &bench_host_vec_init_db, db_paths);
+
+  bench_loop_reset("job_map_init", nodes, nr_hosts, &bench_jobs_reset,
+                   &bench_job_map, map_path);
+
+  /* As continuous mode rereads it, with every job already known. */
+  bench_loop("job_map_reread", nodes, nr_hosts, &bench_job_map, map_path);
+
+  for (i = 0; i < nr_hosts; i++) {
+    struct host_ent *h = host_vec[i];
+    int k;
+
+    for (k = 0; k < NR_CTRS; k++)
+      h->h_ctrs[k] = (random() % 1000000) << k;
+    h->h_elapsed = 1;
+    h->h_valid = 3;
   }
 
-  int k;
-  for (k = 0; k < NR_CTRS; k++)
-    h->h_ctrs[k] += which == 0 ? -c[k] : c[k];
+  bench_loop("jobs_update", nodes, nr_hosts, &bench_jobs_update, NULL);
+
+  shuffle = malloc(nr_jobs * sizeof(shuffle[0]));
+  if (shuffle == NULL)
+    OOM();
+
+  memcpy(shuffle, job_vec, nr_jobs * sizeof(shuffle[0]));
+  for (i = nr_jobs; i > 1; i--) {
+    size_t k = random() % i;
+    struct job_ent *j = shuffle[i - 1];
+
+    shuffle[i - 1] = shuffle[k];
+    shuffle[k] = j;
+  }
+
+  bench_loop("job_sort", nodes, nr_jobs, &bench_job_sort, shuffle);
+
+  collectors_fini();
+  free(shuffle);
 
-  h->h_valid |= 1u << which;
+  unlink(disc_path);
+  unlink(info_path);
+  unlink(db_path);
+  unlink(map_path);
+  rmdir(dir);
+
+  free(disc_path);
+  free(info_path);
+  free(db_path);
+  free(map_path);
 
   return 0;
 }
-
+#else
 int main(int argc, char *argv[])
 {
   int have_host_args = 0;
   int have_job_args = 0;
   int want_expand = 0;
+  int want_continuous = 0;
   char **args = NULL;
   size_t nr_args = 0;
 
   const char *net_info_path = IBTOP_NET_INFO_PATH;
+  const char *net_db_path = NULL;
+  int have_net_info_arg = 0;
   const char *net_info_cmd = IBTOP_NET_INFO_CMD;
   const char *job_map_path = IBTOP_JOB_MAP_PATH;
   const char *job_map_cmd = IBTOP_JOB_MAP_CMD;
   int job_map_max_age = IBTOP_JOB_MAP_MAX_AGE; /* Use -1 for never. */
   double interval = 1;
-  size_t i;
+  size_t window = 64;
+  size_t window_max = 1024;
+  double mad_rate = 0;
+  size_t target_max = 4;
+  double rto_init = 0, rto_min = 0, rto_max = 0; /* 0 for sched's. */
+  int want_rtt = 0;
+  const char *io_backend = "read";
+  struct hca_port *port_vec = NULL;
+  size_t nr_ports = 0;
+  const char *state_path = IBTOP_STATE_PATH;
+  double state_max_age = IBTOP_STATE_MAX_AGE;
+  const char *snap_name = IBTOP_SNAP_NAME;
+  const char *archive_path = NULL;
+  const char *acct_path = NULL;
+  FILE *acct_file = NULL;
+  double burst_duration = 0;
+  double burst_period = 0.005;
+  int want_burst_series = 0;
+  int use_daemon = 1;
+  const char *record_path = NULL;
+  const char *replay_path = NULL;
+  double replay_speed = 1;
+  uint64_t seed = time(NULL) ^ getpid();
+  struct snap snap;
+#ifdef IBTOPD
+  int want_daemon = 1;
+#else
+  int want_daemon = 0;
+#endif
+
+#ifdef IBTOP_SIM
+  /* ibtop-sim queries simulated PMAs and leaves the real state alone. */
+  io_backend = "sim";
+  state_path = NULL;
+  use_daemon = 0;
+#endif
 
   struct option opts[] = {
+    { "continuous",      0, NULL, 'c' },
+    { "delay",           1, NULL, 'd' },
     { "help",            0, NULL, 'h' },
     { "interval",        1, NULL, 'i' },
     { "job-list",        0, NULL, 'j' },
@@ -550,17 +3094,58 @@ int main(int argc, char *argv[])
     { "job-map-cmd",     1, NULL, 258 },
     { "net-info",        1, NULL, 259 },
     { "net-info-cmd",    1, NULL, 260 },
+    { "window",          1, NULL, 261 },
+    { "max-window",      1, NULL, 262 },
+    { "mad-rate",        1, NULL, 263 },
+    { "stats",           0, NULL, 264 },
+    { "per-lid",         1, NULL, 265 },
+    { "retries",         1, NULL, 266 },
+    { "rtt",             0, NULL, 267 },
+    { "io",              1, NULL, 268 },
+    { "hca",             1, NULL, 269 },
+    { "state",           1, NULL, 270 },
+    { "no-state",        0, NULL, 271 },
+    { "state-max-age",   1, NULL, 272 },
+    { "daemon",          0, NULL, 273 },
+    { "no-daemon",       0, NULL, 274 },
+    { "snapshot",        1, NULL, 275 },
+    { "archive",         1, NULL, 276 },
+    { "acct",            1, NULL, 277 },
+    { "avg",             1, NULL, 278 },
+    { "ema",             1, NULL, 279 },
+    { "burst",           1, NULL, 280 },
+    { "burst-period",    1, NULL, 281 },
+    { "burst-series",    0, NULL, 282 },
+    { "port-samples",    1, NULL, 283 },
+    { "record",          1, NULL, 284 },
+    { "replay",          1, NULL, 285 },
+    { "replay-speed",    1, NULL, 286 },
+    { "net-db",          1, NULL, 287 },
+    { "rto-init",        1, NULL, 288 },
+    { "rto-min",         1, NULL, 289 },
+    { "rto-max",         1, NULL, 290 },
     { NULL, 0, NULL, 0},
   };
 
   int c;
-  while ((c = getopt_long(argc, argv, "hi:jlm:nx", opts, 0)) != -1) {
+  while ((c = getopt_long(argc, argv, "cd:hi:jlm:nx", opts, 0)) != -1) {
     switch (c) {
+    case 'c':
+      want_continuous = 1;
+      break;
+    case 'd':
+      want_continuous = 1;
+      interval = strtod(optarg, NULL);
+      if (interval <= 0)
+        FATAL("invalid delay `%s'\n", optarg);
+      break;
     case 'h':
       printf("Usage: %s [OPTION]... [ARGS...]\n"
              "Report IB load by job or host.\n"
              "\n"
              "Mandatory arguments to long options are mandatory for short options too.\n"
+             "  -c, --continuous              keep sampling, reporting once per interval\n"
+             "  -d, --delay=NUMBER            same as `-c -i NUMBER'\n"
              "  -h, --help                    display this help and exit\n"
              "  -i, --interval=NUMBER         report load over NUMBER seconds\n"
              "  -j, --job-list                report load on jobs given as arguments\n"
@@ -571,7 +3156,47 @@ int main(int argc, char *argv[])
              "  --job-map=PATH                use job map at PATH\n"
              "  --job-map-cmd=COMMAND         use COMMAND to generate job map\n"
              "  --net-info=PATH               use net info at PATH\n"
-             "  --net-info-cmd=COMMAND        use COMMAND to regenerate net info\n",
+             "  --net-info-cmd=COMMAND        use COMMAND to regenerate net info\n"
+             "  --net-db=PATH                 use the compiled net info at PATH (the default\n"
+             "                                unless --net-info is given)\n"
+             "  --window=NUMBER               start with at most NUMBER MADs outstanding\n"
+             "  --max-window=NUMBER           never have more than NUMBER MADs outstanding\n"
+             "  --mad-rate=NUMBER             send at most NUMBER MADs per second\n"
+             "  --per-lid=NUMBER              have at most NUMBER MADs outstanding to any LID\n"
+             "  --retries=NUMBER              resend unanswered queries up to NUMBER times\n"
+             "  --rto-init=NUMBER             time out queries to a new LID after NUMBER seconds\n"
+             "                                (default 0.1)\n"
+             "  --rto-min=NUMBER              never time out queries sooner than NUMBER seconds\n"
+             "                                (default 0.005)\n"
+             "  --rto-max=NUMBER              never time out queries later than NUMBER seconds\n"
+             "                                (default 1)\n"
+             "  --rtt                         print round trip times by LID after each report\n"
+             "  --io=BACKEND                  do umad I/O with BACKEND (read, uring, or sim[:OPTS])\n"
+             "  --hca=NAME[:PORT]             query through PORT of HCA NAME (may be repeated,\n"
+             "                                default all active IB ports)\n"
+             "  --state=PATH                  keep counters between runs in PATH\n"
+             "  --no-state                    do not use a state file\n"
+             "  --state-max-age=NUMBER        ignore saved counters more than NUMBER seconds old\n"
+             "  --daemon                      sample continuously, publishing to the snapshot\n"
+             "  --no-daemon                   sample directly even if ibtopd is running\n"
+             "  --snapshot=NAME               use shared memory snapshot NAME\n"
+             "  --archive=PATH                append counters for each interval to PATH\n"
+             "  --acct=PATH                   append a summary of each job leaving the job map to PATH\n"
+             "  --avg=SPAN[,SPAN]...          also report rates over each SPAN (like 10s, 5m)\n"
+             "  --ema=SPAN[,SPAN]             also report moving averages with time constant SPAN\n"
+             "  --burst=NUMBER                sample the hosts given by -l or -j for NUMBER seconds\n"
+             "                                and report their peak, median, and 99th percentile rates\n"
+             "                                (still within --mad-rate and --per-lid)\n"
+             "  --burst-period=NUMBER         burst sample every NUMBER seconds (default 0.005)\n"
+             "  --burst-series                also print every burst sample\n"
+             "  --port-samples=NUMBER         measure switch ports with the switch's port sampling,\n"
+             "                                over windows of NUMBER seconds\n"
+             "  --record=PATH                 record every MAD sent and received to PATH\n"
+             "  --replay=PATH                 answer queries from the recording PATH instead of\n"
+             "                                the fabric\n"
+             "  --replay-speed=NUMBER         replay passes and responses NUMBER times faster\n"
+             "                                (default 1)\n"
+             "  --stats                       print per pass MAD statistics to stderr\n",
              program_invocation_short_name);
       exit(EXIT_SUCCESS);
     case 'i':
@@ -602,10 +3227,134 @@ int main(int argc, char *argv[])
       break;
     case 259:
       net_info_path = optarg;
+      have_net_info_arg = 1;
       break;
     case 260:
       net_info_cmd = optarg;
       break;
+    case 261:
+      window = strtoul(optarg, NULL, 0);
+      if (window == 0)
+        FATAL("invalid window `%s'\n", optarg);
+      break;
+    case 262:
+      window_max = strtoul(optarg, NULL, 0);
+      if (window_max == 0)
+        FATAL("invalid window `%s'\n", optarg);
+      break;
+    case 263:
+      mad_rate = strtod(optarg, NULL);
+      if (mad_rate < 0)
+        FATAL("invalid MAD rate `%s'\n", optarg);
+      break;
+    case 264:
+      want_stats = 1;
+      break;
+    case 265:
+      target_max = strtoul(optarg, NULL, 0);
+      if (target_max == 0)
+        FATAL("invalid per LID limit `%s'\n", optarg);
+      break;
+    case 266:
+      umad_retries = atoi(optarg);
+      if (umad_retries < 0 || umad_retries > TRID_SEQ_MASK)
+        FATAL("invalid number of retries `%s'\n", optarg);
+      break;
+    case 267:
+      want_rtt = 1;
+      break;
+    case 268:
+      io_backend = optarg;
+      break;
+    case 269:
+      port_vec = realloc(port_vec, (nr_ports + 1) * sizeof(port_vec[0]));
+      if (port_vec == NULL)
+        OOM();
+      if (hca_port_parse(&port_vec[nr_ports], optarg) < 0)
+        FATAL("invalid HCA port `%s'\n", optarg);
+      nr_ports++;
+      break;
+    case 270:
+      state_path = optarg;
+      break;
+    case 271:
+      state_path = NULL;
+      break;
+    case 272:
+      state_max_age = strtod(optarg, NULL);
+      if (state_max_age <= 0)
+        FATAL("invalid state max age `%s'\n", optarg);
+      break;
+    case 273:
+      want_daemon = 1;
+      break;
+    case 274:
+      use_daemon = 0;
+      break;
+    case 275:
+      snap_name = optarg;
+      break;
+    case 276:
+      archive_path = optarg;
+      break;
+    case 277:
+      acct_path = optarg;
+      break;
+    case 278:
+      if (rate_cols_parse(optarg, 0) < 0)
+        FATAL("invalid spans `%s'\n", optarg);
+      break;
+    case 279:
+      if (rate_cols_parse(optarg, 1) < 0)
+        FATAL("invalid spans `%s'\n", optarg);
+      break;
+    case 280:
+      burst_duration = strtod(optarg, NULL);
+      if (burst_duration <= 0)
+        FATAL("invalid burst duration `%s'\n", optarg);
+      break;
+    case 281:
+      burst_period = strtod(optarg, NULL);
+      if (burst_period <= 0)
+        FATAL("invalid burst period `%s'\n", optarg);
+      break;
+    case 282:
+      want_burst_series = 1;
+      break;
+    case 283:
+      samples_window = strtod(optarg, NULL);
+      if (samples_window <= 0)
+        FATAL("invalid port sample window `%s'\n", optarg);
+      break;
+    case 284:
+      record_path = optarg;
+      break;
+    case 285:
+      replay_path = optarg;
+      break;
+    case 286:
+      replay_speed = strtod(optarg, NULL);
+      if (replay_speed <= 0)
+        FATAL("invalid replay speed `%s'\n", optarg);
+      break;
+    case 287:
+      net_db_path = optarg;
+      break;
+    case 288:
+      rto_init = strtod(optarg, NULL);
+      if (rto_init <= 0)
+        FATAL("invalid timeout `%s'\n", optarg);
+      break;
+    case 289:
+      rto_min = strtod(optarg, NULL);
+      if (rto_min <= 0)
+        FATAL("invalid timeout `%s'\n", optarg);
+      break;
+    case 290:
+      rto_max = strtod(optarg, NULL);
+      if (rto_max <= 0)
+        FATAL("invalid timeout `%s'\n", optarg);
+      break;
     case '?':
       fprintf(stderr, "Try `%s --help' for more information.",
               program_invocation_short_name);
@@ -619,198 +3368,319 @@ int main(int argc, char *argv[])
   args = argv + optind;
   nr_args = argc - optind;
 
-  host_vec_len = NR_HOSTS_HINT > 0 ? NR_HOSTS_HINT : 4096;
-  host_vec = malloc(host_vec_len * sizeof(host_vec[0]));
-  if (host_vec == NULL)
-    OOM();
+  if (want_daemon) {
+    if (have_job_args || have_host_args || nr_args > 0)
+      FATAL("cannot restrict hosts when running as a daemon\n");
+    if (burst_duration > 0)
+      FATAL("cannot burst sample when running as a daemon\n");
+    want_continuous = 1;
+  }
 
-  if (dict_init(&host_dict, NR_HOSTS_HINT) < 0)
-    OOM();
+  /* Net info given by path is probably not what the DB was made from. */
+  if (net_db_path == NULL && !have_net_info_arg)
+    net_db_path = IBTOP_NET_DB_PATH;
 
-  job_vec_len = NR_JOBS_HINT > 0 ? NR_JOBS_HINT : 256;
-  job_vec = malloc(job_vec_len * sizeof(job_vec[0]));
-  if (job_vec == NULL)
-    OOM();
+  if (record_path != NULL && replay_path != NULL)
+    FATAL("cannot record and replay simultaneously\n");
 
-  if (dict_init(&job_dict, NR_JOBS_HINT) < 0)
-    OOM();
+  /* A replay needs the recording's seed so that passes go in the same
+     order, and must not touch the fabric or the state file. */
+  if (replay_path != NULL) {
+    mad_replay = umad_replay_open(replay_path, replay_speed);
+    if (mad_replay == NULL)
+      FATAL("cannot open recording `%s': %m\n", replay_path);
 
-  if (host_vec_init(net_info_path, net_info_cmd) < 0)
-    /* ... */;
+    seed = umad_replay_hdr(mad_replay)->rh_seed;
+    state_path = NULL;
+    use_daemon = 0;
+  }
 
-  if (nr_hosts == 0)
-    FATAL("no valid hosts\n");
+  if (burst_duration > 0 && !(have_job_args || have_host_args))
+    FATAL("must specify hosts or jobs to burst sample\n");
 
-  if (job_map_path != NULL)
-    job_map_init(job_map_path, job_map_cmd, job_map_max_age);
+  /* Windows are collected by the next pass. */
+  if (samples_window > interval / 2)
+    FATAL("port sample window must be at most half the interval\n");
+
+  tables_init();
+
+  /* A running ibtopd saves us (and the fabric) the trouble. */
+  if (!want_daemon && use_daemon && burst_duration == 0 &&
+      snap_client(snap_name, have_host_args, have_job_args, args, nr_args,
+                  want_continuous, interval, want_expand) == 0)
+    return 0;
+
+  srandom(seed);
 
 #ifdef IBTOP_UMAD_DEBUG
   umad_debug(9);
 #endif
 
-  if (umad_init() < 0)
-    FATAL("cannot init libibumad: %m\n");
+  /* A replay has one port per recorded collector. */
+  if (mad_replay != NULL) {
+    size_t nr = umad_replay_hdr(mad_replay)->rh_nr_colls;
 
-  umad_fd = umad_open_port(hca_name, hca_port);
-  if (umad_fd < 0)
-    FATAL("cannot open umad port: %m\n");
+    free(port_vec);
+    port_vec = calloc(nr, sizeof(port_vec[0]));
+    if (port_vec == NULL)
+      OOM();
+
+    for (nr_ports = 0; nr_ports < nr; nr_ports++) {
+      char name[32];
 
-  umad_agent_id = umad_register(umad_fd, IB_PERFORMANCE_CLASS, 1, 0, 0);
-  if (umad_agent_id < 0)
-    FATAL("cannot register umad agent: %m\n");
+      snprintf(name, sizeof(name), "replay:%zu", nr_ports + 1);
+      hca_port_parse(&port_vec[nr_ports], name);
+    }
+  } else if (!umad_io_needs_port(io_backend)) {
+    /* The simulator needs no HCA; give it one port unless told more. */
+    if (nr_ports == 0) {
+      port_vec = calloc(1, sizeof(port_vec[0]));
+      if (port_vec == NULL)
+        OOM();
+      hca_port_parse(&port_vec[nr_ports++], "sim:1");
+    }
+  } else {
+    if (umad_init() < 0)
+      FATAL("cannot init libibumad: %m\n");
 
-  double start[2];
-  double deadline[2];
-  deadline[0] = dnow() + interval;
-  deadline[1] = deadline[0] + 1;
+    if (nr_ports == 0 && hca_port_scan(&port_vec, &nr_ports) < 0)
+      FATAL("cannot scan `%s': %m\n", HCA_SYSFS_DIR);
+  }
 
-  int which;
-  for (which = 0; which < 2; which++) {
-    size_t nr_sent = 0, nr_responses = 0;
+  if (nr_ports == 0)
+    FATAL("no active IB ports\n");
 
-    start[which] = dnow();
+  /* Hosts are sharded across collectors as they're read. */
+  collectors_init(port_vec, nr_ports, window, window_max, mad_rate,
+                  target_max, rto_init, rto_min, rto_max, io_backend);
+  free(port_vec);
 
-    if (have_host_args) {
-      for (i = 0; i < nr_args; i++) {
-        struct host_ent *h = host_lookup(args[i], 0);
-        if (h == NULL) {
-          if (which == 0)
-            ERROR("unknown host `%s'\n", args[i]);
-          continue;
-        }
-        if (host_send_perf_umad(h) < 0)
-          continue;
-        nr_sent++;
-      }
-    } else if (have_job_args) {
-      for (i = 0; i < nr_args; i++) {
-        struct job_ent *j = job_lookup(args[i], NULL, 0);
-        if (j == NULL) {
-          if (which == 0)
-            ERROR("unknown job `%s'\n", args[i]);
-          continue;
-        }
+  /* A targeted query only loads what it asks about, if it can. */
+  if ((have_host_args || have_job_args) && net_db_path != NULL &&
+      hosts_lazy_init(net_db_path, net_info_path, have_host_args,
+                      args, nr_args) == 0)
+    TRACE("loading hosts lazily\n");
+  else if (host_vec_init(net_db_path, net_info_path, net_info_cmd) < 0)
+    /* ... */;
 
-        struct host_ent *h;
-        list_for_each_entry(h, &j->j_host_list, h_job_link) {
-          if (host_send_perf_umad(h) < 0)
-            continue;
-          nr_sent++;
-        }
-      }
-    } else {
-      for (i = 0; i < nr_hosts; i++) {
-        if (host_send_perf_umad(host_vec[i]) < 0)
-          continue;
-        nr_sent++;
-      }
-    }
+  if (acct_path != NULL) {
+    acct_file = fopen(acct_path, "a");
+    if (acct_file == NULL)
+      FATAL("cannot open `%s': %m\n", acct_path);
+  }
 
-    TRACE("sent %zu in %f seconds\n", nr_sent, dnow() - start[which]);
+  /* In continuous mode the job map is reread whenever it changes (or
+     needs regenerating), and job totals are kept across rereads. */
+  time_t job_map_mtime = 0;
+  double job_map_check = dnow();
 
-    while (1) {
-      double poll_timeout_ms = (deadline[which] - dnow()) * 1000;
-      if (poll_timeout_ms <= 0)
-        break;
+  if (job_map_path != NULL) {
+    struct stat stat_buf;
 
-      struct pollfd poll_fds = {
-        .fd = umad_fd,
-        .events = POLLIN,
-      };
+    job_map_init(job_map_path, job_map_cmd, job_map_max_age);
+    jobs_map_update(acct_file);
 
-      int np = poll(&poll_fds, 1, poll_timeout_ms);
-      if (np < 0)
-        FATAL("error polling for responses: %m\n");
+    if (stat(job_map_path, &stat_buf) == 0)
+      job_map_mtime = stat_buf.st_mtime;
+  }
 
-      if (np == 0) {
-        TRACE("timedout waiting for mad, nr_responses %zu\n", nr_responses);
-        break;
-      }
+  if (nr_hosts == 0 && !lazy_hosts)
+    FATAL("no valid hosts\n");
 
-      if (recv_response_umad(which) < 0)
-        continue;
+  if (mad_replay != NULL) {
+    const struct rec_hdr *rh = umad_replay_hdr(mad_replay);
 
-      nr_responses++;
+    if (rh->rh_nr_hosts != nr_hosts)
+      FATAL("recording `%s' has %"PRIu32" hosts, not %zu\n",
+            replay_path, rh->rh_nr_hosts, nr_hosts);
 
-      if (nr_responses == nr_sent) {
-        TRACE("received all responses in %f seconds\n", dnow() - start[which]);
-        if (which == 1)
-          break;
-      }
-    }
+    if (rh->rh_umad_size != umad_size())
+      FATAL("recording `%s' has umad size %"PRIu32", not %zu\n",
+            replay_path, rh->rh_umad_size, (size_t) umad_size());
   }
 
-  for (i = 0; i < nr_hosts; i++) {
-    struct host_ent *h = host_vec[i];
-    struct job_ent *j = h->h_job;
+  if (record_path != NULL) {
+    size_t i;
 
-    if (h->h_valid != 3) {
-      TRACE("skipping host `%s', valid %u\n",
-            h->h_name, (unsigned int) h->h_valid);
-      continue;
-    }
+    mad_rec = umad_rec_create(record_path, seed, nr_hosts, nr_colls,
+                              umad_size());
+    if (mad_rec == NULL)
+      FATAL("cannot create recording `%s': %m\n", record_path);
 
-    if (j == NULL)
-      j = job_lookup(h->h_name, NULL, 1);
+    for (i = 0; i < nr_colls; i++)
+      if (umad_rec_wrap(&coll_vec[i].co_io, mad_rec, i) < 0)
+        OOM();
+  }
 
-    j->j_nr_valid++;
+  if (nr_rate_cols > 0) {
+    size_t i;
 
-    int k;
-    for (k = 0; k < NR_CTRS; k++)
-      j->j_ctrs[k] += h->h_ctrs[k];
+    hist_conf_init(&hist_conf, mnow() - 1, interval);
+    for (i = 0; i < nr_rate_cols; i++)
+      if (rate_cols[i].rc_ema)
+        hist_conf.hc_tau[rate_cols[i].rc_ema - 1] = rate_cols[i].rc_span;
+    hist_conf.hc_nr_tau = nr_ema_cols;
+
+    hist_vec_len = host_vec_len;
+    hist_vec = calloc(hist_vec_len, sizeof(hist_vec[0]));
+    if (hist_vec == NULL)
+      OOM();
   }
 
-  qsort(job_vec, nr_jobs, sizeof(job_vec[0]), &job_cmp);
+  umad_vec_init();
 
-  /* Omit packet counters for now. */
-  printf("%-12s %14s %14s %8s %-12s\n",
-         "JOBID", "TX_MB/S", "RX_MB/S", "NR_HOSTS", "OWNER");
+  if (samples_window > 0)
+    samples_init(interval);
 
-  for (i = 0; i < nr_jobs; i++) {
-    struct job_ent *j = job_vec[i];
+  collectors_start();
 
-    if (j->j_nr_valid == 0)
-      continue;
+  if (burst_duration > 0) {
+    burst_run(have_host_args, have_job_args, args, nr_args,
+              burst_duration, burst_period, want_burst_series);
+    collectors_fini();
+    recording_close(record_path);
+    if (acct_file != NULL)
+      fclose(acct_file);
+    return 0;
+  }
 
-    double rx_mbps = j->j_ctrs[C_RX_B] / interval / 1048576;
-    /* double rx_ps = j->j_ctrs[C_RX_P] / interval; */
-    double tx_mbps = j->j_ctrs[C_TX_B] / interval / 1048576;
-    /* double tx_ps = j->j_ctrs[C_TX_P] / interval; */
+  if (want_daemon && snap_create(&snap, snap_name, nr_hosts, nr_hosts) < 0)
+    FATAL("cannot create snapshot `%s': %m\n", snap_name);
+
+  if (archive_path != NULL && archive_hosts_open(archive_path) < 0)
+    FATAL("cannot open archive `%s': %m\n", archive_path);
+
+  /* Each pass waits at most a second (or one interval, if shorter)
+     for responses.  Samples are taken once per interval, with the
+     report for each interval printed after its closing sample.  In
+     one-shot mode that means two passes, or just one if the state
+     file has a recent enough sample of every host (in which case we
+     wait until that sample is at least an interval old).  Replays
+     run passes replay_speed times as often; the rates still come from
+     the recorded times. */
+  double period = replay_path != NULL ? interval / replay_speed : interval;
+  double timeout = period < 1 ? period : 1;
+  double tick = dnow();
+  double newest, last_save = mnow();
+  unsigned long pass, nr_reports = 0;
+  int have_baseline = 0;
+
+  if (state_path != NULL &&
+      state_load(state_path, state_max_age, &newest) > 0) {
+    double young = newest + interval - mnow();
+    if (young > 0)
+      tick += young;
+    have_baseline = 1;
+  }
+
+  if (want_continuous) {
+    struct sigaction sa = {
+      .sa_handler = &exit_handler,
+    };
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+  }
+
+  for (pass = 0; ; pass++) {
+    double now = dnow();
+
+    if (now < tick) {
+      struct timespec ts = {
+        .tv_sec = (time_t) (tick - now),
+        .tv_nsec = ((tick - now) - (time_t) (tick - now)) * 1e9,
+      };
+      while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !exit_signal)
+        ;
+    }
 
-    if (j->j_nr_hosts == 0) { /* Fake job. */
-      printf("%-12s %14.3f %14.3f\n", j->j_name, tx_mbps, rx_mbps);
+    if (exit_signal)
+      break;
+
+    if (samples_window > 0)
+      samples_pass(have_host_args, have_job_args, args, nr_args,
+                   pass == 0, tick + timeout);
+    else
+      sample_pass(have_host_args, have_job_args, args, nr_args,
+                  pass == 0, tick + timeout);
+
+    tick += period;
+
+    if (pass == 0 && !(have_baseline && state_complete()))
       continue;
+
+    if (want_daemon) {
+      jobs_update(interval);
+      snap_publish(&snap, interval);
+    } else {
+      if (want_continuous && isatty(STDOUT_FILENO))
+        printf("\033[H\033[2J");
+      else if (nr_reports > 0)
+        printf("\n");
+
+      print_report(interval, pass_skew, want_expand);
+
+      if (want_rtt)
+        print_rtt_table();
     }
+    nr_reports++;
 
-    printf("%-12s %14.3f %14.3f %8zu %-12s\n",
-           j->j_name, tx_mbps, rx_mbps, j->j_nr_hosts,
-           j->j_owner != NULL ? j->j_owner : "-");
+    if (want_continuous)
+      jobs_account(interval, dnow());
 
-    if (want_expand) {
-      struct host_ent *h, **v;
-      size_t i;
+    if (want_continuous && job_map_path != NULL &&
+        dnow() - job_map_check >= IBTOP_JOB_MAP_CHECK_INTERVAL) {
+      struct stat stat_buf;
+      int st_rc = stat(job_map_path, &stat_buf);
 
-      v = malloc(j->j_nr_hosts * sizeof(v[0]));
+      job_map_check = dnow();
 
-      i = 0;
-      list_for_each_entry(h, &j->j_host_list, h_job_link)
-        v[i++] = h;
+      if (st_rc < 0 || stat_buf.st_mtime != job_map_mtime ||
+          (job_map_max_age >= 0 &&
+           job_map_check > stat_buf.st_mtime + job_map_max_age)) {
+        if (job_map_init(job_map_path, job_map_cmd, job_map_max_age) == 0)
+          jobs_map_update(acct_file);
 
-      /* XXX We're sorting hosts using job_cmp(). */
-      qsort(v, j->j_nr_hosts, sizeof(v[0]), &job_cmp);
+        if (stat(job_map_path, &stat_buf) == 0)
+          job_map_mtime = stat_buf.st_mtime;
+      }
+    }
 
-      for (i = 0; i < j->j_nr_hosts; i++)
-        printf("  %-10s %14.3f %14.3f\n",
-               v[i]->h_name,
-               v[i]->h_ctrs[C_TX_B] / interval / 1048576,
-               v[i]->h_ctrs[C_RX_B] / interval / 1048576);
+    if (archive_path != NULL && archive_hosts_append(interval) < 0) {
+      ERROR("cannot append to archive `%s': %m\n", archive_path);
+      archive_close(&mad_archive);
+      archive_path = NULL;
+    }
 
-      free(v);
+    if (state_path != NULL &&
+        (!want_continuous ||
+         mnow() - last_save >= IBTOP_STATE_SAVE_INTERVAL)) {
+      if (state_save_hosts(state_path, state_max_age) < 0) {
+        ERROR("cannot save state to `%s': %m\n", state_path);
+        state_path = NULL;
+      }
+      last_save = mnow();
     }
+
+    if (!want_continuous || exit_signal)
+      break;
   }
 
-  if (umad_fd >= 0)
-    umad_close_port(umad_fd);
+  collectors_fini();
+  recording_close(record_path);
+
+  if (want_daemon)
+    snap_close(&snap);
+
+  if (archive_path != NULL)
+    archive_close(&mad_archive);
+
+  if (acct_file != NULL) {
+    jobs_acct_flush(acct_file);
+    fclose(acct_file);
+  }
 
   return 0;
 }
+#endif
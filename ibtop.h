@@ -5,7 +5,13 @@
 #define IBTOP_NET_INFO_CMD BINDIR"/make-net-info"
 #define IBTOP_JOB_MAP_CMD BINDIR"/make-job-map"
 #define IBTOP_NET_INFO_PATH "/var/run/ibtop-net-info"
+#define IBTOP_NET_DB_PATH "/var/run/ibtop-net-db"
 #define IBTOP_JOB_MAP_PATH "/var/run/ibtop-job-map"
 #define IBTOP_JOB_MAP_MAX_AGE 180
+#define IBTOP_JOB_MAP_CHECK_INTERVAL 10
+#define IBTOP_STATE_PATH "/var/run/ibtop-state"
+#define IBTOP_STATE_MAX_AGE 60
+#define IBTOP_STATE_SAVE_INTERVAL 10
+#define IBTOP_SNAP_NAME "/ibtop-snap"
 
 #endif
@@ -12,8 +12,8 @@ Summary: Eine Koenigin Unter den IB Monitoren
 %define _bindir /opt/%{name}
 
 %description
-This package provides the ibtop command, along with the supporting
-executables make-job-map and make-net-info.
+This package provides the ibtop command and the ibtopd daemon, along
+with the supporting executables make-job-map and make-net-info.
 
 %prep
 %setup -q
@@ -25,6 +25,8 @@ make VERSION=%{version} BINDIR=%{_bindir}
 rm -rf %{buildroot}
 install -m 0755 -d %{buildroot}/%{_bindir}
 install -m 0755 %{name} %{buildroot}/%{_bindir}/%{name}
+install -m 0755 ibtopd %{buildroot}/%{_bindir}/ibtopd
+install -m 0755 ibtop-archive %{buildroot}/%{_bindir}/ibtop-archive
 install -m 0755 make-job-map %{buildroot}/%{_bindir}/make-job-map
 install -m 0755 make-net-info %{buildroot}/%{_bindir}/make-net-info
 
@@ -35,5 +37,7 @@ rm -rf %{buildroot}
 %defattr(-,root,root,-)
 %dir %{_bindir}/
 %attr(0755,root,root) %{_bindir}/%{name}
+%attr(0755,root,root) %{_bindir}/ibtopd
+%attr(0755,root,root) %{_bindir}/ibtop-archive
 %attr(0755,root,root) %{_bindir}/make-job-map
 %attr(0755,root,root) %{_bindir}/make-net-info
@@ -0,0 +1,256 @@
+#ifndef _MAD_CODEC_H_
+#define _MAD_CODEC_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+/* Fixed layout of the parts of a MAD we touch on hot paths, so that
+   encoding and decoding are plain big-endian loads and stores rather
+   than walks through libibmad's field table.  Offsets are in bytes
+   from the start of the MAD (the common MAD header) or, for the PCE_
+   ones, from the start of the PMA attribute data. */
+
+#define MAD_BASEVER_OFFS   0
+#define MAD_MGMTCLASS_OFFS 1
+#define MAD_CLASSVER_OFFS  2
+#define MAD_METHOD_OFFS    3
+#define MAD_STATUS_OFFS    4
+#define MAD_TRID_OFFS      8
+#define MAD_ATTRID_OFFS    16
+#define MAD_ATTRMOD_OFFS   20
+#define MAD_PMA_DATA_OFFS  64
+
+/* The status field less the D bit of directed route SMPs, as
+   extracted by libibmad's IB_DRSMP_STATUS_F. */
+#define MAD_STATUS_MASK 0x7fff
+
+/* Directed route SMPs: the hop pointer and count follow the status,
+   and the SMP data and the initial path (a port per hop, from byte
+   1) are at fixed offsets. */
+#define SMP_HOP_PTR_OFFS   6
+#define SMP_HOP_CNT_OFFS   7
+#define SMP_DR_SLID_OFFS   32
+#define SMP_DR_DLID_OFFS   34
+#define SMP_DATA_OFFS      64
+#define SMP_INIT_PATH_OFFS 128
+#define SMP_DATA_SIZE      64
+#define SMP_MAX_HOPS       63
+
+#define SMP_STATUS_D_BIT 0x8000
+
+/* NodeInfo. */
+#define NI_NODE_TYPE_OFFS  2
+#define NI_NR_PORTS_OFFS   3
+#define NI_SYS_GUID_OFFS   4
+#define NI_NODE_GUID_OFFS  12
+#define NI_PORT_GUID_OFFS  20
+#define NI_DEVICE_ID_OFFS  30
+#define NI_LOCAL_PORT_OFFS 36
+#define NI_VENDOR_ID_OFFS  37 /* 24 bits. */
+
+#define NI_TYPE_CA     1
+#define NI_TYPE_SWITCH 2
+
+/* PortInfo.  PortState is the low 4 bits of its byte and
+   LinkSpeedActive the high 4 of its; LinkSpeedExtActive (the high 4
+   bits of its byte) is only valid if the CapabilityMask has
+   PI_CAP_EXT_SPEEDS. */
+#define PI_LID_OFFS               16
+#define PI_CAP_MASK_OFFS          20
+#define PI_LOCAL_PORT_OFFS        28
+#define PI_LINK_WIDTH_ACTIVE_OFFS 31
+#define PI_PORT_STATE_OFFS        32
+#define PI_LINK_SPEED_ACTIVE_OFFS 35
+#define PI_LINK_SPEED_EXT_OFFS    62
+
+#define PI_CAP_EXT_SPEEDS 0x00004000
+#define PI_STATE_DOWN     1
+#define PI_STATE_ACTIVE   4
+
+/* SubnAdm MADs: the RMPP header, then the SA header, then the data.
+   GetTable responses are records at a stride of AttributeOffset 8
+   byte words, and come reassembled by the kernel: the first segment
+   whole, then the data of the rest. */
+#define RMPP_VERSION_OFFS 24
+#define RMPP_TYPE_OFFS    25
+#define RMPP_FLAGS_OFFS   26 /* The low 3 bits. */
+#define RMPP_STATUS_OFFS  27
+#define RMPP_SEG_NUM_OFFS 28
+#define RMPP_PAYLEN_OFFS  32
+#define SA_SM_KEY_OFFS    36
+#define SA_ATTR_OFFS_OFFS 44
+#define SA_COMP_MASK_OFFS 48
+#define SA_DATA_OFFS      56
+#define SA_HDR_SIZE       20 /* Counted in the RMPP PayloadLength. */
+
+#define RMPP_TYPE_DATA   1
+#define RMPP_FLAG_ACTIVE 0x1
+#define RMPP_FLAG_FIRST  0x2
+#define RMPP_FLAG_LAST   0x4
+
+#define SA_ATTR_NODE_RECORD      0x0011
+#define SA_ATTR_PORT_INFO_RECORD 0x0012
+#define SA_ATTR_LINK_RECORD      0x0020
+
+/* NodeRecord, PortInfoRecord, and LinkRecord, less padding. */
+#define NR_LID_OFFS       0
+#define NR_NODE_INFO_OFFS 4
+#define NR_NODE_DESC_OFFS 44
+#define NR_SIZE           108
+
+#define PIR_LID_OFFS       0
+#define PIR_PORT_OFFS      2
+#define PIR_PORT_INFO_OFFS 4
+#define PIR_SIZE           68
+
+#define LR_FROM_LID_OFFS  0
+#define LR_FROM_PORT_OFFS 2
+#define LR_TO_PORT_OFFS   3
+#define LR_TO_LID_OFFS    4
+#define LR_SIZE           6
+
+/* PortCountersExtended. */
+#define PCE_PORT_SELECT_OFFS    1
+#define PCE_COUNTER_SELECT_OFFS 2
+#define PCE_XMT_BYTES_OFFS      8
+#define PCE_RCV_BYTES_OFFS      16
+#define PCE_XMT_PKTS_OFFS       24
+#define PCE_RCV_PKTS_OFFS       32
+
+/* PortSamplesControl.  SampleStatus is the low 2 bits of its byte,
+   and there are 15 16-bit CounterSelects. */
+#define PSC_PORT_SELECT_OFFS     1
+#define PSC_TICK_OFFS            2
+#define PSC_SAMPLE_STATUS_OFFS   11
+#define PSC_SAMPLE_START_OFFS    28
+#define PSC_SAMPLE_INTERVAL_OFFS 32
+#define PSC_TAG_OFFS             36
+#define PSC_COUNTER_SELECT_OFFS  38
+
+/* PortSamplesResult, with 15 32-bit counters. */
+#define PSR_TAG_OFFS             0
+#define PSR_SAMPLE_STATUS_OFFS   3
+#define PSR_COUNTER_OFFS         4
+
+#define PS_SEL_XMT_DATA 0x0001 /* In units of 4 bytes. */
+#define PS_SEL_RCV_DATA 0x0002
+#define PS_SEL_XMT_PKTS 0x0003
+#define PS_SEL_RCV_PKTS 0x0004
+
+#define PS_STATUS_MASK 0x3
+#define PS_STATUS_DONE 0x0
+
+static inline uint8_t get_u8(const void *p, size_t offs)
+{
+  return ((const uint8_t *) p)[offs];
+}
+
+static inline uint16_t get_be16(const void *p, size_t offs)
+{
+  uint16_t v;
+  memcpy(&v, (const char *) p + offs, sizeof(v));
+  return be16toh(v);
+}
+
+static inline uint32_t get_be32(const void *p, size_t offs)
+{
+  uint32_t v;
+  memcpy(&v, (const char *) p + offs, sizeof(v));
+  return be32toh(v);
+}
+
+static inline uint64_t get_be64(const void *p, size_t offs)
+{
+  uint64_t v;
+  memcpy(&v, (const char *) p + offs, sizeof(v));
+  return be64toh(v);
+}
+
+static inline void put_u8(void *p, size_t offs, uint8_t v)
+{
+  ((uint8_t *) p)[offs] = v;
+}
+
+static inline void put_be16(void *p, size_t offs, uint16_t v)
+{
+  v = htobe16(v);
+  memcpy((char *) p + offs, &v, sizeof(v));
+}
+
+static inline void put_be32(void *p, size_t offs, uint32_t v)
+{
+  v = htobe32(v);
+  memcpy((char *) p + offs, &v, sizeof(v));
+}
+
+static inline void put_be64(void *p, size_t offs, uint64_t v)
+{
+  v = htobe64(v);
+  memcpy((char *) p + offs, &v, sizeof(v));
+}
+
+static inline uint64_t mad_get_trid(const void *mad)
+{
+  return get_be64(mad, MAD_TRID_OFFS);
+}
+
+static inline void mad_put_trid(void *mad, uint64_t trid)
+{
+  put_be64(mad, MAD_TRID_OFFS, trid);
+}
+
+static inline unsigned int mad_get_attr_id(const void *mad)
+{
+  return get_be16(mad, MAD_ATTRID_OFFS);
+}
+
+static inline unsigned int mad_get_status(const void *mad)
+{
+  return get_be16(mad, MAD_STATUS_OFFS) & MAD_STATUS_MASK;
+}
+
+/* Fill in the common header of a class version 1 request.  The rest
+   of the MAD is left alone. */
+static inline void mad_encode_hdr(void *mad, unsigned int mgmt_class,
+                                  unsigned int method, unsigned int attr_id,
+                                  uint32_t attr_mod, uint64_t trid)
+{
+  put_u8(mad, MAD_BASEVER_OFFS, 1);
+  put_u8(mad, MAD_MGMTCLASS_OFFS, mgmt_class);
+  put_u8(mad, MAD_CLASSVER_OFFS, 1);
+  put_u8(mad, MAD_METHOD_OFFS, method);
+  put_be16(mad, MAD_STATUS_OFFS, 0);
+  put_be64(mad, MAD_TRID_OFFS, trid);
+  put_be16(mad, MAD_ATTRID_OFFS, attr_id);
+  put_be32(mad, MAD_ATTRMOD_OFFS, attr_mod);
+}
+
+struct pce_ctrs {
+  uint64_t pce_xmt_bytes;
+  uint64_t pce_rcv_bytes;
+  uint64_t pce_xmt_pkts;
+  uint64_t pce_rcv_pkts;
+};
+
+static inline void pce_decode(const void *mad, struct pce_ctrs *pce)
+{
+  const char *pc = (const char *) mad + MAD_PMA_DATA_OFFS;
+
+  pce->pce_xmt_bytes = get_be64(pc, PCE_XMT_BYTES_OFFS);
+  pce->pce_rcv_bytes = get_be64(pc, PCE_RCV_BYTES_OFFS);
+  pce->pce_xmt_pkts  = get_be64(pc, PCE_XMT_PKTS_OFFS);
+  pce->pce_rcv_pkts  = get_be64(pc, PCE_RCV_PKTS_OFFS);
+}
+
+/* Decode nr MADs at mad[0], mad[stride], ... into pce[0..nr). */
+static inline void pce_decode_batch(const void *mad, size_t stride, size_t nr,
+                                    struct pce_ctrs *pce)
+{
+  size_t i;
+
+  for (i = 0; i < nr; i++)
+    pce_decode((const char *) mad + i * stride, &pce[i]);
+}
+
+#endif
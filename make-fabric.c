@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "trace.h"
+#include "fabric.h"
+
+int main(int argc, char *argv[])
+{
+  struct fabric_conf fc = {
+    .fc_nr_hosts = 10000,
+    .fc_job_size = 64,
+    .fc_idle = 0.1,
+    .fc_seed = 1,
+  };
+  int c;
+
+  while ((c = getopt(argc, argv, "ahi:j:n:s:")) != -1) {
+    switch (c) {
+    case 'a':
+      fc.fc_sa_dump = 1;
+      break;
+    case 'h':
+      printf("Usage: %s [OPTION]... DIR\n"
+             "Write a synthetic fabric's ibnetdiscover output, net info, and job map\n"
+             "to DIR/net-disc, DIR/net-info, and DIR/job-map.\n"
+             "\n"
+             "  -a                            also write the SA's records to DIR/sa-dump\n"
+             "  -n NODES                      hosts in the fabric (default 10000)\n"
+             "  -j NUMBER                     mean hosts per job (default 64)\n"
+             "  -i NUMBER                     fraction of hosts in no job (default 0.1)\n"
+             "  -s NUMBER                     seed (default 1)\n",
+             program_invocation_short_name);
+      exit(EXIT_SUCCESS);
+    case 'i':
+      fc.fc_idle = strtod(optarg, NULL);
+      break;
+    case 'j':
+      fc.fc_job_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      fc.fc_nr_hosts = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      fc.fc_seed = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind != 1)
+    FATAL("must specify one directory\n");
+
+  if (fc.fc_job_size == 0)
+    FATAL("invalid job size\n");
+
+  if (fabric_write_dir(&fc, argv[optind]) < 0)
+    return 1;
+
+  return 0;
+}
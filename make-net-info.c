@@ -1,87 +1,175 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <ctype.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
 #include "trace.h"
 #include "string1.h"
 #include "ibtop.h"
+#include "hca.h"
+#include "umad-io.h"
+#include "net-disc.h"
+#include "dr-disc.h"
+#include "sa-disc.h"
+#include "ib-net-db.h"
+
+int use_legacy = 0;
+int nr_threads = 0;
+
+/* For native discovery with -a or -d. */
+const char *disc_port_name = NULL;
+const char *disc_io_backend = "read";
+int use_sa = 0;
+
+struct dr_disc_conf dr_conf = {
+  .dc_window = 64,
+  .dc_timeout_ms = 200,
+  .dc_retries = 3,
+};
+
+struct sa_disc_conf sa_conf = {
+  .sc_timeout_ms = 1000,
+  .sc_retries = 3,
+};
+
+struct disc_port {
+  struct umad_io dp_io;
+  int dp_fd;
+  int dp_agent_id;
+  unsigned int dp_sm_lid;
+  unsigned int dp_sm_sl;
+};
+
+/* Open backend on the -p port (the first active one by default) with
+   an agent of mgmt_class registered, or just the backend if it's the
+   simulator. */
+int disc_port_open(struct disc_port *dp, const char *backend,
+                   int mgmt_class, int mgmt_version, int rmpp_version,
+                   size_t depth)
+{
+  struct hca_port port, *port_vec = NULL;
+  size_t nr_ports = 0;
+  umad_port_t up;
+  int rc = -1;
 
-#define P_GUID "%016"PRIx64
+  memset(dp, 0, sizeof(*dp));
+  dp->dp_fd = -1;
 
-int net_disc_to_info(FILE *disc_file, FILE *info_file)
-{
-  char *line = NULL;
-  size_t line_size = 0;
-
-  /* awk -v RS="\n\n" -v ORS="\n\n" '/i115-308/' current_net.out  */
-  /* vendid=0x2c9
-     devid=0xb924
-     sysimgguid=0x144fa5eb880051
-     switchguid=0x144fa5eb880050(144fa5eb880050)
-     Switch  24 "S-00144fa5eb880050" # "MT47396 Infiniscale-III Mellanox Technologies" base port 0 lid 3229 lmc 0
-     [1] "H-00144fa5eb88002c"[1](144fa5eb88002d) # "i115-312 HCA-1" lid 5290 4xSDR
-     ... */
-
-  while (getline(&line, &line_size, disc_file) >= 0) {
-    uint64_t sw_guid;
-    uint16_t sw_lid;
-
-    /* Scan for switch records. */
-    if (sscanf(line,
-               "Switch %*d \"S-%"SCNx64"\" # \"%*[^\"]\" %*s port %*d lid %"SCNu16,
-               &sw_guid, &sw_lid) != 2)
-      continue;
-
-    TRACE("sw_guid "P_GUID", sw_lid %"PRIu16", line `%s'\n",
-          sw_guid, sw_lid, chop(line, '\n'));
-
-    /* OK, we have a switch record.  Now extract all of the HCAs. */
-
-    while (getline(&line, &line_size, disc_file) >= 0) {
-      uint64_t hca_guid;
-      uint16_t hca_lid;
-      uint8_t sw_port, hca_port;
-      char hca_desc[64], *host;
-      unsigned int use_hca = 0; /* TODO */
-      int link_width;
-      char link_speed[4];
-
-      if (isspace(*line))
-        break;
-
-      /* [1] "H-00144fa5eb88002c"[1](144fa5eb88002d) # "i115-312 HCA-1" lid 5290 4xSDR */
-      if (sscanf(line,
-                 "[%"SCNu8"] \"H-%"SCNx64"\"[%"SCNu8"](%*x) # \"%64[^\"]\" "
-                 "lid %"SCNu16" %dx%4s",
-                 &sw_port, &hca_guid, &hca_port, hca_desc,
-                 &hca_lid, &link_width, link_speed) != 7)
-        continue;
-
-      host = chop(hca_desc, ' ');
-
-      TRACE("sw_port %2"PRIu8", hca_guid "P_GUID", hca_port %2"PRIu8", "
-            "host `%s', hca_lid %"PRIu16", link_width %d, link_speed %.4s, "
-            "line `%s'\n",
-            sw_port, hca_guid, hca_port, host, hca_lid,
-            link_width, link_speed,
-            chop(line, '\n'));
-
-      fprintf(info_file, "%s %d %"PRIx64" %"PRIx16" %"PRIx8" "
-	      "%"PRIx64" %"PRIx16" %"PRIx8"\n",
-	      host, use_hca, hca_guid, hca_lid, hca_port,
-	      sw_guid, sw_lid, sw_port);
+  if (umad_io_needs_port(backend)) {
+    if (umad_init() < 0) {
+      ERROR("cannot init libibumad: %m\n");
+      goto out;
+    }
+
+    if (disc_port_name != NULL) {
+      if (hca_port_parse(&port, disc_port_name) < 0) {
+        ERROR("invalid port `%s'\n", disc_port_name);
+        goto out;
+      }
+    } else {
+      if (hca_port_scan(&port_vec, &nr_ports) < 0 || nr_ports == 0) {
+        ERROR("no active IB ports\n");
+        goto out;
+      }
+      port = port_vec[0];
+    }
+
+    if (umad_get_port(port.hp_hca, port.hp_port, &up) < 0) {
+      ERROR("cannot get umad port `%s:%d'\n", port.hp_hca, port.hp_port);
+      goto out;
+    }
+
+    dp->dp_sm_lid = up.sm_lid;
+    dp->dp_sm_sl = up.sm_sl;
+    umad_release_port(&up);
+
+    dp->dp_fd = umad_open_port(port.hp_hca, port.hp_port);
+    if (dp->dp_fd < 0) {
+      ERROR("cannot open umad port `%s:%d': %m\n", port.hp_hca, port.hp_port);
+      goto out;
+    }
+
+    dp->dp_agent_id = umad_register(dp->dp_fd, mgmt_class, mgmt_version,
+                                    rmpp_version, NULL);
+    if (dp->dp_agent_id < 0) {
+      ERROR("cannot register class %#x agent on `%s:%d': %m\n",
+            mgmt_class, port.hp_hca, port.hp_port);
+      goto out;
     }
   }
 
-  free(line);
+  if (umad_io_open(&dp->dp_io, backend, dp->dp_fd, depth,
+                   umad_size() + 256) < 0) {
+    ERROR("cannot open umad I/O backend `%s': %m\n", backend);
+    goto out;
+  }
 
-  return 0;
+  rc = 0;
+
+ out:
+  free(port_vec);
+
+  return rc;
 }
 
+void disc_port_close(struct disc_port *dp)
+{
+  umad_io_close(&dp->dp_io);
+  if (dp->dp_fd >= 0)
+    umad_close_port(dp->dp_fd);
+  dp->dp_fd = -1;
+}
+
+int dr_write_info(FILE *info_file)
+{
+  struct disc_port dp;
+  int rc = -1;
+
+  if (disc_port_open(&dp, disc_io_backend, IB_SMI_DIRECT_CLASS, 1, 0,
+                     dr_conf.dc_window) < 0)
+    goto out;
+
+  dr_conf.dc_agent_id = dp.dp_agent_id;
+  rc = dr_disc_to_info(&dp.dp_io, &dr_conf, info_file);
+
+ out:
+  disc_port_close(&dp);
+
+  return rc;
+}
+
+int sa_write_info(FILE *info_file)
+{
+  const char *backend = disc_io_backend;
+  struct disc_port dp;
+  int rc = -1;
+
+  /* RMPP responses don't fit uring's fixed buffers, so read(2) them. */
+  if (umad_io_needs_port(backend))
+    backend = "read";
+
+  if (disc_port_open(&dp, backend, IB_SA_CLASS, 2, 1, 1) < 0)
+    goto out;
+
+  sa_conf.sc_agent_id = dp.dp_agent_id;
+  sa_conf.sc_sm_lid = dp.dp_sm_lid;
+  sa_conf.sc_sm_sl = dp.dp_sm_sl;
+  rc = sa_disc_to_info(&dp.dp_io, &sa_conf, info_file);
+
+ out:
+  disc_port_close(&dp);
+
+  return rc;
+}
+
+/* From ibnetdiscover's output, or by sa_write_info() or
+   dr_write_info() if disc_cmd is NULL. */
 int make_net_info(const char *disc_cmd, const char *info_path)
 {
   int rc = -1;
@@ -116,14 +204,27 @@ int make_net_info(const char *disc_cmd, const char *info_path)
   }
   stmp_fd = -1;
 
+  if (disc_cmd == NULL) {
+    if ((use_sa ? sa_write_info : dr_write_info)(stmp_file) < 0)
+      goto out;
+
+    rc = 0;
+    goto out;
+  }
+
   disc_file = popen(disc_cmd, "r");
   if (disc_file == NULL) {
     ERROR("cannot execute `%s': %m\n", disc_cmd);
     goto out;
   }
 
-  if (net_disc_to_info(disc_file, stmp_file) < 0)
-    goto out;
+  if (use_legacy) {
+    if (net_disc_to_info(disc_file, stmp_file) < 0)
+      goto out;
+  } else {
+    if (net_disc_fast_to_info(disc_file, stmp_file, nr_threads) < 0)
+      goto out;
+  }
 
   rc = 0;
 
@@ -156,13 +257,128 @@ int make_net_info(const char *disc_cmd, const char *info_path)
   return rc;
 }
 
+/* Compiled after the text, so that it's at least as new. */
+int make_net_db(const char *info_path, const char *db_path)
+{
+  FILE *info_file = fopen(info_path, "r");
+  int rc = 0;
+
+  if (info_file == NULL) {
+    ERROR("cannot open `%s': %m\n", info_path);
+    return -1;
+  }
+
+  if (ib_net_db_build(db_path, info_file) < 0) {
+    ERROR("cannot write `%s': %m\n", db_path);
+    rc = -1;
+  }
+
+  fclose(info_file);
+
+  return rc;
+}
+
+/* Unless -b is given, the DB goes next to the net info: its path with
+   a trailing "-info" replaced by "-db" (so the defaults pair up), or
+   with "-db" appended. */
+char *net_db_path(const char *info_path)
+{
+  size_t len = strlen(info_path);
+  char *path;
+
+  if (len >= 5 && strcmp(info_path + len - 5, "-info") == 0)
+    len -= 5;
+
+  if (asprintf(&path, "%.*s-db", (int) len, info_path) < 0)
+    OOM();
+
+  return path;
+}
+
 int main(int argc, char *argv[])
 {
   const char *disc_cmd = IBNETDISCOVER_PATH;
   const char *info_path = IBTOP_NET_INFO_PATH;
+  const char *db_path = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "ab:c:dhi:lo:p:s:t:w:")) != -1) {
+    switch (c) {
+    case 'a':
+      disc_cmd = NULL;
+      use_sa = 1;
+      break;
+    case 'b':
+      db_path = optarg;
+      break;
+    case 'c':
+      disc_cmd = optarg;
+      break;
+    case 'd':
+      disc_cmd = NULL;
+      use_sa = 0;
+      break;
+    case 'h':
+      printf("Usage: %s [OPTION]...\n"
+             "Write the net info and net DB (%s and %s) from ibnetdiscover's\n"
+             "output, or by discovering the fabric with -a or -d.\n"
+             "\n"
+             "  -a                            fetch node, port, and link records from the SA\n"
+             "                                rather than running ibnetdiscover\n"
+             "  -b PATH                       write the net DB to PATH (default next to the\n"
+             "                                net info, see -o)\n"
+             "  -c COMMAND                    read ibnetdiscover output from COMMAND (default\n"
+             "                                %s)\n"
+             "  -d                            discover the fabric with directed route SMPs\n"
+             "                                rather than running ibnetdiscover\n"
+             "  -i BACKEND                    umad I/O backend for -a and -d: read, uring, or\n"
+             "                                sim:hosts=N,sa=PATH,... (see ibtop --io)\n"
+             "  -l                            use the old sscanf() parser\n"
+             "  -o PATH                       write the net info to PATH, and unless -b is\n"
+             "                                given the net DB next to it (PATH with a\n"
+             "                                trailing -info replaced by -db, or PATH-db)\n"
+             "  -p HCA[:PORT]                 discover from HCA port (default first active)\n"
+             "  -s PATH                       with -a, save the SA's records to PATH\n"
+             "  -t NUMBER                     parse with NUMBER threads (default up to one per CPU)\n"
+             "  -w NUMBER                     keep NUMBER SMPs outstanding (default %zu)\n",
+             program_invocation_short_name, IBTOP_NET_INFO_PATH,
+             IBTOP_NET_DB_PATH, IBNETDISCOVER_PATH,
+             dr_conf.dc_window);
+      exit(EXIT_SUCCESS);
+    case 'i':
+      disc_io_backend = optarg;
+      break;
+    case 'l':
+      use_legacy = 1;
+      break;
+    case 'o':
+      info_path = optarg;
+      break;
+    case 'p':
+      disc_port_name = optarg;
+      break;
+    case 's':
+      sa_conf.sc_save_path = optarg;
+      break;
+    case 't':
+      nr_threads = strtol(optarg, NULL, 0);
+      break;
+    case 'w':
+      dr_conf.dc_window = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (db_path == NULL)
+    db_path = net_db_path(info_path);
 
   if (make_net_info(disc_cmd, info_path) < 0)
     return 1;
 
+  if (make_net_db(info_path, db_path) < 0)
+    return 1;
+
   return 0;
 }
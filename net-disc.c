@@ -0,0 +1,594 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "string1.h"
+#include "net-disc.h"
+
+#define P_GUID "%016"PRIx64
+
+/* Enough for FDR10. */
+#define LINK_SPEED_MAX 8
+
+int net_disc_to_info(FILE *disc_file, FILE *info_file)
+{
+  char *line = NULL;
+  size_t line_size = 0;
+
+  /* awk -v RS="\n\n" -v ORS="\n\n" '/i115-308/' current_net.out  */
+  /* vendid=0x2c9
+     devid=0xb924
+     sysimgguid=0x144fa5eb880051
+     switchguid=0x144fa5eb880050(144fa5eb880050)
+     Switch  24 "S-00144fa5eb880050" # "MT47396 Infiniscale-III Mellanox Technologies" base port 0 lid 3229 lmc 0
+     [1] "H-00144fa5eb88002c"[1](144fa5eb88002d) # "i115-312 HCA-1" lid 5290 4xSDR
+     ... */
+
+  while (getline(&line, &line_size, disc_file) >= 0) {
+    uint64_t sw_guid;
+    uint16_t sw_lid;
+
+    /* Scan for switch records. */
+    if (sscanf(line,
+               "Switch %*d \"S-%"SCNx64"\" # \"%*[^\"]\" %*s port %*d lid %"SCNu16,
+               &sw_guid, &sw_lid) != 2)
+      continue;
+
+    TRACE("sw_guid "P_GUID", sw_lid %"PRIu16", line `%s'\n",
+          sw_guid, sw_lid, chop(line, '\n'));
+
+    /* OK, we have a switch record.  Now extract all of the HCAs. */
+
+    while (getline(&line, &line_size, disc_file) >= 0) {
+      uint64_t hca_guid;
+      uint16_t hca_lid;
+      uint8_t sw_port, hca_port;
+      char hca_desc[64 + 1], *host;
+      int link_width;
+      char link_speed[LINK_SPEED_MAX + 1], link[16 + LINK_SPEED_MAX];
+      struct net_info_port np;
+
+      if (isspace(*line))
+        break;
+
+      /* [1] "H-00144fa5eb88002c"[1](144fa5eb88002d) # "i115-312 HCA-1" lid 5290 4xSDR */
+      if (sscanf(line,
+                 "[%"SCNu8"] \"H-%"SCNx64"\"[%"SCNu8"](%*x) # \"%64[^\"]\" "
+                 "lid %"SCNu16" %dx%8s",
+                 &sw_port, &hca_guid, &hca_port, hca_desc,
+                 &hca_lid, &link_width, link_speed) != 7)
+        continue;
+
+      host = chop(hca_desc, ' ');
+
+      TRACE("sw_port %2"PRIu8", hca_guid "P_GUID", hca_port %2"PRIu8", "
+            "host `%s', hca_lid %"PRIu16", link_width %d, link_speed %s, "
+            "line `%s'\n",
+            sw_port, hca_guid, hca_port, host, hca_lid,
+            link_width, link_speed,
+            chop(line, '\n'));
+
+      snprintf(link, sizeof(link), "%dx%s", link_width, link_speed);
+
+      np.np_host = host;
+      np.np_host_len = strlen(host);
+      np.np_hca_guid = hca_guid;
+      np.np_hca_lid = hca_lid;
+      np.np_hca_port = hca_port;
+      np.np_sw_guid = sw_guid;
+      np.np_sw_lid = sw_lid;
+      np.np_sw_port = sw_port;
+      np.np_link = link;
+      np.np_link_len = strlen(link);
+      net_info_write(info_file, &np);
+    }
+  }
+
+  free(line);
+
+  return 0;
+}
+
+/* The tokenizer for net_disc_buf_to_info().  Each nd_ function
+   matches what the conversion or literal of the same meaning in the
+   sscanf() formats above would, on a cursor bounded by the end of the
+   line, and returns -1 if it doesn't match. */
+
+#define NET_DISC_MAX_THREADS 64
+#define NET_DISC_MIN_CHUNK (1 << 20)
+
+struct nd_cur {
+  const char *p, *end;
+};
+
+static inline void nd_ws(struct nd_cur *c)
+{
+  while (c->p < c->end && isspace((unsigned char) *c->p))
+    c->p++;
+}
+
+static inline int nd_lit(struct nd_cur *c, const char *s)
+{
+  size_t len = strlen(s);
+
+  if (c->end - c->p < len || memcmp(c->p, s, len) != 0)
+    return -1;
+
+  c->p += len;
+
+  return 0;
+}
+
+static inline int nd_hex(struct nd_cur *c, uint64_t *x)
+{
+  const char *p;
+
+  nd_ws(c);
+
+  *x = 0;
+  for (p = c->p; p < c->end && isxdigit((unsigned char) *p); p++)
+    *x = (*x << 4) | (isdigit((unsigned char) *p) ? *p - '0' :
+                      (tolower((unsigned char) *p) - 'a' + 10));
+
+  if (p == c->p)
+    return -1;
+
+  c->p = p;
+
+  return 0;
+}
+
+static inline int nd_dec(struct nd_cur *c, uint64_t *x)
+{
+  const char *p;
+  int neg = 0;
+
+  nd_ws(c);
+
+  p = c->p;
+  if (p < c->end && (*p == '+' || *p == '-'))
+    neg = *p++ == '-';
+
+  if (!(p < c->end && isdigit((unsigned char) *p)))
+    return -1;
+
+  *x = 0;
+  for (; p < c->end && isdigit((unsigned char) *p); p++)
+    *x = *x * 10 + (*p - '0');
+
+  if (neg)
+    *x = -*x;
+
+  c->p = p;
+
+  return 0;
+}
+
+/* %s with at most max characters (0 for no limit).  s and len may be
+   NULL. */
+static inline int nd_word(struct nd_cur *c, size_t max,
+                          const char **s, size_t *len)
+{
+  const char *p;
+
+  nd_ws(c);
+
+  for (p = c->p; p < c->end && !isspace((unsigned char) *p); p++)
+    if (max > 0 && p - c->p == max)
+      break;
+
+  if (p == c->p)
+    return -1;
+
+  if (s != NULL) {
+    *s = c->p;
+    *len = p - c->p;
+  }
+
+  c->p = p;
+
+  return 0;
+}
+
+/* %[^"] with at most max characters (0 for no limit). */
+static inline int nd_quoted(struct nd_cur *c, size_t max,
+                            const char **s, size_t *len)
+{
+  const char *p;
+
+  for (p = c->p; p < c->end && *p != '"'; p++)
+    if (max > 0 && p - c->p == max)
+      break;
+
+  if (p == c->p)
+    return -1;
+
+  *s = c->p;
+  *len = p - c->p;
+  c->p = p;
+
+  return 0;
+}
+
+/* Switch  24 "S-00144fa5eb880050" # "MT47396 Infiniscale-III Mellanox Technologies" base port 0 lid 3229 lmc 0 */
+static int nd_switch(struct nd_cur *c, uint64_t *sw_guid, uint16_t *sw_lid)
+{
+  const char *desc;
+  size_t desc_len;
+  uint64_t x;
+
+  if (nd_lit(c, "Switch") < 0 || nd_dec(c, &x) < 0 ||
+      (nd_ws(c), nd_lit(c, "\"S-")) < 0 || nd_hex(c, sw_guid) < 0 ||
+      nd_lit(c, "\"") < 0 ||
+      (nd_ws(c), nd_lit(c, "#")) < 0 ||
+      (nd_ws(c), nd_lit(c, "\"")) < 0 ||
+      nd_quoted(c, 0, &desc, &desc_len) < 0 || nd_lit(c, "\"") < 0 ||
+      nd_word(c, 0, NULL, NULL) < 0 ||
+      (nd_ws(c), nd_lit(c, "port")) < 0 || nd_dec(c, &x) < 0 ||
+      (nd_ws(c), nd_lit(c, "lid")) < 0 || nd_dec(c, &x) < 0)
+    return -1;
+
+  *sw_lid = x;
+
+  return 0;
+}
+
+/* [1] "H-00144fa5eb88002c"[1](144fa5eb88002d) # "i115-312 HCA-1" lid 5290 4xSDR */
+static int nd_hca(struct nd_cur *c, uint8_t *sw_port, uint64_t *hca_guid,
+                  uint8_t *hca_port, const char **host, size_t *host_len,
+                  uint16_t *hca_lid, int *link_width,
+                  const char **link_speed, size_t *link_speed_len)
+{
+  const char *desc, *sp;
+  size_t desc_len;
+  uint64_t sw_port_x, hca_port_x, hca_lid_x, link_width_x, x;
+
+  if (nd_lit(c, "[") < 0 || nd_dec(c, &sw_port_x) < 0 ||
+      nd_lit(c, "]") < 0 ||
+      (nd_ws(c), nd_lit(c, "\"H-")) < 0 || nd_hex(c, hca_guid) < 0 ||
+      nd_lit(c, "\"[") < 0 || nd_dec(c, &hca_port_x) < 0 ||
+      nd_lit(c, "](") < 0 || nd_hex(c, &x) < 0 || nd_lit(c, ")") < 0 ||
+      (nd_ws(c), nd_lit(c, "#")) < 0 ||
+      (nd_ws(c), nd_lit(c, "\"")) < 0 ||
+      nd_quoted(c, 64, &desc, &desc_len) < 0 || nd_lit(c, "\"") < 0 ||
+      (nd_ws(c), nd_lit(c, "lid")) < 0 || nd_dec(c, &hca_lid_x) < 0 ||
+      nd_dec(c, &link_width_x) < 0 || nd_lit(c, "x") < 0 ||
+      nd_word(c, LINK_SPEED_MAX, link_speed, link_speed_len) < 0)
+    return -1;
+
+  *sw_port = sw_port_x;
+  *hca_port = hca_port_x;
+  *hca_lid = hca_lid_x;
+  *link_width = link_width_x;
+
+  sp = memchr(desc, ' ', desc_len);
+  *host = desc;
+  *host_len = sp != NULL ? sp - desc : desc_len;
+
+  return 0;
+}
+
+/* %x, for nd_parse(), which spends most of its time writing. */
+static inline char *nd_put_hex(char *p, uint64_t x)
+{
+  char tmp[16];
+  size_t n = 0;
+
+  do {
+    tmp[n++] = "0123456789abcdef"[x & 0xf];
+    x >>= 4;
+  } while (x != 0);
+
+  while (n > 0)
+    *p++ = tmp[--n];
+
+  return p;
+}
+
+static inline char *nd_put_dec(char *p, int x)
+{
+  char tmp[16];
+  unsigned int u = x;
+  size_t n = 0;
+
+  if (x < 0) {
+    *p++ = '-';
+    u = -u;
+  }
+
+  do {
+    tmp[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+
+  while (n > 0)
+    *p++ = tmp[--n];
+
+  return p;
+}
+
+void net_info_write(FILE *info_file, const struct net_info_port *np)
+{
+  unsigned int use_hca = 0; /* TODO */
+  char info[8 * 17 + 1], *q = info;
+
+  *q++ = ' ';
+  q = nd_put_hex(q, use_hca);
+  *q++ = ' ';
+  q = nd_put_hex(q, np->np_hca_guid);
+  *q++ = ' ';
+  q = nd_put_hex(q, np->np_hca_lid);
+  *q++ = ' ';
+  q = nd_put_hex(q, np->np_hca_port);
+  *q++ = ' ';
+  q = nd_put_hex(q, np->np_sw_guid);
+  *q++ = ' ';
+  q = nd_put_hex(q, np->np_sw_lid);
+  *q++ = ' ';
+  q = nd_put_hex(q, np->np_sw_port);
+  *q++ = ' ';
+
+  fwrite(np->np_host, 1, np->np_host_len, info_file);
+  fwrite(info, 1, q - info, info_file);
+  fwrite(np->np_link, 1, np->np_link_len, info_file);
+  putc('\n', info_file);
+}
+
+static inline const char *nd_next_line(const char *p, const char *end)
+{
+  p = memchr(p, '\n', end - p);
+
+  return p != NULL ? p + 1 : end;
+}
+
+/* Like the loops in net_disc_to_info(): a record runs from a switch
+   line to the next line starting with whitespace. */
+static int nd_parse(const char *p, const char *end, FILE *info_file)
+{
+  while (p < end) {
+    struct nd_cur c = { .p = p, .end = nd_next_line(p, end) };
+    uint64_t sw_guid;
+    uint16_t sw_lid;
+
+    p = c.end;
+    if (nd_switch(&c, &sw_guid, &sw_lid) < 0)
+      continue;
+
+    while (p < end) {
+      struct net_info_port np = { .np_sw_guid = sw_guid, .np_sw_lid = sw_lid };
+      const char *link_speed;
+      size_t link_speed_len;
+      int link_width;
+      char link[16 + LINK_SPEED_MAX], *q;
+
+      c.p = p;
+      c.end = nd_next_line(p, end);
+      p = c.end;
+
+      if (isspace((unsigned char) *c.p))
+        break;
+
+      if (nd_hca(&c, &np.np_sw_port, &np.np_hca_guid, &np.np_hca_port,
+                 &np.np_host, &np.np_host_len, &np.np_hca_lid,
+                 &link_width, &link_speed, &link_speed_len) < 0)
+        continue;
+
+      /* "%dx%s", as above. */
+      q = nd_put_dec(link, link_width);
+      *q++ = 'x';
+      memcpy(q, link_speed, link_speed_len);
+      q += link_speed_len;
+
+      np.np_link = link;
+      np.np_link_len = q - link;
+      net_info_write(info_file, &np);
+    }
+  }
+
+  return ferror(info_file) ? -1 : 0;
+}
+
+/* The first place at or after p where the legacy parser is sure to
+   be between records: just after a line starting with whitespace. */
+static const char *nd_boundary(const char *buf, const char *p,
+                               const char *end)
+{
+  if (p > buf && p[-1] != '\n')
+    p = nd_next_line(p, end);
+
+  while (p < end) {
+    const char *next = nd_next_line(p, end);
+
+    if (isspace((unsigned char) *p))
+      return next;
+
+    p = next;
+  }
+
+  return end;
+}
+
+struct nd_chunk {
+  const char *nc_begin, *nc_end;
+  char *nc_out;
+  size_t nc_out_size;
+  int nc_rc;
+  pthread_t nc_thread;
+  int nc_started;
+};
+
+static void *nd_chunk_main(void *arg)
+{
+  struct nd_chunk *nc = arg;
+  FILE *file = open_memstream(&nc->nc_out, &nc->nc_out_size);
+
+  nc->nc_rc = -1;
+  if (file == NULL)
+    return NULL;
+
+  nc->nc_rc = nd_parse(nc->nc_begin, nc->nc_end, file);
+
+  if (fclose(file) != 0)
+    nc->nc_rc = -1;
+
+  return NULL;
+}
+
+int net_disc_buf_to_info(const char *buf, size_t size, FILE *info_file,
+                         int nr_threads)
+{
+  struct nd_chunk *chunk_vec = NULL;
+  const char *end = buf + size;
+  size_t nr_chunks, i;
+  int rc = -1;
+
+  if (nr_threads <= 0) {
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+    if (nr_threads > size / NET_DISC_MIN_CHUNK)
+      nr_threads = size / NET_DISC_MIN_CHUNK;
+  }
+
+  if (nr_threads > NET_DISC_MAX_THREADS)
+    nr_threads = NET_DISC_MAX_THREADS;
+
+  if (nr_threads <= 1)
+    return nd_parse(buf, end, info_file);
+
+  nr_chunks = nr_threads;
+  chunk_vec = calloc(nr_chunks, sizeof(chunk_vec[0]));
+  if (chunk_vec == NULL)
+    OOM();
+
+  for (i = 0; i < nr_chunks; i++) {
+    struct nd_chunk *nc = &chunk_vec[i];
+
+    nc->nc_begin = i == 0 ? buf : chunk_vec[i - 1].nc_end;
+    nc->nc_end = i == nr_chunks - 1 ? end :
+      nd_boundary(buf, buf + size / nr_chunks * (i + 1), end);
+    if (nc->nc_end < nc->nc_begin)
+      nc->nc_end = nc->nc_begin;
+
+    TRACE("chunk %zu [%zu, %zu)\n", i, (size_t) (nc->nc_begin - buf),
+          (size_t) (nc->nc_end - buf));
+
+    nc->nc_started = pthread_create(&nc->nc_thread, NULL,
+                                    &nd_chunk_main, nc) == 0;
+    if (!nc->nc_started)
+      nd_chunk_main(nc);
+  }
+
+  rc = 0;
+
+  for (i = 0; i < nr_chunks; i++) {
+    struct nd_chunk *nc = &chunk_vec[i];
+
+    if (nc->nc_started)
+      pthread_join(nc->nc_thread, NULL);
+
+    if (nc->nc_rc < 0)
+      rc = -1;
+    else if (rc == 0 && nc->nc_out_size > 0 &&
+             fwrite(nc->nc_out, 1, nc->nc_out_size, info_file) !=
+             nc->nc_out_size)
+      rc = -1;
+
+    free(nc->nc_out);
+  }
+
+  free(chunk_vec);
+
+  return rc;
+}
+
+int net_disc_fast_to_info(FILE *disc_file, FILE *info_file, int nr_threads)
+{
+  int fd = fileno(disc_file);
+  struct stat stat_buf;
+  char *buf = NULL;
+  size_t size = 0, buf_size = 0;
+  int is_map = 0;
+  int rc = -1;
+
+  if (fstat(fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode) &&
+      stat_buf.st_size > 0) {
+    buf = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf != MAP_FAILED) {
+      size = stat_buf.st_size;
+      is_map = 1;
+      goto have_buf;
+    }
+    buf = NULL;
+  }
+
+  /* A pipe (from popen()), so buffer all of it. */
+  while (1) {
+    ssize_t nr;
+
+    if (size == buf_size) {
+      buf_size = buf_size > 0 ? 2 * buf_size : 1 << 20;
+      buf = realloc(buf, buf_size);
+      if (buf == NULL)
+        OOM();
+    }
+
+    nr = read(fd, buf + size, buf_size - size);
+    if (nr < 0) {
+      ERROR("cannot read ibnetdiscover output: %m\n");
+      goto out;
+    }
+
+    if (nr == 0)
+      break;
+
+    size += nr;
+  }
+
+ have_buf:
+  rc = net_disc_buf_to_info(buf, size, info_file, nr_threads);
+
+ out:
+  if (is_map)
+    munmap(buf, size);
+  else
+    free(buf);
+
+  return rc;
+}
+
+const char *net_info_width_str(unsigned int width)
+{
+  switch (width) {
+  case 0x01: return "1";
+  case 0x02: return "4";
+  case 0x04: return "8";
+  case 0x08: return "12";
+  case 0x10: return "2";
+  default: return "?";
+  }
+}
+
+const char *net_info_speed_str(unsigned int speed, unsigned int speed_ext)
+{
+  switch (speed_ext) {
+  case 0x1: return "FDR";
+  case 0x2: return "EDR";
+  case 0x4: return "HDR";
+  case 0x8: return "NDR";
+  }
+
+  switch (speed) {
+  case 0x1: return "SDR";
+  case 0x2: return "DDR";
+  case 0x4: return "QDR";
+  default: return "?";
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef _NET_DISC_H_
+#define _NET_DISC_H_
+#include <stdio.h>
+#include <stdint.h>
+
+/* Translate ibnetdiscover output to net-info lines, one for each HCA
+   port attached to a switch:
+
+     HOST USE_HCA HCA_GUID HCA_LID HCA_PORT SW_GUID SW_LID SW_PORT LINK
+
+   with everything from USE_HCA to SW_PORT in hex, and LINK the link's
+   width and speed as ibnetdiscover prints them (4xQDR, ...).  Readers
+   ignore LINK, which older net info lacks. */
+int net_disc_to_info(FILE *disc_file, FILE *info_file);
+
+/* One net-info line.  host and link (LINK, "4xQDR") needn't be
+   terminated. */
+struct net_info_port {
+  const char *np_host;
+  size_t np_host_len;
+  uint64_t np_hca_guid;
+  uint16_t np_hca_lid;
+  uint8_t np_hca_port;
+  uint64_t np_sw_guid;
+  uint16_t np_sw_lid;
+  uint8_t np_sw_port;
+  const char *np_link;
+  size_t np_link_len;
+};
+
+/* Write np's line to info_file.  Every net-info writer goes through
+   here. */
+void net_info_write(FILE *info_file, const struct net_info_port *np);
+
+/* The same translation without sscanf() or copying: records in buf
+   are tokenized in place, split at record boundaries across
+   nr_threads threads (0 for one per CPU), and their lines written to
+   info_file in order.  The output is identical to net_disc_to_info()'s
+   for anything ibnetdiscover writes. */
+int net_disc_buf_to_info(const char *buf, size_t size, FILE *info_file,
+                         int nr_threads);
+
+/* net_disc_buf_to_info() on all of disc_file (which must not have
+   been read from yet), mapped if it's a regular file, read into
+   memory if it's a pipe. */
+int net_disc_fast_to_info(FILE *disc_file, FILE *info_file, int nr_threads);
+
+/* LINK's width and speed from PortInfo's LinkWidthActive,
+   LinkSpeedActive, and LinkSpeedExtActive (0 if unsupported). */
+const char *net_info_width_str(unsigned int width);
+const char *net_info_speed_str(unsigned int speed, unsigned int speed_ext);
+
+#endif
@@ -0,0 +1,449 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <infiniband/umad.h>
+#include "trace.h"
+#include "string1.h"
+#include "mad-codec.h"
+#include "net-disc.h"
+#include "sa-dump.h"
+#include "sa-disc.h"
+
+#define SA_MAD_SIZE 256
+#define SA_CLASS 0x03
+#define SA_CLASS_VERSION 2
+#define SA_METHOD_GET_TABLE 0x12
+#define SA_METHOD_GET_TABLE_RESP 0x92
+#define SA_QP1_QKEY 0x80010000
+#define SA_NR_LIDS 65536
+#define SA_NR_QUERIES 3
+
+/* After the first segment, an RMPP transfer of a big table takes
+   longer than a MAD timeout. */
+#define SA_TRANSFER_SEC 10
+
+#define P_GUID "%016"PRIx64
+
+struct sa_query {
+  unsigned int sq_attr;
+  size_t sq_min_size;
+  uint32_t sq_trid;
+  char *sq_buf;             /* The response, once it's in. */
+  struct sa_table sq_table;
+};
+
+/* What the tables say about each LID. */
+struct sa_lid {
+  uint64_t sl_guid;
+  const char *sl_desc;      /* CAs: NodeDescription in the node table. */
+  uint16_t sl_sw_lid;
+  uint8_t sl_type;
+  uint8_t sl_port;          /* CAs: the port with this LID. */
+  uint8_t sl_sw_port;
+  uint8_t sl_width;
+  uint8_t sl_speed;
+  uint8_t sl_speed_ext;
+};
+
+static double sa_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int sa_send(struct umad_io *io, const struct sa_disc_conf *sc,
+                   struct sa_query *sq, void *um, size_t um_len)
+{
+  struct ib_user_mad *umh = um;
+  char *m;
+
+  memset(um, 0, um_len);
+  umad_set_addr(um, sc->sc_sm_lid, 1, sc->sc_sm_sl, SA_QP1_QKEY);
+  umh->agent_id = sc->sc_agent_id;
+  umh->timeout_ms = sc->sc_timeout_ms;
+  umh->retries = sc->sc_retries;
+
+  /* No ComponentMask, so every record. */
+  m = umad_get_mad(um);
+  mad_encode_hdr(m, SA_CLASS, SA_METHOD_GET_TABLE, sq->sq_attr, 0,
+                 sq->sq_trid);
+  put_u8(m, MAD_CLASSVER_OFFS, SA_CLASS_VERSION);
+
+  return umad_io_send(io, um, um_len);
+}
+
+/* Receive one MAD into *buf, growing it to fit. */
+static ssize_t sa_recv(struct umad_io *io, char **buf, size_t *buf_size)
+{
+  while (1) {
+    size_t len, need;
+    ssize_t nr;
+    char *new_buf;
+
+    nr = umad_io_recv(io, *buf, *buf_size, 1, &len, NULL);
+    if (nr > 0)
+      return len;
+
+    if (nr == 0 || errno != ENOSPC)
+      return nr;
+
+    need = ((struct ib_user_mad *) *buf)->length;
+    if (!(need > *buf_size)) {
+      errno = EPROTO;
+      return -1;
+    }
+
+    new_buf = realloc(*buf, need);
+    if (new_buf == NULL)
+      OOM();
+
+    *buf = new_buf;
+    *buf_size = need;
+  }
+}
+
+/* Take buf (of len bytes) as the response to sq if it's good. */
+static int sa_take(struct sa_query *sq, char *buf, size_t len)
+{
+  const struct ib_user_mad *umh = (struct ib_user_mad *) buf;
+  const char *m = umad_get_mad(buf);
+  struct sa_table *st = &sq->sq_table;
+  unsigned int status;
+
+  if (umh->status != 0) {
+    ERROR("SA query for attribute %#x failed: %s\n", sq->sq_attr,
+          strerror(umh->status));
+    return -1;
+  }
+
+  status = mad_get_status(m);
+  if (status != 0 || get_u8(m, MAD_METHOD_OFFS) != SA_METHOD_GET_TABLE_RESP) {
+    ERROR("SA query for attribute %#x failed: status %#x\n", sq->sq_attr,
+          status);
+    return -1;
+  }
+
+  if (len < umad_size() + SA_DATA_OFFS) {
+    ERROR("short SA response for attribute %#x\n", sq->sq_attr);
+    return -1;
+  }
+
+  st->st_attr = sq->sq_attr;
+  st->st_stride = 8 * get_be16(m, SA_ATTR_OFFS_OFFS);
+  st->st_recs = m + SA_DATA_OFFS;
+  st->st_count = 0;
+
+  if (st->st_stride != 0)
+    st->st_count = (len - umad_size() - SA_DATA_OFFS) / st->st_stride;
+
+  if (st->st_count > 0 && st->st_stride < sq->sq_min_size) {
+    ERROR("SA records for attribute %#x are too short (%zu bytes)\n",
+          sq->sq_attr, st->st_stride);
+    return -1;
+  }
+
+  TRACE("SA attribute %#x: %zu records of %zu bytes\n",
+        st->st_attr, st->st_count, st->st_stride);
+
+  sq->sq_buf = buf;
+
+  return 0;
+}
+
+/* Send all the queries at once and wait for their responses. */
+static int sa_fetch(struct umad_io *io, const struct sa_disc_conf *sc,
+                    struct sa_query *sq_vec, size_t nr_queries)
+{
+  size_t um_len = umad_size() + SA_MAD_SIZE;
+  size_t buf_size = um_len, nr_left = nr_queries, i;
+  char *send_bufs = NULL, *buf = NULL;
+  double deadline;
+  int rc = -1;
+
+  send_bufs = malloc(nr_queries * um_len);
+  buf = malloc(buf_size);
+  if (send_bufs == NULL || buf == NULL)
+    OOM();
+
+  for (i = 0; i < nr_queries; i++) {
+    if (sa_send(io, sc, &sq_vec[i], send_bufs + i * um_len, um_len) < 0) {
+      ERROR("cannot send SA query: %m\n");
+      goto out;
+    }
+  }
+
+  if (umad_io_flush(io) < 0) {
+    ERROR("cannot send SA queries: %m\n");
+    goto out;
+  }
+
+  deadline = sa_now() + SA_TRANSFER_SEC +
+    sc->sc_timeout_ms * (sc->sc_retries + 1) / 1000.0;
+
+  while (nr_left > 0) {
+    ssize_t len;
+    uint32_t trid;
+
+    if (!(sa_now() < deadline)) {
+      ERROR("no response from the SA at LID %u\n", sc->sc_sm_lid);
+      goto out;
+    }
+
+    if (umad_io_wait(io, 0.1) < 0) {
+      ERROR("cannot wait for SA responses: %m\n");
+      goto out;
+    }
+
+    len = sa_recv(io, &buf, &buf_size);
+    if (len < 0) {
+      ERROR("cannot receive SA responses: %m\n");
+      goto out;
+    }
+
+    if (len == 0)
+      continue;
+
+    trid = mad_get_trid(umad_get_mad(buf));
+    for (i = 0; i < nr_queries; i++)
+      if (sq_vec[i].sq_buf == NULL && sq_vec[i].sq_trid == trid)
+        break;
+
+    if (!(i < nr_queries))
+      continue; /* Duplicate or stale. */
+
+    if (sa_take(&sq_vec[i], buf, len) < 0)
+      goto out;
+
+    nr_left--;
+    buf_size = um_len;
+    buf = malloc(buf_size);
+    if (buf == NULL)
+      OOM();
+  }
+
+  rc = 0;
+
+ out:
+  free(send_bufs);
+  free(buf);
+
+  return rc;
+}
+
+static int sa_save(const char *path, const struct sa_query *sq_vec,
+                   size_t nr_queries)
+{
+  FILE *file = fopen(path, "w");
+  size_t i;
+  int rc = -1;
+
+  if (file == NULL) {
+    ERROR("cannot open `%s': %m\n", path);
+    return -1;
+  }
+
+  if (sa_dump_write_magic(file) < 0)
+    goto out;
+
+  for (i = 0; i < nr_queries; i++)
+    if (sa_dump_write_table(file, &sq_vec[i].sq_table) < 0)
+      goto out;
+
+  rc = 0;
+
+ out:
+  if (fclose(file) != 0)
+    rc = -1;
+
+  if (rc < 0)
+    ERROR("cannot write `%s': %m\n", path);
+
+  return rc;
+}
+
+static void sa_join_nodes(struct sa_lid *sl_vec, const struct sa_table *st)
+{
+  size_t i;
+
+  for (i = 0; i < st->st_count; i++) {
+    const char *r = st->st_recs + i * st->st_stride;
+    const char *ni = r + NR_NODE_INFO_OFFS;
+    uint16_t lid = get_be16(r, NR_LID_OFFS);
+    struct sa_lid *sl = &sl_vec[lid];
+
+    /* LID 0 is no one's, so sl_vec[0] stays empty. */
+    if (lid == 0)
+      continue;
+
+    sl->sl_guid = get_be64(ni, NI_NODE_GUID_OFFS);
+    sl->sl_desc = r + NR_NODE_DESC_OFFS;
+    sl->sl_type = get_u8(ni, NI_NODE_TYPE_OFFS);
+    sl->sl_port = get_u8(ni, NI_LOCAL_PORT_OFFS);
+  }
+}
+
+/* Only CA ports' link width and speed are wanted. */
+static void sa_join_port_info(struct sa_lid *sl_vec, const struct sa_table *st)
+{
+  size_t i;
+
+  for (i = 0; i < st->st_count; i++) {
+    const char *r = st->st_recs + i * st->st_stride;
+    const char *pi = r + PIR_PORT_INFO_OFFS;
+    struct sa_lid *sl = &sl_vec[get_be16(r, PIR_LID_OFFS)];
+
+    if (sl->sl_type != NI_TYPE_CA || get_u8(r, PIR_PORT_OFFS) != sl->sl_port)
+      continue;
+
+    sl->sl_width = get_u8(pi, PI_LINK_WIDTH_ACTIVE_OFFS);
+    sl->sl_speed = get_u8(pi, PI_LINK_SPEED_ACTIVE_OFFS) >> 4;
+    if (get_be32(pi, PI_CAP_MASK_OFFS) & PI_CAP_EXT_SPEEDS)
+      sl->sl_speed_ext = get_u8(pi, PI_LINK_SPEED_EXT_OFFS) >> 4;
+  }
+}
+
+static void sa_join_links(struct sa_lid *sl_vec, const struct sa_table *st)
+{
+  size_t i;
+
+  for (i = 0; i < st->st_count; i++) {
+    const char *r = st->st_recs + i * st->st_stride;
+    struct sa_lid *sl = &sl_vec[get_be16(r, LR_FROM_LID_OFFS)];
+    uint16_t to_lid = get_be16(r, LR_TO_LID_OFFS);
+
+    if (sl->sl_type != NI_TYPE_CA ||
+        get_u8(r, LR_FROM_PORT_OFFS) != sl->sl_port ||
+        sl_vec[to_lid].sl_type != NI_TYPE_SWITCH)
+      continue;
+
+    sl->sl_sw_lid = to_lid;
+    sl->sl_sw_port = get_u8(r, LR_TO_PORT_OFFS);
+  }
+}
+
+/* Order CAs' LIDs by switch GUID and port, as ibnetdiscover does.
+   arg is the LID vector. */
+static int sa_lid_cmp(const void *p1, const void *p2, void *arg)
+{
+  const struct sa_lid *sl_vec = arg;
+  const struct sa_lid *l1 = &sl_vec[*(const uint16_t *) p1];
+  const struct sa_lid *l2 = &sl_vec[*(const uint16_t *) p2];
+  uint64_t g1 = sl_vec[l1->sl_sw_lid].sl_guid;
+  uint64_t g2 = sl_vec[l2->sl_sw_lid].sl_guid;
+
+  if (g1 != g2)
+    return g1 < g2 ? -1 : 1;
+
+  if (l1->sl_sw_port != l2->sl_sw_port)
+    return l1->sl_sw_port < l2->sl_sw_port ? -1 : 1;
+
+  return 0;
+}
+
+static int sa_write_info(const struct sa_lid *sl_vec, FILE *info_file)
+{
+  uint16_t *ca_vec;
+  size_t nr_cas = 0, lid, i;
+
+  ca_vec = malloc(SA_NR_LIDS * sizeof(ca_vec[0]));
+  if (ca_vec == NULL)
+    OOM();
+
+  for (lid = 1; lid < SA_NR_LIDS; lid++)
+    if (sl_vec[lid].sl_type == NI_TYPE_CA && sl_vec[lid].sl_sw_lid != 0)
+      ca_vec[nr_cas++] = lid;
+
+  qsort_r(ca_vec, nr_cas, sizeof(ca_vec[0]), &sa_lid_cmp,
+          (void *) sl_vec);
+
+  for (i = 0; i < nr_cas; i++) {
+    const struct sa_lid *sl = &sl_vec[ca_vec[i]];
+    const struct sa_lid *sw = &sl_vec[sl->sl_sw_lid];
+    char desc[SMP_DATA_SIZE + 1], link[32];
+    struct net_info_port np = {
+      .np_host = desc,
+      .np_hca_guid = sl->sl_guid,
+      .np_hca_lid = ca_vec[i],
+      .np_hca_port = sl->sl_port,
+      .np_sw_guid = sw->sl_guid,
+      .np_sw_lid = sl->sl_sw_lid,
+      .np_sw_port = sl->sl_sw_port,
+      .np_link = link,
+    };
+
+    memcpy(desc, sl->sl_desc, SMP_DATA_SIZE);
+    desc[SMP_DATA_SIZE] = 0;
+    chop(desc, ' ');
+    if (*desc == 0) {
+      ERROR("no description for CA "P_GUID" on switch "P_GUID" port %u\n",
+            sl->sl_guid, sw->sl_guid, sl->sl_sw_port);
+      continue;
+    }
+
+    snprintf(link, sizeof(link), "%sx%s", net_info_width_str(sl->sl_width),
+             net_info_speed_str(sl->sl_speed, sl->sl_speed_ext));
+
+    np.np_host_len = strlen(desc);
+    np.np_link_len = strlen(link);
+    net_info_write(info_file, &np);
+  }
+
+  free(ca_vec);
+
+  return ferror(info_file) ? -1 : 0;
+}
+
+int sa_disc_to_info(struct umad_io *io, const struct sa_disc_conf *sc,
+                    FILE *info_file)
+{
+  struct sa_query sq_vec[SA_NR_QUERIES] = {
+    { .sq_attr = SA_ATTR_NODE_RECORD, .sq_min_size = NR_SIZE, },
+    { .sq_attr = SA_ATTR_PORT_INFO_RECORD, .sq_min_size = PIR_SIZE, },
+    { .sq_attr = SA_ATTR_LINK_RECORD, .sq_min_size = LR_SIZE, },
+  };
+  struct sa_lid *sl_vec = NULL;
+  uint32_t trid = time(NULL) << 8;
+  double start = sa_now();
+  size_t i;
+  int rc = -1;
+
+  for (i = 0; i < SA_NR_QUERIES; i++)
+    sq_vec[i].sq_trid = trid + i;
+
+  if (sa_fetch(io, sc, sq_vec, SA_NR_QUERIES) < 0)
+    goto out;
+
+  TRACE("%zu nodes, %zu ports, %zu links in %f s\n",
+        sq_vec[0].sq_table.st_count, sq_vec[1].sq_table.st_count,
+        sq_vec[2].sq_table.st_count, sa_now() - start);
+
+  if (sc->sc_save_path != NULL &&
+      sa_save(sc->sc_save_path, sq_vec, SA_NR_QUERIES) < 0)
+    goto out;
+
+  /* Nodes first, so ports and links know what their LIDs are. */
+  sl_vec = calloc(SA_NR_LIDS, sizeof(sl_vec[0]));
+  if (sl_vec == NULL)
+    OOM();
+
+  sa_join_nodes(sl_vec, &sq_vec[0].sq_table);
+  sa_join_port_info(sl_vec, &sq_vec[1].sq_table);
+  sa_join_links(sl_vec, &sq_vec[2].sq_table);
+
+  rc = sa_write_info(sl_vec, info_file);
+
+ out:
+  for (i = 0; i < SA_NR_QUERIES; i++)
+    free(sq_vec[i].sq_buf);
+
+  free(sl_vec);
+
+  return rc;
+}
@@ -0,0 +1,28 @@
+#ifndef _SA_DISC_H_
+#define _SA_DISC_H_
+#include <stdint.h>
+#include <stdio.h>
+#include "umad-io.h"
+
+/* Fabric discovery from the subnet administrator, for make-net-info
+   -a: the NodeRecord, PortInfoRecord, and LinkRecord tables, each
+   fetched by one GetTable (an RMPP transfer, reassembled by the
+   kernel), joined in memory by LID.  Much less traffic than walking
+   the fabric, but only as current as the SM's last sweep. */
+
+struct sa_disc_conf {
+  int sc_agent_id;          /* An SA (RMPP) agent on io's port. */
+  uint16_t sc_sm_lid;
+  uint8_t sc_sm_sl;
+  int sc_timeout_ms;
+  int sc_retries;
+  const char *sc_save_path; /* Save the tables there (see sa-dump.h). */
+};
+
+/* Fetch the tables through io and write a net info line (see
+   net-disc.h) for each CA port attached to a switch, in switch GUID
+   and port order. */
+int sa_disc_to_info(struct umad_io *io, const struct sa_disc_conf *sc,
+                    FILE *info_file);
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "mad-codec.h"
+#include "sa-dump.h"
+
+#define SA_DUMP_HDR_SIZE 8
+
+int sa_dump_write_magic(FILE *file)
+{
+  if (fwrite(SA_DUMP_MAGIC, strlen(SA_DUMP_MAGIC), 1, file) != 1)
+    return -1;
+
+  return 0;
+}
+
+int sa_dump_write_hdr(FILE *file, unsigned int attr, size_t stride,
+                      size_t count)
+{
+  char hdr[SA_DUMP_HDR_SIZE];
+
+  if (stride == 0 || stride > UINT16_MAX || count > UINT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  put_be16(hdr, 0, attr);
+  put_be16(hdr, 2, stride);
+  put_be32(hdr, 4, count);
+
+  if (fwrite(hdr, sizeof(hdr), 1, file) != 1)
+    return -1;
+
+  return 0;
+}
+
+int sa_dump_write_table(FILE *file, const struct sa_table *st)
+{
+  if (sa_dump_write_hdr(file, st->st_attr, st->st_stride, st->st_count) < 0)
+    return -1;
+
+  if (st->st_count > 0 &&
+      fwrite(st->st_recs, st->st_stride, st->st_count, file) != st->st_count)
+    return -1;
+
+  return 0;
+}
+
+int sa_dump_load(struct sa_dump *sd, const char *path)
+{
+  struct stat stat_buf;
+  size_t offs;
+  int fd = -1;
+
+  memset(sd, 0, sizeof(*sd));
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    goto err;
+
+  if (fstat(fd, &stat_buf) < 0)
+    goto err;
+
+  if (stat_buf.st_size < strlen(SA_DUMP_MAGIC)) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  sd->sd_size = stat_buf.st_size;
+  sd->sd_map = mmap(NULL, sd->sd_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (sd->sd_map == MAP_FAILED) {
+    sd->sd_map = NULL;
+    goto err;
+  }
+
+  close(fd);
+  fd = -1;
+
+  if (memcmp(sd->sd_map, SA_DUMP_MAGIC, strlen(SA_DUMP_MAGIC)) != 0) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  offs = strlen(SA_DUMP_MAGIC);
+  while (offs < sd->sd_size) {
+    const char *hdr = (const char *) sd->sd_map + offs;
+    struct sa_table *st;
+
+    if (!(sd->sd_nr_tables < SA_DUMP_MAX_TABLES) ||
+        sd->sd_size - offs < SA_DUMP_HDR_SIZE) {
+      errno = EINVAL;
+      goto err;
+    }
+
+    st = &sd->sd_tables[sd->sd_nr_tables++];
+    st->st_attr = get_be16(hdr, 0);
+    st->st_stride = get_be16(hdr, 2);
+    st->st_count = get_be32(hdr, 4);
+    st->st_recs = hdr + SA_DUMP_HDR_SIZE;
+    offs += SA_DUMP_HDR_SIZE;
+
+    if (st->st_stride == 0 ||
+        (sd->sd_size - offs) / st->st_stride < st->st_count) {
+      errno = EINVAL;
+      goto err;
+    }
+
+    offs += st->st_stride * st->st_count;
+  }
+
+  return 0;
+
+ err:
+  if (fd >= 0)
+    close(fd);
+
+  sa_dump_free(sd);
+
+  return -1;
+}
+
+void sa_dump_free(struct sa_dump *sd)
+{
+  int saved_errno = errno;
+
+  if (sd->sd_map != NULL)
+    munmap(sd->sd_map, sd->sd_size);
+
+  memset(sd, 0, sizeof(*sd));
+  errno = saved_errno;
+}
+
+const struct sa_table *sa_dump_find(const struct sa_dump *sd,
+                                    unsigned int attr)
+{
+  size_t i;
+
+  for (i = 0; i < sd->sd_nr_tables; i++)
+    if (sd->sd_tables[i].st_attr == attr)
+      return &sd->sd_tables[i];
+
+  return NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef _SA_DUMP_H_
+#define _SA_DUMP_H_
+#include <stddef.h>
+#include <stdio.h>
+
+/* SA tables as GetTable returns them, for the simulator's stand-in SA
+   (sim:sa=PATH).  make-net-info -a -s PATH saves the tables it fetches
+   and make-fabric -a writes a synthetic fabric's.  A dump is
+   SA_DUMP_MAGIC followed by tables, each a header of big-endian
+   attribute ID (16 bits), record stride in bytes (16), and record
+   count (32), then the records at that stride. */
+
+#define SA_DUMP_MAGIC "IBSADMP1"
+#define SA_DUMP_MAX_TABLES 8
+
+struct sa_table {
+  unsigned int st_attr;
+  size_t st_stride;
+  size_t st_count;
+  const char *st_recs;
+};
+
+struct sa_dump {
+  void *sd_map;
+  size_t sd_size;
+  struct sa_table sd_tables[SA_DUMP_MAX_TABLES];
+  size_t sd_nr_tables;
+};
+
+int sa_dump_write_magic(FILE *file);
+
+/* To be followed by count records of stride bytes. */
+int sa_dump_write_hdr(FILE *file, unsigned int attr, size_t stride,
+                      size_t count);
+
+int sa_dump_write_table(FILE *file, const struct sa_table *st);
+
+/* Read the dump at path.  Returns -1 (with errno set) if it's missing
+   or malformed. */
+int sa_dump_load(struct sa_dump *sd, const char *path);
+
+void sa_dump_free(struct sa_dump *sd);
+
+/* The table of attr, or NULL. */
+const struct sa_table *sa_dump_find(const struct sa_dump *sd,
+                                    unsigned int attr);
+
+#endif
@@ -0,0 +1,284 @@
+#include <stddef.h>
+#include <string.h>
+#include "trace.h"
+#include "list.h"
+#include "sched.h"
+
+#define SCHED_WINDOW_MIN 1
+#define SCHED_BURST_SECONDS 0.01
+#define SCHED_RTO_INIT 0.1
+#define SCHED_RTO_MIN 0.005
+#define SCHED_RTO_MAX 1.0
+#define SCHED_CLOCK_GRANULARITY 0.001
+
+void sched_init(struct sched *s, size_t window, size_t window_max,
+                double rate, size_t target_max)
+{
+  memset(s, 0, sizeof(*s));
+  INIT_LIST_HEAD(&s->s_targets);
+  INIT_LIST_HEAD(&s->s_ready);
+
+  if (target_max < 1)
+    target_max = 1;
+  s->s_target_max = target_max;
+
+  if (window_max < SCHED_WINDOW_MIN)
+    window_max = SCHED_WINDOW_MIN;
+  if (window < SCHED_WINDOW_MIN)
+    window = SCHED_WINDOW_MIN;
+  if (window > window_max)
+    window = window_max;
+
+  s->s_window = window;
+  s->s_ssthresh = window_max;
+  s->s_window_min = SCHED_WINDOW_MIN;
+  s->s_window_max = window_max;
+  s->s_nr_since_cut = window_max;
+
+  s->s_rto_init = SCHED_RTO_INIT;
+  s->s_rto_min = SCHED_RTO_MIN;
+  s->s_rto_max = SCHED_RTO_MAX;
+
+  if (rate > 0) {
+    s->s_rate = rate;
+    s->s_burst = rate * SCHED_BURST_SECONDS;
+    if (s->s_burst < 1)
+      s->s_burst = 1;
+    s->s_tokens = s->s_burst;
+  }
+}
+
+void sched_target_init(struct sched *s, struct sched_target *t, unsigned int lid)
+{
+  memset(t, 0, sizeof(*t));
+  INIT_LIST_HEAD(&t->t_ready_link);
+  INIT_LIST_HEAD(&t->t_queue);
+  t->t_lid = lid;
+  t->t_rto = s->s_rto_init;
+  list_add_tail(&t->t_link, &s->s_targets);
+}
+
+void sched_rto_init(struct sched *s, double rto_init, double rto_min, double rto_max)
+{
+  if (rto_min > 0)
+    s->s_rto_min = rto_min;
+  if (rto_max > 0)
+    s->s_rto_max = rto_max;
+  if (s->s_rto_max < s->s_rto_min)
+    s->s_rto_max = s->s_rto_min;
+
+  s->s_rto_init = rto_init > 0 ? rto_init : SCHED_RTO_INIT;
+  if (s->s_rto_init < s->s_rto_min)
+    s->s_rto_init = s->s_rto_min;
+  if (s->s_rto_init > s->s_rto_max)
+    s->s_rto_init = s->s_rto_max;
+}
+
+void sched_rtt_sample(struct sched *s, struct sched_target *t, double rtt)
+{
+  double var;
+
+  if (t->t_nr_samples++ == 0) {
+    t->t_srtt = rtt;
+    t->t_rttvar = rtt / 2;
+  } else {
+    double err = t->t_srtt - rtt;
+    t->t_rttvar = 0.75 * t->t_rttvar + 0.25 * (err < 0 ? -err : err);
+    t->t_srtt = 0.875 * t->t_srtt + 0.125 * rtt;
+  }
+
+  var = 4 * t->t_rttvar;
+  if (var < SCHED_CLOCK_GRANULARITY)
+    var = SCHED_CLOCK_GRANULARITY;
+
+  t->t_rto = t->t_srtt + var;
+  if (t->t_rto < s->s_rto_min)
+    t->t_rto = s->s_rto_min;
+  if (t->t_rto > s->s_rto_max)
+    t->t_rto = s->s_rto_max;
+}
+
+/* Put t on the tail of the ready list if it has something queued and
+   is under its cap, take it off otherwise. */
+static void sched_target_update(struct sched *s, struct sched_target *t)
+{
+  int ready = !list_empty(&t->t_queue) && t->t_nr_outstanding < s->s_target_max;
+
+  if (ready && list_empty(&t->t_ready_link))
+    list_add_tail(&t->t_ready_link, &s->s_ready);
+  else if (!ready && !list_empty(&t->t_ready_link))
+    list_del_init(&t->t_ready_link);
+}
+
+static void sched_target_put(struct sched *s, struct sched_target *t)
+{
+  if (t == NULL)
+    return;
+
+  if (t->t_nr_outstanding > 0)
+    t->t_nr_outstanding--;
+
+  sched_target_update(s, t);
+}
+
+static void sched_sample_window(struct sched *s)
+{
+  if (s->s_nr_window_samples == 0 || s->s_window < s->s_window_lo)
+    s->s_window_lo = s->s_window;
+  if (s->s_nr_window_samples == 0 || s->s_window > s->s_window_hi)
+    s->s_window_hi = s->s_window;
+
+  s->s_window_sum += s->s_window;
+  s->s_nr_window_samples++;
+}
+
+void sched_pass_begin(struct sched *s, double now)
+{
+  struct sched_target *t;
+
+  list_for_each_entry(t, &s->s_targets, t_link) {
+    while (!list_empty(&t->t_queue))
+      list_del_init(t->t_queue.next);
+    INIT_LIST_HEAD(&t->t_ready_link);
+  }
+
+  INIT_LIST_HEAD(&s->s_ready);
+  s->s_nr_queued = 0;
+  s->s_nr_sent = 0;
+  s->s_nr_acked = 0;
+  s->s_nr_lost = 0;
+  s->s_window_lo = s->s_window;
+  s->s_window_hi = s->s_window;
+  s->s_window_sum = 0;
+  s->s_nr_window_samples = 0;
+  s->s_token_time = now;
+}
+
+void sched_enqueue(struct sched *s, struct sched_target *t, struct list_head *item)
+{
+  list_add_tail(item, &t->t_queue);
+  s->s_nr_queued++;
+  sched_target_update(s, t);
+}
+
+int sched_may_send(struct sched *s, double now, double *wait)
+{
+  if (s->s_nr_outstanding >= (size_t) s->s_window)
+    return -1;
+
+  if (s->s_rate <= 0)
+    return 0;
+
+  if (now > s->s_token_time) {
+    s->s_tokens += (now - s->s_token_time) * s->s_rate;
+    if (s->s_tokens > s->s_burst)
+      s->s_tokens = s->s_burst;
+    s->s_token_time = now;
+  }
+
+  if (s->s_tokens >= 1)
+    return 0;
+
+  *wait = (1 - s->s_tokens) / s->s_rate;
+
+  return -1;
+}
+
+struct list_head *sched_next(struct sched *s, double now, double *wait,
+                             struct sched_target **tp)
+{
+  struct sched_target *t;
+  struct list_head *item;
+
+  if (list_empty(&s->s_ready))
+    return NULL;
+
+  if (sched_may_send(s, now, wait) < 0)
+    return NULL;
+
+  t = list_entry(s->s_ready.next, struct sched_target, t_ready_link);
+  item = t->t_queue.next;
+  list_del_init(item);
+  s->s_nr_queued--;
+
+  t->t_nr_outstanding++;
+  list_del_init(&t->t_ready_link);
+  sched_target_update(s, t);
+
+  *tp = t;
+
+  return item;
+}
+
+void sched_sent(struct sched *s)
+{
+  s->s_nr_outstanding++;
+  s->s_nr_sent++;
+
+  if (s->s_rate > 0)
+    s->s_tokens -= 1;
+
+  sched_sample_window(s);
+}
+
+void sched_release(struct sched *s, struct sched_target *t)
+{
+  sched_target_put(s, t);
+}
+
+void sched_abandon(struct sched *s, struct sched_target *t)
+{
+  sched_target_put(s, t);
+
+  if (s->s_nr_outstanding > 0)
+    s->s_nr_outstanding--;
+}
+
+void sched_acked(struct sched *s, struct sched_target *t)
+{
+  sched_target_put(s, t);
+
+  if (s->s_nr_outstanding > 0)
+    s->s_nr_outstanding--;
+  s->s_nr_acked++;
+  s->s_nr_since_cut++;
+
+  if (s->s_window < s->s_ssthresh)
+    s->s_window += 1;
+  else
+    s->s_window += 1 / s->s_window;
+
+  if (s->s_window > s->s_window_max)
+    s->s_window = s->s_window_max;
+}
+
+void sched_lost(struct sched *s, struct sched_target *t)
+{
+  sched_target_put(s, t);
+
+  if (t != NULL) {
+    t->t_nr_timeouts++;
+    t->t_rto *= 2;
+    if (t->t_rto > s->s_rto_max)
+      t->t_rto = s->s_rto_max;
+  }
+
+  if (s->s_nr_outstanding > 0)
+    s->s_nr_outstanding--;
+  s->s_nr_lost++;
+
+  /* Timeouts come in bunches; only back off once per window. */
+  if (s->s_nr_since_cut++ < (size_t) s->s_window)
+    return;
+
+  s->s_nr_since_cut = 0;
+  s->s_ssthresh = s->s_window / 2;
+  if (s->s_ssthresh < s->s_window_min)
+    s->s_ssthresh = s->s_window_min;
+
+  s->s_window = s->s_ssthresh;
+
+  TRACE("lost, window %f\n", s->s_window);
+
+  sched_sample_window(s);
+}
@@ -0,0 +1,119 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+#include <stddef.h>
+#include "list.h"
+
+/* Send scheduler for PMA queries.  Caps the number of outstanding
+   MADs with an AIMD window (slow start up to s_ssthresh, then one
+   MAD per window of responses; halved on timeouts) and,
+   optionally, the global send rate with a token bucket.  The window
+   and threshold persist across passes so that continuous mode
+   converges on what the fabric can take.
+
+   Queries are queued per target (destination LID).  At most
+   s_target_max MADs are outstanding to any one target, and sends are
+   taken round robin from the targets that are under that cap, so
+   that no single switch PMA sees a burst.
+
+   Each target also keeps a smoothed round trip time and variance
+   from which its retransmission timeout is computed as in RFC 6298:
+   rto = srtt + 4 * rttvar, clamped to [s_rto_min, s_rto_max], and
+   doubled on every timeout until the next good sample. */
+
+struct sched_target {
+  struct list_head t_link;
+  struct list_head t_ready_link;
+  struct list_head t_queue;
+  size_t t_nr_outstanding;
+  unsigned int t_lid;
+  double t_srtt;
+  double t_rttvar;
+  double t_rto;
+  size_t t_nr_samples;
+  size_t t_nr_timeouts;
+};
+
+struct sched {
+  double s_window;
+  double s_ssthresh;
+  size_t s_window_min;
+  size_t s_window_max;
+  size_t s_nr_outstanding;
+  size_t s_nr_since_cut;
+  size_t s_target_max;
+  size_t s_nr_queued;
+  struct list_head s_targets;
+  struct list_head s_ready;
+
+  double s_rto_init;
+  double s_rto_min;
+  double s_rto_max;
+
+  double s_rate; /* MADs per second, 0 for unlimited. */
+  double s_burst;
+  double s_tokens;
+  double s_token_time;
+
+  /* Per pass. */
+  size_t s_nr_sent;
+  size_t s_nr_acked;
+  size_t s_nr_lost;
+  double s_window_lo;
+  double s_window_hi;
+  double s_window_sum;
+  size_t s_nr_window_samples;
+};
+
+void sched_init(struct sched *s, size_t window, size_t window_max,
+                double rate, size_t target_max);
+void sched_target_init(struct sched *s, struct sched_target *t, unsigned int lid);
+
+/* Must be called before any targets are initialized.  In seconds; 0
+   keeps the default (0.1, 0.005, and 1). */
+void sched_rto_init(struct sched *s, double rto_init, double rto_min, double rto_max);
+
+/* Empties all target queues. */
+void sched_pass_begin(struct sched *s, double now);
+
+void sched_enqueue(struct sched *s, struct sched_target *t, struct list_head *item);
+
+/* Returns 0 if a MAD may be sent now.  Otherwise returns -1 and, if
+   the rate budget is what stops us, sets *wait to the number of
+   seconds until it won't; if the window is full *wait is untouched. */
+int sched_may_send(struct sched *s, double now, double *wait);
+
+/* Dequeues the next item to send, or returns NULL if the window, the
+   rate budget, or the per target caps say we must wait.  The item
+   counts against its target (returned in *tp) until it is passed to
+   sched_acked(), sched_lost(), sched_release(), or sched_abandon(). */
+struct list_head *sched_next(struct sched *s, double now, double *wait,
+                             struct sched_target **tp);
+
+void sched_sent(struct sched *s);
+
+/* Forget an item that could not be sent. */
+void sched_release(struct sched *s, struct sched_target *t);
+
+/* Forget a sent item without learning anything from it, because we
+   gave up waiting at the end of a pass.  Frees its window slot. */
+void sched_abandon(struct sched *s, struct sched_target *t);
+
+/* t may be NULL if the response can't be matched to a target.
+   sched_lost() backs off the target's RTO. */
+void sched_acked(struct sched *s, struct sched_target *t);
+void sched_lost(struct sched *s, struct sched_target *t);
+
+void sched_rtt_sample(struct sched *s, struct sched_target *t, double rtt);
+
+static inline int sched_pass_done(const struct sched *s)
+{
+  return s->s_nr_queued == 0 && s->s_nr_acked + s->s_nr_lost >= s->s_nr_sent;
+}
+
+static inline double sched_window_mean(const struct sched *s)
+{
+  return s->s_nr_window_samples != 0 ?
+    s->s_window_sum / s->s_nr_window_samples : s->s_window;
+}
+
+#endif
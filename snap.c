@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "snap.h"
+
+#define SNAP_READ_TRIES 16
+
+static inline struct snap_buf *snap_buf(struct snap *sn, unsigned int i)
+{
+  return (struct snap_buf *)
+    ((char *) (sn->sn_hdr + 1) + i * sn->sn_hdr->sp_buf_size);
+}
+
+int snap_create(struct snap *sn, const char *name,
+                size_t max_hosts, size_t max_jobs)
+{
+  size_t buf_size;
+  int fd = -1;
+
+  memset(sn, 0, sizeof(*sn));
+
+  buf_size = sizeof(struct snap_buf) + max_hosts * sizeof(struct snap_host) +
+    max_jobs * sizeof(struct snap_job);
+  buf_size = (buf_size + 63) & ~(size_t) 63;
+
+  sn->sn_size = sizeof(struct snap_hdr) + 2 * buf_size;
+  sn->sn_name = strdup(name);
+  if (sn->sn_name == NULL)
+    goto err;
+
+  /* Readers of an old object keep their mapping and see its writer
+     gone, rather than having it resized under them. */
+  shm_unlink(name);
+
+  fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+  if (fd < 0)
+    goto err;
+
+  if (fchmod(fd, 0644) < 0 || ftruncate(fd, sn->sn_size) < 0)
+    goto err;
+
+  sn->sn_map = mmap(NULL, sn->sn_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (sn->sn_map == MAP_FAILED) {
+    sn->sn_map = NULL;
+    goto err;
+  }
+
+  close(fd);
+  sn->sn_writer = 1;
+
+  sn->sn_hdr = sn->sn_map;
+  sn->sn_hdr->sp_max_hosts = max_hosts;
+  sn->sn_hdr->sp_max_jobs = max_jobs;
+  sn->sn_hdr->sp_buf_size = buf_size;
+  sn->sn_hdr->sp_pid = getpid();
+
+  /* Readers check the magic last. */
+  __atomic_store_n(&sn->sn_hdr->sp_magic, SNAP_MAGIC, __ATOMIC_RELEASE);
+
+  return 0;
+
+ err:
+  if (fd >= 0) {
+    close(fd);
+    shm_unlink(name);
+  }
+  snap_close(sn);
+
+  return -1;
+}
+
+struct snap_buf *snap_begin(struct snap *sn)
+{
+  unsigned int cur = __atomic_load_n(&sn->sn_hdr->sp_cur, __ATOMIC_RELAXED);
+  struct snap_buf *sb = snap_buf(sn, !cur);
+
+  __atomic_store_n(&sb->sb_seq, sb->sb_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  return sb;
+}
+
+void snap_commit(struct snap *sn, struct snap_buf *sb)
+{
+  unsigned int cur = __atomic_load_n(&sn->sn_hdr->sp_cur, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&sb->sb_seq, sb->sb_seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&sn->sn_hdr->sp_cur, !cur, __ATOMIC_RELEASE);
+}
+
+int snap_open(struct snap *sn, const char *name)
+{
+  struct stat stat_buf;
+  int fd = -1;
+
+  memset(sn, 0, sizeof(*sn));
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    goto err;
+
+  if (fstat(fd, &stat_buf) < 0)
+    goto err;
+
+  if (stat_buf.st_size < sizeof(struct snap_hdr)) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  /* Only trust snapshots published by root or by us. */
+  if (stat_buf.st_uid != 0 && stat_buf.st_uid != geteuid()) {
+    errno = EPERM;
+    goto err;
+  }
+
+  sn->sn_size = stat_buf.st_size;
+  sn->sn_map = mmap(NULL, sn->sn_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (sn->sn_map == MAP_FAILED) {
+    sn->sn_map = NULL;
+    goto err;
+  }
+
+  close(fd);
+  fd = -1;
+
+  sn->sn_hdr = sn->sn_map;
+
+  if (__atomic_load_n(&sn->sn_hdr->sp_magic, __ATOMIC_ACQUIRE) != SNAP_MAGIC) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  /* The buffers must fit in the object, and the maxima in the buffers. */
+  uint64_t buf_size = sn->sn_hdr->sp_buf_size;
+  uint64_t min_size = sizeof(struct snap_buf) +
+    (uint64_t) sn->sn_hdr->sp_max_hosts * sizeof(struct snap_host) +
+    (uint64_t) sn->sn_hdr->sp_max_jobs * sizeof(struct snap_job);
+
+  if (buf_size > sn->sn_size ||
+      sn->sn_size < sizeof(struct snap_hdr) + 2 * buf_size ||
+      buf_size < min_size) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  return 0;
+
+ err:
+  if (fd >= 0)
+    close(fd);
+  snap_close(sn);
+
+  return -1;
+}
+
+int snap_read(struct snap *sn, struct snap_buf **copy)
+{
+  size_t buf_size = sn->sn_hdr->sp_buf_size;
+  int i;
+
+  if (*copy == NULL) {
+    *copy = malloc(buf_size);
+    if (*copy == NULL)
+      return -1;
+  }
+
+  for (i = 0; i < SNAP_READ_TRIES; i++) {
+    unsigned int cur = __atomic_load_n(&sn->sn_hdr->sp_cur, __ATOMIC_ACQUIRE);
+    struct snap_buf *sb = snap_buf(sn, cur);
+    uint32_t seq = __atomic_load_n(&sb->sb_seq, __ATOMIC_ACQUIRE);
+
+    /* Nothing published yet, or being rewritten. */
+    if (seq == 0 || (seq & 1))
+      goto again;
+
+    memcpy(*copy, sb, buf_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&sb->sb_seq, __ATOMIC_RELAXED) != seq)
+      goto again;
+
+    if ((*copy)->sb_nr_hosts > sn->sn_hdr->sp_max_hosts ||
+        (*copy)->sb_nr_jobs > sn->sn_hdr->sp_max_jobs)
+      goto again;
+
+    return 0;
+
+  again:
+    usleep(1000);
+  }
+
+  errno = EAGAIN;
+
+  return -1;
+}
+
+int snap_alive(struct snap *sn)
+{
+  pid_t pid = sn->sn_hdr->sp_pid;
+
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+void snap_close(struct snap *sn)
+{
+  if (sn->sn_map != NULL)
+    munmap(sn->sn_map, sn->sn_size);
+
+  if (sn->sn_writer && sn->sn_name != NULL)
+    shm_unlink(sn->sn_name);
+
+  free(sn->sn_name);
+  memset(sn, 0, sizeof(*sn));
+}
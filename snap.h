@@ -0,0 +1,91 @@
+#ifndef _SNAP_H_
+#define _SNAP_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Snapshots of per host and per job rates published by ibtopd in a
+   POSIX shared memory object.  There are two buffers: the writer
+   fills the one readers aren't pointed at, then flips sp_cur.  Each
+   buffer also has its own sequence count (odd while being written),
+   so a reader that is slow enough to race the next write to the same
+   buffer notices and retries. */
+
+#define SNAP_MAGIC 0x3250414e53424949ULL /* "IIBSNAP2" */
+#define SNAP_NAME_MAX 64
+#define SNAP_NR_CTRS 4
+
+struct snap_host {
+  char hs_name[SNAP_NAME_MAX];
+  uint32_t hs_job;   /* Index into jobs, or -1. */
+  uint32_t hs_valid;
+  double hs_rate[SNAP_NR_CTRS];
+};
+
+struct snap_job {
+  char js_name[SNAP_NAME_MAX];
+  char js_owner[SNAP_NAME_MAX];
+};
+
+struct snap_buf {
+  uint32_t sb_seq;
+  uint32_t sb_nr_hosts;
+  uint32_t sb_nr_jobs;
+  uint32_t sb_pad;
+  double sb_time;     /* Realtime of the closing sample. */
+  double sb_interval;
+  double sb_skew;     /* Sweep skew of the closing sample. */
+  /* struct snap_host hosts[sp_max_hosts]; */
+  /* struct snap_job jobs[sp_max_jobs]; */
+};
+
+struct snap_hdr {
+  uint64_t sp_magic;
+  uint32_t sp_max_hosts;
+  uint32_t sp_max_jobs;
+  uint64_t sp_buf_size;
+  uint32_t sp_cur;
+  int32_t sp_pid;
+};
+
+struct snap {
+  void *sn_map;
+  size_t sn_size;
+  struct snap_hdr *sn_hdr;
+  char *sn_name;
+  int sn_writer;
+};
+
+static inline struct snap_host *snap_buf_hosts(struct snap_buf *sb)
+{
+  return (struct snap_host *) (sb + 1);
+}
+
+static inline struct snap_job *snap_buf_jobs(struct snap_buf *sb,
+                                             size_t max_hosts)
+{
+  return (struct snap_job *) (snap_buf_hosts(sb) + max_hosts);
+}
+
+/* Writer.  Replaces any existing object called name. */
+int snap_create(struct snap *sn, const char *name,
+                size_t max_hosts, size_t max_jobs);
+
+/* Returns the buffer to fill in, then published by snap_commit(). */
+struct snap_buf *snap_begin(struct snap *sn);
+void snap_commit(struct snap *sn, struct snap_buf *sb);
+
+/* Reader. */
+int snap_open(struct snap *sn, const char *name);
+
+/* Copy the current buffer into *copy (malloced, sp_buf_size bytes).
+   Returns -1 if no consistent copy could be had. */
+int snap_read(struct snap *sn, struct snap_buf **copy);
+
+/* Returns 1 if the writer is still around. */
+int snap_alive(struct snap *sn);
+
+/* Unmaps the object, and removes it if we created it. */
+void snap_close(struct snap *sn);
+
+#endif
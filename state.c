@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "string1.h"
+#include "trace.h"
+#include "state.h"
+
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+static int boot_id(char *buf, size_t size)
+{
+  ssize_t nr;
+  int fd = open(BOOT_ID_PATH, O_RDONLY);
+
+  memset(buf, 0, size);
+
+  if (fd < 0)
+    return -1;
+
+  nr = read(fd, buf, size - 1);
+  close(fd);
+
+  if (nr <= 0)
+    return -1;
+
+  chop(buf, '\n');
+
+  return 0;
+}
+
+static inline int state_key_cmp(uint64_t g1, uint8_t p1, uint64_t g2, uint8_t p2)
+{
+  if (g1 != g2)
+    return g1 < g2 ? -1 : 1;
+
+  return (int) p1 - (int) p2;
+}
+
+/* Newest first for equal keys. */
+static int state_ent_cmp(const void *p1, const void *p2)
+{
+  const struct state_ent *e1 = p1, *e2 = p2;
+  int c = state_key_cmp(e1->se_guid, e1->se_port, e2->se_guid, e2->se_port);
+
+  if (c != 0)
+    return c;
+
+  if (e1->se_time != e2->se_time)
+    return e1->se_time > e2->se_time ? -1 : 1;
+
+  return 0;
+}
+
+int state_open(struct state *st, const char *path)
+{
+  char id[sizeof(st->st_hdr->sh_boot_id)];
+  struct stat stat_buf;
+  int fd = -1;
+
+  memset(st, 0, sizeof(*st));
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    goto err;
+
+  if (fstat(fd, &stat_buf) < 0)
+    goto err;
+
+  if (stat_buf.st_size < sizeof(struct state_hdr)) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  st->st_size = stat_buf.st_size;
+  st->st_map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (st->st_map == MAP_FAILED) {
+    st->st_map = NULL;
+    goto err;
+  }
+
+  close(fd);
+  fd = -1;
+
+  st->st_hdr = st->st_map;
+  st->st_ents = (const struct state_ent *) (st->st_hdr + 1);
+  st->st_nr_ents = st->st_hdr->sh_nr_ents;
+
+  if (st->st_hdr->sh_magic != STATE_MAGIC ||
+      st->st_hdr->sh_ent_size != sizeof(struct state_ent) ||
+      st->st_size < sizeof(struct state_hdr) +
+                    st->st_nr_ents * sizeof(struct state_ent)) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  /* Monotonic times from another boot are meaningless. */
+  if (boot_id(id, sizeof(id)) < 0 ||
+      strncmp(id, st->st_hdr->sh_boot_id, sizeof(id)) != 0) {
+    errno = ESTALE;
+    goto err;
+  }
+
+  return 0;
+
+ err:
+  if (fd >= 0)
+    close(fd);
+  state_close(st);
+
+  return -1;
+}
+
+void state_close(struct state *st)
+{
+  if (st->st_map != NULL)
+    munmap(st->st_map, st->st_size);
+
+  memset(st, 0, sizeof(*st));
+}
+
+const struct state_ent *state_lookup(const struct state *st,
+                                     uint64_t guid, uint8_t port)
+{
+  size_t lo = 0, hi = st->st_nr_ents;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const struct state_ent *e = &st->st_ents[mid];
+    int c = state_key_cmp(guid, port, e->se_guid, e->se_port);
+
+    if (c == 0)
+      return e;
+    else if (c < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  return NULL;
+}
+
+int state_save(const char *path, struct state_ent *ents, size_t nr_ents,
+               double now, double max_age)
+{
+  int rc = -1;
+  char *tmp_path = NULL;
+  FILE *tmp_file = NULL;
+  int tmp_fd = -1;
+  struct state old;
+  struct state_ent *vec = NULL;
+  size_t i, nr = 0;
+
+  /* Keep what others (or earlier runs) saved for ports we didn't
+     sample, as long as it's still recent. */
+  if (state_open(&old, path) < 0)
+    memset(&old, 0, sizeof(old));
+
+  vec = malloc((nr_ents + old.st_nr_ents + 1) * sizeof(vec[0]));
+  if (vec == NULL)
+    goto out;
+
+  memcpy(vec, ents, nr_ents * sizeof(vec[0]));
+  nr = nr_ents;
+
+  for (i = 0; i < old.st_nr_ents; i++)
+    if (now - old.st_ents[i].se_time <= max_age)
+      vec[nr++] = old.st_ents[i];
+
+  qsort(vec, nr, sizeof(vec[0]), &state_ent_cmp);
+
+  /* Drop all but the newest entry for each key. */
+  size_t k = 0;
+  for (i = 0; i < nr; i++) {
+    if (k > 0 && state_key_cmp(vec[i].se_guid, vec[i].se_port,
+                               vec[k - 1].se_guid, vec[k - 1].se_port) == 0)
+      continue;
+    vec[k++] = vec[i];
+  }
+  nr = k;
+
+  struct state_hdr hdr = {
+    .sh_magic = STATE_MAGIC,
+    .sh_ent_size = sizeof(struct state_ent),
+    .sh_nr_ents = nr,
+    .sh_time = now,
+  };
+
+  if (boot_id(hdr.sh_boot_id, sizeof(hdr.sh_boot_id)) < 0)
+    goto out;
+
+  tmp_path = strf("%s.XXXXXXXX", path);
+  if (tmp_path == NULL)
+    goto out;
+
+  tmp_fd = mkstemp(tmp_path);
+  if (tmp_fd < 0)
+    goto out;
+
+  if (fchmod(tmp_fd, 0644) < 0)
+    goto out;
+
+  tmp_file = fdopen(tmp_fd, "w");
+  if (tmp_file == NULL)
+    goto out;
+  tmp_fd = -1;
+
+  if (fwrite(&hdr, sizeof(hdr), 1, tmp_file) != 1 ||
+      fwrite(vec, sizeof(vec[0]), nr, tmp_file) != nr)
+    goto out;
+
+  if (fclose(tmp_file) != 0) {
+    tmp_file = NULL;
+    goto out;
+  }
+  tmp_file = NULL;
+
+  if (rename(tmp_path, path) < 0)
+    goto out;
+
+  rc = 0;
+
+ out:
+  if (tmp_file != NULL)
+    fclose(tmp_file);
+  if (tmp_fd >= 0)
+    close(tmp_fd);
+  if (rc < 0 && tmp_path != NULL) {
+    int err = errno;
+    unlink(tmp_path);
+    errno = err;
+  }
+  free(tmp_path);
+  free(vec);
+  state_close(&old);
+
+  return rc;
+}
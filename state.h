@@ -0,0 +1,53 @@
+#ifndef _STATE_H_
+#define _STATE_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/* Raw counters of each port as last sampled, keyed by port GUID and
+   number, so that the next run can compute rates after one pass.
+   Times are CLOCK_MONOTONIC and only mean anything within the boot
+   recorded in the header.  Entries are sorted by key. */
+
+#define STATE_MAGIC 0x3154535054424949ULL /* "IIBTPST1" */
+#define STATE_NR_CTRS 4
+
+struct state_hdr {
+  uint64_t sh_magic;
+  uint32_t sh_ent_size;
+  uint32_t sh_nr_ents;
+  double sh_time;
+  char sh_boot_id[40];
+};
+
+struct state_ent {
+  uint64_t se_guid;
+  uint8_t se_port;
+  uint8_t se_pad[7];
+  double se_time;
+  uint64_t se_raw[STATE_NR_CTRS];
+};
+
+struct state {
+  void *st_map;
+  size_t st_size;
+  const struct state_hdr *st_hdr;
+  const struct state_ent *st_ents;
+  size_t st_nr_ents;
+};
+
+/* Map the state file at path.  Returns -1 (with errno set) if it's
+   missing, malformed, or from another boot. */
+int state_open(struct state *st, const char *path);
+
+void state_close(struct state *st);
+
+const struct state_ent *state_lookup(const struct state *st,
+                                     uint64_t guid, uint8_t port);
+
+/* Sort ents and atomically replace the state file at path with them,
+   along with the entries of the current file that are not in ents
+   and are no older than max_age seconds at time now. */
+int state_save(const char *path, struct state_ent *ents, size_t nr_ents,
+               double now, double max_age);
+
+#endif
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Burst sampling through a lossy fabric must keep its window open:
+# with 30% of MADs dropped, well under half of the samples may be
+# lost.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+./make-fabric -n 1000 "$dir"
+
+hosts=$(head -n 8 "$dir/net-info" | awk '{ print $1 }')
+
+./ibtop-sim --net-info="$dir/net-info" --job-map="$dir/job-map" -m -1 \
+  --no-state --io=sim:drop=0.3 --burst=1 --burst-period=0.01 \
+  -l $hosts > "$dir/out"
+
+# 8 hosts, 100 samples each every 10.000 ms over 1.010 s, 300 lost
+set -- $(head -n 1 "$dir/out")
+nr_samples=$(($1 * $3))
+nr_lost=${12}
+
+if [ "$nr_lost" -gt $((nr_samples / 2)) ]; then
+  echo "$0: lost $nr_lost of $nr_samples burst samples" >&2
+  exit 1
+fi
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Directed route discovery of a simulated fabric must write the same
+# net info that make-fabric did.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+./make-fabric -n 1000 "$dir"
+
+./make-net-info -d -i sim:hosts=1000 -o "$dir/out" -b "$dir/db"
+
+if ! cmp -s "$dir/out" "$dir/net-info"; then
+  echo "$0: discovered net info differs" >&2
+  diff "$dir/out" "$dir/net-info" | head >&2
+  exit 1
+fi
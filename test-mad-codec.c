@@ -0,0 +1,363 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <infiniband/mad.h>
+#include "mad-codec.h"
+#include "trace.h"
+
+/* Check mad-codec.h's fixed layout against libibmad's field table,
+   on random MADs, for make check.  Each failure prints the field and
+   exits with status 1. */
+
+#define NR_ROUNDS 1000
+#define NR_BATCH 16
+#define BATCH_STRIDE (IB_MAD_SIZE + 8)
+
+/* A field as mad-codec.h's users read it: size bytes big-endian at
+   base + offs, then shifted right by shift and masked by mask (if
+   nonzero).  base is where libibmad counts the field from. */
+struct codec_field {
+  const char *cf_name;
+  enum MAD_FIELDS cf_field;
+  size_t cf_base;
+  size_t cf_offs;
+  unsigned int cf_size;
+  unsigned int cf_shift;
+  uint64_t cf_mask;
+};
+
+#define F(field, base, offs, size, shift, mask) \
+  { #field, field, base, offs, size, shift, mask }
+
+static const struct codec_field codec_fields[] = {
+  F(IB_MAD_BASEVER_F,   0, MAD_BASEVER_OFFS,   1, 0, 0),
+  F(IB_MAD_MGMTCLASS_F, 0, MAD_MGMTCLASS_OFFS, 1, 0, 0),
+  F(IB_MAD_CLASSVER_F,  0, MAD_CLASSVER_OFFS,  1, 0, 0),
+  F(IB_MAD_METHOD_F,    0, MAD_METHOD_OFFS,    1, 0, 0x7f),
+  F(IB_MAD_RESPONSE_F,  0, MAD_METHOD_OFFS,    1, 7, 0x1),
+  F(IB_MAD_STATUS_F,    0, MAD_STATUS_OFFS,    2, 0, 0),
+  F(IB_MAD_TRID_F,      0, MAD_TRID_OFFS,      8, 0, 0),
+  F(IB_MAD_ATTRID_F,    0, MAD_ATTRID_OFFS,    2, 0, 0),
+  F(IB_MAD_ATTRMOD_F,   0, MAD_ATTRMOD_OFFS,   4, 0, 0),
+
+  F(IB_DRSMP_STATUS_F,    0, MAD_STATUS_OFFS,  2, 0, MAD_STATUS_MASK),
+  F(IB_DRSMP_DIRECTION_F, 0, MAD_STATUS_OFFS,  2, 15, 0x1),
+  F(IB_DRSMP_HOPPTR_F,    0, SMP_HOP_PTR_OFFS, 1, 0, 0),
+  F(IB_DRSMP_HOPCNT_F,    0, SMP_HOP_CNT_OFFS, 1, 0, 0),
+  F(IB_DRSMP_DRSLID_F,    0, SMP_DR_SLID_OFFS, 2, 0, 0),
+  F(IB_DRSMP_DRDLID_F,    0, SMP_DR_DLID_OFFS, 2, 0, 0),
+
+  F(IB_NODE_TYPE_F,        SMP_DATA_OFFS, NI_NODE_TYPE_OFFS,  1, 0, 0),
+  F(IB_NODE_NPORTS_F,      SMP_DATA_OFFS, NI_NR_PORTS_OFFS,   1, 0, 0),
+  F(IB_NODE_SYSTEM_GUID_F, SMP_DATA_OFFS, NI_SYS_GUID_OFFS,   8, 0, 0),
+  F(IB_NODE_GUID_F,        SMP_DATA_OFFS, NI_NODE_GUID_OFFS,  8, 0, 0),
+  F(IB_NODE_PORT_GUID_F,   SMP_DATA_OFFS, NI_PORT_GUID_OFFS,  8, 0, 0),
+  F(IB_NODE_DEVID_F,       SMP_DATA_OFFS, NI_DEVICE_ID_OFFS,  2, 0, 0),
+  F(IB_NODE_LOCAL_PORT_F,  SMP_DATA_OFFS, NI_LOCAL_PORT_OFFS, 1, 0, 0),
+  F(IB_NODE_VENDORID_F,    SMP_DATA_OFFS, NI_VENDOR_ID_OFFS,  3, 0, 0),
+
+  F(IB_PORT_LID_F,          SMP_DATA_OFFS, PI_LID_OFFS,        2, 0, 0),
+  F(IB_PORT_CAPMASK_F,      SMP_DATA_OFFS, PI_CAP_MASK_OFFS,   4, 0, 0),
+  F(IB_PORT_LOCAL_PORT_F,   SMP_DATA_OFFS, PI_LOCAL_PORT_OFFS, 1, 0, 0),
+  F(IB_PORT_LINK_WIDTH_ACTIVE_F, SMP_DATA_OFFS,
+    PI_LINK_WIDTH_ACTIVE_OFFS, 1, 0, 0),
+  F(IB_PORT_STATE_F,        SMP_DATA_OFFS, PI_PORT_STATE_OFFS, 1, 0, 0xf),
+  F(IB_PORT_LINK_SPEED_ACTIVE_F, SMP_DATA_OFFS,
+    PI_LINK_SPEED_ACTIVE_OFFS, 1, 4, 0xf),
+  F(IB_PORT_LINK_SPEED_EXT_ACTIVE_F, SMP_DATA_OFFS,
+    PI_LINK_SPEED_EXT_OFFS, 1, 4, 0xf),
+
+  F(IB_SA_RMPP_VERS_F,   0, RMPP_VERSION_OFFS, 1, 0, 0),
+  F(IB_SA_RMPP_TYPE_F,   0, RMPP_TYPE_OFFS,    1, 0, 0),
+  F(IB_SA_RMPP_FLAGS_F,  0, RMPP_FLAGS_OFFS,   1, 0, 0x7),
+  F(IB_SA_RMPP_STATUS_F, 0, RMPP_STATUS_OFFS,  1, 0, 0),
+  F(IB_SA_RMPP_SEGNUM_F, 0, RMPP_SEG_NUM_OFFS, 4, 0, 0),
+  F(IB_SA_RMPP_LEN_F,    0, RMPP_PAYLEN_OFFS,  4, 0, 0),
+  F(IB_SA_MKEY_F,        0, SA_SM_KEY_OFFS,    8, 0, 0),
+  F(IB_SA_ATTROFFS_F,    0, SA_ATTR_OFFS_OFFS, 2, 0, 0),
+  F(IB_SA_COMPMASK_F,    0, SA_COMP_MASK_OFFS, 8, 0, 0),
+
+  F(IB_PC_EXT_PORT_SELECT_F,    MAD_PMA_DATA_OFFS,
+    PCE_PORT_SELECT_OFFS, 1, 0, 0),
+  F(IB_PC_EXT_COUNTER_SELECT_F, MAD_PMA_DATA_OFFS,
+    PCE_COUNTER_SELECT_OFFS, 2, 0, 0),
+  F(IB_PC_EXT_XMT_BYTES_F, MAD_PMA_DATA_OFFS, PCE_XMT_BYTES_OFFS, 8, 0, 0),
+  F(IB_PC_EXT_RCV_BYTES_F, MAD_PMA_DATA_OFFS, PCE_RCV_BYTES_OFFS, 8, 0, 0),
+  F(IB_PC_EXT_XMT_PKTS_F,  MAD_PMA_DATA_OFFS, PCE_XMT_PKTS_OFFS,  8, 0, 0),
+  F(IB_PC_EXT_RCV_PKTS_F,  MAD_PMA_DATA_OFFS, PCE_RCV_PKTS_OFFS,  8, 0, 0),
+
+  F(IB_PSC_PORT_SELECT_F,   MAD_PMA_DATA_OFFS, PSC_PORT_SELECT_OFFS, 1, 0, 0),
+  F(IB_PSC_TICK_F,          MAD_PMA_DATA_OFFS, PSC_TICK_OFFS,        1, 0, 0),
+  F(IB_PSC_SAMPLE_STATUS_F, MAD_PMA_DATA_OFFS,
+    PSC_SAMPLE_STATUS_OFFS, 1, 0, PS_STATUS_MASK),
+  F(IB_PSC_SAMPLE_START_F,  MAD_PMA_DATA_OFFS, PSC_SAMPLE_START_OFFS, 4, 0, 0),
+  F(IB_PSC_SAMPLE_INTVL_F,  MAD_PMA_DATA_OFFS,
+    PSC_SAMPLE_INTERVAL_OFFS, 4, 0, 0),
+  F(IB_PSC_TAG_F,           MAD_PMA_DATA_OFFS, PSC_TAG_OFFS,          2, 0, 0),
+  F(IB_PSC_COUNTER_SEL0_F,  MAD_PMA_DATA_OFFS,
+    PSC_COUNTER_SELECT_OFFS + 0, 2, 0, 0),
+  F(IB_PSC_COUNTER_SEL1_F,  MAD_PMA_DATA_OFFS,
+    PSC_COUNTER_SELECT_OFFS + 2, 2, 0, 0),
+  F(IB_PSC_COUNTER_SEL2_F,  MAD_PMA_DATA_OFFS,
+    PSC_COUNTER_SELECT_OFFS + 4, 2, 0, 0),
+  F(IB_PSC_COUNTER_SEL3_F,  MAD_PMA_DATA_OFFS,
+    PSC_COUNTER_SELECT_OFFS + 6, 2, 0, 0),
+
+  F(IB_PSR_TAG_F,           MAD_PMA_DATA_OFFS, PSR_TAG_OFFS, 2, 0, 0),
+  F(IB_PSR_SAMPLE_STATUS_F, MAD_PMA_DATA_OFFS,
+    PSR_SAMPLE_STATUS_OFFS, 1, 0, PS_STATUS_MASK),
+  F(IB_PSR_COUNTER0_F, MAD_PMA_DATA_OFFS, PSR_COUNTER_OFFS + 0,  4, 0, 0),
+  F(IB_PSR_COUNTER1_F, MAD_PMA_DATA_OFFS, PSR_COUNTER_OFFS + 4,  4, 0, 0),
+  F(IB_PSR_COUNTER2_F, MAD_PMA_DATA_OFFS, PSR_COUNTER_OFFS + 8,  4, 0, 0),
+  F(IB_PSR_COUNTER3_F, MAD_PMA_DATA_OFFS, PSR_COUNTER_OFFS + 12, 4, 0, 0),
+};
+
+static void fill_random(void *buf, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    ((uint8_t *) buf)[i] = random();
+}
+
+static uint64_t codec_get(const void *mad, const struct codec_field *cf)
+{
+  const uint8_t *p = (const uint8_t *) mad + cf->cf_base + cf->cf_offs;
+  uint64_t v = 0;
+  unsigned int i;
+
+  for (i = 0; i < cf->cf_size; i++)
+    v = v << 8 | p[i];
+
+  v >>= cf->cf_shift;
+  if (cf->cf_mask != 0)
+    v &= cf->cf_mask;
+
+  return v;
+}
+
+static uint64_t ibmad_get(void *mad, const struct codec_field *cf)
+{
+  if (cf->cf_size == 8)
+    return mad_get_field64(mad, cf->cf_base, cf->cf_field);
+  else
+    return mad_get_field(mad, cf->cf_base, cf->cf_field);
+}
+
+/* Every offset in mad-codec.h against libibmad's field. */
+static void check_fields(void *mad)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(codec_fields) / sizeof(codec_fields[0]); i++) {
+    const struct codec_field *cf = &codec_fields[i];
+    uint64_t v = codec_get(mad, cf), w = ibmad_get(mad, cf);
+
+    if (v != w)
+      FATAL("%s: codec %"PRIx64", libibmad %"PRIx64"\n", cf->cf_name, v, w);
+  }
+
+  uint8_t path[SMP_MAX_HOPS + 1];
+
+  mad_get_array(mad, 0, IB_DRSMP_PATH_F, path);
+  if (memcmp(path, (uint8_t *) mad + SMP_INIT_PATH_OFFS, sizeof(path)) != 0)
+    FATAL("IB_DRSMP_PATH_F: initial path differs\n");
+}
+
+static void check_pce(void *mad, const struct pce_ctrs *pce)
+{
+  uint8_t *pc = (uint8_t *) mad + IB_PC_DATA_OFFS;
+  uint64_t rcv_b, rcv_p, xmt_b, xmt_p;
+
+  mad_decode_field(pc, IB_PC_EXT_RCV_BYTES_F, &rcv_b);
+  mad_decode_field(pc, IB_PC_EXT_RCV_PKTS_F,  &rcv_p);
+  mad_decode_field(pc, IB_PC_EXT_XMT_BYTES_F, &xmt_b);
+  mad_decode_field(pc, IB_PC_EXT_XMT_PKTS_F,  &xmt_p);
+
+  if (rcv_b != pce->pce_rcv_bytes || rcv_p != pce->pce_rcv_pkts ||
+      xmt_b != pce->pce_xmt_bytes || xmt_p != pce->pce_xmt_pkts)
+    FATAL("PortCountersExtended decode mismatch\n");
+}
+
+/* The hot path accessors, on random MADs. */
+static void check_decode(void)
+{
+  static uint8_t batch[NR_BATCH * BATCH_STRIDE];
+  struct pce_ctrs pce[NR_BATCH];
+  size_t round, i;
+
+  for (round = 0; round < NR_ROUNDS; round++) {
+    uint8_t mad[IB_MAD_SIZE];
+
+    fill_random(mad, sizeof(mad));
+    check_fields(mad);
+
+    pce_decode(mad, &pce[0]);
+    check_pce(mad, &pce[0]);
+
+    if (mad_get_trid(mad) != mad_get_field64(mad, 0, IB_MAD_TRID_F))
+      FATAL("mad_get_trid() mismatch\n");
+
+    if (mad_get_status(mad) != mad_get_field(mad, 0, IB_DRSMP_STATUS_F))
+      FATAL("mad_get_status() mismatch\n");
+
+    if (mad_get_attr_id(mad) != mad_get_field(mad, 0, IB_MAD_ATTRID_F))
+      FATAL("mad_get_attr_id() mismatch\n");
+  }
+
+  /* A stride that isn't a multiple of 8, so the loads are unaligned. */
+  for (round = 0; round < NR_ROUNDS / NR_BATCH; round++) {
+    fill_random(batch, sizeof(batch));
+    pce_decode_batch(batch + 1, BATCH_STRIDE - 1, NR_BATCH - 1, pce);
+
+    for (i = 0; i < NR_BATCH - 1; i++)
+      check_pce(batch + 1 + i * (BATCH_STRIDE - 1), &pce[i]);
+  }
+}
+
+/* The common header as libibmad's users set it, on top of whatever is
+   in mad already. */
+static void ibmad_set_hdr(void *mad, unsigned int mgmt_class,
+                          unsigned int class_ver, unsigned int method,
+                          unsigned int attr_id, uint32_t attr_mod,
+                          uint64_t trid)
+{
+  mad_set_field(mad, 0, IB_MAD_BASEVER_F, 1);
+  mad_set_field(mad, 0, IB_MAD_MGMTCLASS_F, mgmt_class);
+  mad_set_field(mad, 0, IB_MAD_CLASSVER_F, class_ver);
+  mad_set_field(mad, 0, IB_MAD_METHOD_F, method);
+  mad_set_field(mad, 0, IB_MAD_RESPONSE_F, 0);
+  mad_set_field(mad, 0, IB_MAD_STATUS_F, 0);
+  mad_set_field64(mad, 0, IB_MAD_TRID_F, trid);
+  mad_set_field(mad, 0, IB_MAD_ATTRID_F, attr_id);
+  mad_set_field(mad, 0, IB_MAD_ATTRMOD_F, attr_mod);
+}
+
+static void check_same(const char *what, const void *mad, const void *ref)
+{
+  size_t i;
+
+  for (i = 0; i < IB_MAD_SIZE; i++)
+    if (((const uint8_t *) mad)[i] != ((const uint8_t *) ref)[i])
+      FATAL("%s: byte %zu is %02x, libibmad has %02x\n", what, i,
+            ((const uint8_t *) mad)[i], ((const uint8_t *) ref)[i]);
+}
+
+/* The queries ibtop and make-net-info build, each from the same random
+   bytes both ways, so a codec store that touches a neighbouring byte
+   shows up too. */
+static void check_encode(void)
+{
+  static const uint16_t sel[] = {
+    PS_SEL_XMT_DATA, PS_SEL_RCV_DATA, PS_SEL_XMT_PKTS, PS_SEL_RCV_PKTS,
+  };
+  size_t round, i;
+
+  for (round = 0; round < NR_ROUNDS; round++) {
+    uint8_t mad[IB_MAD_SIZE], ref[IB_MAD_SIZE];
+    uint64_t trid = (uint64_t) random() << 32 | random();
+    unsigned int port = random() & 0xff;
+    void *pc = mad + MAD_PMA_DATA_OFFS;
+
+    /* PortCountersExtended, as umad_build_perf(). */
+    fill_random(mad, sizeof(mad));
+    memcpy(ref, mad, sizeof(ref));
+
+    mad_encode_hdr(mad, IB_PERFORMANCE_CLASS, IB_MAD_METHOD_GET,
+                   IB_GSI_PORT_COUNTERS_EXT, 0, trid);
+    put_u8(pc, PCE_PORT_SELECT_OFFS, port);
+
+    ibmad_set_hdr(ref, IB_PERFORMANCE_CLASS, 1, IB_MAD_METHOD_GET,
+                  IB_GSI_PORT_COUNTERS_EXT, 0, trid);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PC_EXT_PORT_SELECT_F, port);
+
+    check_same("PortCountersExtended", mad, ref);
+
+    /* PortSamplesControl Set, as umad_build_samples(). */
+    uint32_t intvl = random();
+    uint16_t tag = random();
+
+    fill_random(mad, sizeof(mad));
+    memcpy(ref, mad, sizeof(ref));
+
+    put_u8(pc, PSC_PORT_SELECT_OFFS, port);
+    put_be32(pc, PSC_SAMPLE_START_OFFS, 0);
+    put_be32(pc, PSC_SAMPLE_INTERVAL_OFFS, intvl);
+    put_be16(pc, PSC_TAG_OFFS, tag);
+    for (i = 0; i < sizeof(sel) / sizeof(sel[0]); i++)
+      put_be16(pc, PSC_COUNTER_SELECT_OFFS + 2 * i, sel[i]);
+    mad_encode_hdr(mad, IB_PERFORMANCE_CLASS, IB_MAD_METHOD_SET,
+                   IB_GSI_PORT_SAMPLES_CONTROL, 0, trid);
+
+    ibmad_set_hdr(ref, IB_PERFORMANCE_CLASS, 1, IB_MAD_METHOD_SET,
+                  IB_GSI_PORT_SAMPLES_CONTROL, 0, trid);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PSC_PORT_SELECT_F, port);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PSC_SAMPLE_START_F, 0);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PSC_SAMPLE_INTVL_F, intvl);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PSC_TAG_F, tag);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PSC_COUNTER_SEL0_F, sel[0]);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PSC_COUNTER_SEL1_F, sel[1]);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PSC_COUNTER_SEL2_F, sel[2]);
+    mad_set_field(ref, IB_PC_DATA_OFFS, IB_PSC_COUNTER_SEL3_F, sel[3]);
+
+    check_same("PortSamplesControl", mad, ref);
+
+    /* A directed route NodeInfo Get, as dr-disc.c's. */
+    unsigned int nr_hops = random() % SMP_MAX_HOPS;
+    uint8_t path[SMP_MAX_HOPS + 1];
+
+    fill_random(mad, sizeof(mad));
+    memcpy(ref, mad, sizeof(ref));
+    fill_random(path, nr_hops + 1);
+
+    mad_encode_hdr(mad, IB_SMI_DIRECT_CLASS, IB_MAD_METHOD_GET,
+                   IB_ATTR_NODE_INFO, 0, trid);
+    memcpy(mad + SMP_INIT_PATH_OFFS, path, nr_hops + 1);
+    put_u8(mad, SMP_HOP_PTR_OFFS, 0);
+    put_u8(mad, SMP_HOP_CNT_OFFS, nr_hops);
+    put_be16(mad, SMP_DR_SLID_OFFS, 0xffff);
+    put_be16(mad, SMP_DR_DLID_OFFS, 0xffff);
+
+    ibmad_set_hdr(ref, IB_SMI_DIRECT_CLASS, 1, IB_MAD_METHOD_GET,
+                  IB_ATTR_NODE_INFO, 0, trid);
+    memcpy(path + nr_hops + 1, ref + SMP_INIT_PATH_OFFS + nr_hops + 1,
+           SMP_MAX_HOPS - nr_hops);
+    mad_set_array(ref, 0, IB_DRSMP_PATH_F, path);
+    mad_set_field(ref, 0, IB_DRSMP_HOPPTR_F, 0);
+    mad_set_field(ref, 0, IB_DRSMP_HOPCNT_F, nr_hops);
+    mad_set_field(ref, 0, IB_DRSMP_DRSLID_F, 0xffff);
+    mad_set_field(ref, 0, IB_DRSMP_DRDLID_F, 0xffff);
+
+    check_same("directed route SMP", mad, ref);
+
+    /* An SA GetTable, as sa-disc.c's. */
+    fill_random(mad, sizeof(mad));
+    memcpy(ref, mad, sizeof(ref));
+
+    mad_encode_hdr(mad, IB_SA_CLASS, IB_MAD_METHOD_GET_TABLE,
+                   IB_SA_ATTR_NODERECORD, 0, trid);
+    put_u8(mad, MAD_CLASSVER_OFFS, 2);
+
+    ibmad_set_hdr(ref, IB_SA_CLASS, 2, IB_MAD_METHOD_GET_TABLE,
+                  IB_SA_ATTR_NODERECORD, 0, trid);
+
+    check_same("SA GetTable", mad, ref);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  if (MAD_PMA_DATA_OFFS != IB_PC_DATA_OFFS ||
+      SMP_DATA_OFFS != IB_SMP_DATA_OFFS ||
+      SA_DATA_OFFS != IB_SA_DATA_OFFS)
+    FATAL("data offsets differ from libibmad's\n");
+
+  srandom(1);
+
+  check_decode();
+  check_encode();
+
+  return 0;
+}
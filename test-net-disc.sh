@@ -0,0 +1,27 @@
+#!/bin/sh
+# The threaded ibnetdiscover parser must write the same net info as
+# the old sscanf() one (make-net-info -l), on awkward input and however
+# it's split between threads.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+disc="cat test-net-disc.data"
+
+./make-net-info -l -c "$disc" -o "$dir/ref"
+
+if ! [ -s "$dir/ref" ]; then
+  echo "$0: no net info from test-net-disc.data" >&2
+  exit 1
+fi
+
+for t in 1 2 3 8; do
+  ./make-net-info -t $t -c "$disc" -o "$dir/out"
+
+  if ! cmp -s "$dir/out" "$dir/ref"; then
+    echo "$0: net info with $t threads differs" >&2
+    diff "$dir/out" "$dir/ref" | head >&2
+    exit 1
+  fi
+done
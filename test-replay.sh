@@ -0,0 +1,34 @@
+#!/bin/sh
+# Replaying a recording must give the same report as the recording
+# run, every time and at any speed.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+./make-fabric -n 1000 "$dir"
+
+sim="./ibtop-sim --net-info=$dir/net-info --job-map=$dir/job-map -m -1 --no-state -i 0.5 -x"
+
+$sim --record="$dir/rec" > "$dir/out0"
+$sim --replay="$dir/rec" > "$dir/out1"
+$sim --replay="$dir/rec" > "$dir/out2"
+$sim --replay="$dir/rec" --replay-speed=5 > "$dir/out3"
+
+if ! cmp -s "$dir/out1" "$dir/out2"; then
+  echo "$0: replays differ" >&2
+  diff "$dir/out1" "$dir/out2" | head >&2
+  exit 1
+fi
+
+if ! cmp -s "$dir/out0" "$dir/out1"; then
+  echo "$0: replay differs from the recording run" >&2
+  diff "$dir/out0" "$dir/out1" | head >&2
+  exit 1
+fi
+
+if ! cmp -s "$dir/out1" "$dir/out3"; then
+  echo "$0: replay at 5 times speed differs" >&2
+  diff "$dir/out1" "$dir/out3" | head >&2
+  exit 1
+fi
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Discovery through the stand-in SA must write the same net info that
+# make-fabric did.  Each GetTable response is far bigger than one MAD,
+# so every receive also goes through sa_recv()'s ENOSPC regrow.
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+./make-fabric -a -n 1000 "$dir"
+
+./make-net-info -a -i sim:sa="$dir/sa-dump" -o "$dir/out" -b "$dir/db"
+
+if ! cmp -s "$dir/out" "$dir/net-info"; then
+  echo "$0: discovered net info differs" >&2
+  diff "$dir/out" "$dir/net-info" | head >&2
+  exit 1
+fi
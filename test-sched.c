@@ -0,0 +1,145 @@
+#include <stddef.h>
+#include <stdio.h>
+#include "list.h"
+#include "sched.h"
+#include "trace.h"
+
+/* Scheduler checks for make check.  Each fails with a message and
+   exit status 1. */
+
+#define NR_TARGETS 4
+#define NR_ITEMS 64
+#define NR_PASSES 8
+
+static struct sched s;
+static struct sched_target target[NR_TARGETS];
+static struct list_head item[NR_TARGETS][NR_ITEMS];
+
+static void pass_begin(double now)
+{
+  size_t i, j;
+
+  sched_pass_begin(&s, now);
+  for (i = 0; i < NR_TARGETS; i++)
+    for (j = 0; j < NR_ITEMS; j++)
+      sched_enqueue(&s, &target[i], &item[i][j]);
+}
+
+/* Send what the window allows, answer every other MAD, and give up on
+   the rest at the end of the pass, as collector_pass() does with
+   hosts still waiting.  The window must open again on every pass. */
+static void check_abandon(void)
+{
+  struct sched_target *out[NR_TARGETS * NR_ITEMS];
+  size_t i, n, pass;
+  double now = 1, wait;
+
+  sched_init(&s, 8, 32, 0, 4);
+  for (i = 0; i < NR_TARGETS; i++)
+    sched_target_init(&s, &target[i], i + 1);
+
+  for (pass = 0; pass < NR_PASSES; pass++, now += 1) {
+    struct sched_target *t;
+
+    pass_begin(now);
+
+    n = 0;
+    while (sched_next(&s, now, &wait, &t) != NULL) {
+      sched_sent(&s);
+      out[n++] = t;
+    }
+
+    if (n == 0)
+      FATAL("pass %zu: nothing sent, window %f, %zu outstanding\n",
+            pass, s.s_window, s.s_nr_outstanding);
+
+    for (i = 0; i < n; i++) {
+      if (i % 2 == 0)
+        sched_acked(&s, out[i]);
+      else
+        sched_abandon(&s, out[i]);
+    }
+
+    if (s.s_nr_outstanding != 0)
+      FATAL("pass %zu: %zu outstanding after abandon\n",
+            pass, s.s_nr_outstanding);
+
+    for (i = 0; i < NR_TARGETS; i++)
+      if (target[i].t_nr_outstanding != 0)
+        FATAL("pass %zu: target %zu has %zu outstanding after abandon\n",
+              pass, i, target[i].t_nr_outstanding);
+  }
+
+  /* The acks alone should have opened the window past its start. */
+  if (s.s_window <= 8)
+    FATAL("window did not grow, %f\n", s.s_window);
+}
+
+/* Items released before they were sent free their target's slot but
+   never held a window slot. */
+static void check_release(void)
+{
+  struct sched_target *t;
+  double wait;
+  size_t n = 0;
+
+  sched_init(&s, 4, 4, 0, 1);
+  for (n = 0; n < NR_TARGETS; n++)
+    sched_target_init(&s, &target[n], n + 1);
+
+  pass_begin(1);
+
+  for (n = 0; n < NR_TARGETS * NR_ITEMS; n++) {
+    if (sched_next(&s, 1, &wait, &t) == NULL)
+      FATAL("release: stuck after %zu items\n", n);
+    sched_release(&s, t);
+  }
+
+  if (s.s_nr_outstanding != 0 || s.s_nr_queued != 0)
+    FATAL("release: %zu outstanding, %zu queued\n",
+          s.s_nr_outstanding, s.s_nr_queued);
+}
+
+/* Timeouts set with sched_rto_init() start at the initial RTO, back
+   off up to the max, and come down no further than the min.  0 keeps
+   the default. */
+static void check_rto(void)
+{
+  struct sched_target *t = &target[0];
+  int i;
+
+  sched_init(&s, 4, 4, 0, 1);
+  sched_rto_init(&s, 0.05, 0.01, 0.2);
+  sched_target_init(&s, t, 1);
+
+  if (t->t_rto != 0.05)
+    FATAL("rto: initial %f, not 0.05\n", t->t_rto);
+
+  for (i = 0; i < 8; i++)
+    sched_lost(&s, t);
+
+  if (t->t_rto != 0.2)
+    FATAL("rto: %f after backing off, not the max 0.2\n", t->t_rto);
+
+  for (i = 0; i < 8; i++)
+    sched_rtt_sample(&s, t, 0.0001);
+
+  if (t->t_rto != 0.01)
+    FATAL("rto: %f after fast samples, not the min 0.01\n", t->t_rto);
+
+  sched_init(&s, 4, 4, 0, 1);
+  sched_rto_init(&s, 0, 0.5, 0);
+
+  if (s.s_rto_min != 0.5 || s.s_rto_max != 1 || s.s_rto_init != 0.5)
+    FATAL("rto: init %f, min %f, max %f with only a min of 0.5\n",
+          s.s_rto_init, s.s_rto_min, s.s_rto_max);
+}
+
+int main(int argc, char *argv[])
+{
+  check_abandon();
+  check_release();
+  check_rto();
+
+  return 0;
+}
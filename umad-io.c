@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <malloc.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "trace.h"
+#include "umad-io.h"
+#include "umad-sim.h"
+
+void umad_io_stamp(double *mono, size_t n)
+{
+  struct timespec ts;
+  size_t i;
+
+  if (mono == NULL || n == 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  for (i = 0; i < n; i++)
+    mono[i] = ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int rw_send(struct umad_io *io, const void *um, size_t len)
+{
+  ssize_t nw;
+
+  io->io_nr_syscalls++;
+
+  nw = write(io->io_fd, um, len);
+  if (nw < 0)
+    return -1;
+
+  io->io_nr_sent++;
+
+  return 0;
+}
+
+/* Drain until the fd would block. */
+static ssize_t rw_recv(struct umad_io *io, void *bufs, size_t buf_size,
+                       size_t nr, size_t *len, double *mono)
+{
+  size_t i = 0;
+
+  while (i < nr) {
+    ssize_t rc;
+
+    io->io_nr_syscalls++;
+
+    rc = read(io->io_fd, (char *) bufs + i * buf_size, buf_size);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EWOULDBLOCK || i > 0)
+        break;
+      return -1;
+    }
+
+    len[i++] = rc;
+  }
+
+  io->io_nr_recvd += i;
+  umad_io_stamp(mono, i);
+
+  return i;
+}
+
+static int rw_wait(struct umad_io *io, double timeout)
+{
+  struct pollfd pfd = {
+    .fd = io->io_fd,
+    .events = POLLIN,
+  };
+  int np;
+
+  io->io_nr_syscalls++;
+
+  /* Round up so callers don't spin waiting for a timer. */
+  np = poll(&pfd, 1, timeout > 0 ? timeout * 1000 + 1 : 0);
+  if (np < 0 && errno != EINTR)
+    return -1;
+
+  return np > 0;
+}
+
+static const struct umad_io_ops rw_ops = {
+  .name = "read",
+  .send = &rw_send,
+  .recv = &rw_recv,
+  .wait = &rw_wait,
+};
+
+#ifdef HAVE_LIBURING
+
+/* Keep ur_depth reads queued on the fd at all times; completed ones
+   are handed out by uring_recv() and requeued.  Writes are queued by
+   uring_send() and submitted together, along with any requeued reads,
+   by uring_flush(), so a pass costs a few io_uring_enter()s rather
+   than a syscall per MAD.  The buffers passed to uring_send() must
+   stay put until the next flush. */
+
+#define URING_WRITE_TAG ((uint64_t) -1)
+
+struct uring_priv {
+  struct io_uring ur_ring;
+  char *ur_buf;
+  size_t ur_buf_size;
+  size_t ur_depth;
+  /* FIFO of completed reads: slot index and length. */
+  size_t *ur_done_slot;
+  size_t *ur_done_len;
+  size_t ur_done_head;
+  size_t ur_nr_done;
+};
+
+static struct io_uring_sqe *uring_get_sqe(struct umad_io *io)
+{
+  struct uring_priv *up = io->io_priv;
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&up->ur_ring);
+
+  if (sqe == NULL) {
+    io->io_nr_syscalls++;
+    io_uring_submit(&up->ur_ring);
+    sqe = io_uring_get_sqe(&up->ur_ring);
+  }
+
+  return sqe;
+}
+
+static int uring_post_read(struct umad_io *io, size_t slot)
+{
+  struct uring_priv *up = io->io_priv;
+  struct io_uring_sqe *sqe = uring_get_sqe(io);
+
+  if (sqe == NULL)
+    return -1;
+
+  io_uring_prep_read(sqe, io->io_fd, up->ur_buf + slot * up->ur_buf_size,
+                     up->ur_buf_size, 0);
+  io_uring_sqe_set_data(sqe, (void *) (uintptr_t) slot);
+
+  return 0;
+}
+
+static void uring_reap(struct umad_io *io)
+{
+  struct uring_priv *up = io->io_priv;
+  struct io_uring_cqe *cqe;
+
+  while (io_uring_peek_cqe(&up->ur_ring, &cqe) == 0) {
+    uint64_t data = (uintptr_t) io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+
+    io_uring_cqe_seen(&up->ur_ring, cqe);
+
+    if (data == URING_WRITE_TAG) {
+      if (res < 0)
+        ERROR("error sending umad: %s\n", strerror(-res));
+      continue;
+    }
+
+    if (res < 0) {
+      if (res != -EAGAIN && res != -EINTR)
+        ERROR("error receiving mad: %s\n", strerror(-res));
+      uring_post_read(io, data);
+      continue;
+    }
+
+    size_t i = (up->ur_done_head + up->ur_nr_done) % up->ur_depth;
+    up->ur_done_slot[i] = data;
+    up->ur_done_len[i] = res;
+    up->ur_nr_done++;
+  }
+}
+
+static int uring_send(struct umad_io *io, const void *um, size_t len)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(io);
+
+  if (sqe == NULL)
+    return -1;
+
+  io_uring_prep_write(sqe, io->io_fd, um, len, 0);
+  io_uring_sqe_set_data(sqe, (void *) (uintptr_t) URING_WRITE_TAG);
+  io->io_nr_sent++;
+
+  return 0;
+}
+
+static int uring_flush(struct umad_io *io)
+{
+  struct uring_priv *up = io->io_priv;
+  int rc;
+
+  if (io_uring_sq_ready(&up->ur_ring) == 0)
+    return 0;
+
+  io->io_nr_syscalls++;
+
+  rc = io_uring_submit(&up->ur_ring);
+  if (rc < 0) {
+    errno = -rc;
+    return -1;
+  }
+
+  return 0;
+}
+
+static ssize_t uring_recv(struct umad_io *io, void *bufs, size_t buf_size,
+                          size_t nr, size_t *len, double *mono)
+{
+  struct uring_priv *up = io->io_priv;
+  size_t i = 0;
+
+  uring_reap(io);
+
+  while (i < nr && up->ur_nr_done > 0) {
+    size_t slot = up->ur_done_slot[up->ur_done_head];
+    size_t n = up->ur_done_len[up->ur_done_head];
+
+    if (n > buf_size)
+      n = buf_size;
+
+    memcpy((char *) bufs + i * buf_size, up->ur_buf + slot * up->ur_buf_size, n);
+    len[i++] = n;
+
+    up->ur_done_head = (up->ur_done_head + 1) % up->ur_depth;
+    up->ur_nr_done--;
+
+    uring_post_read(io, slot);
+  }
+
+  io->io_nr_recvd += i;
+  umad_io_stamp(mono, i);
+  uring_flush(io);
+
+  return i;
+}
+
+static int uring_wait(struct umad_io *io, double timeout)
+{
+  struct uring_priv *up = io->io_priv;
+  struct io_uring_cqe *cqe;
+  struct __kernel_timespec ts = {
+    .tv_sec = timeout,
+    .tv_nsec = (timeout - (long long) timeout) * 1e9,
+  };
+  int rc;
+
+  uring_flush(io);
+  uring_reap(io);
+
+  if (up->ur_nr_done > 0)
+    return 1;
+
+  if (timeout <= 0)
+    return 0;
+
+  io->io_nr_syscalls++;
+
+  rc = io_uring_wait_cqe_timeout(&up->ur_ring, &cqe, &ts);
+  if (rc < 0 && rc != -ETIME && rc != -EINTR) {
+    errno = -rc;
+    return -1;
+  }
+
+  uring_reap(io);
+
+  return up->ur_nr_done > 0;
+}
+
+static void uring_close(struct umad_io *io)
+{
+  struct uring_priv *up = io->io_priv;
+
+  io_uring_queue_exit(&up->ur_ring);
+  free(up->ur_buf);
+  free(up->ur_done_slot);
+  free(up->ur_done_len);
+  free(up);
+  io->io_priv = NULL;
+}
+
+static const struct umad_io_ops uring_ops = {
+  .name = "uring",
+  .send = &uring_send,
+  .flush = &uring_flush,
+  .recv = &uring_recv,
+  .wait = &uring_wait,
+  .close = &uring_close,
+};
+
+static int uring_open(struct umad_io *io, size_t depth, size_t buf_size)
+{
+  struct uring_priv *up;
+  size_t i;
+  int rc, flags;
+
+  up = calloc(1, sizeof(*up));
+  if (up == NULL)
+    return -1;
+
+  up->ur_depth = depth;
+  up->ur_buf_size = buf_size;
+  up->ur_buf = malloc(depth * buf_size);
+  up->ur_done_slot = malloc(depth * sizeof(up->ur_done_slot[0]));
+  up->ur_done_len = malloc(depth * sizeof(up->ur_done_len[0]));
+  if (up->ur_buf == NULL || up->ur_done_slot == NULL || up->ur_done_len == NULL)
+    goto err;
+
+  /* Room for all the reads plus as many writes again. */
+  rc = io_uring_queue_init(2 * depth, &up->ur_ring, 0);
+  if (rc < 0) {
+    errno = -rc;
+    goto err;
+  }
+
+  /* Let the reads wait in the kernel rather than fail with EAGAIN. */
+  flags = fcntl(io->io_fd, F_GETFL);
+  if (flags >= 0)
+    fcntl(io->io_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+  io->io_priv = up;
+  io->io_ops = &uring_ops;
+
+  for (i = 0; i < depth; i++)
+    uring_post_read(io, i);
+
+  if (uring_flush(io) < 0) {
+    uring_close(io);
+    return -1;
+  }
+
+  return 0;
+
+ err:
+  free(up->ur_buf);
+  free(up->ur_done_slot);
+  free(up->ur_done_len);
+  free(up);
+  return -1;
+}
+#endif
+
+int umad_io_open(struct umad_io *io, const char *backend, int fd,
+                 size_t depth, size_t buf_size)
+{
+  memset(io, 0, sizeof(*io));
+  io->io_fd = fd;
+
+  if (backend == NULL || strcmp(backend, rw_ops.name) == 0) {
+    io->io_ops = &rw_ops;
+    return 0;
+  }
+
+#ifdef HAVE_LIBURING
+  if (strcmp(backend, uring_ops.name) == 0)
+    return uring_open(io, depth, buf_size);
+#endif
+
+  if (!umad_io_needs_port(backend))
+    return umad_sim_open(io, backend[3] == ':' ? backend + 4 : "");
+
+  errno = ENOTSUP;
+  return -1;
+}
+
+int umad_io_needs_port(const char *backend)
+{
+  return !(backend != NULL && strncmp(backend, "sim", 3) == 0 &&
+           (backend[3] == 0 || backend[3] == ':'));
+}
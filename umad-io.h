@@ -0,0 +1,77 @@
+#ifndef _UMAD_IO_H_
+#define _UMAD_IO_H_
+#include <stddef.h>
+#include <sys/types.h>
+
+/* I/O backends for umad buffers.  Sends may be batched until
+   umad_io_flush(); receives drain as many buffers as are ready (up to
+   nr) in one call.  Each receive buffer is buf_size bytes at
+   bufs + i * buf_size, and its length is returned in len[i] and, if
+   mono isn't NULL, the CLOCK_MONOTONIC time it came in in mono[i]
+   (for replays, the recorded time shifted to the replay's start). */
+
+struct umad_io;
+
+struct umad_io_ops {
+  const char *name;
+  int (*send)(struct umad_io *io, const void *um, size_t len);
+  int (*flush)(struct umad_io *io);
+  ssize_t (*recv)(struct umad_io *io, void *bufs, size_t buf_size, size_t nr,
+                  size_t *len, double *mono);
+  /* Returns 1 if there may be something to receive, 0 on timeout. */
+  int (*wait)(struct umad_io *io, double timeout);
+  void (*close)(struct umad_io *io);
+};
+
+struct umad_io {
+  const struct umad_io_ops *io_ops;
+  int io_fd;
+  void *io_priv;
+  size_t io_nr_sent;
+  size_t io_nr_recvd;
+  size_t io_nr_syscalls;
+};
+
+/* backend is "read" (plain read(2)/write(2)/poll(2)), "uring" if
+   built with HAVE_LIBURING, or "sim[:OPTS]" for simulated PMAs (see
+   umad-sim.h), which ignores fd.  depth bounds the number of receives
+   kept queued by backends that queue them. */
+int umad_io_open(struct umad_io *io, const char *backend, int fd,
+                 size_t depth, size_t buf_size);
+
+/* Whether backend does I/O on a umad port (all but the simulator). */
+int umad_io_needs_port(const char *backend);
+
+static inline int umad_io_send(struct umad_io *io, const void *um, size_t len)
+{
+  return (*io->io_ops->send)(io, um, len);
+}
+
+static inline int umad_io_flush(struct umad_io *io)
+{
+  return io->io_ops->flush != NULL ? (*io->io_ops->flush)(io) : 0;
+}
+
+static inline ssize_t umad_io_recv(struct umad_io *io, void *bufs,
+                                   size_t buf_size, size_t nr, size_t *len,
+                                   double *mono)
+{
+  return (*io->io_ops->recv)(io, bufs, buf_size, nr, len, mono);
+}
+
+/* For backends: set mono[0..n) to now, if mono isn't NULL. */
+void umad_io_stamp(double *mono, size_t n);
+
+static inline int umad_io_wait(struct umad_io *io, double timeout)
+{
+  return (*io->io_ops->wait)(io, timeout);
+}
+
+static inline void umad_io_close(struct umad_io *io)
+{
+  if (io->io_ops != NULL && io->io_ops->close != NULL)
+    (*io->io_ops->close)(io);
+  io->io_ops = NULL;
+}
+
+#endif
@@ -0,0 +1,618 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "mad-codec.h"
+#include "umad-rec.h"
+
+static double rec_mono(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Receive times are a base plus the sum of the deltas so far, added
+   up the same way when recording and when replaying.  With bases on a
+   2^-10 second grid, base + sum rounds the same whatever the base (in
+   the same binade), so the times' differences, and the rates computed
+   from them, are the same bit for bit. */
+static double rec_base(void)
+{
+  return floor(rec_mono() * 1024) / 1024;
+}
+
+struct umad_rec {
+  FILE *rc_file;
+  pthread_mutex_t rc_lock;
+  double rc_start;
+  double rc_time; /* Sum of the deltas so far. */
+  int rc_error;
+};
+
+struct umad_rec *umad_rec_create(const char *path, uint64_t seed,
+                                 uint32_t nr_hosts, uint32_t nr_colls,
+                                 uint32_t umad_size)
+{
+  struct umad_rec *rec = NULL;
+  struct rec_hdr rh;
+  struct timespec ts;
+
+  rec = calloc(1, sizeof(*rec));
+  if (rec == NULL)
+    goto err;
+
+  rec->rc_file = fopen(path, "w");
+  if (rec->rc_file == NULL)
+    goto err;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  memset(&rh, 0, sizeof(rh));
+  rh.rh_magic = REC_MAGIC;
+  rh.rh_seed = seed;
+  rh.rh_nr_hosts = nr_hosts;
+  rh.rh_nr_colls = nr_colls;
+  rh.rh_umad_size = umad_size;
+  rh.rh_time = ts.tv_sec + ts.tv_nsec * 1e-9;
+
+  if (fwrite(&rh, sizeof(rh), 1, rec->rc_file) != 1)
+    goto err;
+
+  pthread_mutex_init(&rec->rc_lock, NULL);
+  rec->rc_start = rec_base();
+
+  return rec;
+
+ err:
+  if (rec != NULL && rec->rc_file != NULL)
+    fclose(rec->rc_file);
+  free(rec);
+
+  return NULL;
+}
+
+/* Log a umad at time (CLOCK_MONOTONIC), or at the last record's time
+   if that's later (another collector got there first).  Returns the
+   time as recorded, to the microsecond. */
+static double rec_log(struct umad_rec *rec, unsigned int coll, int dir,
+                      const void *buf, size_t len, double time)
+{
+  struct rec_ent re;
+  double delta;
+
+  pthread_mutex_lock(&rec->rc_lock);
+
+  delta = (time - (rec->rc_start + rec->rc_time)) * 1e6 + 0.5;
+  if (delta < 0)
+    delta = 0;
+
+  re.re_delta_us = delta < UINT32_MAX ? (uint32_t) delta : UINT32_MAX;
+  re.re_len = len < UINT16_MAX ? len : UINT16_MAX;
+  re.re_dir = dir;
+  re.re_coll = coll;
+
+  rec->rc_time += re.re_delta_us * 1e-6;
+  time = rec->rc_start + rec->rc_time;
+
+  if (fwrite(&re, sizeof(re), 1, rec->rc_file) != 1 ||
+      fwrite(buf, re.re_len, 1, rec->rc_file) != 1)
+    rec->rc_error = 1;
+
+  pthread_mutex_unlock(&rec->rc_lock);
+
+  return time;
+}
+
+int umad_rec_close(struct umad_rec *rec)
+{
+  int rc = rec->rc_error ? -1 : 0;
+
+  if (fclose(rec->rc_file) != 0)
+    rc = -1;
+
+  pthread_mutex_destroy(&rec->rc_lock);
+  free(rec);
+
+  return rc;
+}
+
+struct rec_io {
+  struct umad_io ri_inner;
+  struct umad_rec *ri_rec;
+  unsigned int ri_coll;
+};
+
+static void rec_io_sync(struct umad_io *io)
+{
+  struct rec_io *ri = io->io_priv;
+
+  io->io_nr_sent = ri->ri_inner.io_nr_sent;
+  io->io_nr_recvd = ri->ri_inner.io_nr_recvd;
+  io->io_nr_syscalls = ri->ri_inner.io_nr_syscalls;
+}
+
+static int rec_io_send(struct umad_io *io, const void *um, size_t len)
+{
+  struct rec_io *ri = io->io_priv;
+  int rc = umad_io_send(&ri->ri_inner, um, len);
+
+  if (rc == 0)
+    rec_log(ri->ri_rec, ri->ri_coll, REC_SEND, um, len, rec_mono());
+
+  rec_io_sync(io);
+
+  return rc;
+}
+
+static int rec_io_flush(struct umad_io *io)
+{
+  struct rec_io *ri = io->io_priv;
+  int rc = umad_io_flush(&ri->ri_inner);
+
+  rec_io_sync(io);
+
+  return rc;
+}
+
+/* Received umads are stamped with their recorded times, which are
+   what a replay gives, so that the recording run reports the same
+   rates as its replays. */
+static ssize_t rec_io_recv(struct umad_io *io, void *bufs, size_t buf_size,
+                           size_t nr, size_t *len, double *mono)
+{
+  struct rec_io *ri = io->io_priv;
+  ssize_t i, n = umad_io_recv(&ri->ri_inner, bufs, buf_size, nr, len, mono);
+
+  for (i = 0; i < n; i++) {
+    double time = rec_log(ri->ri_rec, ri->ri_coll, REC_RECV,
+                          (char *) bufs + i * buf_size, len[i],
+                          mono != NULL ? mono[i] : rec_mono());
+    if (mono != NULL)
+      mono[i] = time;
+  }
+
+  rec_io_sync(io);
+
+  return n;
+}
+
+static int rec_io_wait(struct umad_io *io, double timeout)
+{
+  struct rec_io *ri = io->io_priv;
+  int rc = umad_io_wait(&ri->ri_inner, timeout);
+
+  rec_io_sync(io);
+
+  return rc;
+}
+
+static void rec_io_close(struct umad_io *io)
+{
+  struct rec_io *ri = io->io_priv;
+
+  umad_io_close(&ri->ri_inner);
+  free(ri);
+  io->io_priv = NULL;
+}
+
+static const struct umad_io_ops rec_io_ops = {
+  .name = "record",
+  .send = &rec_io_send,
+  .flush = &rec_io_flush,
+  .recv = &rec_io_recv,
+  .wait = &rec_io_wait,
+  .close = &rec_io_close,
+};
+
+int umad_rec_wrap(struct umad_io *io, struct umad_rec *rec, unsigned int coll)
+{
+  struct rec_io *ri = malloc(sizeof(*ri));
+
+  if (ri == NULL)
+    return -1;
+
+  ri->ri_inner = *io;
+  ri->ri_rec = rec;
+  ri->ri_coll = coll;
+
+  io->io_ops = &rec_io_ops;
+  io->io_priv = ri;
+
+  return 0;
+}
+
+/* Replay.  Each collector's records are sorted by TRID, and by time
+   within a TRID, so that the umads received for a send follow it.  The
+   first event of each TRID's run keeps the index of its next unused
+   send. */
+struct rp_ev {
+  uint32_t ev_key;
+  uint32_t ev_seq;
+  double ev_time;
+  const char *ev_buf;
+  size_t ev_next;
+  uint16_t ev_len;
+  uint8_t ev_dir;
+};
+
+struct rp_coll {
+  struct rp_ev *rc_evs;
+  size_t rc_nr_evs;
+};
+
+struct umad_replay {
+  char *rp_data;
+  size_t rp_size;
+  const struct rec_hdr *rp_hdr;
+  double rp_speed;
+  double rp_start; /* CLOCK_MONOTONIC time of opening. */
+  struct rp_coll *rp_colls;
+};
+
+static int rp_ev_cmp(const void *p1, const void *p2)
+{
+  const struct rp_ev *e1 = p1, *e2 = p2;
+
+  if (e1->ev_key != e2->ev_key)
+    return e1->ev_key < e2->ev_key ? -1 : 1;
+
+  return e1->ev_seq < e2->ev_seq ? -1 : e1->ev_seq > e2->ev_seq;
+}
+
+static inline uint32_t rp_key(const char *buf, size_t len, size_t umad_size)
+{
+  if (len < umad_size + MAD_TRID_OFFS + 8)
+    return 0;
+
+  return get_be32(buf + umad_size, MAD_TRID_OFFS + 4);
+}
+
+struct umad_replay *umad_replay_open(const char *path, double speed)
+{
+  struct umad_replay *rp = NULL;
+  FILE *file = NULL;
+  struct stat st;
+  size_t offs, i, nr_colls;
+  double time = 0;
+
+  rp = calloc(1, sizeof(*rp));
+  if (rp == NULL)
+    goto err;
+
+  rp->rp_speed = speed;
+  rp->rp_start = rec_base();
+
+  file = fopen(path, "r");
+  if (file == NULL || fstat(fileno(file), &st) < 0)
+    goto err;
+
+  rp->rp_size = st.st_size;
+  rp->rp_data = malloc(rp->rp_size + 1);
+  if (rp->rp_data == NULL)
+    goto err;
+
+  if (fread(rp->rp_data, 1, rp->rp_size, file) != rp->rp_size)
+    goto err;
+
+  rp->rp_hdr = (const struct rec_hdr *) rp->rp_data;
+  if (rp->rp_size < sizeof(*rp->rp_hdr) || rp->rp_hdr->rh_magic != REC_MAGIC ||
+      rp->rp_hdr->rh_nr_colls == 0 || rp->rp_hdr->rh_nr_colls > 256) {
+    errno = EINVAL;
+    goto err;
+  }
+
+  nr_colls = rp->rp_hdr->rh_nr_colls;
+  rp->rp_colls = calloc(nr_colls, sizeof(rp->rp_colls[0]));
+  if (rp->rp_colls == NULL)
+    goto err;
+
+  /* Count, then fill.  A truncated last record is ignored. */
+  for (i = 0; i < 2; i++) {
+    uint32_t seq = 0;
+    size_t c;
+
+    offs = sizeof(*rp->rp_hdr);
+    time = 0;
+
+    while (offs + sizeof(struct rec_ent) <= rp->rp_size) {
+      struct rec_ent re;
+      const char *buf;
+
+      memcpy(&re, rp->rp_data + offs, sizeof(re));
+      buf = rp->rp_data + offs + sizeof(re);
+      if (offs + sizeof(re) + re.re_len > rp->rp_size)
+        break;
+
+      offs += sizeof(re) + re.re_len;
+      time += re.re_delta_us * 1e-6;
+
+      if (!(re.re_coll < nr_colls))
+        continue;
+
+      struct rp_coll *rc = &rp->rp_colls[re.re_coll];
+
+      if (i == 1) {
+        struct rp_ev *ev = &rc->rc_evs[rc->rc_nr_evs];
+
+        ev->ev_key = rp_key(buf, re.re_len, rp->rp_hdr->rh_umad_size);
+        ev->ev_seq = seq++;
+        ev->ev_time = time;
+        ev->ev_buf = buf;
+        ev->ev_len = re.re_len;
+        ev->ev_dir = re.re_dir;
+      }
+
+      rc->rc_nr_evs++;
+    }
+
+    if (i == 1)
+      break;
+
+    for (c = 0; c < nr_colls; c++) {
+      struct rp_coll *rc = &rp->rp_colls[c];
+
+      rc->rc_evs = calloc(rc->rc_nr_evs + 1, sizeof(rc->rc_evs[0]));
+      if (rc->rc_evs == NULL)
+        goto err;
+      rc->rc_nr_evs = 0;
+    }
+  }
+
+  for (i = 0; i < nr_colls; i++) {
+    struct rp_coll *rc = &rp->rp_colls[i];
+    struct rp_ev *evs = rc->rc_evs;
+    size_t k, end, s;
+
+    qsort(evs, rc->rc_nr_evs, sizeof(evs[0]), &rp_ev_cmp);
+
+    for (k = 0; k < rc->rc_nr_evs; k = end) {
+      for (end = k; end < rc->rc_nr_evs && evs[end].ev_key == evs[k].ev_key;
+           end++)
+        ;
+
+      for (s = k; s < end && evs[s].ev_dir != REC_SEND; s++)
+        ;
+
+      evs[k].ev_next = s;
+    }
+  }
+
+  fclose(file);
+
+  return rp;
+
+ err:
+  if (file != NULL)
+    fclose(file);
+  if (rp != NULL)
+    umad_replay_close(rp);
+
+  return NULL;
+}
+
+const struct rec_hdr *umad_replay_hdr(const struct umad_replay *rp)
+{
+  return rp->rp_hdr;
+}
+
+void umad_replay_close(struct umad_replay *rp)
+{
+  size_t c;
+
+  if (rp->rp_colls != NULL && rp->rp_hdr != NULL)
+    for (c = 0; c < rp->rp_hdr->rh_nr_colls; c++)
+      free(rp->rp_colls[c].rc_evs);
+
+  free(rp->rp_colls);
+  free(rp->rp_data);
+  free(rp);
+}
+
+/* Received umads due for delivery, soonest first. */
+struct rp_due {
+  double rd_time;
+  const struct rp_ev *rd_ev;
+};
+
+struct replay_io {
+  struct umad_replay *ri_rp;
+  struct rp_coll *ri_coll;
+  struct rp_due *ri_heap;
+  size_t ri_nr_heap;
+  size_t ri_heap_len;
+};
+
+static int replay_push(struct replay_io *ri, double time,
+                       const struct rp_ev *ev)
+{
+  size_t i;
+
+  if (!(ri->ri_nr_heap < ri->ri_heap_len)) {
+    size_t new_len = 2 * ri->ri_heap_len + 64;
+    struct rp_due *new_heap = realloc(ri->ri_heap,
+                                      new_len * sizeof(new_heap[0]));
+    if (new_heap == NULL)
+      return -1;
+
+    ri->ri_heap = new_heap;
+    ri->ri_heap_len = new_len;
+  }
+
+  for (i = ri->ri_nr_heap++; i > 0; i = (i - 1) / 2) {
+    if (ri->ri_heap[(i - 1) / 2].rd_time <= time)
+      break;
+    ri->ri_heap[i] = ri->ri_heap[(i - 1) / 2];
+  }
+
+  ri->ri_heap[i].rd_time = time;
+  ri->ri_heap[i].rd_ev = ev;
+
+  return 0;
+}
+
+static const struct rp_ev *replay_pop(struct replay_io *ri)
+{
+  const struct rp_ev *top = ri->ri_heap[0].rd_ev;
+  struct rp_due last = ri->ri_heap[--ri->ri_nr_heap];
+  size_t i = 0, n = ri->ri_nr_heap;
+
+  while (2 * i + 1 < n) {
+    size_t c = 2 * i + 1;
+
+    if (c + 1 < n && ri->ri_heap[c + 1].rd_time < ri->ri_heap[c].rd_time)
+      c++;
+
+    if (last.rd_time <= ri->ri_heap[c].rd_time)
+      break;
+
+    ri->ri_heap[i] = ri->ri_heap[c];
+    i = c;
+  }
+
+  if (n > 0)
+    ri->ri_heap[i] = last;
+
+  return top;
+}
+
+static int replay_send(struct umad_io *io, const void *um, size_t len)
+{
+  struct replay_io *ri = io->io_priv;
+  struct rp_coll *rc = ri->ri_coll;
+  uint32_t key = rp_key(um, len, ri->ri_rp->rp_hdr->rh_umad_size);
+  size_t lo = 0, hi = rc->rc_nr_evs, k;
+  double now = rec_mono();
+
+  io->io_nr_sent++;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (rc->rc_evs[mid].ev_key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (!(lo < rc->rc_nr_evs) || rc->rc_evs[lo].ev_key != key) {
+    TRACE("no recorded send for trid %08x\n", key);
+    return 0;
+  }
+
+  struct rp_ev *first = &rc->rc_evs[lo];
+  struct rp_ev *send = &rc->rc_evs[first->ev_next];
+
+  if (!(first->ev_next < rc->rc_nr_evs) || send->ev_key != key ||
+      send->ev_dir != REC_SEND) {
+    TRACE("recorded sends for trid %08x used up\n", key);
+    return 0;
+  }
+
+  for (k = first->ev_next + 1;
+       k < rc->rc_nr_evs && rc->rc_evs[k].ev_key == key &&
+         rc->rc_evs[k].ev_dir != REC_SEND; k++) {
+    const struct rp_ev *ev = &rc->rc_evs[k];
+
+    if (replay_push(ri, now + (ev->ev_time - send->ev_time) /
+                    ri->ri_rp->rp_speed, ev) < 0)
+      return -1;
+  }
+
+  first->ev_next = k;
+
+  return 0;
+}
+
+/* Receive times are the recorded ones, so that the rates computed
+   from them are the same on every replay. */
+static ssize_t replay_recv(struct umad_io *io, void *bufs, size_t buf_size,
+                           size_t nr, size_t *len, double *mono)
+{
+  struct replay_io *ri = io->io_priv;
+  double now = rec_mono();
+  size_t i = 0;
+
+  while (i < nr && ri->ri_nr_heap > 0 && ri->ri_heap[0].rd_time <= now) {
+    const struct rp_ev *ev = replay_pop(ri);
+    size_t n = ev->ev_len < buf_size ? ev->ev_len : buf_size;
+
+    memcpy((char *) bufs + i * buf_size, ev->ev_buf, n);
+    if (mono != NULL)
+      mono[i] = ri->ri_rp->rp_start + ev->ev_time;
+    len[i++] = n;
+  }
+
+  io->io_nr_recvd += i;
+
+  return i;
+}
+
+static int replay_wait(struct umad_io *io, double timeout)
+{
+  struct replay_io *ri = io->io_priv;
+  double now = rec_mono();
+  double until = now + (timeout > 0 ? timeout : 0);
+  struct timespec ts;
+
+  if (ri->ri_nr_heap > 0 && ri->ri_heap[0].rd_time < until)
+    until = ri->ri_heap[0].rd_time;
+
+  if (until > now) {
+    ts.tv_sec = until;
+    ts.tv_nsec = (until - ts.tv_sec) * 1e9;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+  }
+
+  return ri->ri_nr_heap > 0 && ri->ri_heap[0].rd_time <= rec_mono();
+}
+
+static void replay_close(struct umad_io *io)
+{
+  struct replay_io *ri = io->io_priv;
+
+  free(ri->ri_heap);
+  free(ri);
+  io->io_priv = NULL;
+}
+
+static const struct umad_io_ops replay_ops = {
+  .name = "replay",
+  .send = &replay_send,
+  .recv = &replay_recv,
+  .wait = &replay_wait,
+  .close = &replay_close,
+};
+
+int umad_replay_io_open(struct umad_io *io, struct umad_replay *rp,
+                        unsigned int coll)
+{
+  struct replay_io *ri;
+
+  if (!(coll < rp->rp_hdr->rh_nr_colls)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ri = calloc(1, sizeof(*ri));
+  if (ri == NULL)
+    return -1;
+
+  ri->ri_rp = rp;
+  ri->ri_coll = &rp->rp_colls[coll];
+
+  memset(io, 0, sizeof(*io));
+  io->io_fd = -1;
+  io->io_ops = &replay_ops;
+  io->io_priv = ri;
+
+  return 0;
+}
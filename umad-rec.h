@@ -0,0 +1,71 @@
+#ifndef _UMAD_REC_H_
+#define _UMAD_REC_H_
+#include <stddef.h>
+#include <stdint.h>
+#include "umad-io.h"
+
+/* Recording and replay of umad exchanges.  A recording is a header
+   followed by one record per umad sent or received by any collector:
+   a struct rec_ent, then re_len bytes of umad.  re_delta_us is the
+   time since the previous record.  Received umads are stamped with
+   their recorded times, when recording as when replaying.
+
+   Replay matches each umad sent by a collector to the next recorded
+   send by the same collector with the same TRID (the low 32 bits; the
+   kernel owns the rest) and delivers the umads received after that
+   send (and before the next one with that TRID), at the recorded
+   delays divided by the replay speed.  Sends with no match go
+   unanswered.  Passes go in the same order as long as srandom() gets
+   rh_seed and the hosts are the same. */
+
+#define REC_MAGIC 0x3143455250544249ULL /* "IBTPREC1" */
+
+struct rec_hdr {
+  uint64_t rh_magic;
+  uint64_t rh_seed;
+  uint32_t rh_nr_hosts;
+  uint32_t rh_nr_colls;
+  uint32_t rh_umad_size; /* Bytes of struct ib_user_mad before the MAD. */
+  uint32_t rh_pad;
+  double rh_time;        /* Realtime of the start. */
+};
+
+enum {
+  REC_SEND,
+  REC_RECV,
+};
+
+struct rec_ent {
+  uint32_t re_delta_us;
+  uint16_t re_len;
+  uint8_t re_dir;
+  uint8_t re_coll;
+};
+
+struct umad_rec;
+
+struct umad_rec *umad_rec_create(const char *path, uint64_t seed,
+                                 uint32_t nr_hosts, uint32_t nr_colls,
+                                 uint32_t umad_size);
+
+/* Record everything sent and received through io (which must be open)
+   as collector coll.  Closing io leaves rec open. */
+int umad_rec_wrap(struct umad_io *io, struct umad_rec *rec, unsigned int coll);
+
+/* Returns -1 if any record could not be written. */
+int umad_rec_close(struct umad_rec *rec);
+
+struct umad_replay;
+
+struct umad_replay *umad_replay_open(const char *path, double speed);
+
+const struct rec_hdr *umad_replay_hdr(const struct umad_replay *rp);
+
+/* Open io as collector coll of the recording. */
+int umad_replay_io_open(struct umad_io *io, struct umad_replay *rp,
+                        unsigned int coll);
+
+/* After the collectors' I/O is closed. */
+void umad_replay_close(struct umad_replay *rp);
+
+#endif
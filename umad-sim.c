@@ -0,0 +1,794 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <infiniband/umad.h>
+#include "trace.h"
+#include "mad-codec.h"
+#include "fabric.h"
+#include "sa-dump.h"
+#include "umad-sim.h"
+
+#define SIM_MAD_SIZE 256
+#define SIM_MSG_SIZE (sizeof(struct ib_user_mad) + SIM_MAD_SIZE)
+#define SIM_NR_LIDS 65536
+#define SIM_SWITCH_BURST 16
+#define SIM_TICK 1          /* PortSamplesControl Tick, 5 ns. */
+#define SIM_MTU 2048        /* Bytes per packet. */
+
+#define SIM_ATTR_PSC 0x10
+#define SIM_ATTR_PSR 0x11
+#define SIM_ATTR_PCE 0x1d
+#define SIM_METHOD_GET 0x01
+#define SIM_METHOD_SET 0x02
+#define SIM_METHOD_GET_RESP 0x81
+#define SIM_STATUS_UNSUP 0x000c
+#define SIM_STATUS_BAD_MOD 0x001c
+
+#define SIM_CLASS_DR_SMP 0x81
+#define SIM_SMP_NODE_DESC 0x0010
+#define SIM_SMP_NODE_INFO 0x0011
+#define SIM_SMP_PORT_INFO 0x0015
+
+#define SIM_CLASS_SA 0x03
+#define SIM_METHOD_GET_TABLE 0x12
+#define SIM_METHOD_GET_TABLE_RESP 0x92
+
+enum {
+  SIM_DIST_CONST,
+  SIM_DIST_UNIFORM,
+  SIM_DIST_EXP,
+};
+
+enum {
+  SIM_MODEL_FLAT,
+  SIM_MODEL_SPREAD,
+  SIM_MODEL_BURST,
+};
+
+struct sim_conf {
+  double sc_lat;
+  double sc_jitter;
+  int sc_dist;
+  double sc_drop;
+  double sc_dup;
+  double sc_late;
+  double sc_late_lat;
+  double sc_rate;
+  int sc_model;
+  double sc_period;
+  double sc_duty;
+  double sc_switch_rate;
+  uint64_t sc_seed;
+  size_t sc_nr_hosts;
+  char *sc_sa_path;
+};
+
+/* Responses bigger than SIM_MSG_SIZE (SA tables) are in sm_big. */
+struct sim_msg {
+  struct sim_msg *sm_next; /* On the free list. */
+  double sm_time;
+  size_t sm_len;
+  char *sm_big;
+  char sm_buf[SIM_MSG_SIZE];
+};
+
+/* Per LID state: the rate limit's token bucket and the PortSamples
+   window.  CounterSelects are taken to be ibtop's (XmitData, RcvData,
+   XmitPkts, RcvPkts). */
+struct sim_lid {
+  double sl_tokens;
+  double sl_last;
+  double sl_start;
+  uint32_t sl_ticks;
+  uint16_t sl_tag;
+  uint8_t sl_port;
+  uint8_t sl_started;
+};
+
+struct sim_priv {
+  struct sim_conf sp_conf;
+  uint64_t sp_rand;
+  double sp_epoch;
+  struct sim_msg **sp_heap; /* Pending responses, soonest first. */
+  size_t sp_nr_heap;
+  size_t sp_heap_len;
+  struct sim_msg *sp_free;
+  struct sim_lid *sp_lids;
+  struct fabric_conf sp_fabric;
+  struct sa_dump sp_sa;
+};
+
+static double sim_mono(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double sim_now(struct sim_priv *sp)
+{
+  return sim_mono() - sp->sp_epoch;
+}
+
+static uint64_t sim_hash(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+  return x ^ (x >> 31);
+}
+
+static double sim_rand(struct sim_priv *sp)
+{
+  uint64_t x = sp->sp_rand;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  sp->sp_rand = x;
+
+  return ((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double sim_latency(struct sim_priv *sp)
+{
+  const struct sim_conf *sc = &sp->sp_conf;
+  double lat = sc->sc_lat;
+
+  switch (sc->sc_dist) {
+  case SIM_DIST_UNIFORM:
+    lat += sc->sc_jitter * (2 * sim_rand(sp) - 1);
+    break;
+  case SIM_DIST_EXP:
+    lat = sc->sc_jitter -
+      (sc->sc_lat - sc->sc_jitter) * log(1 - sim_rand(sp));
+    break;
+  }
+
+  return lat > 0 ? lat : 0;
+}
+
+/* Bytes through port of lid by time t, transmitted if dir is 0,
+   received if 1.  Counters start at a random offset so they're never
+   zero. */
+static double sim_bytes(struct sim_priv *sp, uint16_t lid, uint8_t port,
+                        int dir, double t)
+{
+  const struct sim_conf *sc = &sp->sp_conf;
+  uint64_t h = sim_hash(((uint64_t) lid << 16 | port << 8 | dir) ^
+                        sc->sc_seed << 32);
+  double u = (h >> 11) * (1.0 / 9007199254740992.0);
+  double base = 1 + (h & 0xffffffffffULL);
+
+  switch (sc->sc_model) {
+  case SIM_MODEL_FLAT:
+    return base + sc->sc_rate * t;
+  case SIM_MODEL_SPREAD:
+    return base + 2 * u * sc->sc_rate * t;
+  default: {
+    double on = sc->sc_duty * sc->sc_period;
+    double n, r;
+
+    t += u * sc->sc_period;
+    n = floor(t / sc->sc_period);
+    r = t - n * sc->sc_period;
+
+    return base + sc->sc_rate / sc->sc_duty * (n * on + (r < on ? r : on));
+  }
+  }
+}
+
+static unsigned int sim_ps_status(const struct sim_lid *sl, double t)
+{
+  if (sl->sl_started && t < sl->sl_start + sl->sl_ticks * SIM_TICK * 5e-9)
+    return 2; /* Running. */
+
+  return PS_STATUS_DONE;
+}
+
+/* Answer a directed route SMP as the node at the end of its path
+   from host 0.  Returns -1 if the path leads nowhere, so the SMP is
+   lost. */
+static int sim_answer_smp(struct sim_priv *sp, struct sim_msg *sm)
+{
+  struct ib_user_mad *um = (struct ib_user_mad *) sm->sm_buf;
+  char *m = (char *) um->data;
+  char *d = m + SMP_DATA_OFFS;
+  unsigned int attr = mad_get_attr_id(m);
+  unsigned int method = get_u8(m, MAD_METHOD_OFFS);
+  unsigned int nr_hops = get_u8(m, SMP_HOP_CNT_OFFS);
+  struct fabric_node fn = { .fn_kind = FABRIC_HOST, .fn_index = 0, };
+  struct fabric_node peer;
+  struct fabric_node_info fi;
+  unsigned int in_port = 1, i;
+
+  if (sp->sp_fabric.fc_nr_hosts == 0 || nr_hops > SMP_MAX_HOPS)
+    return -1;
+
+  for (i = 1; i <= nr_hops; i++) {
+    if (fabric_link(&sp->sp_fabric, &fn,
+                    get_u8(m, SMP_INIT_PATH_OFFS + i), &peer, &in_port) < 0)
+      return -1;
+
+    fn = peer;
+  }
+
+  fabric_node_info(&sp->sp_fabric, &fn, &fi);
+
+  um->status = 0;
+  put_u8(m, MAD_METHOD_OFFS, SIM_METHOD_GET_RESP);
+  put_be16(m, MAD_STATUS_OFFS, SMP_STATUS_D_BIT);
+  sm->sm_len = SIM_MSG_SIZE;
+  memset(d, 0, SMP_DATA_SIZE);
+
+  if (method != SIM_METHOD_GET) {
+    put_be16(m, MAD_STATUS_OFFS, SMP_STATUS_D_BIT | SIM_STATUS_UNSUP);
+    return 0;
+  }
+
+  switch (attr) {
+  case SIM_SMP_NODE_DESC:
+    memcpy(d, fi.fi_desc, strlen(fi.fi_desc));
+    break;
+  case SIM_SMP_NODE_INFO:
+    fabric_node_info_encode(&fi, in_port, d);
+    break;
+  case SIM_SMP_PORT_INFO:
+    if (fabric_port_info_encode(&sp->sp_fabric, &fn, &fi,
+                                get_be32(m, MAD_ATTRMOD_OFFS), in_port, d) < 0)
+      put_be16(m, MAD_STATUS_OFFS, SMP_STATUS_D_BIT | SIM_STATUS_BAD_MOD);
+    break;
+  default:
+    put_be16(m, MAD_STATUS_OFFS, SMP_STATUS_D_BIT | SIM_STATUS_UNSUP);
+    break;
+  }
+
+  return 0;
+}
+
+/* Answer an SA GetTable from the dump, with the whole table at once,
+   as the kernel hands over RMPP transfers. */
+static int sim_answer_sa(struct sim_priv *sp, struct sim_msg *sm)
+{
+  struct ib_user_mad *um = (struct ib_user_mad *) sm->sm_buf;
+  char *m = (char *) um->data;
+  unsigned int method = get_u8(m, MAD_METHOD_OFFS);
+  const struct sa_table *st = sa_dump_find(&sp->sp_sa, mad_get_attr_id(m));
+  size_t stride = 8, data_len = 0, len;
+  char *big;
+
+  um->status = 0;
+  put_u8(m, MAD_METHOD_OFFS, SIM_METHOD_GET_TABLE_RESP);
+  sm->sm_len = SIM_MSG_SIZE;
+
+  if (method != SIM_METHOD_GET_TABLE || sp->sp_sa.sd_map == NULL) {
+    put_be16(m, MAD_STATUS_OFFS, SIM_STATUS_UNSUP);
+    return 0;
+  }
+
+  /* No table, no records. */
+  if (st != NULL && st->st_stride % 8 == 0) {
+    stride = st->st_stride;
+    data_len = stride * st->st_count;
+  }
+
+  len = sizeof(*um) + SA_DATA_OFFS + data_len;
+
+  big = calloc(1, len);
+  if (big == NULL)
+    return -1;
+
+  memcpy(big, sm->sm_buf, sizeof(*um) + SA_DATA_OFFS);
+  um = (struct ib_user_mad *) big;
+  m = (char *) um->data;
+  um->length = len;
+
+  put_u8(m, RMPP_VERSION_OFFS, 1);
+  put_u8(m, RMPP_TYPE_OFFS, RMPP_TYPE_DATA);
+  put_u8(m, RMPP_FLAGS_OFFS,
+         RMPP_FLAG_ACTIVE | RMPP_FLAG_FIRST | RMPP_FLAG_LAST);
+  put_u8(m, RMPP_STATUS_OFFS, 0);
+  put_be32(m, RMPP_SEG_NUM_OFFS, 1);
+  put_be32(m, RMPP_PAYLEN_OFFS, SA_HDR_SIZE + data_len);
+  put_be16(m, SA_ATTR_OFFS_OFFS, stride / 8);
+  if (data_len > 0)
+    memcpy(m + SA_DATA_OFFS, st->st_recs, data_len);
+
+  sm->sm_big = big;
+  sm->sm_len = len;
+
+  return 0;
+}
+
+static int sim_answer(struct sim_priv *sp, struct sim_msg *sm, uint16_t lid,
+                      double t)
+{
+  struct ib_user_mad *um = (struct ib_user_mad *) sm->sm_buf;
+  char *m = (char *) um->data;
+  char *pc = m + MAD_PMA_DATA_OFFS;
+  unsigned int attr = mad_get_attr_id(m);
+  unsigned int method = get_u8(m, MAD_METHOD_OFFS);
+  struct sim_lid *sl = &sp->sp_lids[lid];
+  uint8_t port;
+  int dir;
+
+  if (get_u8(m, MAD_MGMTCLASS_OFFS) == SIM_CLASS_DR_SMP)
+    return sim_answer_smp(sp, sm);
+
+  if (get_u8(m, MAD_MGMTCLASS_OFFS) == SIM_CLASS_SA)
+    return sim_answer_sa(sp, sm);
+
+  um->status = 0;
+  put_u8(m, MAD_METHOD_OFFS, SIM_METHOD_GET_RESP);
+  sm->sm_len = SIM_MSG_SIZE;
+
+  if (attr == SIM_ATTR_PCE && method == SIM_METHOD_GET) {
+    port = get_u8(pc, PCE_PORT_SELECT_OFFS);
+    for (dir = 0; dir < 2; dir++) {
+      double b = sim_bytes(sp, lid, port, dir, t);
+
+      /* Data counters are in units of 4 bytes. */
+      put_be64(pc, dir ? PCE_RCV_BYTES_OFFS : PCE_XMT_BYTES_OFFS, b / 4);
+      put_be64(pc, dir ? PCE_RCV_PKTS_OFFS : PCE_XMT_PKTS_OFFS, b / SIM_MTU);
+    }
+  } else if (attr == SIM_ATTR_PSC &&
+             (method == SIM_METHOD_GET || method == SIM_METHOD_SET)) {
+    if (method == SIM_METHOD_SET) {
+      sl->sl_port = get_u8(pc, PSC_PORT_SELECT_OFFS);
+      sl->sl_ticks = get_be32(pc, PSC_SAMPLE_INTERVAL_OFFS);
+      sl->sl_tag = get_be16(pc, PSC_TAG_OFFS);
+      sl->sl_start = t;
+      sl->sl_started = 1;
+    }
+
+    put_u8(pc, PSC_PORT_SELECT_OFFS, sl->sl_port);
+    put_u8(pc, PSC_TICK_OFFS, SIM_TICK);
+    put_u8(pc, PSC_SAMPLE_STATUS_OFFS, sim_ps_status(sl, t));
+    put_be32(pc, PSC_SAMPLE_INTERVAL_OFFS, sl->sl_ticks);
+    put_be16(pc, PSC_TAG_OFFS, sl->sl_tag);
+  } else if (attr == SIM_ATTR_PSR && method == SIM_METHOD_GET) {
+    unsigned int status = sim_ps_status(sl, t);
+    double end = sl->sl_start + sl->sl_ticks * SIM_TICK * 5e-9;
+
+    memset(pc, 0, SIM_MAD_SIZE - MAD_PMA_DATA_OFFS);
+    put_be16(pc, PSR_TAG_OFFS, sl->sl_tag);
+    put_u8(pc, PSR_SAMPLE_STATUS_OFFS, status);
+
+    if (sl->sl_started && status == PS_STATUS_DONE) {
+      for (dir = 0; dir < 2; dir++) {
+        double b = sim_bytes(sp, lid, sl->sl_port, dir, end) -
+          sim_bytes(sp, lid, sl->sl_port, dir, sl->sl_start);
+        double words = b / 4 < UINT32_MAX ? b / 4 : UINT32_MAX;
+
+        put_be32(pc, PSR_COUNTER_OFFS + 4 * dir, words);
+        put_be32(pc, PSR_COUNTER_OFFS + 8 + 4 * dir, b / SIM_MTU);
+      }
+    }
+  } else {
+    put_be16(m, MAD_STATUS_OFFS, SIM_STATUS_UNSUP);
+  }
+
+  return 0;
+}
+
+static struct sim_msg *sim_msg_new(struct sim_priv *sp, const void *buf,
+                                   size_t len, double time)
+{
+  struct sim_msg *sm = sp->sp_free;
+
+  if (sm != NULL) {
+    sp->sp_free = sm->sm_next;
+  } else {
+    sm = malloc(sizeof(*sm));
+    if (sm == NULL)
+      return NULL;
+  }
+
+  memset(sm->sm_buf, 0, sizeof(sm->sm_buf));
+  memcpy(sm->sm_buf, buf, len);
+  sm->sm_len = len;
+  sm->sm_big = NULL;
+  sm->sm_time = time;
+
+  return sm;
+}
+
+static void sim_msg_free(struct sim_priv *sp, struct sim_msg *sm)
+{
+  free(sm->sm_big);
+  sm->sm_big = NULL;
+  sm->sm_next = sp->sp_free;
+  sp->sp_free = sm;
+}
+
+static int sim_heap_push(struct sim_priv *sp, struct sim_msg *sm)
+{
+  size_t i;
+
+  if (!(sp->sp_nr_heap < sp->sp_heap_len)) {
+    size_t new_len = 2 * sp->sp_heap_len;
+    struct sim_msg **new_heap =
+      realloc(sp->sp_heap, new_len * sizeof(new_heap[0]));
+
+    if (new_heap == NULL)
+      return -1;
+
+    sp->sp_heap = new_heap;
+    sp->sp_heap_len = new_len;
+  }
+
+  for (i = sp->sp_nr_heap++; i > 0; i = (i - 1) / 2) {
+    struct sim_msg *parent = sp->sp_heap[(i - 1) / 2];
+
+    if (parent->sm_time <= sm->sm_time)
+      break;
+
+    sp->sp_heap[i] = parent;
+  }
+
+  sp->sp_heap[i] = sm;
+
+  return 0;
+}
+
+static struct sim_msg *sim_heap_pop(struct sim_priv *sp)
+{
+  struct sim_msg *top = sp->sp_heap[0];
+  struct sim_msg *last = sp->sp_heap[--sp->sp_nr_heap];
+  size_t i = 0, n = sp->sp_nr_heap;
+
+  while (2 * i + 1 < n) {
+    size_t c = 2 * i + 1;
+
+    if (c + 1 < n && sp->sp_heap[c + 1]->sm_time < sp->sp_heap[c]->sm_time)
+      c++;
+
+    if (last->sm_time <= sp->sp_heap[c]->sm_time)
+      break;
+
+    sp->sp_heap[i] = sp->sp_heap[c];
+    i = c;
+  }
+
+  if (n > 0)
+    sp->sp_heap[i] = last;
+
+  return top;
+}
+
+/* Whether lid's PMA drops a query at now. */
+static int sim_drop(struct sim_priv *sp, uint16_t lid, double now)
+{
+  const struct sim_conf *sc = &sp->sp_conf;
+
+  if (sc->sc_drop > 0 && sim_rand(sp) < sc->sc_drop)
+    return 1;
+
+  if (sc->sc_switch_rate > 0) {
+    struct sim_lid *sl = &sp->sp_lids[lid];
+
+    sl->sl_tokens += (now - sl->sl_last) * sc->sc_switch_rate;
+    sl->sl_last = now;
+    if (sl->sl_tokens > SIM_SWITCH_BURST)
+      sl->sl_tokens = SIM_SWITCH_BURST;
+
+    if (sl->sl_tokens < 1)
+      return 1;
+
+    sl->sl_tokens -= 1;
+  }
+
+  return 0;
+}
+
+static int sim_send(struct umad_io *io, const void *buf, size_t len)
+{
+  struct sim_priv *sp = io->io_priv;
+  const struct sim_conf *sc = &sp->sp_conf;
+  const struct ib_user_mad *um = buf;
+  uint16_t lid = ntohs(um->addr.lid);
+  double now = sim_now(sp);
+  struct sim_msg *sm;
+
+  if (len > SIM_MSG_SIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  io->io_nr_sent++;
+
+  if (sim_drop(sp, lid, now))
+    goto lost;
+
+  double lat = sim_latency(sp);
+
+  if (sc->sc_late > 0 && sim_rand(sp) < sc->sc_late)
+    lat += sc->sc_late_lat;
+
+  sm = sim_msg_new(sp, buf, len, now + lat);
+  if (sm == NULL)
+    return -1;
+
+  /* The PMA reads its counters halfway through. */
+  if (sim_answer(sp, sm, lid, now + lat / 2) < 0) {
+    sim_msg_free(sp, sm);
+    goto lost;
+  }
+
+  if (sim_heap_push(sp, sm) < 0)
+    return -1;
+
+  if (sm->sm_big == NULL && sc->sc_dup > 0 && sim_rand(sp) < sc->sc_dup) {
+    struct sim_msg *dup = sim_msg_new(sp, sm->sm_buf, sm->sm_len,
+                                      sm->sm_time + sim_latency(sp));
+    if (dup == NULL)
+      return -1;
+
+    return sim_heap_push(sp, dup);
+  }
+
+  return 0;
+
+ lost:
+  if (um->timeout_ms == 0)
+    return 0;
+
+  sm = sim_msg_new(sp, buf, len, now + um->timeout_ms / 1000.0);
+  if (sm == NULL)
+    return -1;
+
+  ((struct ib_user_mad *) sm->sm_buf)->status = ETIMEDOUT;
+
+  return sim_heap_push(sp, sm);
+}
+
+static ssize_t sim_recv(struct umad_io *io, void *bufs, size_t buf_size,
+                        size_t nr, size_t *len, double *mono)
+{
+  struct sim_priv *sp = io->io_priv;
+  double now = sim_now(sp);
+  size_t i = 0;
+
+  while (i < nr && sp->sp_nr_heap > 0 && sp->sp_heap[0]->sm_time <= now) {
+    struct sim_msg *sm = sp->sp_heap[0];
+    size_t n = sm->sm_len < buf_size ? sm->sm_len : buf_size;
+
+    /* Like the kernel, leave a big response queued and hand over its
+       first part, with the length it needs, until there's room. */
+    if (sm->sm_big != NULL && sm->sm_len > buf_size) {
+      if (i > 0)
+        break;
+
+      memcpy(bufs, sm->sm_big, buf_size < SIM_MSG_SIZE ? buf_size :
+             SIM_MSG_SIZE);
+      errno = ENOSPC;
+      return -1;
+    }
+
+    sim_heap_pop(sp);
+    memcpy((char *) bufs + i * buf_size,
+           sm->sm_big != NULL ? sm->sm_big : sm->sm_buf, n);
+    len[i++] = n;
+    sim_msg_free(sp, sm);
+  }
+
+  io->io_nr_recvd += i;
+  umad_io_stamp(mono, i);
+
+  return i;
+}
+
+static int sim_wait(struct umad_io *io, double timeout)
+{
+  struct sim_priv *sp = io->io_priv;
+  double now = sim_now(sp);
+  double until = now + (timeout > 0 ? timeout : 0);
+  struct timespec ts;
+
+  if (sp->sp_nr_heap > 0 && sp->sp_heap[0]->sm_time < until)
+    until = sp->sp_heap[0]->sm_time;
+
+  if (until > now) {
+    until += sp->sp_epoch;
+    ts.tv_sec = until;
+    ts.tv_nsec = (until - ts.tv_sec) * 1e9;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+  }
+
+  return sp->sp_nr_heap > 0 && sp->sp_heap[0]->sm_time <= sim_now(sp);
+}
+
+static void sim_close(struct umad_io *io)
+{
+  struct sim_priv *sp = io->io_priv;
+  struct sim_msg *sm;
+
+  if (sp == NULL)
+    return;
+
+  while (sp->sp_nr_heap > 0)
+    sim_msg_free(sp, sim_heap_pop(sp));
+
+  while ((sm = sp->sp_free) != NULL) {
+    sp->sp_free = sm->sm_next;
+    free(sm);
+  }
+
+  sa_dump_free(&sp->sp_sa);
+  free(sp->sp_conf.sc_sa_path);
+  free(sp->sp_heap);
+  free(sp->sp_lids);
+  free(sp);
+  io->io_priv = NULL;
+}
+
+static const struct umad_io_ops sim_ops = {
+  .name = "sim",
+  .send = &sim_send,
+  .recv = &sim_recv,
+  .wait = &sim_wait,
+  .close = &sim_close,
+};
+
+static int sim_conf_parse(struct sim_conf *sc, const char *opts)
+{
+  char *list = strdup(opts), *rest = list, *tok;
+  int rc = -1;
+
+  if (list == NULL)
+    return -1;
+
+  while ((tok = strsep(&rest, ",")) != NULL) {
+    char *key = strsep(&tok, "="), *val = tok, *end;
+    double x;
+
+    if (*key == 0)
+      continue;
+
+    if (val == NULL)
+      goto out;
+
+    if (strcmp(key, "dist") == 0) {
+      if (strcmp(val, "const") == 0)
+        sc->sc_dist = SIM_DIST_CONST;
+      else if (strcmp(val, "uniform") == 0)
+        sc->sc_dist = SIM_DIST_UNIFORM;
+      else if (strcmp(val, "exp") == 0)
+        sc->sc_dist = SIM_DIST_EXP;
+      else
+        goto out;
+      continue;
+    }
+
+    if (strcmp(key, "model") == 0) {
+      if (strcmp(val, "flat") == 0)
+        sc->sc_model = SIM_MODEL_FLAT;
+      else if (strcmp(val, "spread") == 0)
+        sc->sc_model = SIM_MODEL_SPREAD;
+      else if (strcmp(val, "burst") == 0)
+        sc->sc_model = SIM_MODEL_BURST;
+      else
+        goto out;
+      continue;
+    }
+
+    if (strcmp(key, "sa") == 0) {
+      free(sc->sc_sa_path);
+      sc->sc_sa_path = strdup(val);
+      if (sc->sc_sa_path == NULL)
+        goto out;
+      continue;
+    }
+
+    x = strtod(val, &end);
+    if (*val == 0 || *end != 0 || x < 0)
+      goto out;
+
+    if (strcmp(key, "lat") == 0)
+      sc->sc_lat = x * 1e-6;
+    else if (strcmp(key, "jitter") == 0)
+      sc->sc_jitter = x * 1e-6;
+    else if (strcmp(key, "drop") == 0)
+      sc->sc_drop = x;
+    else if (strcmp(key, "dup") == 0)
+      sc->sc_dup = x;
+    else if (strcmp(key, "late") == 0)
+      sc->sc_late = x;
+    else if (strcmp(key, "late-lat") == 0)
+      sc->sc_late_lat = x * 1e-6;
+    else if (strcmp(key, "rate") == 0)
+      sc->sc_rate = x;
+    else if (strcmp(key, "period") == 0 && x > 0)
+      sc->sc_period = x;
+    else if (strcmp(key, "duty") == 0 && x > 0 && x <= 1)
+      sc->sc_duty = x;
+    else if (strcmp(key, "switch-rate") == 0)
+      sc->sc_switch_rate = x;
+    else if (strcmp(key, "seed") == 0)
+      sc->sc_seed = x;
+    else if (strcmp(key, "hosts") == 0)
+      sc->sc_nr_hosts = x;
+    else
+      goto out;
+  }
+
+  rc = 0;
+ out:
+  if (rc < 0) {
+    ERROR("invalid simulator options `%s'\n", opts);
+    errno = EINVAL;
+  }
+
+  free(list);
+
+  return rc;
+}
+
+int umad_sim_open(struct umad_io *io, const char *opts)
+{
+  static uint64_t nr_opened;
+  struct sim_priv *sp = NULL;
+
+  sp = calloc(1, sizeof(*sp));
+  if (sp == NULL)
+    goto err;
+
+  sp->sp_conf = (struct sim_conf) {
+    .sc_lat = 20e-6,
+    .sc_jitter = 5e-6,
+    .sc_dist = SIM_DIST_UNIFORM,
+    .sc_late_lat = 50e-3,
+    .sc_rate = 1e8,
+    .sc_model = SIM_MODEL_SPREAD,
+    .sc_period = 0.1,
+    .sc_duty = 0.2,
+    .sc_seed = 1,
+  };
+
+  if (sim_conf_parse(&sp->sp_conf, opts) < 0)
+    goto err;
+
+  sp->sp_fabric.fc_nr_hosts = sp->sp_conf.sc_nr_hosts;
+
+  if (sp->sp_conf.sc_sa_path != NULL &&
+      sa_dump_load(&sp->sp_sa, sp->sp_conf.sc_sa_path) < 0) {
+    ERROR("cannot load SA dump `%s': %m\n", sp->sp_conf.sc_sa_path);
+    goto err;
+  }
+
+  /* Each collector gets its own stream of randomness. */
+  sp->sp_rand = sim_hash(sp->sp_conf.sc_seed ^ nr_opened++ << 40) | 1;
+
+  /* Start a second in, so rate limits start out full. */
+  sp->sp_epoch = sim_mono() - 1;
+
+  sp->sp_heap_len = 1024;
+  sp->sp_heap = malloc(sp->sp_heap_len * sizeof(sp->sp_heap[0]));
+  sp->sp_lids = calloc(SIM_NR_LIDS, sizeof(sp->sp_lids[0]));
+  if (sp->sp_heap == NULL || sp->sp_lids == NULL)
+    goto err;
+
+  io->io_ops = &sim_ops;
+  io->io_priv = sp;
+
+  return 0;
+
+ err:
+  if (sp != NULL) {
+    free(sp->sp_conf.sc_sa_path);
+    free(sp->sp_heap);
+    free(sp->sp_lids);
+    free(sp);
+  }
+
+  return -1;
+}
@@ -0,0 +1,45 @@
+#ifndef _UMAD_SIM_H_
+#define _UMAD_SIM_H_
+#include "umad-io.h"
+
+/* Simulated PMAs behind a umad_io, for running and benchmarking ibtop
+   without IB hardware.  Every LID and port answers PortCountersExtended,
+   PortSamplesControl, and PortSamplesResult queries, with counters
+   that grow according to a model and responses delivered after a
+   random latency.  opts is a comma separated list of KEY=VALUE:
+
+     lat=USEC          mean response latency (default 20)
+     jitter=USEC       latency spread (default 5)
+     dist=DIST         latency distribution: const, uniform (mean +/-
+                       jitter), or exp (jitter plus an exponential with
+                       the rest of the mean) (default uniform)
+     drop=P            probability a query is never answered
+     dup=P             probability a response is delivered twice
+     late=P            probability a response is delayed by late-lat
+     late-lat=USEC     extra latency of late responses (default 50000)
+     rate=BPS          mean bytes per second through each port
+                       (default 1e8)
+     model=MODEL       counter growth: flat (every port at rate),
+                       spread (uniform in [0, 2 * rate)), or burst (on
+                       for duty of every period at rate / duty)
+                       (default spread)
+     period=SEC        burst period (default 0.1)
+     duty=FRAC         burst duty cycle (default 0.2)
+     switch-rate=QPS   queries each LID answers per second, the rest
+                       are dropped (default unlimited)
+     seed=N            random seed (default 1)
+     hosts=N           answer directed route SMPs as the fabric of N
+                       hosts from make-fabric -n N (see fabric.h)
+                       would, seen from port 1 of its first host
+                       (default no fabric, and no answers)
+     sa=PATH           answer SA GetTable queries (at any LID) with
+                       the tables in the SA dump at PATH (see
+                       sa-dump.h), each in one response as the
+                       kernel delivers RMPP transfers
+
+   Queries that are dropped come back with status ETIMEDOUT after their
+   timeout_ms, like the kernel's. */
+
+int umad_sim_open(struct umad_io *io, const char *opts);
+
+#endif
@@ -0,0 +1,112 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <string.h>
+#include "list.h"
+#include "wheel.h"
+
+static inline uint64_t wheel_time_to_tick(struct wheel *w, double t)
+{
+  if (t <= w->w_base)
+    return 0;
+
+  return (t - w->w_base) / w->w_tick;
+}
+
+int wheel_init(struct wheel *w, size_t nr_slots, double tick, double now)
+{
+  size_t i, len = 1;
+
+  while (len < nr_slots)
+    len *= 2;
+
+  memset(w, 0, sizeof(*w));
+  w->w_slot = malloc(len * sizeof(w->w_slot[0]));
+  if (w->w_slot == NULL)
+    return -1;
+
+  for (i = 0; i < len; i++)
+    INIT_LIST_HEAD(&w->w_slot[i]);
+
+  w->w_nr_slots = len;
+  w->w_tick = tick;
+  w->w_base = now;
+
+  return 0;
+}
+
+void wheel_destroy(struct wheel *w)
+{
+  free(w->w_slot);
+  memset(w, 0, sizeof(*w));
+}
+
+void wheel_add(struct wheel *w, struct wheel_timer *wt, double expire)
+{
+  if (wheel_timer_pending(wt))
+    wheel_del(w, wt);
+
+  /* Round up so that timers never fire early. */
+  wt->wt_expire = wheel_time_to_tick(w, expire) + 1;
+  if (wt->wt_expire <= w->w_now)
+    wt->wt_expire = w->w_now + 1;
+
+  list_add_tail(&wt->wt_link, &w->w_slot[wt->wt_expire & (w->w_nr_slots - 1)]);
+  w->w_count++;
+}
+
+void wheel_del(struct wheel *w, struct wheel_timer *wt)
+{
+  if (!wheel_timer_pending(wt))
+    return;
+
+  list_del_init(&wt->wt_link);
+  w->w_count--;
+}
+
+void wheel_advance(struct wheel *w, double now, struct list_head *expired)
+{
+  uint64_t end = wheel_time_to_tick(w, now);
+  size_t mask = w->w_nr_slots - 1;
+
+  /* After a long sleep there is no point going round more than once. */
+  if (end > w->w_now + w->w_nr_slots)
+    w->w_now = end - w->w_nr_slots;
+
+  while (w->w_now < end && w->w_count > 0) {
+    struct list_head *slot = &w->w_slot[++w->w_now & mask];
+    struct wheel_timer *wt, *next;
+
+    list_for_each_entry_safe(wt, next, slot, wt_link) {
+      if (wt->wt_expire > end)
+        continue;
+
+      list_move_tail(&wt->wt_link, expired);
+      w->w_count--;
+    }
+  }
+
+  w->w_now = end;
+}
+
+double wheel_next(struct wheel *w)
+{
+  size_t mask = w->w_nr_slots - 1;
+  uint64_t i, min = 0;
+
+  if (w->w_count == 0)
+    return -1;
+
+  for (i = w->w_now + 1; i <= w->w_now + w->w_nr_slots; i++) {
+    struct wheel_timer *wt;
+
+    list_for_each_entry(wt, &w->w_slot[i & mask], wt_link) {
+      if (wt->wt_expire == i)
+        return w->w_base + i * w->w_tick;
+      if (min == 0 || wt->wt_expire < min)
+        min = wt->wt_expire;
+    }
+  }
+
+  return w->w_base + min * w->w_tick;
+}
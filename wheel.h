@@ -0,0 +1,48 @@
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+#include <stddef.h>
+#include <stdint.h>
+#include "list.h"
+
+/* Hashed timer wheel.  Timers are kept in w_nr_slots buckets of
+   w_tick seconds each; a timer further out than one turn of the
+   wheel is simply skipped until its turn comes round. */
+
+struct wheel_timer {
+  struct list_head wt_link;
+  uint64_t wt_expire;
+};
+
+struct wheel {
+  struct list_head *w_slot;
+  size_t w_nr_slots; /* Power of two. */
+  double w_tick;
+  double w_base;
+  uint64_t w_now;
+  size_t w_count;
+};
+
+int wheel_init(struct wheel *w, size_t nr_slots, double tick, double now);
+void wheel_destroy(struct wheel *w);
+
+static inline void wheel_timer_init(struct wheel_timer *wt)
+{
+  INIT_LIST_HEAD(&wt->wt_link);
+}
+
+static inline int wheel_timer_pending(const struct wheel_timer *wt)
+{
+  return !list_empty(&wt->wt_link);
+}
+
+void wheel_add(struct wheel *w, struct wheel_timer *wt, double expire);
+void wheel_del(struct wheel *w, struct wheel_timer *wt);
+
+/* Move all timers that have expired by now onto expired. */
+void wheel_advance(struct wheel *w, double now, struct list_head *expired);
+
+/* Returns the time of the next expiry (to within one tick), or a
+   negative number if no timers are pending. */
+double wheel_next(struct wheel *w);
+
+#endif